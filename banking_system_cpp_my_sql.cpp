@@ -5,9 +5,54 @@
 //  - README.md
 //  - db.sql
 //  - Makefile
+//  - include/money.h
+//  - src/money.cpp
 //  - include/bank.h
+//  - src/metrics.h
+//  - src/metrics.cpp
+//  - src/connection_pool.h
+//  - src/connection_pool.cpp
+//  - src/account_cache.h
+//  - src/account_cache.cpp
+//  - src/idempotency_cache.h
+//  - src/idempotency_cache.cpp
+//  - src/limit_rules.h
+//  - src/limit_rules.cpp
+//  - src/ledger_sql.h
+//  - src/ledger_sql.cpp
+//  - src/partitions.h
+//  - src/partitions.cpp
+//  - src/account_snapshot.h
+//  - src/account_snapshot.cpp
+//  - src/account_kernels.h
+//  - src/account_kernels.cpp
+//  - src/ledger_engine.h
+//  - src/ledger_engine.cpp
+//  - src/string_arena.h
 //  - src/bank.cpp
+//  - include/async_bank.h
+//  - src/async_bank.cpp
+//  - include/metrics_server.h
+//  - src/metrics_server.cpp
+//  - include/bank_protocol.h
+//  - include/bank_server.h
+//  - src/bank_server.cpp
+//  - include/change_feed.h
+//  - src/change_feed.cpp
+//  - include/eod_report.h
+//  - src/eod_report.cpp
+//  - include/sharded_bank.h
+//  - src/sharded_bank.cpp
+//  - include/call_trace.h
+//  - src/call_trace.cpp
+//  - src/eod.cpp
+//  - src/bulk.cpp
+//  - src/archive.cpp
+//  - src/server_main.cpp
 //  - src/main.cpp
+//  - src/latency_stats.h
+//  - src/bench.cpp
+//  - src/replay.cpp
 
 // -------------------- README.md --------------------
 /*
@@ -18,8 +63,24 @@ A simple, portfolio-ready banking application in C++ using an object-oriented de
 ## Features
 - Create and manage customers and accounts
 - Deposit, withdraw, transfer funds
-- View account details and recent transactions
+- View account details and transaction history, paged by cursor (`transactionsPage`) or streamed in constant memory (`forEachTransaction`)
 - Basic input validation and error handling
+- Bulk `createCustomers`/`createAccounts` for imports: multi-row INSERTs that return the generated id ranges
+- Constant-memory visitor scans over customers and transactions (`ScanOptions::fetch_rows` rows per round trip)
+- Thread-safe `Bank` backed by a MySQL connection pool (sized via `BankOptions::pool`)
+- `AsyncBank`: future/callback-based front end that runs calls on a worker pool
+- `bank_server`: the Bank API over a pipelined binary protocol (`include/bank_protocol.h`) on an epoll event loop, with per-connection in-flight limits and `APPLY_BATCH` for batching
+- Optional in-process account cache (`BankOptions::cache`), kept current by the bank's own writes
+- Read-replica routing for read-only calls, with an optional read-your-writes window (`BankOptions::replicas`)
+- Deadlock-free transfer ordering, with retry and jittered backoff on InnoDB deadlocks and lock wait timeouts (`BankOptions::retry`)
+- Per-call latency histograms and counters, including deadlocks and lock wait timeouts per call (`Bank::metrics()`), exported in Prometheus format by `MetricsServer`
+- Optional in-memory ledger engine with a group-committed write-ahead log (`BankOptions::ledger`)
+- Optional idempotency keys on `deposit`/`withdraw`/`transfer`, so client retries never double-post; recent keys are answered from memory (`BankOptions::idempotency`)
+- Change-data capture: committed deposits, withdrawals and transfers published to an in-process broadcast ring (`BankOptions::feed`, `ChangeFeed`), with `FeedForwarder` to pump them into a message bus
+- `ShardedBank`: customers and accounts spread over several MySQL instances by id range, with cross-shard transfers run as a resumable saga
+- Running balance on every ledger row and a per-account daily rollup (`account_daily`), so `balanceAsOf` and `dailyRollups` answer statements without scanning the history
+- Balance striping for hot accounts (`BankOptions::striping`): deposits to a listed account spread over K stripe rows instead of queueing on one row lock
+- Withdrawal/transfer limits and velocity rules (`BankOptions::rules`), checked against in-memory sliding-window totals per account with no extra query, plus an optional custom hook
 
 ## Requirements
 - g++ (C++17)
@@ -43,8 +104,30 @@ make
 ```
 ./bank_app
 ```
+5. Benchmark (optional): `./bank_bench --setup --accounts 10000 --threads 16 --mix transfer`.
+   Mixes are `read`, `transfer`, `hot` (Zipfian account skew) and `bulk` (applyBatch);
+   `--format json` prints one machine-readable line for comparing runs.
+   To replay real traffic instead, capture it with `./bank_server --trace prod.trace`, then run
+   `./bank_replay --trace prod.trace --speed 4 --save before.json` against a staging copy of the database and, after a change,
+   `./bank_replay --trace prod.trace --speed 4 --baseline before.json --tolerance 10`, which exits 3 if any call type's p99 or lock conflict rate got worse.
+6. Bulk copy (optional): `./bank_bulk export --table transactions --out dump --threads 16` writes one CSV per primary-key range in parallel and records the ranges in `dump/transactions.manifest`, so rerunning it resumes the same split; `./bank_bulk import --table transactions --checkpoint tx.ckpt dump/transactions-*.csv` loads them back with ids kept, resuming from the checkpoint after an interruption. Import with the application stopped, and move `account_daily` together with `transactions` so `balanceAsOf` and the daily rollups cover the imported history.
+7. Partitions and archival: `./bank_archive --keep-months 12 --ahead 3`, run daily (e.g. from cron), creates the coming months' partitions of `transactions` and moves months older than `--keep-months` to the compressed `transactions_archive` table.
+8. End-of-day totals (optional): `./bank_eod --snapshot accounts.snap --rate-ppm 110 --interest-out interest.csv` reads a ledger snapshot and needs no database.
 
 ## Notes
+- `createCustomer`/`createAccount` call the `create_customer`/`create_account` procedures from `db.sql`; load them into databases created before they existed.
+- Without the ledger engine, `deposit`/`withdraw`/`transfer` are one `CALL` each: the `deposit_funds`/`withdraw_funds`/`transfer_funds` procedures claim the idempotency key, move the money and write the ledger rows and rollups in their own transaction. Load them (and their helpers) from `db.sql` as well. `applyBatch` and the cross-shard legs still run their statements from the client.
+- `BankOptions::ledger.snapshot_path` keeps a memory-mappable, columnar copy of the account balances (see `src/account_snapshot.h` for the layout) so the ledger engine starts from it plus the WAL instead of reading every account; offline tools can scan the same file with `AccountSnapshot`.
+- Account and transaction types are `AccountType`/`TransactionType` enums backed by MySQL ENUM columns and read by index, so `Account` holds no strings. Text is converted only at the edges: `parseAccountType` for input, `toString` for display and SQL parameters. `db.sql` has the `ALTER TABLE` for an existing `accounts` table.
+- `endOfDay()` (`include/eod_report.h`) computes total liabilities, per-type balances, interest accrual and low-balance accounts over a snapshot or, through `Bank::endOfDay`, the ledger engine's live balances. The scans pick AVX-512, AVX2 or scalar code at runtime with identical results; interest is rounded half up per account (ties toward +infinity, for negative rates too) in exact 128-bit arithmetic, and a total outside the int64 range is an error rather than a wrapped value.
+- `BankOptions::striping.accounts` lists hot accounts, e.g. merchant settlement accounts that take thousands of deposits a second. A deposit to one of them adds to one of its `striping.stripes` rows in `account_stripes` (each thread keeps to its own), so that many deposits commit side by side; balance reads add the stripes in. A withdrawal or outgoing transfer first locks the stripes and folds them into the account row, so debits on a striped account run one at a time as before. List the accounts in every process that writes them: elsewhere a debit sees only the account row and may be refused while funds sit in stripes. The ledger engine already batches its writes and ignores the setting.
+- `transactions` is partitioned by `created_at` month with a BIGINT `transaction_id`. `transactionsPage`/`recentTransactions` query a window of months at a time, newest first, so MySQL reads only those partitions; `forEachTransaction` bounds its scan by `from`/`to` and also reads `transactions_archive`, so archived months stay reachable for statements. Pages do not reach archived months. Partitioned tables cannot carry foreign keys, so ledger rows are no longer removed together with their account.
+- Each ledger row carries `balance_after`, and each posting adds to its account's `account_daily` row for the day in the same transaction. `balanceAsOf(account, "2024-03-31")` is one index lookup; `dailyRollups` gives opening/closing balances plus credit and debit totals per day for a statement, with `forEachTransaction` supplying its lines. Credits to striped accounts have no exact running balance, so their rows leave `balance_after` NULL and their balances as of a date are derived from the current balance and the later days. Days before `account_daily` existed are not covered; `db.sql` shows how to seed it on an existing database. `post_transaction` gained a stripe argument, so re-create it from `db.sql` when upgrading.
+- `BankOptions::rules` limits are enforced per process: each `Bank` keeps its own window totals, filled from the write path and, at startup, from the last window of `transactions`. Route each account's writes through one process (as `ShardedBank` does per shard) or the limits apply per process rather than per account. Windows are kept in `slices` steps and may reach back up to one step further than `window_seconds`, never less. A rejected call returns false/`REJECTED` like insufficient funds and counts in `bank_rule_rejections_total`.
+- With `BankOptions::ledger.wal_path` set, money movements are acknowledged once they are in the local WAL and reach MySQL a few milliseconds later, so `recentTransactions` can lag slightly behind balances. Only one process may run the engine against a database. A keyed call's key is logged with its WAL record (in `<wal_path>.keys`) and inserted into `idempotency_keys` by the flush that applies the record; until then the engine answers retries from memory, so concurrent retries cannot both post, and recovery replays the keys with their records. Engine postings are dated when their WAL record became durable, so a flush or replay after midnight still puts them in the right `account_daily` day; a WAL left by an older build is still read and replayed.
+- `ShardedBank` needs each shard's `AUTO_INCREMENT` set to its first id (see `db.sql`). A cross-shard transfer is debited before it is credited; if a shard is unreachable in between, the money stays in flight until `resumePendingTransfers()` settles it. In `applyBatch` it keeps its place among its source shard's operations.
+- Traces (`include/call_trace.h`) hold call types, ids, amounts and timing only, 32 bytes a call; idempotency keys are replaced with fresh ones on replay. Restore staging from a copy taken when the trace started (e.g. with `bank_bulk`), or withdrawals and transfers are rejected on balances that no longer match. At `--speed` above 1 the recorded concurrency is compressed too; `behind p99` shows how far the replay fell behind the schedule when `--threads` was too few to keep up.
+- `ChangeFeed` holds events in memory only: a subscriber that falls a full ring behind loses events (`Subscription::lost()`), and nothing is replayed after a restart. Consumers that need every row should reconcile against `transactions`.
 - This is a console application meant for learning and interviews. For production, add stronger security, transaction management, and input sanitization.
 */
 
@@ -64,49 +147,445 @@ CREATE TABLE customers (
 CREATE TABLE accounts (
   account_id INT AUTO_INCREMENT PRIMARY KEY,
   customer_id INT NOT NULL,
-  account_type VARCHAR(20) NOT NULL,
+  -- ENUM values are stored as their 1-based index (AccountType); on an existing database:
+  --   ALTER TABLE accounts MODIFY account_type ENUM('SAVINGS','CURRENT') NOT NULL;
+  -- after checking SELECT DISTINCT account_type FROM accounts holds no other values
+  account_type ENUM('SAVINGS','CURRENT') NOT NULL,
   balance DECIMAL(15,2) DEFAULT 0.00,
   created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
   FOREIGN KEY (customer_id) REFERENCES customers(customer_id) ON DELETE CASCADE
 );
 
+-- The ledger, one RANGE partition per created_at month: pYYYYMM holds that
+-- month, p_start everything before the first of them, p_future anything past
+-- the last. bank_archive splits p_future ahead of time and moves old months to
+-- transactions_archive. created_at is in the primary key because every unique
+-- key of a partitioned table must contain the partitioning column, and
+-- partitioned InnoDB tables cannot have foreign keys, so account_id is not one.
+-- On an existing database (a table rebuild; stop the application first):
+--   ALTER TABLE transactions DROP FOREIGN KEY transactions_ibfk_1,  -- the name SHOW CREATE TABLE gives
+--     MODIFY transaction_id BIGINT NOT NULL AUTO_INCREMENT,
+--     MODIFY created_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+--     DROP PRIMARY KEY, ADD PRIMARY KEY (transaction_id, created_at);
+--   ALTER TABLE transactions PARTITION BY RANGE (UNIX_TIMESTAMP(created_at)) (
+--     PARTITION p_start VALUES LESS THAN (UNIX_TIMESTAMP('2026-10-01 00:00:00')),
+--     PARTITION p_future VALUES LESS THAN MAXVALUE);
+-- then run bank_archive once to create the monthly partitions.
 CREATE TABLE transactions (
-  transaction_id INT AUTO_INCREMENT PRIMARY KEY,
+  transaction_id BIGINT NOT NULL AUTO_INCREMENT,
   account_id INT NOT NULL,
   type ENUM('DEPOSIT','WITHDRAW','TRANSFER') NOT NULL,
   amount DECIMAL(15,2) NOT NULL,
   details VARCHAR(255),
-  created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+  -- balance right after this posting; NULL for credits to striped accounts and
+  -- for rows from before the column. On an existing database:
+  --   ALTER TABLE transactions ADD COLUMN balance_after DECIMAL(15,2) NULL AFTER details;
+  balance_after DECIMAL(15,2) NULL,
+  created_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  PRIMARY KEY (transaction_id, created_at),
+  -- serves per-account history in time order and keyset paging; on an existing
+  -- database: ALTER TABLE transactions ADD INDEX idx_transactions_account_created (account_id, created_at, transaction_id);
+  INDEX idx_transactions_account_created (account_id, created_at, transaction_id)
+)
+PARTITION BY RANGE (UNIX_TIMESTAMP(created_at)) (
+  PARTITION p_start VALUES LESS THAN (UNIX_TIMESTAMP('2026-10-01 00:00:00')),
+  PARTITION p_future VALUES LESS THAN MAXVALUE
+);
+
+-- Months bank_archive has moved out of transactions, on compressed pages
+-- (needs innodb_file_per_table). forEachTransaction reads it alongside
+-- transactions.
+CREATE TABLE transactions_archive (
+  transaction_id BIGINT NOT NULL PRIMARY KEY,
+  account_id INT NOT NULL,
+  type ENUM('DEPOSIT','WITHDRAW','TRANSFER') NOT NULL,
+  amount DECIMAL(15,2) NOT NULL,
+  details VARCHAR(255),
+  balance_after DECIMAL(15,2) NULL,
+  created_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  INDEX idx_transactions_archive_account_created (account_id, created_at, transaction_id)
+) ROW_FORMAT=COMPRESSED KEY_BLOCK_SIZE=8;
+
+-- Extra balance rows of hot accounts (BankOptions::striping): deposits land on
+-- one stripe each, so they do not queue on the account row. An account's
+-- balance is accounts.balance plus the sum of its stripes; withdrawals fold the
+-- stripes back into accounts.balance first.
+CREATE TABLE account_stripes (
+  account_id INT NOT NULL,
+  stripe TINYINT UNSIGNED NOT NULL,
+  balance DECIMAL(15,2) NOT NULL DEFAULT 0.00,
+  PRIMARY KEY (account_id, stripe),
+  FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE
+);
+
+-- Per-account daily rollup of the ledger, kept in the posting's own transaction,
+-- so balance-as-of-date and statements read a few rows instead of scanning
+-- transactions. stripe 0 carries opening/closing; credits to a striped account
+-- are summed on stripe 1..K with NULL opening/closing (and the stripe 0 row of
+-- a striped account has NULL ones too), so they do not queue on one row.
+-- On an existing database, seed every account once so later days chain from it:
+--   INSERT INTO account_daily(account_id,day,stripe,opening,closing)
+--     SELECT account_id, CURRENT_DATE - INTERVAL 1 DAY, 0, balance, balance FROM accounts;
+CREATE TABLE account_daily (
+  account_id INT NOT NULL,
+  day DATE NOT NULL,
+  stripe TINYINT UNSIGNED NOT NULL DEFAULT 0,
+  opening DECIMAL(15,2) NULL,
+  closing DECIMAL(15,2) NULL,
+  credits DECIMAL(15,2) NOT NULL DEFAULT 0.00,
+  debits DECIMAL(15,2) NOT NULL DEFAULT 0.00,
+  PRIMARY KEY (account_id, day, stripe),
   FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE
 );
+
+-- Highest ledger-engine WAL record already applied to the tables above.
+CREATE TABLE ledger_checkpoint (
+  id TINYINT PRIMARY KEY,
+  applied_lsn BIGINT NOT NULL
+);
+INSERT INTO ledger_checkpoint VALUES (1, 0);
+
+-- Keys of committed idempotent deposit/withdraw/transfer calls. Rows only
+-- matter while clients may still retry; purge old ones periodically, e.g.
+--   DELETE FROM idempotency_keys WHERE created_at < NOW() - INTERVAL 7 DAY;
+CREATE TABLE idempotency_keys (
+  idem_key VARCHAR(64) PRIMARY KEY,
+  created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+);
+
+-- Cross-shard transfers (ShardedBank). On a shard the customers and accounts
+-- ids must start at the shard's first_id, e.g. for a shard owning 1000000 on:
+--   ALTER TABLE customers AUTO_INCREMENT = 1000000;
+--   ALTER TABLE accounts AUTO_INCREMENT = 1000000;
+-- Outbound legs debited on this shard; PENDING until the target has answered.
+CREATE TABLE shard_transfers (
+  transfer_id BIGINT AUTO_INCREMENT PRIMARY KEY,
+  from_account_id INT NOT NULL,
+  to_account_id INT NOT NULL,
+  amount DECIMAL(15,2) NOT NULL,
+  state ENUM('PENDING','DONE','REFUNDED') NOT NULL DEFAULT 'PENDING',
+  idem_key VARCHAR(64) NULL,  -- freed again if the leg is refunded
+  created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+  INDEX idx_shard_transfers_state (state, created_at)
+);
+
+-- Inbound legs credited on this shard, keyed by the source shard's first_id.
+CREATE TABLE shard_transfer_credits (
+  source_shard INT NOT NULL,
+  transfer_id BIGINT NOT NULL,
+  PRIMARY KEY (source_shard, transfer_id)
+);
+
+-- Single-row creates: the INSERT and its generated id in one round trip.
+DELIMITER //
+CREATE PROCEDURE create_customer(IN p_name VARCHAR(100), IN p_email VARCHAR(100), IN p_phone VARCHAR(20))
+BEGIN
+  INSERT INTO customers(name,email,phone) VALUES(p_name,p_email,p_phone);
+  SELECT LAST_INSERT_ID();
+END //
+-- Ledger row of a posting whose balance change the calling transaction has
+-- just made, with the balance after it, plus its account_daily rollup on the
+-- row's created_at day. A credit to stripe p_stripe > 0 of a striped account
+-- has no exact balance after it and rolls up on that stripe's row.
+CREATE PROCEDURE post_transaction(IN p_account_id INT, IN p_type ENUM('DEPOSIT','WITHDRAW','TRANSFER'),
+                                  IN p_amount DECIMAL(15,2), IN p_details VARCHAR(255), IN p_striped BOOLEAN,
+                                  IN p_stripe INT)
+BEGIN
+  DECLARE v_after DECIMAL(15,2);
+  DECLARE v_delta DECIMAL(15,2);
+  DECLARE v_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP;
+  IF p_stripe > 0 THEN
+    INSERT INTO transactions(account_id,type,amount,details,created_at)
+      VALUES(p_account_id,p_type,p_amount,p_details,v_at);
+    INSERT INTO account_daily(account_id,day,stripe,credits) VALUES(p_account_id, DATE(v_at), p_stripe, p_amount)
+      ON DUPLICATE KEY UPDATE credits = credits + VALUES(credits);
+  ELSE
+    SET v_delta = IF(p_type = 'DEPOSIT', p_amount, -p_amount);
+    SELECT balance INTO v_after FROM accounts WHERE account_id = p_account_id;
+    INSERT INTO transactions(account_id,type,amount,details,balance_after,created_at)
+      VALUES(p_account_id,p_type,p_amount,p_details,v_after,v_at);
+    INSERT INTO account_daily(account_id,day,stripe,opening,closing,credits,debits)
+      VALUES(p_account_id, DATE(v_at), 0, IF(p_striped, NULL, v_after - v_delta), IF(p_striped, NULL, v_after),
+             GREATEST(v_delta, 0), GREATEST(-v_delta, 0))
+      ON DUPLICATE KEY UPDATE closing = VALUES(closing), credits = credits + VALUES(credits), debits = debits + VALUES(debits);
+  END IF;
+END //
+-- Money movements in one round trip each: deposit_funds, withdraw_funds and
+-- transfer_funds claim the idempotency key (NULL for none), move the money,
+-- write the ledger rows and rollups, and commit, then SELECT a status:
+-- 0 applied, 1 key already used, 2 rejected (unknown account or
+-- insufficient funds). Errors roll back and are raised again, so the caller
+-- retries a deadlock as usual. p_stripe is the stripe a striped account's
+-- credit goes to, plus one; 0 for an unstriped account.
+CREATE PROCEDURE claim_key(IN p_key VARCHAR(64), OUT p_claimed BOOLEAN)
+BEGIN
+  SET p_claimed = TRUE;
+  IF p_key IS NOT NULL THEN
+    INSERT IGNORE INTO idempotency_keys(idem_key) VALUES(p_key);
+    SET p_claimed = ROW_COUNT() = 1;
+  END IF;
+END //
+CREATE PROCEDURE credit_account(IN p_account_id INT, IN p_amount DECIMAL(15,2), IN p_stripe INT, OUT p_ok BOOLEAN)
+BEGIN
+  IF p_stripe > 0 THEN
+    INSERT INTO account_stripes(account_id,stripe,balance) VALUES(p_account_id, p_stripe - 1, p_amount)
+      ON DUPLICATE KEY UPDATE balance = balance + VALUES(balance);
+  ELSE
+    UPDATE accounts SET balance = balance + p_amount WHERE account_id = p_account_id;
+  END IF;
+  SET p_ok = ROW_COUNT() > 0;
+END //
+-- The balance check is part of the UPDATE; a striped account's stripes are
+-- locked and folded into its row first.
+CREATE PROCEDURE debit_account(IN p_account_id INT, IN p_amount DECIMAL(15,2), IN p_striped BOOLEAN, OUT p_ok BOOLEAN)
+BEGIN
+  DECLARE v_striped DECIMAL(15,2);
+  IF p_striped THEN
+    SELECT COALESCE(SUM(balance), 0) INTO v_striped FROM account_stripes WHERE account_id = p_account_id FOR UPDATE;
+    IF v_striped <> 0 THEN
+      UPDATE account_stripes SET balance = 0 WHERE account_id = p_account_id AND balance <> 0;
+      UPDATE accounts SET balance = balance + v_striped WHERE account_id = p_account_id;
+    END IF;
+  END IF;
+  UPDATE accounts SET balance = balance - p_amount WHERE account_id = p_account_id AND balance >= p_amount;
+  SET p_ok = ROW_COUNT() = 1;
+END //
+CREATE PROCEDURE deposit_funds(IN p_key VARCHAR(64), IN p_account_id INT, IN p_amount DECIMAL(15,2), IN p_stripe INT)
+body: BEGIN
+  DECLARE v_ok BOOLEAN;
+  DECLARE EXIT HANDLER FOR SQLEXCEPTION BEGIN ROLLBACK; RESIGNAL; END;
+  START TRANSACTION;
+  CALL claim_key(p_key, v_ok);
+  IF NOT v_ok THEN ROLLBACK; SELECT 1; LEAVE body; END IF;
+  CALL credit_account(p_account_id, p_amount, p_stripe, v_ok);
+  IF NOT v_ok THEN ROLLBACK; SELECT 2; LEAVE body; END IF;
+  CALL post_transaction(p_account_id, 'DEPOSIT', p_amount, 'Deposit via app', p_stripe > 0, p_stripe);
+  COMMIT;
+  SELECT 0;
+END //
+CREATE PROCEDURE withdraw_funds(IN p_key VARCHAR(64), IN p_account_id INT, IN p_amount DECIMAL(15,2), IN p_striped BOOLEAN)
+body: BEGIN
+  DECLARE v_ok BOOLEAN;
+  DECLARE EXIT HANDLER FOR SQLEXCEPTION BEGIN ROLLBACK; RESIGNAL; END;
+  START TRANSACTION;
+  CALL claim_key(p_key, v_ok);
+  IF NOT v_ok THEN ROLLBACK; SELECT 1; LEAVE body; END IF;
+  CALL debit_account(p_account_id, p_amount, p_striped, v_ok);
+  IF NOT v_ok THEN ROLLBACK; SELECT 2; LEAVE body; END IF;
+  CALL post_transaction(p_account_id, 'WITHDRAW', p_amount, 'Withdrawal via app', p_striped, 0);
+  COMMIT;
+  SELECT 0;
+END //
+-- Row locks are taken lower account_id first whichever way the money moves,
+-- so A->B and B->A running together queue instead of deadlocking.
+CREATE PROCEDURE transfer_funds(IN p_key VARCHAR(64), IN p_from INT, IN p_to INT, IN p_amount DECIMAL(15,2),
+                                IN p_from_striped BOOLEAN, IN p_to_striped BOOLEAN, IN p_to_stripe INT)
+body: BEGIN
+  DECLARE v_ok BOOLEAN;
+  DECLARE EXIT HANDLER FOR SQLEXCEPTION BEGIN ROLLBACK; RESIGNAL; END;
+  START TRANSACTION;
+  CALL claim_key(p_key, v_ok);
+  IF NOT v_ok THEN ROLLBACK; SELECT 1; LEAVE body; END IF;
+  IF p_from < p_to THEN
+    CALL debit_account(p_from, p_amount, p_from_striped, v_ok);
+    IF v_ok THEN CALL credit_account(p_to, p_amount, p_to_stripe, v_ok); END IF;
+  ELSE
+    CALL credit_account(p_to, p_amount, p_to_stripe, v_ok);
+    IF v_ok THEN CALL debit_account(p_from, p_amount, p_from_striped, v_ok); END IF;
+  END IF;
+  IF NOT v_ok THEN ROLLBACK; SELECT 2; LEAVE body; END IF;
+  CALL post_transaction(p_from, 'TRANSFER', p_amount, CONCAT('Transfer to account ', p_to), p_from_striped, 0);
+  CALL post_transaction(p_to, 'DEPOSIT', p_amount, CONCAT('Transfer from account ', p_from), p_to_striped, p_to_stripe);
+  COMMIT;
+  SELECT 0;
+END //
+CREATE PROCEDURE create_account(IN p_customer_id INT, IN p_type ENUM('SAVINGS','CURRENT'))
+BEGIN
+  INSERT INTO accounts(customer_id,account_type,balance) VALUES(p_customer_id,p_type,0.00);
+  SELECT LAST_INSERT_ID();
+END //
+DELIMITER ;
 */
 
 // -------------------- Makefile --------------------
 /*
 CXX = g++
-CXXFLAGS = -std=c++17 -Iinclude -O2
-LDFLAGS = -lmysqlcppconn
-SRC = src/main.cpp src/bank.cpp
+CXXFLAGS = -std=c++17 -Iinclude -O2 -pthread
+LDFLAGS = -lmysqlcppconn -pthread
+LIB_SRC = src/money.cpp src/bank.cpp src/connection_pool.cpp src/account_cache.cpp src/ledger_sql.cpp src/ledger_engine.cpp \
+          src/idempotency_cache.cpp src/account_snapshot.cpp \
+          src/async_bank.cpp src/metrics.cpp src/metrics_server.cpp src/bank_server.cpp src/sharded_bank.cpp \
+          src/change_feed.cpp src/account_kernels.cpp src/eod_report.cpp src/partitions.cpp src/limit_rules.cpp src/call_trace.cpp
+SRC = src/main.cpp $(LIB_SRC)
 OBJ = $(SRC:.cpp=.o)
 TARGET = bank_app
+BENCH = bank_bench
+EOD = bank_eod
+EOD_SRC = src/eod.cpp src/money.cpp src/account_snapshot.cpp src/account_kernels.cpp src/eod_report.cpp
+BULK = bank_bulk
+SERVER = bank_server
+ARCHIVE = bank_archive
+REPLAY = bank_replay
 
-all: $(TARGET)
+all: $(TARGET) $(BENCH) $(EOD) $(BULK) $(SERVER) $(ARCHIVE) $(REPLAY)
 
 $(TARGET): $(SRC)
 	$(CXX) $(CXXFLAGS) $(SRC) -o $(TARGET) $(LDFLAGS)
 
+$(BENCH): src/bench.cpp $(LIB_SRC)
+	$(CXX) $(CXXFLAGS) src/bench.cpp $(LIB_SRC) -o $(BENCH) $(LDFLAGS)
+
+$(SERVER): src/server_main.cpp $(LIB_SRC)
+	$(CXX) $(CXXFLAGS) src/server_main.cpp $(LIB_SRC) -o $(SERVER) $(LDFLAGS)
+
+$(BULK): src/bulk.cpp $(LIB_SRC)
+	$(CXX) $(CXXFLAGS) src/bulk.cpp $(LIB_SRC) -o $(BULK) $(LDFLAGS)
+
+$(ARCHIVE): src/archive.cpp $(LIB_SRC)
+	$(CXX) $(CXXFLAGS) src/archive.cpp $(LIB_SRC) -o $(ARCHIVE) $(LDFLAGS)
+
+$(REPLAY): src/replay.cpp $(LIB_SRC)
+	$(CXX) $(CXXFLAGS) src/replay.cpp $(LIB_SRC) -o $(REPLAY) $(LDFLAGS)
+
+# Reads snapshot files only, so it needs no MySQL connector.
+$(EOD): $(EOD_SRC)
+	$(CXX) $(CXXFLAGS) $(EOD_SRC) -o $(EOD) -pthread
+
 clean:
-	rm -f $(TARGET) $(OBJ)
+	rm -f $(TARGET) $(BENCH) $(EOD) $(BULK) $(SERVER) $(ARCHIVE) $(REPLAY) $(OBJ)
 */
 
+// -------------------- include/money.h --------------------
+
+#ifndef MONEY_H
+#define MONEY_H
+
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+// Exact currency amount stored as a whole number of cents, matching the
+// DECIMAL(15,2) columns. Arithmetic is checked: overflow throws
+// std::overflow_error instead of wrapping.
+class Money {
+public:
+    constexpr Money() : value(0) {}
+
+    static constexpr Money fromCents(std::int64_t cents) { return Money(cents); }
+    constexpr std::int64_t cents() const { return value; }
+
+    // Accepts "12", "12.5", "-12.34"; throws std::invalid_argument for
+    // anything else, including more than two decimal places.
+    static Money parse(const std::string &text);
+    std::string toString() const;
+
+    constexpr Money operator+(Money o) const { return Money(add(value, o.value)); }
+    constexpr Money operator-(Money o) const { return Money(sub(value, o.value)); }
+    constexpr Money operator-() const { return Money(sub(0, value)); }
+    constexpr Money operator*(std::int64_t n) const { return Money(mul(value, n)); }
+    Money& operator+=(Money o) { value = add(value, o.value); return *this; }
+    Money& operator-=(Money o) { value = sub(value, o.value); return *this; }
+
+    constexpr bool operator==(Money o) const { return value == o.value; }
+    constexpr bool operator!=(Money o) const { return value != o.value; }
+    constexpr bool operator<(Money o) const { return value < o.value; }
+    constexpr bool operator<=(Money o) const { return value <= o.value; }
+    constexpr bool operator>(Money o) const { return value > o.value; }
+    constexpr bool operator>=(Money o) const { return value >= o.value; }
+
+private:
+    constexpr explicit Money(std::int64_t cents) : value(cents) {}
+
+    static constexpr std::int64_t add(std::int64_t a, std::int64_t b) {
+        std::int64_t r = 0;
+        if (__builtin_add_overflow(a, b, &r)) throw std::overflow_error("Money overflow");
+        return r;
+    }
+    static constexpr std::int64_t sub(std::int64_t a, std::int64_t b) {
+        std::int64_t r = 0;
+        if (__builtin_sub_overflow(a, b, &r)) throw std::overflow_error("Money overflow");
+        return r;
+    }
+    static constexpr std::int64_t mul(std::int64_t a, std::int64_t b) {
+        std::int64_t r = 0;
+        if (__builtin_mul_overflow(a, b, &r)) throw std::overflow_error("Money overflow");
+        return r;
+    }
+
+    std::int64_t value;
+};
+
+std::ostream& operator<<(std::ostream &os, Money m);
+
+#endif // MONEY_H
+
+// -------------------- src/money.cpp --------------------
+
+#include "../include/money.h"
+#include <cctype>
+
+Money Money::parse(const std::string &text) {
+    std::size_t i = 0, n = text.size();
+    while (i < n && std::isspace(static_cast<unsigned char>(text[i]))) ++i;
+    while (n > i && std::isspace(static_cast<unsigned char>(text[n - 1]))) --n;
+    bool negative = false;
+    if (i < n && (text[i] == '-' || text[i] == '+')) negative = text[i++] == '-';
+
+    std::int64_t cents = 0;
+    int digits = 0, decimals = -1;  // decimals stays -1 until a '.' is seen
+    for (; i < n; ++i) {
+        char ch = text[i];
+        if (ch == '.' && decimals < 0) { decimals = 0; continue; }
+        if (!std::isdigit(static_cast<unsigned char>(ch)) || decimals == 2)
+            throw std::invalid_argument("invalid amount: " + text);
+        cents = add(mul(cents, 10), ch - '0');
+        ++digits;
+        if (decimals >= 0) ++decimals;
+    }
+    if (digits == 0) throw std::invalid_argument("invalid amount: " + text);
+    for (int d = decimals < 0 ? 0 : decimals; d < 2; ++d) cents = mul(cents, 10);
+    return Money(negative ? -cents : cents);
+}
+
+std::string Money::toString() const {
+    std::uint64_t mag = value < 0 ? 0 - static_cast<std::uint64_t>(value) : static_cast<std::uint64_t>(value);
+    std::string frac = std::to_string(mag % 100);
+    if (frac.size() < 2) frac.insert(0, "0");
+    return (value < 0 ? "-" : "") + std::to_string(mag / 100) + "." + frac;
+}
+
+std::ostream& operator<<(std::ostream &os, Money m) {
+    return os << m.toString();
+}
+
 // -------------------- include/bank.h --------------------
 
 #ifndef BANK_H
 #define BANK_H
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "money.h"
+
+// Stored in the accounts.account_type and transactions.type ENUM columns.
+// Each value is its ENUM index, so rows are read back as "column + 0" without
+// a string; UNKNOWN (0) is the index MySQL gives a value outside the ENUM.
+enum class AccountType : std::uint8_t { UNKNOWN = 0, SAVINGS = 1, CURRENT = 2 };
+enum class TransactionType : std::uint8_t { UNKNOWN = 0, DEPOSIT = 1, WITHDRAW = 2, TRANSFER = 3 };
+static const std::size_t ACCOUNT_TYPE_COUNT = 3;  // including UNKNOWN
+
+// Names as spelled in the schema; "" for UNKNOWN.
+const char *toString(AccountType type);
+const char *toString(TransactionType type);
+// Case-insensitive. Returns false, leaving out as UNKNOWN, for any other text.
+bool parseAccountType(const std::string &text, AccountType &out);
+
 struct Customer {
     int id;
     std::string name;
@@ -117,39 +596,404 @@ struct Customer {
 struct Account {
     int id;
     int customer_id;
-    std::string type;
-    double balance;
+    AccountType type;
+    Money balance;
 };
 
 struct TransactionRecord {
-    int id;
+    std::int64_t id;
     int account_id;
-    std::string type; // DEPOSIT, WITHDRAW, TRANSFER
-    double amount;
+    TransactionType type;
+    Money amount;
     std::string details;
     std::string created_at;
+    // Balance right after the posting; not kept for credits to striped
+    // accounts or for rows written before the column existed.
+    bool has_balance_after;
+    Money balance_after;
+};
+
+// Non-owning rows passed by the *View scans. The strings point into a buffer
+// that is reused for the next batch: copy anything needed after fn returns.
+struct CustomerView {
+    int id;
+    std::string_view name;
+    std::string_view email;
+    std::string_view phone;
+};
+
+struct TransactionView {
+    std::int64_t id;
+    int account_id;
+    TransactionType type;
+    Money amount;
+    std::string_view details;
+    std::string_view created_at;
+    bool has_balance_after;
+    Money balance_after;
+};
+
+// One account's postings on one day, from the account_daily rollup.
+struct DailyRollup {
+    std::string day;  // YYYY-MM-DD
+    Money opening;    // balance at the start of the day
+    Money closing;    // and at its end
+    Money credits;
+    Money debits;
+};
+
+// One entry of a batch passed to Bank::applyBatch.
+struct Operation {
+    enum Kind { DEPOSIT, WITHDRAW, TRANSFER };
+    Kind kind;
+    int account_id;     // source account for TRANSFER
+    int to_account_id;  // TRANSFER only
+    Money amount;
+};
+
+enum class OperationResult {
+    APPLIED,
+    REJECTED,  // bad amount, unknown account, insufficient funds or a limit rule
+    FAILED     // database error; the whole chunk containing the operation was rolled back
+};
+
+// Ids generated by one multi-row INSERT: first, first + step, ... (count ids).
+// step is the server's auto_increment_increment, 1 unless configured otherwise.
+struct IdRange {
+    int first;
+    int count;
+    int step;
+};
+
+struct BatchOptions {
+    std::size_t commit_every = 500;     // operations per transaction
+    std::size_t rows_per_insert = 100;  // ledger rows per multi-row INSERT
+};
+
+// Visitor scans (forEachCustomer, forEachTransaction) read this many rows per
+// round trip; memory use is bounded by one batch, not by the table size.
+struct ScanOptions {
+    std::size_t fetch_rows = 1000;
+};
+
+// Connection pool sizing. Connections are opened lazily up to max_connections.
+struct PoolOptions {
+    std::size_t min_connections = 1;
+    std::size_t max_connections = 8;
+    int acquire_timeout_ms = 5000;       // how long a caller waits for a free connection
+    int validate_after_idle_ms = 30000;  // ping connections idle longer than this on checkout
+    std::size_t max_cached_statements = 64;  // per connection; the cache is reset when it grows past this
+};
+
+// Account cache used by getAccount(); capacity 0 turns it off.
+struct CacheOptions {
+    std::size_t capacity = 0;  // accounts held, across all shards
+    std::size_t shards = 16;
+    int ttl_ms = 0;            // 0 = never expire; set it when other processes write the same database
+};
+
+struct CacheStats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    std::uint64_t entries = 0;
+};
+
+// In-memory ledger engine with a local write-ahead log; an empty wal_path
+// keeps every write a direct MySQL transaction.
+struct LedgerOptions {
+    std::string wal_path;
+    int flush_interval_ms = 20;       // how often durable records are written to MySQL
+    std::size_t flush_batch = 10000;  // WAL records per MySQL transaction
+    // With a snapshot_path, startup maps the columnar account snapshot and
+    // replays the WAL from its position instead of selecting every account.
+    // The WAL is folded into a new snapshot every snapshot_interval_s.
+    std::string snapshot_path;
+    int snapshot_interval_s = 300;
+};
+
+// One latency timer, in nanoseconds. Quantiles are histogram bucket upper
+// edges, within ~3% of the true value.
+struct LatencySummary {
+    std::string name;
+    std::uint64_t count = 0;
+    std::uint64_t sum_ns = 0;
+    std::uint64_t p50_ns = 0;
+    std::uint64_t p99_ns = 0;
+    std::uint64_t p999_ns = 0;
+    std::uint64_t max_ns = 0;
+    // InnoDB lock conflicts retried inside the call; public calls only.
+    std::uint64_t deadlocks = 0;
+    std::uint64_t lock_wait_timeouts = 0;
+};
+
+// Cumulative since the Bank was constructed, except the pool gauges.
+struct MetricsSnapshot {
+    std::vector<LatencySummary> methods;  // one per public call, e.g. "deposit"
+    std::vector<LatencySummary> phases;   // "prepare" (server-side prepares only), "execute", "commit", "pool_wait"
+    std::uint64_t rollbacks = 0;
+    std::uint64_t lock_wait_retries = 0;
+    std::uint64_t pool_waits = 0;         // acquires that found every connection busy
+    std::uint64_t pool_timeouts = 0;
+    std::uint64_t rule_rejections = 0;    // operations turned down by BankOptions::rules
+    std::size_t pool_connections = 0;
+    std::size_t pool_in_use = 0;
+};
+
+// Transactions that hit an InnoDB deadlock or lock wait timeout are rolled
+// back and run again after a jittered exponential backoff.
+struct RetryOptions {
+    int max_attempts = 5;         // 1 turns retrying off
+    int base_backoff_us = 500;    // ceiling of the first sleep; doubles per attempt
+    int max_backoff_us = 50000;
+};
+
+// Read-only calls (getCustomer, getAccount, listAccountsByCustomer, the
+// customer and transaction scans and pages) go to the replica with the fewest
+// busy connections; writes always use the primary. Replicas share the
+// primary's user, password and schema. A replica that cannot be reached falls
+// back to the primary.
+struct ReplicaOptions {
+    std::vector<std::string> hosts;  // e.g. "tcp://10.0.0.12:3306"
+    PoolOptions pool;                // sizing of each replica's own pool
+    // > 0: after a thread writes, its reads stay on the primary for this long,
+    // so it sees its own writes despite replication lag
+    int read_your_writes_ms = 0;
+};
+
+class ChangeFeed;
+struct EndOfDayOptions;
+struct EndOfDayReport;
+
+// Publishes every committed deposit, withdrawal and transfer to an in-process
+// ChangeFeed (include/change_feed.h). Off unless capacity or shared is set.
+struct ChangeFeedOptions {
+    std::size_t capacity = 0;      // ring slots of a feed owned by the Bank
+    ChangeFeed *shared = nullptr;  // publish into this feed instead; it must outlive the Bank
+};
+
+// Keys of committed idempotent calls remembered in memory; older keys are
+// checked against the idempotency_keys table. 0 asks MySQL every time.
+struct IdempotencyOptions {
+    std::size_t cache_capacity = 100000;
+    std::size_t shards = 16;
+};
+
+// Hot accounts whose credits are spread over `stripes` rows of account_stripes
+// instead of all waiting on the account's row lock. Reads sum the stripes;
+// debits fold them into the account row first. Ignored with the ledger engine.
+struct StripingOptions {
+    std::vector<int> accounts;
+    int stripes = 8;  // 1..255; deposits to one account commit in parallel up to this many
+};
+
+// One limit on an account's recent money movements, e.g. at most 2000.00
+// withdrawn per 24 hours or at most 10 transfers a minute. The operation being
+// checked counts towards the limit; a transfer counts against its source
+// account.
+struct LimitRule {
+    enum Measure { AMOUNT, COUNT };
+    std::string name;
+    unsigned applies_to = (1u << Operation::WITHDRAW) | (1u << Operation::TRANSFER);  // one bit per Operation::Kind
+    Measure measure = AMOUNT;
+    int window_seconds = 86400;
+    std::int64_t limit = 0;  // cents for AMOUNT, operations for COUNT
+};
+
+// An account's movements of a rule's kinds within the rule's window,
+// including the operation being checked.
+struct WindowTotals {
+    Money amount;
+    std::int64_t count = 0;
+};
+
+// Limit rules checked on every deposit, withdrawal, transfer and applyBatch
+// operation before it is written, against totals kept in memory by the Bank's
+// own writes; no rules and no hook turns checking off.
+struct RuleOptions {
+    std::vector<LimitRule> rules;  // at most 8 distinct window lengths
+    int slices = 24;               // steps per window; more is exacter and costs more per check
+    std::size_t shards = 64;
+    bool warm_start = true;        // read the longest window back from transactions at startup
+    // Further check once every rule has passed: totals[i] belongs to rules[i].
+    // Return false to reject. It runs under a lock shared with other accounts,
+    // so it must be quick and must not call back into the Bank.
+    std::function<bool(const Operation &op, const WindowTotals *totals)> hook;
+};
+
+struct BankOptions {
+    PoolOptions pool;
+    CacheOptions cache;
+    IdempotencyOptions idempotency;
+    LedgerOptions ledger;
+    RetryOptions retry;
+    ReplicaOptions replicas;
+    ChangeFeedOptions feed;
+    StripingOptions striping;
+    RuleOptions rules;
 };
 
-class Bank {
+// The customer/account/money API shared by Bank (one MySQL database) and
+// ShardedBank (several). All methods are safe to call from multiple threads at once.
+class BankInterface {
 public:
-    Bank(const std::string &host, const std::string &user, const std::string &pass, const std::string &db);
-    ~Bank();
+    virtual ~BankInterface() {}
 
     // Customer operations
-    int createCustomer(const std::string &name, const std::string &email, const std::string &phone);
-    std::vector<Customer> listCustomers();
-    Customer getCustomer(int customer_id);
+    virtual int createCustomer(const std::string &name, const std::string &email, const std::string &phone) = 0;
+    // Bulk inserts for imports: options.rows_per_insert rows per multi-row
+    // INSERT, about options.commit_every rows per transaction. Returns the id
+    // range of every committed INSERT, in input order. After an error the open
+    // transaction is rolled back, so the ranges cover fewer rows than given.
+    virtual std::vector<IdRange> createCustomers(const std::vector<Customer> &customers,
+                                                 const BatchOptions &options = BatchOptions()) = 0;
+    virtual std::vector<Customer> listCustomers() = 0;
+    // Calls fn for every customer in id order, fetching options.fetch_rows at a
+    // time with no connection held while fn runs. Use this rather than
+    // listCustomers() for exports. Returns the rows visited, or -1 on error.
+    virtual std::int64_t forEachCustomer(const std::function<void(const Customer&)> &fn,
+                                         const ScanOptions &options = ScanOptions()) = 0;
+    // Same scan without a heap allocation per field; see CustomerView.
+    virtual std::int64_t forEachCustomerView(const std::function<void(const CustomerView&)> &fn,
+                                             const ScanOptions &options = ScanOptions()) = 0;
+    virtual Customer getCustomer(int customer_id) = 0;
 
     // Account operations
-    int createAccount(int customer_id, const std::string &type);
-    Account getAccount(int account_id);
-    std::vector<Account> listAccountsByCustomer(int customer_id);
+    virtual int createAccount(int customer_id, AccountType type) = 0;
+    // Uses customer_id and type of each entry; accounts open with a zero balance.
+    virtual std::vector<IdRange> createAccounts(const std::vector<Account> &accounts,
+                                                const BatchOptions &options = BatchOptions()) = 0;
+    virtual Account getAccount(int account_id) = 0;
+    virtual std::vector<Account> listAccountsByCustomer(int customer_id) = 0;
+
+    // Transactions. A non-empty idempotency_key (at most 64 characters) makes
+    // a retry safe: once a call with that key has applied, later calls with
+    // the same key return true without applying anything. A key names one
+    // request; reusing it for a different one returns the first call's outcome.
+    // A rejected call records nothing, so it can be retried with its key.
+    virtual bool deposit(int account_id, Money amount, const std::string &idempotency_key = std::string()) = 0;
+    virtual bool withdraw(int account_id, Money amount, const std::string &idempotency_key = std::string()) = 0;
+    virtual bool transfer(int from_account_id, int to_account_id, Money amount,
+                          const std::string &idempotency_key = std::string()) = 0;
+    virtual std::vector<TransactionRecord> recentTransactions(int account_id, int limit=10) = 0;
+    // Newest first. Pass 0 for the first page, then the id of the last record
+    // returned to get the next, older page.
+    virtual std::vector<TransactionRecord> transactionsPage(int account_id, std::int64_t before_txn_id, int limit) = 0;
+    // Calls fn for every transaction with from <= created_at < to, oldest first.
+    // Rows are fetched options.fetch_rows at a time and no connection is held
+    // while fn runs, so memory stays flat however long the history is. Timestamps
+    // use MySQL's 'YYYY-MM-DD HH:MM:SS' form. Returns the rows visited, or -1 on error.
+    virtual std::int64_t forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                            const std::function<void(const TransactionRecord&)> &fn,
+                                            const ScanOptions &options = ScanOptions()) = 0;
+    // Same scan without a heap allocation per field; see TransactionView.
+    virtual std::int64_t forEachTransactionView(int account_id, const std::string &from, const std::string &to,
+                                                const std::function<void(const TransactionView&)> &fn,
+                                                const ScanOptions &options = ScanOptions()) = 0;
+    // Balance at the end of day (YYYY-MM-DD), read from the daily rollups
+    // rather than the transaction history. Returns false for an unknown account
+    // or on error.
+    virtual bool balanceAsOf(int account_id, const std::string &day, Money &out) = 0;
+    // The rollup of every day with postings in from <= day <= to, oldest first:
+    // the opening and closing balances and daily totals a statement needs.
+    virtual std::vector<DailyRollup> dailyRollups(int account_id, const std::string &from, const std::string &to) = 0;
+
+    // Bulk money movement: operations are applied in order, grouped into one
+    // transaction per options.commit_every entries. Returns one result per operation.
+    virtual std::vector<OperationResult> applyBatch(const std::vector<Operation> &ops,
+                                                    const BatchOptions &options = BatchOptions()) = 0;
+
+    virtual CacheStats cacheStats() = 0;
+
+    // Latency and error counters recorded by every call; cheap enough to leave on.
+    virtual MetricsSnapshot metrics() = 0;
+    // The same in Prometheus text exposition format; see MetricsServer for an HTTP endpoint.
+    virtual std::string metricsText() = 0;
+
+    // The feed committed money movements are published to, or null when
+    // BankOptions::feed leaves change capture off.
+    virtual ChangeFeed *changeFeed() = 0;
+};
+
+// An outbound cross-shard transfer leg that has debited its source account
+// but is not yet settled; see Bank::transferOut.
+struct PendingTransfer {
+    std::int64_t transfer_id;
+    int from_account_id;
+    int to_account_id;
+    Money amount;
+};
+
+class Bank : public BankInterface {
+public:
+    Bank(const std::string &host, const std::string &user, const std::string &pass, const std::string &db,
+         const BankOptions &options = BankOptions());
+    ~Bank() override;
+    Bank(const Bank&) = delete;
+    Bank& operator=(const Bank&) = delete;
+
+    int createCustomer(const std::string &name, const std::string &email, const std::string &phone) override;
+    std::vector<IdRange> createCustomers(const std::vector<Customer> &customers,
+                                         const BatchOptions &options = BatchOptions()) override;
+    std::vector<Customer> listCustomers() override;
+    std::int64_t forEachCustomer(const std::function<void(const Customer&)> &fn,
+                                 const ScanOptions &options = ScanOptions()) override;
+    std::int64_t forEachCustomerView(const std::function<void(const CustomerView&)> &fn,
+                                     const ScanOptions &options = ScanOptions()) override;
+    Customer getCustomer(int customer_id) override;
 
-    // Transactions
-    bool deposit(int account_id, double amount);
-    bool withdraw(int account_id, double amount);
-    bool transfer(int from_account_id, int to_account_id, double amount);
-    std::vector<TransactionRecord> recentTransactions(int account_id, int limit=10);
+    int createAccount(int customer_id, AccountType type) override;
+    std::vector<IdRange> createAccounts(const std::vector<Account> &accounts,
+                                        const BatchOptions &options = BatchOptions()) override;
+    Account getAccount(int account_id) override;
+    std::vector<Account> listAccountsByCustomer(int customer_id) override;
+
+    bool deposit(int account_id, Money amount, const std::string &idempotency_key = std::string()) override;
+    bool withdraw(int account_id, Money amount, const std::string &idempotency_key = std::string()) override;
+    bool transfer(int from_account_id, int to_account_id, Money amount,
+                  const std::string &idempotency_key = std::string()) override;
+    std::vector<TransactionRecord> recentTransactions(int account_id, int limit=10) override;
+    std::vector<TransactionRecord> transactionsPage(int account_id, std::int64_t before_txn_id, int limit) override;
+    std::int64_t forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                    const std::function<void(const TransactionRecord&)> &fn,
+                                    const ScanOptions &options = ScanOptions()) override;
+    std::int64_t forEachTransactionView(int account_id, const std::string &from, const std::string &to,
+                                        const std::function<void(const TransactionView&)> &fn,
+                                        const ScanOptions &options = ScanOptions()) override;
+    bool balanceAsOf(int account_id, const std::string &day, Money &out) override;
+    std::vector<DailyRollup> dailyRollups(int account_id, const std::string &from, const std::string &to) override;
+
+    std::vector<OperationResult> applyBatch(const std::vector<Operation> &ops,
+                                            const BatchOptions &options = BatchOptions()) override;
+
+    CacheStats cacheStats() override;
+    MetricsSnapshot metrics() override;
+    std::string metricsText() override;
+    ChangeFeed *changeFeed() override;
+
+    // End-of-day aggregates over the ledger engine's in-memory balances, without
+    // a query against MySQL; see eod_report.h. Returns false when
+    // BankOptions::ledger is off or a total does not fit in int64.
+    bool endOfDay(const EndOfDayOptions &options, EndOfDayReport &out);
+
+    // Cross-shard transfer legs, driven by ShardedBank. Each is one local
+    // transaction and safe to repeat after a crash or timeout.
+    //
+    // Debits from_account_id, writes its TRANSFER ledger row and records the
+    // leg in shard_transfers. Returns the transfer id, 0 if rejected
+    // (insufficient funds, unknown account), -1 on error, or -2 if
+    // idempotency_key already started a transfer.
+    std::int64_t transferOut(int from_account_id, int to_account_id, Money amount, const std::string &idempotency_key = std::string());
+    // Credits to_account_id once per (source_shard, transfer_id); a repeat
+    // returns APPLIED without crediting again.
+    OperationResult transferIn(int source_shard, std::int64_t transfer_id, int from_account_id, int to_account_id,
+                               Money amount);
+    // Closes an outbound leg: marks it done, or refunds the source account
+    // and frees its idempotency key when the credit was rejected. Already
+    // settled legs are left alone.
+    bool settleTransferOut(std::int64_t transfer_id, bool credited);
+    // Outbound legs still unsettled after older_than_s seconds.
+    std::vector<PendingTransfer> pendingTransfersOut(int older_than_s);
 
 private:
     // opaque pointer to hide MySQL connector headers from this header
@@ -159,287 +1003,7973 @@ private:
 
 #endif // BANK_H
 
-// -------------------- src/bank.cpp --------------------
+// -------------------- src/metrics.h --------------------
 
-#include "../include/bank.h"
-#include <iostream>
-#include <stdexcept>
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "../include/bank.h"
+#include "latency_stats.h"
+
+enum MetricTimer {
+    // public Bank calls; keep in step with TIMER_NAMES in metrics.cpp
+    T_CREATE_CUSTOMER, T_CREATE_CUSTOMERS, T_GET_CUSTOMER, T_SCAN_CUSTOMERS,
+    T_CREATE_ACCOUNT, T_CREATE_ACCOUNTS, T_GET_ACCOUNT, T_LIST_ACCOUNTS,
+    T_DEPOSIT, T_WITHDRAW, T_TRANSFER, T_TRANSACTIONS_PAGE, T_SCAN_TRANSACTIONS, T_APPLY_BATCH,
+    T_BALANCE_AS_OF, T_DAILY_ROLLUPS,
+    T_TRANSFER_OUT, T_TRANSFER_IN, T_SETTLE_TRANSFER_OUT, T_PENDING_TRANSFERS_OUT, T_END_OF_DAY,
+    T_RECENT_TRANSACTIONS,
+    METHOD_TIMER_COUNT,
+    // phases inside those calls
+    T_PREPARE = METHOD_TIMER_COUNT, T_EXECUTE, T_COMMIT, T_POOL_WAIT,
+    TIMER_COUNT
+};
+
+enum MetricCounter { C_ROLLBACKS, C_LOCK_WAIT_RETRIES, C_POOL_WAITS, C_POOL_TIMEOUTS, C_RULE_REJECTIONS, COUNTER_COUNT };
+
+// Latency histograms and counters for one Bank, kept per thread. A thread
+// only ever writes its own block, with relaxed loads and stores and no locked
+// instructions, so record() costs a thread-local lookup, a bucket index and a
+// handful of plain stores. snapshot() sums every block under a lock that
+// writers never take after their first call.
+//
+// The thread-local lookup caches one Metrics instance per thread; a thread
+// alternating between two Banks takes the locked path on every switch.
+class Metrics {
+public:
+    Metrics();
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    static std::uint64_t now() {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void record(MetricTimer t, std::uint64_t ns) {
+        Timer &tm = local().timers[t];
+        bump(tm.buckets[LatencyHistogram::indexOf(ns)], 1);
+        bump(tm.count, 1);
+        bump(tm.sum_ns, ns);
+        if (ns > tm.max_ns.load(std::memory_order_relaxed)) tm.max_ns.store(ns, std::memory_order_relaxed);
+    }
+
+    void count(MetricCounter c, std::uint64_t n = 1) { bump(local().counters[c], n); }
+
+    // A deadlock or lock wait timeout about to be retried. Besides
+    // C_LOCK_WAIT_RETRIES it is charged to the public call running on this
+    // thread, as marked by that call's ScopedTimer.
+    void countRetry(bool deadlock) {
+        Block &b = local();
+        bump(b.counters[C_LOCK_WAIT_RETRIES], 1);
+        if (b.method >= 0) bump((deadlock ? b.deadlocks : b.lock_wait_timeouts)[b.method], 1);
+    }
+
+    // Used by ScopedTimer: marks timer as the running public call and
+    // returns what leave() needs to restore; phase timers leave it alone.
+    int enter(MetricTimer t) {
+        if (t >= METHOD_TIMER_COUNT) return -2;
+        Block &b = local();
+        int outer = b.method;
+        b.method = t;
+        return outer;
+    }
+    void leave(int outer) {
+        if (outer != -2) local().method = outer;
+    }
+
+    // Fills the timer and counter fields of out; pool gauges are left alone.
+    void snapshot(MetricsSnapshot &out) const;
+
+private:
+    struct Timer {
+        std::atomic<std::uint64_t> buckets[LatencyHistogram::BUCKETS];
+        std::atomic<std::uint64_t> count;
+        std::atomic<std::uint64_t> sum_ns;
+        std::atomic<std::uint64_t> max_ns;
+    };
+
+    struct Block {
+        Timer timers[TIMER_COUNT];
+        std::atomic<std::uint64_t> counters[COUNTER_COUNT];
+        std::atomic<std::uint64_t> deadlocks[METHOD_TIMER_COUNT];
+        std::atomic<std::uint64_t> lock_wait_timeouts[METHOD_TIMER_COUNT];
+        int method = -1;  // public call in progress on the owning thread; read by nobody else
+    };
+
+    // single writer per block, so a plain load + store is enough
+    static void bump(std::atomic<std::uint64_t> &a, std::uint64_t n) {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    Block& local() {
+        struct Cached { std::uint64_t owner; Block *block; };
+        static thread_local Cached cached = {0, nullptr};
+        if (cached.owner != id) {
+            cached.block = &attach();
+            cached.owner = id;
+        }
+        return *cached.block;
+    }
+
+    Block& attach();
+
+    const std::uint64_t id;  // process-unique, so a reused address never matches a stale cache
+    mutable std::mutex mu;
+    std::map<std::thread::id, std::unique_ptr<Block>> blocks;  // kept after a thread exits: totals are cumulative
+};
+
+// Records the time from construction to destruction into one timer.
+class ScopedTimer {
+public:
+    ScopedTimer(Metrics &metrics, MetricTimer timer)
+        : metrics(metrics), timer(timer), start(Metrics::now()), outer(metrics.enter(timer)) {}
+    ~ScopedTimer() {
+        metrics.record(timer, Metrics::now() - start);
+        metrics.leave(outer);
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Metrics &metrics;
+    MetricTimer timer;
+    std::uint64_t start;
+    int outer;
+};
+
+// Prometheus text exposition format (0.0.4) for a snapshot.
+std::string prometheusText(const MetricsSnapshot &snapshot);
+
+#endif // METRICS_H
+
+// -------------------- src/metrics.cpp --------------------
+
+#include "metrics.h"
 #include <sstream>
 
-// Include MySQL Connector/C++ headers
+static const char *const TIMER_NAMES[TIMER_COUNT] = {
+    "create_customer", "create_customers", "get_customer", "scan_customers",
+    "create_account", "create_accounts", "get_account", "list_accounts",
+    "deposit", "withdraw", "transfer", "transactions_page", "scan_transactions", "apply_batch",
+    "balance_as_of", "daily_rollups",
+    "transfer_out", "transfer_in", "settle_transfer_out", "pending_transfers_out", "end_of_day",
+    "recent_transactions",
+    "prepare", "execute", "commit", "pool_wait",
+};
+
+static std::atomic<std::uint64_t> next_metrics_id(1);
+
+Metrics::Metrics() : id(next_metrics_id.fetch_add(1)) {}
+
+Metrics::Block& Metrics::attach() {
+    std::lock_guard<std::mutex> lock(mu);
+    std::unique_ptr<Block> &b = blocks[std::this_thread::get_id()];
+    if (!b) b.reset(new Block());  // value-initialised: every counter starts at zero
+    return *b;
+}
+
+void Metrics::snapshot(MetricsSnapshot &out) const {
+    std::uint64_t counters[COUNTER_COUNT] = {};
+    std::uint64_t deadlocks[METHOD_TIMER_COUNT] = {}, lock_wait_timeouts[METHOD_TIMER_COUNT] = {};
+    std::vector<LatencyHistogram> merged(TIMER_COUNT);
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        for (auto &entry : blocks) {
+            const Block &b = *entry.second;
+            for (int t = 0; t < TIMER_COUNT; ++t) {
+                const Timer &tm = b.timers[t];
+                if (tm.count.load(std::memory_order_relaxed) == 0) continue;
+                for (std::size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+                    std::uint64_t n = tm.buckets[i].load(std::memory_order_relaxed);
+                    if (n) merged[t].addBucket(i, n);
+                }
+                merged[t].addTotals(tm.sum_ns.load(std::memory_order_relaxed), tm.max_ns.load(std::memory_order_relaxed));
+            }
+            for (int c = 0; c < COUNTER_COUNT; ++c) counters[c] += b.counters[c].load(std::memory_order_relaxed);
+            for (int t = 0; t < METHOD_TIMER_COUNT; ++t) {
+                deadlocks[t] += b.deadlocks[t].load(std::memory_order_relaxed);
+                lock_wait_timeouts[t] += b.lock_wait_timeouts[t].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    out.methods.clear();
+    out.phases.clear();
+    for (int t = 0; t < TIMER_COUNT; ++t) {
+        const LatencyHistogram &h = merged[t];
+        LatencySummary s;
+        s.name = TIMER_NAMES[t];
+        s.count = h.count();
+        s.sum_ns = h.sum();
+        s.p50_ns = h.percentile(0.50);
+        s.p99_ns = h.percentile(0.99);
+        s.p999_ns = h.percentile(0.999);
+        s.max_ns = h.max();
+        if (t < METHOD_TIMER_COUNT) {
+            s.deadlocks = deadlocks[t];
+            s.lock_wait_timeouts = lock_wait_timeouts[t];
+        }
+        (t < METHOD_TIMER_COUNT ? out.methods : out.phases).push_back(s);
+    }
+    out.rollbacks = counters[C_ROLLBACKS];
+    out.lock_wait_retries = counters[C_LOCK_WAIT_RETRIES];
+    out.pool_waits = counters[C_POOL_WAITS];
+    out.pool_timeouts = counters[C_POOL_TIMEOUTS];
+    out.rule_rejections = counters[C_RULE_REJECTIONS];
+}
+
+static void writeSummary(std::ostringstream &os, const char *metric, const char *label,
+                         const std::vector<LatencySummary> &rows) {
+    os << "# TYPE " << metric << " summary\n";
+    for (const LatencySummary &s : rows) {
+        if (s.count == 0) continue;
+        const std::string key = std::string(label) + "=\"" + s.name + "\"";
+        os << metric << "{" << key << ",quantile=\"0.5\"} " << double(s.p50_ns) / 1e9 << "\n";
+        os << metric << "{" << key << ",quantile=\"0.99\"} " << double(s.p99_ns) / 1e9 << "\n";
+        os << metric << "{" << key << ",quantile=\"0.999\"} " << double(s.p999_ns) / 1e9 << "\n";
+        os << metric << "_sum{" << key << "} " << double(s.sum_ns) / 1e9 << "\n";
+        os << metric << "_count{" << key << "} " << s.count << "\n";
+    }
+}
+
+static void writeCounter(std::ostringstream &os, const char *metric, const char *type, std::uint64_t value) {
+    os << "# TYPE " << metric << " " << type << "\n" << metric << " " << value << "\n";
+}
+
+static void writeConflicts(std::ostringstream &os, const std::vector<LatencySummary> &methods) {
+    os << "# TYPE bank_lock_conflicts_total counter\n";
+    for (const LatencySummary &s : methods) {
+        if (s.deadlocks) os << "bank_lock_conflicts_total{method=\"" << s.name << "\",kind=\"deadlock\"} " << s.deadlocks << "\n";
+        if (s.lock_wait_timeouts)
+            os << "bank_lock_conflicts_total{method=\"" << s.name << "\",kind=\"lock_wait_timeout\"} " << s.lock_wait_timeouts << "\n";
+    }
+}
+
+std::string prometheusText(const MetricsSnapshot &snapshot) {
+    std::ostringstream os;
+    writeSummary(os, "bank_call_duration_seconds", "method", snapshot.methods);
+    writeSummary(os, "bank_phase_duration_seconds", "phase", snapshot.phases);
+    writeCounter(os, "bank_rollbacks_total", "counter", snapshot.rollbacks);
+    writeCounter(os, "bank_lock_wait_retries_total", "counter", snapshot.lock_wait_retries);
+    writeConflicts(os, snapshot.methods);
+    writeCounter(os, "bank_pool_waits_total", "counter", snapshot.pool_waits);
+    writeCounter(os, "bank_pool_timeouts_total", "counter", snapshot.pool_timeouts);
+    writeCounter(os, "bank_rule_rejections_total", "counter", snapshot.rule_rejections);
+    writeCounter(os, "bank_pool_connections", "gauge", snapshot.pool_connections);
+    writeCounter(os, "bank_pool_connections_in_use", "gauge", snapshot.pool_in_use);
+    return os.str();
+}
+
+// -------------------- src/connection_pool.h --------------------
+
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <mysql_driver.h>
 #include <mysql_connection.h>
-#include <cppconn/statement.h>
+#include <cppconn/exception.h>
 #include <cppconn/prepared_statement.h>
 #include <cppconn/resultset.h>
 
-struct Bank::Impl {
+#include "../include/bank.h"
+#include "metrics.h"
+
+// Fixed-ceiling pool of MySQL sessions shared by all threads using one Bank.
+// A connection is checked out for the duration of one Bank call and handed
+// back automatically when the Lease goes out of scope.
+//
+// Each pooled connection keeps its own prepared statements keyed by SQL text,
+// so a statement is parsed by the server once per session, not once per call.
+class ConnectionPool {
+    struct Slot;
+public:
+    class Lease {
+    public:
+        Lease() : pool(nullptr), slot(nullptr) {}
+        Lease(Lease &&other) noexcept;
+        Lease& operator=(Lease &&other) noexcept;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease() { release(); }
+
+        sql::Connection* operator->() const;
+        explicit operator bool() const { return slot != nullptr; }
+        void release();
+
+        // Cached prepared statement for this connection, parameters cleared.
+        // The pointer stays valid until the lease is released.
+        sql::PreparedStatement* prepare(std::string_view sql);
+
+        // Statement and transaction calls timed into the pool's Metrics. Use
+        // these rather than calling ps->execute...() or conn->commit() directly.
+        sql::ResultSet* executeQuery(sql::PreparedStatement *ps);
+        int executeUpdate(sql::PreparedStatement *ps);
+        bool execute(sql::PreparedStatement *ps);
+        void commit();
+        void rollback();
+
+    private:
+        friend class ConnectionPool;
+        Lease(ConnectionPool *p, Slot *s) : pool(p), slot(s) {}
+        ConnectionPool *pool;
+        Slot *slot;
+    };
+
+    // metrics, if given, must outlive the pool.
+    ConnectionPool(const std::string &host, const std::string &user, const std::string &pass,
+                   const std::string &db, const PoolOptions &options, Metrics *metrics = nullptr);
+    ~ConnectionPool();
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Throws sql::SQLException if no connection frees up within acquire_timeout_ms.
+    Lease acquire();
+
+    std::size_t size() const;
+    std::size_t inUse() const;
+
+private:
+    struct CachedStatement {
+        std::string sql;
+        std::unique_ptr<sql::PreparedStatement> ps;
+    };
+
+    struct Slot {
+        std::unique_ptr<sql::Connection> conn;
+        // declared after conn so statements are closed before their connection
+        std::unordered_map<std::string_view, std::unique_ptr<CachedStatement>> statements;
+        std::chrono::steady_clock::time_point last_used;
+        std::thread::id last_thread;  // affinity hint: prefer handing a slot back to its last user
+        bool in_use = false;
+    };
+
+    sql::Connection* open();
+    Slot* takeFreeSlot();
+    void validate(Slot &slot);
+    void giveBack(Slot *slot);
+
     sql::mysql::MySQL_Driver *driver;
-    std::unique_ptr<sql::Connection> conn;
-    Impl(const std::string &host, const std::string &user, const std::string &pass, const std::string &db) {
-        driver = sql::mysql::get_mysql_driver_instance();
-        conn.reset(driver->connect(host, user, pass));
-        conn->setSchema(db);
-    }
+    std::string host, user, pass, db;
+    PoolOptions options;
+    Metrics *metrics;
+
+    mutable std::mutex mu;
+    std::condition_variable available;
+    std::vector<std::unique_ptr<Slot>> slots;  // unique_ptr keeps Slot addresses stable for Leases
+    std::size_t busy = 0;
+    std::size_t opening = 0;  // connections being opened outside the lock
 };
 
-Bank::Bank(const std::string &host, const std::string &user, const std::string &pass, const std::string &db) {
-    try {
-        impl = new Impl(host, user, pass, db);
-    } catch (sql::SQLException &e) {
-        std::cerr << "[DB Error] " << e.what() << std::endl;
-        throw;
+#endif // CONNECTION_POOL_H
+
+// -------------------- src/connection_pool.cpp --------------------
+
+#include "connection_pool.h"
+#include <algorithm>
+
+ConnectionPool::Lease::Lease(Lease &&other) noexcept : pool(other.pool), slot(other.slot) {
+    other.pool = nullptr;
+    other.slot = nullptr;
+}
+
+ConnectionPool::Lease& ConnectionPool::Lease::operator=(Lease &&other) noexcept {
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        slot = other.slot;
+        other.pool = nullptr;
+        other.slot = nullptr;
     }
+    return *this;
 }
 
-Bank::~Bank() {
-    delete impl;
+sql::Connection* ConnectionPool::Lease::operator->() const {
+    return slot->conn.get();
 }
 
-int Bank::createCustomer(const std::string &name, const std::string &email, const std::string &phone) {
-    try {
-        std::unique_ptr<sql::PreparedStatement> ps(
-            impl->conn->prepareStatement("INSERT INTO customers(name,email,phone) VALUES(?,?,?)"));
-        ps->setString(1, name);
-        ps->setString(2, email);
-        ps->setString(3, phone);
-        ps->execute();
-        std::unique_ptr<sql::Statement> st(impl->conn->createStatement());
-        std::unique_ptr<sql::ResultSet> rs(st->executeQuery("SELECT LAST_INSERT_ID() as id"));
-        rs->next();
-        return rs->getInt("id");
-    } catch (sql::SQLException &e) {
-        std::cerr << "[createCustomer error] " << e.what() << std::endl;
-        return -1;
+sql::PreparedStatement* ConnectionPool::Lease::prepare(std::string_view sql) {
+    auto it = slot->statements.find(sql);
+    if (it != slot->statements.end()) {
+        it->second->ps->clearParameters();
+        return it->second->ps.get();
+    }
+    std::unique_ptr<CachedStatement> cs(new CachedStatement());
+    cs->sql.assign(sql.data(), sql.size());
+    std::uint64_t start = pool->metrics ? Metrics::now() : 0;
+    cs->ps.reset(slot->conn->prepareStatement(cs->sql));
+    if (pool->metrics) pool->metrics->record(T_PREPARE, Metrics::now() - start);
+    sql::PreparedStatement *ps = cs->ps.get();
+    std::string_view key(cs->sql);
+    slot->statements.emplace(key, std::move(cs));
+    return ps;
+}
+
+sql::ResultSet* ConnectionPool::Lease::executeQuery(sql::PreparedStatement *ps) {
+    if (!pool->metrics) return ps->executeQuery();
+    ScopedTimer timer(*pool->metrics, T_EXECUTE);
+    return ps->executeQuery();
+}
+
+int ConnectionPool::Lease::executeUpdate(sql::PreparedStatement *ps) {
+    if (!pool->metrics) return ps->executeUpdate();
+    ScopedTimer timer(*pool->metrics, T_EXECUTE);
+    return ps->executeUpdate();
+}
+
+bool ConnectionPool::Lease::execute(sql::PreparedStatement *ps) {
+    if (!pool->metrics) return ps->execute();
+    ScopedTimer timer(*pool->metrics, T_EXECUTE);
+    return ps->execute();
+}
+
+void ConnectionPool::Lease::commit() {
+    if (!pool->metrics) return slot->conn->commit();
+    ScopedTimer timer(*pool->metrics, T_COMMIT);
+    slot->conn->commit();
+}
+
+void ConnectionPool::Lease::rollback() {
+    if (pool->metrics) pool->metrics->count(C_ROLLBACKS);
+    slot->conn->rollback();
+}
+
+void ConnectionPool::Lease::release() {
+    if (slot) {
+        pool->giveBack(slot);
+        pool = nullptr;
+        slot = nullptr;
+    }
+}
+
+ConnectionPool::ConnectionPool(const std::string &host, const std::string &user, const std::string &pass,
+                               const std::string &db, const PoolOptions &options, Metrics *metrics)
+    : driver(sql::mysql::get_mysql_driver_instance()), host(host), user(user), pass(pass), db(db), options(options),
+      metrics(metrics) {
+    if (this->options.max_connections == 0) this->options.max_connections = 1;
+    this->options.min_connections = std::min(this->options.min_connections, this->options.max_connections);
+    for (std::size_t i = 0; i < this->options.min_connections; ++i) {
+        std::unique_ptr<Slot> s(new Slot());
+        s->conn.reset(open());
+        s->last_used = std::chrono::steady_clock::now();
+        slots.push_back(std::move(s));
+    }
+}
+
+ConnectionPool::~ConnectionPool() {
+    // Leases must not outlive the pool; Bank guarantees this by owning both.
+    slots.clear();
+}
+
+sql::Connection* ConnectionPool::open() {
+    std::unique_ptr<sql::Connection> c(driver->connect(host, user, pass));
+    c->setSchema(db);
+    return c.release();
+}
+
+// Caller holds mu. Prefers the slot this thread used last so a worker keeps
+// talking to the same session (and its server-side state stays warm).
+ConnectionPool::Slot* ConnectionPool::takeFreeSlot() {
+    const std::thread::id me = std::this_thread::get_id();
+    Slot *pick = nullptr;
+    for (auto &s : slots) {
+        if (s->in_use) continue;
+        if (s->last_thread == me) { pick = s.get(); break; }
+        if (!pick || s->last_used > pick->last_used) pick = s.get();
+    }
+    if (pick) {
+        pick->in_use = true;
+        ++busy;
+    }
+    return pick;
+}
+
+// Runs outside the lock on a slot the caller already owns. Nobody holds
+// statement pointers at this point, so this is also where the cache is trimmed.
+void ConnectionPool::validate(Slot &slot) {
+    if (slot.statements.size() > options.max_cached_statements) slot.statements.clear();
+    auto idle = std::chrono::steady_clock::now() - slot.last_used;
+    if (idle < std::chrono::milliseconds(options.validate_after_idle_ms)) return;
+    bool ok = false;
+    try { ok = slot.conn->isValid(); } catch (sql::SQLException&) {}
+    if (!ok) {
+        std::unique_ptr<sql::Connection> fresh(open());
+        slot.statements.clear();
+        slot.conn = std::move(fresh);
+    }
+}
+
+ConnectionPool::Lease ConnectionPool::acquire() {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.acquire_timeout_ms);
+    std::unique_lock<std::mutex> lock(mu);
+    bool timed_out = false;
+    std::uint64_t wait_start = 0;  // set once this caller has had to wait
+    while (true) {
+        if (Slot *s = takeFreeSlot()) {
+            lock.unlock();
+            if (wait_start && metrics) metrics->record(T_POOL_WAIT, Metrics::now() - wait_start);
+            try {
+                validate(*s);
+            } catch (...) {
+                giveBack(s);
+                throw;
+            }
+            return Lease(this, s);
+        }
+        if (slots.size() + opening < options.max_connections) {
+            ++opening;
+            lock.unlock();
+            std::unique_ptr<Slot> s(new Slot());
+            try {
+                s->conn.reset(open());
+            } catch (...) {
+                lock.lock();
+                --opening;
+                available.notify_one();
+                throw;
+            }
+            s->in_use = true;
+            Slot *raw = s.get();
+            lock.lock();
+            --opening;
+            ++busy;
+            slots.push_back(std::move(s));
+            return Lease(this, raw);
+        }
+        if (timed_out) {
+            if (metrics) metrics->count(C_POOL_TIMEOUTS);
+            throw sql::SQLException("connection pool exhausted", "HYT00", 0);
+        }
+        if (!wait_start && metrics) {
+            metrics->count(C_POOL_WAITS);
+            wait_start = Metrics::now();
+        }
+        timed_out = available.wait_until(lock, deadline) == std::cv_status::timeout;
+    }
+}
+
+void ConnectionPool::giveBack(Slot *slot) {
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        slot->in_use = false;
+        slot->last_used = std::chrono::steady_clock::now();
+        slot->last_thread = std::this_thread::get_id();
+        --busy;
+    }
+    available.notify_one();
+}
+
+std::size_t ConnectionPool::size() const {
+    std::lock_guard<std::mutex> lock(mu);
+    return slots.size();
+}
+
+std::size_t ConnectionPool::inUse() const {
+    std::lock_guard<std::mutex> lock(mu);
+    return busy;
+}
+
+// -------------------- src/account_cache.h --------------------
+
+#ifndef ACCOUNT_CACHE_H
+#define ACCOUNT_CACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "../include/bank.h"
+
+// Sharded, bounded cache of Account rows in front of MySQL.
+//
+// Bank's own writes keep cached balances current: a writer brackets its
+// transaction with beginWrite()/endWrite(), and the committed delta is applied
+// to the cached row. Rows read from MySQL are only inserted if no write to the
+// same account was in flight and no write finished since the read started
+// (see ticket()), so a slow reader cannot overwrite a newer balance.
+// Writes made by other processes are only picked up once ttl_ms expires.
+class AccountCache {
+public:
+    explicit AccountCache(const CacheOptions &options);
+
+    bool enabled() const { return !shards.empty(); }
+
+    bool get(int account_id, Account &out);
+    std::uint64_t ticket() const { return write_epoch.load(std::memory_order_acquire); }
+    void fill(const Account &a, std::uint64_t ticket);
+
+    void beginWrite(int account_id);
+    void endWrite(int account_id, Money delta);  // committed
+    void cancelWrite(int account_id);             // rolled back or outcome unknown; drops the row
+
+    CacheStats stats() const;
+
+private:
+    struct Entry {
+        Account account;
+        std::chrono::steady_clock::time_point loaded;
+        bool referenced = false;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mu;
+        std::unordered_map<int, std::size_t> index;  // account_id -> slot
+        std::vector<Entry> slots;
+        std::unordered_map<int, int> writers;        // in-flight writes per account
+        std::size_t hand = 0;                        // CLOCK hand
+        std::uint64_t hits = 0, misses = 0, evictions = 0;
+    };
+
+    Shard& shardFor(int account_id) { return shards[static_cast<unsigned>(account_id) % shards.size()]; }
+    void finishWrite(Shard &s, int account_id);
+    bool expired(const Entry &e, std::chrono::steady_clock::time_point now) const;
+
+    std::vector<Shard> shards;
+    std::size_t per_shard;
+    std::chrono::milliseconds ttl;
+    std::atomic<std::uint64_t> write_epoch{0};
+};
+
+// Brackets one account's write for the cache; rolls back (drops the row)
+// unless commit() is reached.
+class CacheWrite {
+public:
+    CacheWrite(AccountCache &cache, int account_id) : cache(cache), account_id(account_id), open(cache.enabled()) {
+        if (open) cache.beginWrite(account_id);
+    }
+    ~CacheWrite() { if (open) cache.cancelWrite(account_id); }
+    CacheWrite(const CacheWrite&) = delete;
+    CacheWrite& operator=(const CacheWrite&) = delete;
+
+    void commit(Money delta) {
+        if (open) cache.endWrite(account_id, delta);
+        open = false;
+    }
+
+private:
+    AccountCache &cache;
+    int account_id;
+    bool open;
+};
+
+#endif // ACCOUNT_CACHE_H
+
+// -------------------- src/account_cache.cpp --------------------
+
+#include "account_cache.h"
+
+AccountCache::AccountCache(const CacheOptions &options) : per_shard(0), ttl(options.ttl_ms) {
+    if (options.capacity == 0) return;
+    std::size_t n = options.shards ? options.shards : 1;
+    if (n > options.capacity) n = options.capacity;
+    per_shard = (options.capacity + n - 1) / n;
+    shards = std::vector<Shard>(n);
+    for (auto &s : shards) s.slots.reserve(per_shard);
+}
+
+bool AccountCache::expired(const Entry &e, std::chrono::steady_clock::time_point now) const {
+    return ttl.count() > 0 && now - e.loaded > ttl;
+}
+
+bool AccountCache::get(int account_id, Account &out) {
+    if (!enabled()) return false;
+    Shard &s = shardFor(account_id);
+    std::lock_guard<std::mutex> lock(s.mu);
+    auto it = s.index.find(account_id);
+    if (it != s.index.end()) {
+        Entry &e = s.slots[it->second];
+        if (!expired(e, std::chrono::steady_clock::now())) {
+            e.referenced = true;
+            out = e.account;
+            ++s.hits;
+            return true;
+        }
+    }
+    ++s.misses;
+    return false;
+}
+
+void AccountCache::fill(const Account &a, std::uint64_t ticket) {
+    if (!enabled()) return;
+    Shard &s = shardFor(a.id);
+    std::lock_guard<std::mutex> lock(s.mu);
+    if (write_epoch.load(std::memory_order_acquire) != ticket || s.writers.count(a.id)) return;
+
+    auto now = std::chrono::steady_clock::now();
+    auto it = s.index.find(a.id);
+    if (it != s.index.end()) {
+        Entry &e = s.slots[it->second];
+        e.account = a;
+        e.loaded = now;
+        return;
+    }
+    std::size_t slot;
+    if (s.slots.size() < per_shard) {
+        slot = s.slots.size();
+        s.slots.push_back(Entry());
+    } else {
+        // CLOCK: clear reference bits until an unreferenced (or expired) slot comes round
+        while (true) {
+            Entry &victim = s.slots[s.hand];
+            if (!victim.referenced || expired(victim, now)) break;
+            victim.referenced = false;
+            s.hand = (s.hand + 1) % s.slots.size();
+        }
+        slot = s.hand;
+        s.hand = (s.hand + 1) % s.slots.size();
+        if (s.slots[slot].account.id >= 0) {
+            s.index.erase(s.slots[slot].account.id);
+            ++s.evictions;
+        }
+    }
+    s.slots[slot].account = a;
+    s.slots[slot].loaded = now;
+    s.slots[slot].referenced = false;
+    s.index[a.id] = slot;
+}
+
+void AccountCache::beginWrite(int account_id) {
+    Shard &s = shardFor(account_id);
+    std::lock_guard<std::mutex> lock(s.mu);
+    ++s.writers[account_id];
+}
+
+// Caller holds s.mu. Bumping the epoch invalidates tickets of reads that
+// might have seen the database before this write landed.
+void AccountCache::finishWrite(Shard &s, int account_id) {
+    auto w = s.writers.find(account_id);
+    if (w != s.writers.end() && --w->second == 0) s.writers.erase(w);
+    write_epoch.fetch_add(1, std::memory_order_acq_rel);
+}
+
+void AccountCache::endWrite(int account_id, Money delta) {
+    Shard &s = shardFor(account_id);
+    std::lock_guard<std::mutex> lock(s.mu);
+    auto it = s.index.find(account_id);
+    if (it != s.index.end()) s.slots[it->second].account.balance += delta;
+    finishWrite(s, account_id);
+}
+
+void AccountCache::cancelWrite(int account_id) {
+    Shard &s = shardFor(account_id);
+    std::lock_guard<std::mutex> lock(s.mu);
+    auto it = s.index.find(account_id);
+    if (it != s.index.end()) {
+        // leave the slot for CLOCK; an id of -1 never matches a lookup
+        s.slots[it->second].account.id = -1;
+        s.slots[it->second].referenced = false;
+        s.index.erase(it);
+    }
+    finishWrite(s, account_id);
+}
+
+CacheStats AccountCache::stats() const {
+    CacheStats st;
+    for (auto &s : shards) {
+        std::lock_guard<std::mutex> lock(s.mu);
+        st.hits += s.hits;
+        st.misses += s.misses;
+        st.evictions += s.evictions;
+        st.entries += s.index.size();
+    }
+    return st;
+}
+
+// -------------------- src/idempotency_cache.h --------------------
+
+#ifndef IDEMPOTENCY_CACHE_H
+#define IDEMPOTENCY_CACHE_H
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "../include/bank.h"
+
+// Sharded, bounded set of idempotency keys known to have committed, so a
+// retried call is answered without a round trip. Oldest keys are evicted
+// first; a miss only means MySQL is asked.
+class IdempotencyCache {
+public:
+    explicit IdempotencyCache(const IdempotencyOptions &options);
+
+    bool contains(const std::string &key);
+    void insert(const std::string &key);
+    void erase(const std::string &key);
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mu;
+        std::unordered_set<std::string> keys;
+        std::vector<std::string> ring;  // insertion order, for FIFO eviction
+        std::size_t hand = 0;
+    };
+
+    Shard& shardFor(const std::string &key) { return shards[std::hash<std::string>()(key) % shards.size()]; }
+
+    std::vector<Shard> shards;
+    std::size_t per_shard;
+};
+
+#endif // IDEMPOTENCY_CACHE_H
+
+// -------------------- src/idempotency_cache.cpp --------------------
+
+#include "idempotency_cache.h"
+
+IdempotencyCache::IdempotencyCache(const IdempotencyOptions &options) : per_shard(0) {
+    if (options.cache_capacity == 0) return;
+    std::size_t n = options.shards ? options.shards : 1;
+    if (n > options.cache_capacity) n = options.cache_capacity;
+    per_shard = (options.cache_capacity + n - 1) / n;
+    shards = std::vector<Shard>(n);
+    for (auto &s : shards) s.ring.reserve(per_shard);
+}
+
+bool IdempotencyCache::contains(const std::string &key) {
+    if (shards.empty() || key.empty()) return false;
+    Shard &s = shardFor(key);
+    std::lock_guard<std::mutex> lock(s.mu);
+    return s.keys.count(key) != 0;
+}
+
+void IdempotencyCache::insert(const std::string &key) {
+    if (shards.empty() || key.empty()) return;
+    Shard &s = shardFor(key);
+    std::lock_guard<std::mutex> lock(s.mu);
+    if (!s.keys.insert(key).second) return;
+    if (s.ring.size() < per_shard) {
+        s.ring.push_back(key);
+        return;
+    }
+    s.keys.erase(s.ring[s.hand]);
+    s.ring[s.hand] = key;
+    s.hand = (s.hand + 1) % s.ring.size();
+}
+
+// The key's ring slot stays until it is evicted; evicting it then only costs
+// a re-inserted twin an early miss.
+void IdempotencyCache::erase(const std::string &key) {
+    if (shards.empty() || key.empty()) return;
+    Shard &s = shardFor(key);
+    std::lock_guard<std::mutex> lock(s.mu);
+    s.keys.erase(key);
+}
+
+// -------------------- src/limit_rules.h --------------------
+
+#ifndef LIMIT_RULES_H
+#define LIMIT_RULES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../include/bank.h"
+
+// In-memory side of RuleOptions: sliding-window totals of each account's money
+// movements, checked and updated on Bank's own write path with no query.
+//
+// The rules are compiled once into a table. Every distinct window length gets
+// a ring of slices + 1 slots per account, each slot holding one slice's amount
+// and count per Operation::Kind, and every rule refers to its window by index.
+// A check sums each window's live slots under the account's shard lock,
+// compares the rules that apply to the operation and, only if all of them
+// pass, adds the operation to the current slots before unlocking, so two
+// concurrent withdrawals cannot both slip under one limit. A window covers its
+// length plus up to one slice, which errs on the strict side.
+class LimitRules {
+public:
+    static const int MAX_WINDOWS = 8;  // distinct window_seconds across the rules
+    static const int PASSED = -1;
+
+    // Where reserve() counted an operation, so release() can take it back out.
+    struct Reservation {
+        int account_id = 0;
+        int kind = -1;  // -1: nothing was counted
+        std::int64_t cents = 0;
+        std::int64_t slices[MAX_WINDOWS] = {};  // -1: not counted in that window
+    };
+
+    // Throws std::invalid_argument for more than MAX_WINDOWS window lengths.
+    explicit LimitRules(const RuleOptions &options);
+
+    bool enabled() const { return !rules.empty() || hook; }
+    std::int64_t longestWindow() const { return longest; }  // seconds
+    static std::int64_t now();                               // seconds since the epoch
+
+    // Checks op as of `at` and counts it if nothing objects. Returns PASSED,
+    // the index of the first broken rule, or rules.size() when the hook said no.
+    int reserve(const Operation &op, std::int64_t at, Reservation &out);
+    // Takes a counted operation back out, e.g. because it was rolled back.
+    void release(const Reservation &r);
+    // Counts a past operation without checking it; used to warm up from the ledger.
+    void record(int account_id, Operation::Kind kind, Money amount, std::int64_t at);
+
+    std::string ruleName(int index) const;
+
+private:
+    struct Window {
+        std::int64_t slice_seconds;
+        std::size_t slots;  // slices + 1
+        std::size_t first;  // offset of this window's slots in an account's ring
+        unsigned kinds;     // union of the kinds its rules apply to
+    };
+
+    struct Rule {
+        std::string name;
+        std::size_t window;
+        unsigned kinds;
+        bool count;  // LimitRule::COUNT
+        std::int64_t limit;
+    };
+
+    struct Slot {
+        std::int64_t slice = -1;  // absolute slice number; stale once it falls out of the window
+        std::int64_t cents[3] = {0, 0, 0};
+        std::int64_t count[3] = {0, 0, 0};
+    };
+
+    struct Entry {
+        std::int64_t last = 0;  // newest operation counted, for sweeping idle accounts
+        std::vector<Slot> slots;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mu;
+        std::unordered_map<int, Entry> accounts;
+        std::size_t since_sweep = 0;
+    };
+
+    Shard& shardFor(int account_id) { return shards[static_cast<unsigned>(account_id) % shards.size()]; }
+    void add(Entry &e, int kind, std::int64_t cents, std::int64_t at, Reservation *out);
+    void sweep(Shard &s, std::int64_t at);
+
+    std::vector<Window> windows;
+    std::vector<Rule> rules;
+    std::size_t ring_size = 0;  // slots per account over all windows
+    unsigned kinds = 0;         // kinds any rule applies to
+    std::int64_t longest = 0;
+    std::function<bool(const Operation&, const WindowTotals*)> hook;
+    std::vector<Shard> shards;
+};
+
+// Holds an operation's place in its limit windows from a passed check until
+// keep(true); destroyed any other way, it gives the place back.
+class LimitHold {
+public:
+    LimitHold(LimitRules &rules, const Operation &op) : rules(&rules) {
+        if (rules.enabled()) broken = rules.reserve(op, LimitRules::now(), held);
+    }
+    LimitHold(LimitHold &&other) noexcept : rules(other.rules), held(other.held), broken(other.broken) {
+        other.rules = nullptr;
+    }
+    ~LimitHold() { if (rules && held.kind >= 0) rules->release(held); }
+    LimitHold(const LimitHold&) = delete;
+    LimitHold& operator=(const LimitHold&) = delete;
+    LimitHold& operator=(LimitHold&&) = delete;
+
+    bool passed() const { return broken == LimitRules::PASSED; }
+    int brokenRule() const { return broken; }
+    // Returns applied; the count stays only if it is true.
+    bool keep(bool applied) {
+        if (applied) rules = nullptr;
+        return applied;
+    }
+
+private:
+    LimitRules *rules;
+    LimitRules::Reservation held;
+    int broken = LimitRules::PASSED;
+};
+
+#endif // LIMIT_RULES_H
+
+// -------------------- src/limit_rules.cpp --------------------
+
+#include "limit_rules.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+static const std::size_t SWEEP_EVERY = 4096;  // counted operations per shard between sweeps
+
+LimitRules::LimitRules(const RuleOptions &options) : hook(options.hook) {
+    const int slices = std::max(1, options.slices);
+    for (const LimitRule &r : options.rules) {
+        const std::int64_t length = std::max(1, r.window_seconds);
+        const std::int64_t slice = (length + slices - 1) / slices;
+        const std::size_t slots = static_cast<std::size_t>((length + slice - 1) / slice) + 1;
+        std::size_t w = 0;
+        while (w < windows.size() && !(windows[w].slice_seconds == slice && windows[w].slots == slots)) ++w;
+        if (w == windows.size()) {
+            if (windows.size() == static_cast<std::size_t>(MAX_WINDOWS))
+                throw std::invalid_argument("RuleOptions: more than 8 distinct window lengths");
+            windows.push_back(Window{slice, slots, ring_size, 0});
+            ring_size += slots;
+        }
+        windows[w].kinds |= r.applies_to;
+        kinds |= r.applies_to;
+        longest = std::max(longest, windows[w].slice_seconds * static_cast<std::int64_t>(windows[w].slots));
+        rules.push_back(Rule{r.name, w, r.applies_to, r.measure == LimitRule::COUNT, r.limit});
+    }
+    if (enabled()) shards = std::vector<Shard>(options.shards ? options.shards : 1);
+}
+
+std::int64_t LimitRules::now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int LimitRules::reserve(const Operation &op, std::int64_t at, Reservation &out) {
+    out.kind = -1;
+    const unsigned bit = 1u << op.kind;
+    if (!(kinds & bit) && !hook) return PASSED;
+    Shard &s = shardFor(op.account_id);
+    std::lock_guard<std::mutex> lock(s.mu);
+    auto it = s.accounts.find(op.account_id);
+
+    WindowTotals sums[MAX_WINDOWS][3] = {};
+    if (it != s.accounts.end()) {
+        for (std::size_t w = 0; w < windows.size(); ++w) {
+            const Window &win = windows[w];
+            const std::int64_t current = at / win.slice_seconds;
+            const std::int64_t oldest = current - static_cast<std::int64_t>(win.slots) + 1;
+            for (std::size_t k = 0; k < win.slots; ++k) {
+                const Slot &slot = it->second.slots[win.first + k];
+                if (slot.slice < oldest || slot.slice > current) continue;
+                for (int kind = 0; kind < 3; ++kind) {
+                    sums[w][kind].amount += Money::fromCents(slot.cents[kind]);
+                    sums[w][kind].count += slot.count[kind];
+                }
+            }
+        }
+    }
+
+    // Totals per rule include the operation being checked when the rule applies to it.
+    static thread_local std::vector<WindowTotals> totals;
+    totals.assign(rules.size(), WindowTotals());
+    for (std::size_t i = 0; i < rules.size(); ++i) {
+        const Rule &r = rules[i];
+        WindowTotals &t = totals[i];
+        for (int kind = 0; kind < 3; ++kind) {
+            if (!(r.kinds & (1u << kind))) continue;
+            t.amount += sums[r.window][kind].amount;
+            t.count += sums[r.window][kind].count;
+        }
+        if (!(r.kinds & bit)) continue;
+        t.amount += op.amount;
+        t.count += 1;
+        if ((r.count ? t.count : t.amount.cents()) > r.limit) return static_cast<int>(i);
+    }
+    if (hook && !hook(op, totals.data())) return static_cast<int>(rules.size());
+    if (!(kinds & bit)) return PASSED;
+
+    if (it == s.accounts.end()) it = s.accounts.emplace(op.account_id, Entry()).first;
+    add(it->second, op.kind, op.amount.cents(), at, &out);
+    out.account_id = op.account_id;
+    if (++s.since_sweep >= SWEEP_EVERY) sweep(s, at);
+    return PASSED;
+}
+
+void LimitRules::release(const Reservation &r) {
+    if (r.kind < 0 || shards.empty()) return;
+    Shard &s = shardFor(r.account_id);
+    std::lock_guard<std::mutex> lock(s.mu);
+    auto it = s.accounts.find(r.account_id);
+    if (it == s.accounts.end()) return;
+    for (std::size_t w = 0; w < windows.size(); ++w) {
+        const Window &win = windows[w];
+        if (!(win.kinds & (1u << r.kind)) || r.slices[w] < 0) continue;
+        Slot &slot = it->second.slots[win.first + static_cast<std::size_t>(r.slices[w] % static_cast<std::int64_t>(win.slots))];
+        if (slot.slice != r.slices[w]) continue;  // already reused for a newer slice
+        slot.cents[r.kind] -= r.cents;
+        slot.count[r.kind] -= 1;
+    }
+}
+
+void LimitRules::record(int account_id, Operation::Kind kind, Money amount, std::int64_t at) {
+    if (!(kinds & (1u << kind))) return;
+    Shard &s = shardFor(account_id);
+    std::lock_guard<std::mutex> lock(s.mu);
+    add(s.accounts[account_id], kind, amount.cents(), at, nullptr);
+}
+
+std::string LimitRules::ruleName(int index) const {
+    if (index >= 0 && static_cast<std::size_t>(index) < rules.size()) return rules[index].name;
+    return index == static_cast<int>(rules.size()) ? "hook" : "";
+}
+
+// Called with the shard locked.
+void LimitRules::add(Entry &e, int kind, std::int64_t cents, std::int64_t at, Reservation *out) {
+    if (e.slots.empty()) e.slots.resize(ring_size);
+    e.last = std::max(e.last, at);
+    for (std::size_t w = 0; w < windows.size(); ++w) {
+        const Window &win = windows[w];
+        if (!(win.kinds & (1u << kind))) continue;
+        const std::int64_t slice = at / win.slice_seconds;
+        Slot &slot = e.slots[win.first + static_cast<std::size_t>(slice % static_cast<std::int64_t>(win.slots))];
+        if (slot.slice > slice) {  // older than the slot's slice: already out of the window
+            if (out) out->slices[w] = -1;
+            continue;
+        }
+        if (slot.slice != slice) slot = Slot();
+        slot.slice = slice;
+        slot.cents[kind] += cents;
+        slot.count[kind] += 1;
+        if (out) out->slices[w] = slice;
+    }
+    if (out) {
+        out->kind = kind;
+        out->cents = cents;
+    }
+}
+
+// Drops accounts with nothing left in any window, so idle accounts do not pile up.
+void LimitRules::sweep(Shard &s, std::int64_t at) {
+    s.since_sweep = 0;
+    for (auto it = s.accounts.begin(); it != s.accounts.end();) {
+        if (at - it->second.last > longest) it = s.accounts.erase(it);
+        else ++it;
+    }
+}
+
+// -------------------- src/ledger_sql.h --------------------
+
+#ifndef LEDGER_SQL_H
+#define LEDGER_SQL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../include/bank.h"
+#include "connection_pool.h"
+
+// SQL and ledger-row helpers shared by Bank and LedgerEngine.
+//
+// Money crosses the wire as integer cents. "? / 100" is exact DECIMAL
+// arithmetic on the server, and balances come back through CAST(... * 100 AS SIGNED),
+// so no amount ever passes through a floating-point type.
+// account, type, cents, details, striped, stripe: the ledger row with its
+// balance after and its rollup, in one round trip (post_transaction in db.sql)
+static const char *const SQL_POST_TRANSACTION = "CALL post_transaction(?,?,? / 100,?,?,?)";
+static const char *const SQL_CREDIT =
+    "UPDATE accounts SET balance = balance + ? / 100 WHERE account_id = ?";
+static const char *const SQL_DEBIT_GUARDED =
+    "UPDATE accounts SET balance = balance - ? / 100 WHERE account_id = ? AND balance >= ? / 100";
+static const char *const SQL_CREDIT_STRIPE =
+    "INSERT INTO account_stripes(account_id,stripe,balance) VALUES(?,?,? / 100) "
+    "ON DUPLICATE KEY UPDATE balance = balance + VALUES(balance)";
+static const char *const SQL_LOCK_STRIPES =
+    "SELECT CAST(COALESCE(SUM(balance), 0) * 100 AS SIGNED) FROM account_stripes WHERE account_id = ? FOR UPDATE";
+static const char *const SQL_CLEAR_STRIPES =
+    "UPDATE account_stripes SET balance = 0 WHERE account_id = ? AND balance <> 0";
+// Balance of an accounts row in cents, stripes included; a macro so it can be
+// spliced into query literals.
+#define SQL_BALANCE_CENTS \
+    "CAST((balance + COALESCE((SELECT SUM(s.balance) FROM account_stripes s " \
+    "WHERE s.account_id = accounts.account_id), 0)) * 100 AS SIGNED)"
+
+static const std::int64_t UNKNOWN_BALANCE = INT64_MIN;
+
+struct LedgerRow {
+    int account_id;
+    TransactionType type;
+    Money amount;
+    std::string details;
+    std::int64_t balance_after = UNKNOWN_BALANCE;  // cents; set by fillBalancesAfter
+    int stripe = -1;  // striped account: the account_daily stripe it is rolled up on
+    std::int64_t posted_at = 0;  // unix seconds; 0 for the time the rows are written
+};
+
+std::string transferDetails(const char *direction, int other_account_id);  // "Transfer to account 7"
+
+// Sets balance_after on the rows of unstriped accounts (stripe < 0), which
+// must be in the order they were applied, from the balances the caller's
+// transaction has left: one query for all accounts, then a walk back per account.
+void fillBalancesAfter(ConnectionPool::Lease &conn, std::vector<LedgerRow> &rows);
+
+// Writes rows with multi-row INSERTs of per_insert rows each, inside the
+// caller's transaction.
+void insertLedgerRows(ConnectionPool::Lease &conn, const std::vector<LedgerRow> &rows, std::size_t per_insert);
+
+// Inserts idempotency keys with multi-row INSERTs of per_insert keys each,
+// inside the caller's transaction; keys already there are skipped.
+void insertIdempotencyKeys(ConnectionPool::Lease &conn, const std::vector<std::string> &keys, std::size_t per_insert);
+
+// Adds rows to the account_daily rollups of their posted_at days (today for
+// rows without one) with one multi-row upsert. Rows must be in posting order.
+void addDailyRollups(ConnectionPool::Lease &conn, const std::vector<LedgerRow> &rows);
+
+#endif // LEDGER_SQL_H
+
+// -------------------- src/ledger_sql.cpp --------------------
+
+#include "ledger_sql.h"
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <cppconn/datatype.h>
+#include <cppconn/resultset.h>
+
+// A LedgerRow's posted_at as a TIMESTAMP; a NULL one is the server's clock.
+#define SQL_POSTED_AT "COALESCE(FROM_UNIXTIME(?), CURRENT_TIMESTAMP)"
+
+static std::string ledgerInsertSql(std::size_t rows) {
+    std::string sql = "INSERT INTO transactions(account_id,type,amount,details,balance_after,created_at) VALUES";
+    for (std::size_t i = 0; i < rows; ++i) sql += (i ? "," : "") + std::string("(?,?,? / 100,?,? / 100," SQL_POSTED_AT ")");
+    return sql;
+}
+
+static void bindCentsOrNull(sql::PreparedStatement *ps, unsigned int col, std::int64_t cents) {
+    if (cents == UNKNOWN_BALANCE) ps->setNull(col, sql::DataType::DECIMAL);
+    else ps->setInt64(col, cents);
+}
+
+static void bindPostedAt(sql::PreparedStatement *ps, unsigned int col, std::int64_t posted_at) {
+    if (posted_at == 0) ps->setNull(col, sql::DataType::BIGINT);
+    else ps->setInt64(col, posted_at);
+}
+
+static void bindLedgerRows(sql::PreparedStatement *ps, const LedgerRow *rows, std::size_t n) {
+    unsigned int col = 1;
+    for (std::size_t i = 0; i < n; ++i) {
+        ps->setInt(col++, rows[i].account_id);
+        ps->setString(col++, toString(rows[i].type));
+        ps->setInt64(col++, rows[i].amount.cents());
+        ps->setString(col++, rows[i].details);
+        bindCentsOrNull(ps, col++, rows[i].balance_after);
+        bindPostedAt(ps, col++, rows[i].posted_at);
+    }
+}
+
+static std::int64_t signedCents(const LedgerRow &row) {
+    return row.type == TransactionType::DEPOSIT ? row.amount.cents() : -row.amount.cents();
+}
+
+void fillBalancesAfter(ConnectionPool::Lease &conn, std::vector<LedgerRow> &rows) {
+    std::unordered_map<int, std::int64_t> balances;
+    std::vector<int> ids;
+    for (const LedgerRow &row : rows) {
+        if (row.stripe < 0 && balances.emplace(row.account_id, 0).second) ids.push_back(row.account_id);
+    }
+    if (ids.empty()) return;
+    std::string sql = "SELECT account_id, " SQL_BALANCE_CENTS " FROM accounts WHERE account_id IN (";
+    for (std::size_t i = 0; i < ids.size(); ++i) sql += (i ? ",?" : "?");
+    sql += ")";
+    // sized to this call; kept out of the statement cache
+    std::unique_ptr<sql::PreparedStatement> ps(conn->prepareStatement(sql));
+    for (std::size_t i = 0; i < ids.size(); ++i) ps->setInt(static_cast<unsigned int>(i + 1), ids[i]);
+    {
+        std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps.get()));
+        while (rs->next()) balances[rs->getInt(1)] = rs->getInt64(2);
+    }
+    for (std::size_t i = rows.size(); i-- > 0;) {
+        LedgerRow &row = rows[i];
+        if (row.stripe >= 0) continue;
+        std::int64_t &balance = balances[row.account_id];
+        row.balance_after = balance;
+        balance -= signedCents(row);
+    }
+}
+
+std::string transferDetails(const char *direction, int other_account_id) {
+    std::ostringstream det;
+    det << "Transfer " << direction << " account " << other_account_id;
+    return det.str();
+}
+
+// Full groups share one cached statement; the shorter tail is prepared once
+// and thrown away so odd sizes do not fill the statement cache.
+void insertLedgerRows(ConnectionPool::Lease &conn, const std::vector<LedgerRow> &rows, std::size_t per_insert) {
+    if (per_insert == 0) per_insert = 1;
+    const std::string full_sql = ledgerInsertSql(per_insert);
+    std::size_t i = 0;
+    for (; i + per_insert <= rows.size(); i += per_insert) {
+        sql::PreparedStatement *ps = conn.prepare(full_sql);
+        bindLedgerRows(ps, &rows[i], per_insert);
+        conn.execute(ps);
+    }
+    if (i < rows.size()) {
+        std::unique_ptr<sql::PreparedStatement> ps(conn->prepareStatement(ledgerInsertSql(rows.size() - i)));
+        bindLedgerRows(ps.get(), &rows[i], rows.size() - i);
+        conn.execute(ps.get());
+    }
+}
+
+static std::string keyInsertSql(std::size_t keys) {
+    std::string sql = "INSERT IGNORE INTO idempotency_keys(idem_key) VALUES";
+    for (std::size_t i = 0; i < keys; ++i) sql += (i ? ",(?)" : "(?)");
+    return sql;
+}
+
+// Same statement reuse as insertLedgerRows.
+void insertIdempotencyKeys(ConnectionPool::Lease &conn, const std::vector<std::string> &keys, std::size_t per_insert) {
+    if (per_insert == 0) per_insert = 1;
+    const std::string full_sql = keyInsertSql(per_insert);
+    std::size_t i = 0;
+    for (; i + per_insert <= keys.size(); i += per_insert) {
+        sql::PreparedStatement *ps = conn.prepare(full_sql);
+        for (std::size_t k = 0; k < per_insert; ++k) ps->setString(static_cast<unsigned int>(k + 1), keys[i + k]);
+        conn.execute(ps);
+    }
+    if (i < keys.size()) {
+        std::unique_ptr<sql::PreparedStatement> ps(conn->prepareStatement(keyInsertSql(keys.size() - i)));
+        for (std::size_t k = i; k < keys.size(); ++k) ps->setString(static_cast<unsigned int>(k - i + 1), keys[k]);
+        conn.execute(ps.get());
+    }
+}
+
+// Rows of one account, stripe and posted_at second fold into one rollup row:
+// opening from the first, closing from the last. Striped stripes carry totals
+// only. The server turns each second into its day, so rows never fold across
+// midnight; rollups of one day are upserted in posting order, which keeps the
+// first opening and the last closing.
+void addDailyRollups(ConnectionPool::Lease &conn, const std::vector<LedgerRow> &rows) {
+    struct Rollup {
+        int account_id;
+        int stripe;
+        std::int64_t posted_at;
+        std::int64_t opening, closing, credits, debits;
+    };
+    struct RollupKey {
+        std::int64_t account_stripe, posted_at;
+        bool operator==(const RollupKey &o) const { return account_stripe == o.account_stripe && posted_at == o.posted_at; }
+    };
+    struct RollupKeyHash {
+        std::size_t operator()(const RollupKey &k) const {
+            return std::hash<std::int64_t>()(k.account_stripe * 31 + k.posted_at);
+        }
+    };
+    std::vector<Rollup> rollups;
+    std::unordered_map<RollupKey, std::size_t, RollupKeyHash> index;  // -> rollups slot
+    for (const LedgerRow &row : rows) {
+        const int stripe = row.stripe < 0 ? 0 : row.stripe;
+        const RollupKey key{(static_cast<std::int64_t>(row.account_id) << 8) | stripe, row.posted_at};
+        auto found = index.emplace(key, rollups.size());
+        if (found.second) {
+            const bool exact = row.stripe < 0 && row.balance_after != UNKNOWN_BALANCE;
+            rollups.push_back(Rollup{row.account_id, stripe, row.posted_at,
+                                     exact ? row.balance_after - signedCents(row) : UNKNOWN_BALANCE, UNKNOWN_BALANCE, 0, 0});
+        }
+        Rollup &r = rollups[found.first->second];
+        if (row.stripe < 0) r.closing = row.balance_after;
+        (row.type == TransactionType::DEPOSIT ? r.credits : r.debits) += row.amount.cents();
+    }
+    if (rollups.empty()) return;
+    std::string sql = "INSERT INTO account_daily(account_id,day,stripe,opening,closing,credits,debits) VALUES";
+    for (std::size_t i = 0; i < rollups.size(); ++i) {
+        sql += (i ? "," : "") + std::string("(?,DATE(" SQL_POSTED_AT "),?,? / 100,? / 100,? / 100,? / 100)");
+    }
+    sql += " ON DUPLICATE KEY UPDATE closing = VALUES(closing), credits = credits + VALUES(credits), "
+           "debits = debits + VALUES(debits)";
+    std::unique_ptr<sql::PreparedStatement> ps(conn->prepareStatement(sql));
+    unsigned int col = 1;
+    for (const Rollup &r : rollups) {
+        ps->setInt(col++, r.account_id);
+        bindPostedAt(ps.get(), col++, r.posted_at);
+        ps->setInt(col++, r.stripe);
+        bindCentsOrNull(ps.get(), col++, r.opening);
+        bindCentsOrNull(ps.get(), col++, r.closing);
+        ps->setInt64(col++, r.credits);
+        ps->setInt64(col++, r.debits);
+    }
+    conn.execute(ps.get());
+}
+
+// -------------------- src/partitions.h --------------------
+
+#ifndef PARTITIONS_H
+#define PARTITIONS_H
+
+#include <cstddef>
+#include <string>
+
+#include "connection_pool.h"
+
+// transactions is RANGE-partitioned by created_at month (see db.sql): pYYYYMM
+// holds one month, p_start everything before the first of them and p_future
+// anything past the last. Months are numbered year * 12 + (month - 1).
+
+int monthOf(const std::string &timestamp);  // "2026-10-14 09:30:00" -> month; -1 unless it starts with YYYY-MM
+std::string monthStart(int month);          // "2026-10-01 00:00:00"
+std::string partitionName(int month);       // "p202610"
+int currentMonth();                         // by this machine's local clock
+
+struct PartitionOptions {
+    int months_ahead = 3;           // months past the current one given their partition in advance
+    int keep_months = 12;           // whole months before the current one kept in transactions
+    std::size_t copy_rows = 50000;  // rows per archive copy transaction
+};
+
+// Splits p_future until every month up to months_ahead past the server's
+// current one has its own partition. Returns the partitions added, -1 on error.
+int addMonthPartitions(ConnectionPool::Lease &conn, const PartitionOptions &options);
+
+// Moves every partition that ends before the first kept month into
+// transactions_archive: its rows are copied copy_rows at a time, then the
+// partition is dropped. Safe to run again after a crash, since the copy skips
+// rows the archive already holds. Returns the partitions archived, -1 on error.
+int archiveOldPartitions(ConnectionPool::Lease &conn, const PartitionOptions &options);
+
+#endif // PARTITIONS_H
+
+// -------------------- src/partitions.cpp --------------------
+
+#include "partitions.h"
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <cppconn/prepared_statement.h>
+#include <cppconn/resultset.h>
+#include <cppconn/statement.h>
+
+static bool digits(const std::string &text, std::size_t at, std::size_t n, int &out) {
+    out = 0;
+    for (std::size_t i = at; i < at + n; ++i) {
+        if (text[i] < '0' || text[i] > '9') return false;
+        out = out * 10 + (text[i] - '0');
+    }
+    return true;
+}
+
+int monthOf(const std::string &timestamp) {
+    int year = 0, month = 0;
+    if (timestamp.size() < 7 || timestamp[4] != '-' || !digits(timestamp, 0, 4, year) || !digits(timestamp, 5, 2, month))
+        return -1;
+    if (month < 1 || month > 12) return -1;
+    return year * 12 + month - 1;
+}
+
+std::string monthStart(int month) {
+    char buf[32];
+    std::snprintf(buf, sizeof buf, "%04d-%02d-01 00:00:00", month / 12, month % 12 + 1);
+    return buf;
+}
+
+std::string partitionName(int month) {
+    char buf[16];
+    std::snprintf(buf, sizeof buf, "p%04d%02d", month / 12, month % 12 + 1);
+    return buf;
+}
+
+int currentMonth() {
+    std::time_t now = std::time(nullptr);
+    std::tm local;
+    localtime_r(&now, &local);
+    return (local.tm_year + 1900) * 12 + local.tm_mon;
+}
+
+namespace {
+
+struct Partition {
+    std::string name;
+    bool bounded;            // false for p_future (MAXVALUE)
+    std::int64_t less_than;  // UNIX_TIMESTAMP of the bound
+};
+
+// In bound order; empty if transactions is not partitioned.
+std::vector<Partition> listPartitions(ConnectionPool::Lease &conn) {
+    std::vector<Partition> out;
+    sql::PreparedStatement *ps = conn.prepare(
+        "SELECT PARTITION_NAME, PARTITION_DESCRIPTION FROM information_schema.PARTITIONS "
+        "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = 'transactions' AND PARTITION_NAME IS NOT NULL "
+        "ORDER BY PARTITION_ORDINAL_POSITION");
+    std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+    while (rs->next()) {
+        Partition p;
+        p.name = rs->getString(1);
+        std::string bound = rs->getString(2);
+        p.bounded = bound != "MAXVALUE";
+        p.less_than = p.bounded ? std::stoll(bound) : 0;
+        out.push_back(p);
+    }
+    return out;
+}
+
+// Month arithmetic is on the server's clock and session time zone, the ones
+// UNIX_TIMESTAMP(created_at) is partitioned by.
+int serverMonth(ConnectionPool::Lease &conn) {
+    std::unique_ptr<sql::Statement> st(conn->createStatement());
+    std::unique_ptr<sql::ResultSet> rs(st->executeQuery("SELECT DATE_FORMAT(NOW(), '%Y-%m')"));
+    return rs->next() ? monthOf(rs->getString(1)) : -1;
+}
+
+std::int64_t unixTime(ConnectionPool::Lease &conn, const std::string &timestamp) {
+    sql::PreparedStatement *ps = conn.prepare("SELECT UNIX_TIMESTAMP(?)");
+    ps->setString(1, timestamp);
+    std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+    return rs->next() ? rs->getInt64(1) : -1;
+}
+
+int monthOfUnixTime(ConnectionPool::Lease &conn, std::int64_t seconds) {
+    sql::PreparedStatement *ps = conn.prepare("SELECT DATE_FORMAT(FROM_UNIXTIME(?), '%Y-%m')");
+    ps->setInt64(1, seconds);
+    std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+    return rs->next() ? monthOf(rs->getString(1)) : -1;
+}
+
+const char *const LEDGER_COLUMNS = "transaction_id,account_id,type,amount,details,balance_after,created_at";
+
+} // namespace
+
+int addMonthPartitions(ConnectionPool::Lease &conn, const PartitionOptions &options) {
+    try {
+        std::vector<Partition> parts = listPartitions(conn);
+        if (parts.empty() || parts.back().bounded) {
+            std::cerr << "[addMonthPartitions error] transactions has no p_future partition; see db.sql" << std::endl;
+            return -1;
+        }
+        const int now = serverMonth(conn);
+        if (now < 0) return -1;
+        // the month that starts at the highest bound is the first without a partition
+        int next = now;
+        if (parts.size() > 1) {
+            next = monthOfUnixTime(conn, parts[parts.size() - 2].less_than);
+            if (next < 0) return -1;
+        }
+        int added = 0;
+        std::unique_ptr<sql::Statement> st(conn->createStatement());
+        for (; next <= now + options.months_ahead; ++next) {
+            st->execute("ALTER TABLE transactions REORGANIZE PARTITION p_future INTO (PARTITION " + partitionName(next) +
+                        " VALUES LESS THAN (UNIX_TIMESTAMP('" + monthStart(next + 1) + "')), "
+                        "PARTITION p_future VALUES LESS THAN MAXVALUE)");
+            ++added;
+        }
+        return added;
+    } catch (sql::SQLException &e) {
+        std::cerr << "[addMonthPartitions error] " << e.what() << std::endl;
+        return -1;
+    } catch (std::exception &e) {
+        std::cerr << "[addMonthPartitions error] " << e.what() << std::endl;
+        return -1;
+    }
+}
+
+int archiveOldPartitions(ConnectionPool::Lease &conn, const PartitionOptions &options) {
+    try {
+        const int now = serverMonth(conn);
+        if (now < 0) return -1;
+        const std::int64_t cutoff = unixTime(conn, monthStart(now - options.keep_months));
+        if (cutoff < 0) return -1;
+        const std::size_t batch = options.copy_rows ? options.copy_rows : 1;
+        int archived = 0;
+        std::unique_ptr<sql::Statement> st(conn->createStatement());
+        for (const Partition &p : listPartitions(conn)) {
+            if (!p.bounded || p.less_than > cutoff) break;
+            // Keyset batches of the partition's primary key, each its own
+            // autocommitted INSERT ... SELECT; IGNORE skips rows a crashed run copied.
+            std::int64_t after = 0, moved = 0;
+            const std::string next_sql = "SELECT MAX(transaction_id) FROM (SELECT transaction_id FROM transactions PARTITION (" +
+                                         p.name + ") WHERE transaction_id > ? ORDER BY transaction_id LIMIT ?) batch";
+            const std::string copy_sql = std::string("INSERT IGNORE INTO transactions_archive(") + LEDGER_COLUMNS + ") SELECT " +
+                                         LEDGER_COLUMNS + " FROM transactions PARTITION (" + p.name +
+                                         ") WHERE transaction_id > ? AND transaction_id <= ?";
+            std::unique_ptr<sql::PreparedStatement> next(conn->prepareStatement(next_sql));
+            std::unique_ptr<sql::PreparedStatement> copy(conn->prepareStatement(copy_sql));
+            for (;;) {
+                next->setInt64(1, after);
+                next->setInt64(2, static_cast<std::int64_t>(batch));
+                std::int64_t upto = 0;
+                {
+                    std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(next.get()));
+                    if (!rs->next() || rs->isNull(1)) break;
+                    upto = rs->getInt64(1);
+                }
+                copy->setInt64(1, after);
+                copy->setInt64(2, upto);
+                moved += conn.executeUpdate(copy.get());
+                after = upto;
+            }
+            st->execute("ALTER TABLE transactions DROP PARTITION " + p.name);
+            std::cerr << "[archive] " << p.name << ": " << moved << " rows moved to transactions_archive" << std::endl;
+            ++archived;
+        }
+        return archived;
+    } catch (sql::SQLException &e) {
+        std::cerr << "[archiveOldPartitions error] " << e.what() << std::endl;
+        return -1;
+    }
+}
+
+// -------------------- src/account_snapshot.h --------------------
+
+#ifndef ACCOUNT_SNAPSHOT_H
+#define ACCOUNT_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// CRC-32 (IEEE); pass the previous result as crc to checksum data in pieces.
+std::uint32_t crc32(const void *data, std::size_t n, std::uint32_t crc = 0);
+
+static const std::size_t SNAPSHOT_MAX_TYPES = 16;  // account_type names, each shorter than 16 bytes
+
+// Columns of an account snapshot, one entry per account in ascending id order.
+struct SnapshotColumns {
+    std::vector<std::int32_t> ids;
+    std::vector<std::int32_t> customer_ids;
+    std::vector<std::uint8_t> type_codes;    // index into type_names
+    std::vector<std::int64_t> balance_cents;
+    std::vector<std::string> type_names;
+};
+
+// Read-only, memory-mapped copy of the accounts table at one ledger WAL
+// position: every WAL record up to lsn() is included. Layout:
+//
+//   header      magic "BANKSNAP", version, lsn, row count, type names,
+//               column offsets, checksums of the header and of the columns
+//   ids           int32[n]
+//   customer_ids  int32[n]
+//   type_codes    uint8[n]
+//   balance_cents int64[n]
+//
+// Each column starts on a 64-byte boundary and is in host byte order, so
+// offline tools can map the file and scan a column as a plain array.
+class AccountSnapshot {
+public:
+    // Throws std::runtime_error if path is missing, truncated, of another
+    // version, or fails a checksum.
+    explicit AccountSnapshot(const std::string &path);
+    ~AccountSnapshot();
+    AccountSnapshot(const AccountSnapshot&) = delete;
+    AccountSnapshot& operator=(const AccountSnapshot&) = delete;
+
+    std::uint64_t lsn() const;
+    std::size_t size() const;
+    const std::int32_t *ids() const;
+    const std::int32_t *customerIds() const;
+    const std::uint8_t *typeCodes() const;
+    const std::int64_t *balanceCents() const;
+    std::string typeName(std::uint8_t code) const;
+    std::size_t typeCount() const;
+    // Row of account_id, or -1.
+    std::ptrdiff_t find(int account_id) const;
+
+    // Writes cols to path through a temporary file, fsync and rename, so
+    // readers see either the old snapshot or the new one.
+    static bool write(const std::string &path, std::uint64_t lsn, const SnapshotColumns &cols);
+
+private:
+    struct Header;
+    const unsigned char *column(int i) const;
+
+    const unsigned char *base;
+    std::size_t length;
+};
+
+#endif // ACCOUNT_SNAPSHOT_H
+
+// -------------------- src/account_snapshot.cpp --------------------
+
+#include "account_snapshot.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::uint32_t crc32(const void *data, std::size_t n, std::uint32_t crc) {
+    struct Table {
+        std::uint32_t v[256];
+        Table() {
+            for (std::uint32_t i = 0; i < 256; ++i) {
+                std::uint32_t c = i;
+                for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                v[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    std::uint32_t c = crc ^ 0xFFFFFFFFu;
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < n; ++i) c = table.v[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static const char SNAPSHOT_MAGIC[8] = {'B', 'A', 'N', 'K', 'S', 'N', 'A', 'P'};
+static const std::uint32_t SNAPSHOT_VERSION = 1;
+static const std::size_t COLUMN_WIDTH[4] = {4, 4, 1, 8};
+
+struct AccountSnapshot::Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t type_count;
+    std::uint64_t lsn;
+    std::uint64_t count;
+    std::uint64_t offsets[4];  // ids, customer_ids, type_codes, balance_cents
+    char type_names[SNAPSHOT_MAX_TYPES][16];
+    std::uint32_t data_crc;    // the four columns, in order
+    std::uint32_t header_crc;  // every header byte before it
+};
+
+static std::uint64_t align64(std::uint64_t n) { return (n + 63) & ~std::uint64_t(63); }
+
+AccountSnapshot::AccountSnapshot(const std::string &path) : base(nullptr), length(0) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open snapshot " + path + ": " + std::strerror(errno));
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+        ::close(fd);
+        throw std::runtime_error("snapshot " + path + " is truncated");
+    }
+    length = static_cast<std::size_t>(st.st_size);
+    void *m = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) throw std::runtime_error("cannot map snapshot " + path + ": " + std::strerror(errno));
+    base = static_cast<const unsigned char*>(m);
+    ::madvise(m, length, MADV_SEQUENTIAL);
+
+    const Header &h = *reinterpret_cast<const Header*>(base);
+    const char *problem = nullptr;
+    if (std::memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || h.version != SNAPSHOT_VERSION) {
+        problem = "is not a version 1 account snapshot";
+    } else if (h.header_crc != crc32(&h, offsetof(Header, header_crc)) || h.type_count > SNAPSHOT_MAX_TYPES) {
+        problem = "has a damaged header";
+    } else {
+        std::uint32_t crc = 0;
+        for (int i = 0; i < 4 && !problem; ++i) {
+            std::uint64_t bytes = h.count * COLUMN_WIDTH[i];
+            if (h.offsets[i] % 64 != 0 || h.offsets[i] > length || bytes > length - h.offsets[i]) problem = "is truncated";
+            else crc = crc32(base + h.offsets[i], static_cast<std::size_t>(bytes), crc);
+        }
+        if (!problem && crc != h.data_crc) problem = "fails its checksum";
+    }
+    if (problem) {
+        ::munmap(m, length);
+        throw std::runtime_error("snapshot " + path + " " + problem);
+    }
+}
+
+AccountSnapshot::~AccountSnapshot() {
+    ::munmap(const_cast<unsigned char*>(base), length);
+}
+
+const unsigned char *AccountSnapshot::column(int i) const {
+    return base + reinterpret_cast<const Header*>(base)->offsets[i];
+}
+
+const std::int32_t *AccountSnapshot::ids() const { return reinterpret_cast<const std::int32_t*>(column(0)); }
+const std::int32_t *AccountSnapshot::customerIds() const { return reinterpret_cast<const std::int32_t*>(column(1)); }
+const std::uint8_t *AccountSnapshot::typeCodes() const { return column(2); }
+const std::int64_t *AccountSnapshot::balanceCents() const { return reinterpret_cast<const std::int64_t*>(column(3)); }
+
+std::uint64_t AccountSnapshot::lsn() const {
+    return reinterpret_cast<const Header*>(base)->lsn;
+}
+
+std::size_t AccountSnapshot::size() const {
+    return static_cast<std::size_t>(reinterpret_cast<const Header*>(base)->count);
+}
+
+std::size_t AccountSnapshot::typeCount() const {
+    return reinterpret_cast<const Header*>(base)->type_count;
+}
+
+std::string AccountSnapshot::typeName(std::uint8_t code) const {
+    const Header &h = *reinterpret_cast<const Header*>(base);
+    if (code >= h.type_count) return std::string();
+    return std::string(h.type_names[code], strnlen(h.type_names[code], sizeof(h.type_names[code])));
+}
+
+std::ptrdiff_t AccountSnapshot::find(int account_id) const {
+    const std::int32_t *first = ids(), *last = ids() + size();
+    const std::int32_t *it = std::lower_bound(first, last, account_id);
+    return it != last && *it == account_id ? it - first : -1;
+}
+
+bool AccountSnapshot::write(const std::string &path, std::uint64_t lsn, const SnapshotColumns &cols) {
+    const std::size_t n = cols.ids.size();
+    if (cols.customer_ids.size() != n || cols.type_codes.size() != n || cols.balance_cents.size() != n ||
+        cols.type_names.size() > SNAPSHOT_MAX_TYPES) {
+        return false;
+    }
+    Header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.version = SNAPSHOT_VERSION;
+    h.type_count = static_cast<std::uint32_t>(cols.type_names.size());
+    h.lsn = lsn;
+    h.count = n;
+    for (std::size_t t = 0; t < cols.type_names.size(); ++t) {
+        std::strncpy(h.type_names[t], cols.type_names[t].c_str(), sizeof(h.type_names[t]) - 1);
+    }
+    const void *data[4] = {cols.ids.data(), cols.customer_ids.data(), cols.type_codes.data(), cols.balance_cents.data()};
+    std::uint64_t offset = align64(sizeof(Header));
+    for (int i = 0; i < 4; ++i) {
+        h.offsets[i] = offset;
+        offset = align64(offset + n * COLUMN_WIDTH[i]);
+        h.data_crc = crc32(data[i], n * COLUMN_WIDTH[i], h.data_crc);
+    }
+    h.header_crc = crc32(&h, offsetof(Header, header_crc));
+
+    const std::string tmp = path + ".tmp";
+    std::FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    static const char zeros[64] = {0};
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+    std::uint64_t at = sizeof(h);
+    for (int i = 0; i < 4 && ok; ++i) {
+        ok = std::fwrite(zeros, 1, h.offsets[i] - at, f) == h.offsets[i] - at &&
+             (n == 0 || std::fwrite(data[i], COLUMN_WIDTH[i], n, f) == n);
+        at = h.offsets[i] + n * COLUMN_WIDTH[i];
+    }
+    ok = ok && std::fflush(f) == 0 && ::fsync(::fileno(f)) == 0;
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    // make the rename itself durable
+    std::string dir = path.find('/') == std::string::npos ? "." : path.substr(0, path.rfind('/') + 1);
+    int dfd = ::open(dir.c_str(), O_RDONLY);
+    if (dfd >= 0) {
+        ::fsync(dfd);
+        ::close(dfd);
+    }
+    return true;
+}
+
+// -------------------- src/account_kernels.h --------------------
+
+#ifndef ACCOUNT_KERNELS_H
+#define ACCOUNT_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Batch kernels over account columns laid out like an AccountSnapshot. Each
+// call picks AVX-512, AVX2 or a scalar loop for the CPU it runs on; all three
+// give identical results. Totals are exact: one that does not fit in int64
+// throws std::overflow_error, as Money arithmetic does.
+enum class KernelLevel { SCALAR, AVX2, AVX512 };
+
+// Best level this CPU supports, capped by limitKernelLevel().
+KernelLevel kernelLevel();
+// Caps the level used from now on, e.g. to compare paths in a benchmark.
+void limitKernelLevel(KernelLevel level);
+const char *kernelLevelName(KernelLevel level);
+
+std::int64_t sumCents(const std::int64_t *cents, std::size_t n);
+
+// totals[c] += sum of cents[i] with codes[i] == c, for c < types (at most 16);
+// rows with other codes are skipped.
+void sumCentsByCode(const std::uint8_t *codes, const std::int64_t *cents, std::size_t n,
+                    std::int64_t *totals, std::size_t types);
+
+// Writes the row numbers with cents[i] < threshold to rows (room for n) and
+// returns how many there are.
+std::size_t rowsBelow(const std::int64_t *cents, std::size_t n, std::int64_t threshold, std::uint32_t *rows);
+
+// interest[i] = positive cents[i] * rate_ppm / 1e6, rounded half up (ties go
+// toward +infinity, so -1.5 cents is -1), for rows with codes[i] == code; 0
+// elsewhere. Returns the total. Exact for any int64 balance and rate:
+// products are taken in 128 bits, which AVX2 and AVX-512F cannot do per
+// lane, so this one is scalar on every level.
+std::int64_t accrueInterest(const std::uint8_t *codes, const std::int64_t *cents, std::size_t n, std::uint8_t code,
+                            std::int64_t rate_ppm, std::int64_t *interest);
+
+#endif // ACCOUNT_KERNELS_H
+
+// -------------------- src/account_kernels.cpp --------------------
+
+#include "account_kernels.h"
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BANK_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+static std::atomic<int> level_cap(static_cast<int>(KernelLevel::AVX512));
+
+static KernelLevel detectLevel() {
+#ifdef BANK_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return KernelLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return KernelLevel::AVX2;
+#endif
+    return KernelLevel::SCALAR;
+}
+
+KernelLevel kernelLevel() {
+    static const KernelLevel detected = detectLevel();
+    int cap = level_cap.load(std::memory_order_relaxed);
+    return static_cast<int>(detected) < cap ? detected : static_cast<KernelLevel>(cap);
+}
+
+void limitKernelLevel(KernelLevel level) {
+    level_cap.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+const char *kernelLevelName(KernelLevel level) {
+    switch (level) {
+    case KernelLevel::AVX512: return "avx512";
+    case KernelLevel::AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+// Totals are kept in 128 bits, which no int64 column can overflow, and
+// narrowed once at the end.
+static std::int64_t narrow(__int128 total) {
+    if (total > INT64_MAX || total < INT64_MIN) throw std::overflow_error("cents total does not fit in int64");
+    return static_cast<std::int64_t>(total);
+}
+
+// Scalar versions, also used for the tails the vector loops leave and for
+// whole columns whose vector lanes might overflow.
+
+static __int128 sumScalar(const std::int64_t *cents, std::size_t n) {
+    __int128 total = 0;
+    for (std::size_t i = 0; i < n; ++i) total += cents[i];
+    return total;
+}
+
+static void sumByCodeScalar(const std::uint8_t *codes, const std::int64_t *cents, std::size_t n,
+                            __int128 *totals, std::size_t types) {
+    for (std::size_t i = 0; i < n; ++i) {
+        if (codes[i] < types) totals[codes[i]] += cents[i];
+    }
+}
+
+static std::size_t belowScalar(const std::int64_t *cents, std::size_t n, std::int64_t threshold,
+                               std::uint32_t *rows, std::size_t base) {
+    std::size_t found = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        rows[found] = static_cast<std::uint32_t>(base + i);
+        found += cents[i] < threshold;  // branch-free: the write is kept only for hits
+    }
+    return found;
+}
+
+#ifdef BANK_X86_KERNELS
+
+// The vector loops add with wraparound and OR together v ^ (v >> 63), which
+// is |v| or |v| - 1, for every value they read. A lane that adds per_lane
+// values no larger than 2^bits stays within per_lane * 2^bits, so when that
+// fits in int64 the lanes are exact; otherwise the caller sums the whole
+// column with the scalar loop.
+static bool lanesExact(std::uint64_t magnitude, std::size_t per_lane) {
+    const int bits = magnitude ? 64 - __builtin_clzll(magnitude) : 0;
+    return (static_cast<__int128>(per_lane) << bits) <= INT64_MAX;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i magnitudeAvx2(__m256i m, __m256i v) {
+    return _mm256_or_si256(m, _mm256_xor_si256(v, _mm256_cmpgt_epi64(_mm256_setzero_si256(), v)));
+}
+
+__attribute__((target("avx2")))
+static std::uint64_t lanesOr256(__m256i m) {
+    alignas(32) std::uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), m);
+    return lanes[0] | lanes[1] | lanes[2] | lanes[3];
+}
+
+__attribute__((target("avx2")))
+static __int128 lanesSum256(__m256i a) {
+    alignas(32) std::int64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), a);
+    return static_cast<__int128>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+static std::int64_t sumAvx2(const std::int64_t *cents, std::size_t n) {
+    __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0, m = a0;
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cents + i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cents + i + 4));
+        __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cents + i + 8));
+        __m256i v3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cents + i + 12));
+        a0 = _mm256_add_epi64(a0, v0);
+        a1 = _mm256_add_epi64(a1, v1);
+        a2 = _mm256_add_epi64(a2, v2);
+        a3 = _mm256_add_epi64(a3, v3);
+        m = magnitudeAvx2(magnitudeAvx2(m, v0), v1);
+        m = magnitudeAvx2(magnitudeAvx2(m, v2), v3);
+    }
+    if (!lanesExact(lanesOr256(m), i / 16)) return narrow(sumScalar(cents, n));
+    return narrow(lanesSum256(a0) + lanesSum256(a1) + lanesSum256(a2) + lanesSum256(a3) + sumScalar(cents + i, n - i));
+}
+
+// Codes are widened to one per 64-bit lane and compared against each group,
+// so the cost grows with types; fine for the handful of account types.
+// Returns false, leaving totals alone, when the lanes may have overflowed.
+__attribute__((target("avx2")))
+static bool sumByCodeAvx2(const std::uint8_t *codes, const std::int64_t *cents, std::size_t n,
+                          __int128 *totals, std::size_t types) {
+    __m256i acc[16];
+    for (std::size_t g = 0; g < types; ++g) acc[g] = _mm256_setzero_si256();
+    __m256i m = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        std::int32_t four;
+        __builtin_memcpy(&four, codes + i, sizeof(four));
+        __m256i c = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(four));
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cents + i));
+        m = magnitudeAvx2(m, v);
+        for (std::size_t g = 0; g < types; ++g) {
+            __m256i hit = _mm256_cmpeq_epi64(c, _mm256_set1_epi64x(static_cast<long long>(g)));
+            acc[g] = _mm256_add_epi64(acc[g], _mm256_and_si256(hit, v));
+        }
+    }
+    if (!lanesExact(lanesOr256(m), i / 4)) return false;
+    for (std::size_t g = 0; g < types; ++g) totals[g] += lanesSum256(acc[g]);
+    sumByCodeScalar(codes + i, cents + i, n - i, totals, types);
+    return true;
+}
+
+__attribute__((target("avx2")))
+static std::size_t belowAvx2(const std::int64_t *cents, std::size_t n, std::int64_t threshold, std::uint32_t *rows) {
+    const __m256i t = _mm256_set1_epi64x(threshold);
+    std::size_t found = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cents + i));
+        unsigned bits = static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(t, v))));
+        while (bits) {
+            rows[found++] = static_cast<std::uint32_t>(i + __builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+    return found + belowScalar(cents + i, n - i, threshold, rows + found, i);
+}
+
+// Lane-wise horizontal sum; _mm512_reduce_add_epi64 trips -Wuninitialized in GCC 12's headers.
+__attribute__((target("avx512f")))
+static __int128 lanesSum512(__m512i a) {
+    alignas(64) std::int64_t lanes[8];
+    _mm512_store_si512(lanes, a);
+    __int128 total = 0;
+    for (std::int64_t lane : lanes) total += lane;
+    return total;
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i magnitudeAvx512(__m512i m, __m512i v) {
+    return _mm512_or_si512(m, _mm512_xor_si512(v, _mm512_srai_epi64(v, 63)));
+}
+
+__attribute__((target("avx512f")))
+static std::uint64_t lanesOr512(__m512i m) {
+    alignas(64) std::uint64_t lanes[8];
+    _mm512_store_si512(lanes, m);
+    std::uint64_t all = 0;
+    for (std::uint64_t lane : lanes) all |= lane;
+    return all;
+}
+
+__attribute__((target("avx512f")))
+static std::int64_t sumAvx512(const std::int64_t *cents, std::size_t n) {
+    __m512i a0 = _mm512_setzero_si512(), a1 = a0, m = a0;
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i v0 = _mm512_loadu_si512(cents + i);
+        __m512i v1 = _mm512_loadu_si512(cents + i + 8);
+        a0 = _mm512_add_epi64(a0, v0);
+        a1 = _mm512_add_epi64(a1, v1);
+        m = magnitudeAvx512(magnitudeAvx512(m, v0), v1);
+    }
+    if (!lanesExact(lanesOr512(m), i / 16)) return narrow(sumScalar(cents, n));
+    return narrow(lanesSum512(a0) + lanesSum512(a1) + sumScalar(cents + i, n - i));
+}
+
+__attribute__((target("avx512f")))
+static bool sumByCodeAvx512(const std::uint8_t *codes, const std::int64_t *cents, std::size_t n,
+                            __int128 *totals, std::size_t types) {
+    __m512i acc[16];
+    for (std::size_t g = 0; g < types; ++g) acc[g] = _mm512_setzero_si512();
+    __m512i m = _mm512_setzero_si512();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i c = _mm512_maskz_cvtepu8_epi64(0xFF, _mm_loadl_epi64(reinterpret_cast<const __m128i*>(codes + i)));
+        __m512i v = _mm512_loadu_si512(cents + i);
+        m = magnitudeAvx512(m, v);
+        for (std::size_t g = 0; g < types; ++g) {
+            __mmask8 hit = _mm512_cmpeq_epi64_mask(c, _mm512_set1_epi64(static_cast<long long>(g)));
+            acc[g] = _mm512_mask_add_epi64(acc[g], hit, acc[g], v);
+        }
+    }
+    if (!lanesExact(lanesOr512(m), i / 8)) return false;
+    for (std::size_t g = 0; g < types; ++g) totals[g] += lanesSum512(acc[g]);
+    sumByCodeScalar(codes + i, cents + i, n - i, totals, types);
+    return true;
+}
+
+__attribute__((target("avx512f")))
+static std::size_t belowAvx512(const std::int64_t *cents, std::size_t n, std::int64_t threshold, std::uint32_t *rows) {
+    const __m512i t = _mm512_set1_epi64(threshold);
+    std::size_t found = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        unsigned bits = _mm512_cmplt_epi64_mask(_mm512_loadu_si512(cents + i), t);
+        while (bits) {
+            rows[found++] = static_cast<std::uint32_t>(i + __builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+    return found + belowScalar(cents + i, n - i, threshold, rows + found, i);
+}
+
+#endif // BANK_X86_KERNELS
+
+std::int64_t sumCents(const std::int64_t *cents, std::size_t n) {
+#ifdef BANK_X86_KERNELS
+    switch (kernelLevel()) {
+    case KernelLevel::AVX512: return sumAvx512(cents, n);
+    case KernelLevel::AVX2: return sumAvx2(cents, n);
+    default: break;
+    }
+#endif
+    return narrow(sumScalar(cents, n));
+}
+
+void sumCentsByCode(const std::uint8_t *codes, const std::int64_t *cents, std::size_t n,
+                    std::int64_t *totals, std::size_t types) {
+    if (types > 16) types = 16;
+    __int128 sums[16] = {};
+    bool done = false;
+#ifdef BANK_X86_KERNELS
+    switch (kernelLevel()) {
+    case KernelLevel::AVX512: done = sumByCodeAvx512(codes, cents, n, sums, types); break;
+    case KernelLevel::AVX2: done = sumByCodeAvx2(codes, cents, n, sums, types); break;
+    default: break;
+    }
+#endif
+    if (!done) sumByCodeScalar(codes, cents, n, sums, types);
+    // checked before any total is written, so a throw leaves totals as they were
+    for (std::size_t g = 0; g < types; ++g) narrow(totals[g] + sums[g]);
+    for (std::size_t g = 0; g < types; ++g) totals[g] = narrow(totals[g] + sums[g]);
+}
+
+std::size_t rowsBelow(const std::int64_t *cents, std::size_t n, std::int64_t threshold, std::uint32_t *rows) {
+#ifdef BANK_X86_KERNELS
+    switch (kernelLevel()) {
+    case KernelLevel::AVX512: return belowAvx512(cents, n, threshold, rows);
+    case KernelLevel::AVX2: return belowAvx2(cents, n, threshold, rows);
+    default: break;
+    }
+#endif
+    return belowScalar(cents, n, threshold, rows, 0);
+}
+
+std::int64_t accrueInterest(const std::uint8_t *codes, const std::int64_t *cents, std::size_t n, std::uint8_t code,
+                            std::int64_t rate_ppm, std::int64_t *interest) {
+    __int128 total = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        std::int64_t x = 0;
+        if (codes[i] == code && cents[i] > 0) {
+            // floor((p + 500000) / 1e6); division truncates, so step down on a negative remainder
+            const __int128 p = static_cast<__int128>(cents[i]) * rate_ppm + 500000;
+            __int128 q = p / 1000000;
+            if (p % 1000000 < 0) --q;
+            x = narrow(q);
+        }
+        interest[i] = x;
+        total += x;
+    }
+    return narrow(total);
+}
+
+// -------------------- src/ledger_engine.h --------------------
+
+#ifndef LEDGER_ENGINE_H
+#define LEDGER_ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../include/bank.h"
+#include "connection_pool.h"
+
+struct SnapshotColumns;
+
+// Optional write path that keeps balances in memory and makes each operation
+// durable in a local write-ahead log (WAL) instead of a MySQL commit:
+//
+//   caller:  check + apply in memory, take an LSN -> publish the WAL record
+//            in the ring slot of its LSN -> wait for fsync
+//   writer:  writes every published record, in LSN order, with one write() +
+//            fdatasync() (group commit), then wakes all callers it covered
+//   flusher: every flush_interval_ms applies durable records to MySQL in one
+//            transaction, together with ledger_checkpoint.applied_lsn
+//
+// On startup, WAL records past applied_lsn are replayed into MySQL before the
+// balances are loaded, so nothing that was acknowledged is lost in a crash.
+// While enabled, the engine must be the only writer of account balances.
+//
+// Idempotency keys travel with their records: the writer syncs them to a side
+// file, <wal_path>.keys, before the records themselves, and the flusher
+// inserts them into idempotency_keys in the transaction that applies the
+// records. Until then the engine holds them in memory, so a retry is answered
+// without MySQL and two calls with one key never both apply.
+//
+// With options.snapshot_path, balances are loaded from an AccountSnapshot
+// plus the WAL records after it, and accounts created since then are the only
+// rows read from MySQL. The WAL then must cover everything after the
+// snapshot, so instead of being truncated once drained it is rotated to
+// <wal_path>.old every snapshot_interval_s; a background thread folds the old
+// file into a new snapshot and deletes it once MySQL has every record in it. A clean shutdown writes a fresh
+// snapshot, so the next start replays nothing.
+//
+// Balances live in cache-line sized slots indexed directly by account_id.
+// Deposits and withdrawals are a compare-and-swap on the slot's cents and
+// never block; a transfer locks its two slots, lower account_id first, so
+// transfers over the same accounts cannot deadlock. LSNs come from an atomic
+// counter and callers wait for the fsync on one of several waiter shards, so
+// no lock covers the whole table or every caller.
+//
+// The WAL and the MySQL flush replay records as unguarded deltas in LSN
+// order, so a debit must never be logged before a credit it relied on. A
+// credit therefore takes its LSN before it changes the balance and a debit
+// only after: a debit that saw a credit's money comes later in the WAL. Any
+// LSN prefix then leaves each account no lower than memory held right after
+// the prefix's last debit on it, so a crash cannot overdraw an account.
+class LedgerEngine {
+public:
+    LedgerEngine(ConnectionPool &pool, const LedgerOptions &options);
+    // Stops accepting work, makes everything queued durable, then drains it to MySQL.
+    ~LedgerEngine();
+    LedgerEngine(const LedgerEngine&) = delete;
+    LedgerEngine& operator=(const LedgerEngine&) = delete;
+
+    // Applies op and blocks until its WAL record is durable. A key, which the
+    // caller must hold (holdKey), is logged with the record; unless op is
+    // applied it is released.
+    OperationResult apply(const Operation &op, const std::string &key = std::string());
+    // Applies every op, waiting for durability once at the end.
+    std::vector<OperationResult> applyBatch(const std::vector<Operation> &ops);
+
+    // Keys of calls in flight, or applied but not yet in idempotency_keys.
+    // holdKey waits while another call holds key and is false once one has
+    // applied it; a held key goes to apply() or back through releaseKey.
+    bool holdKey(const std::string &key);
+    void releaseKey(const std::string &key);
+
+    bool balance(int account_id, Money &out);
+    void addAccount(int account_id, int customer_id, AccountType type);
+    // Copies every account into out, in id order. Balances are read live, so
+    // operations racing with the copy may or may not be reflected; everything
+    // durable before the call is. Returns the durable LSN at the start.
+    std::uint64_t exportColumns(SnapshotColumns &out);
+
+private:
+    // REC_VOID fills the LSN of a credit that overflowed after taking it.
+    enum : std::uint8_t { REC_VOID = 0, REC_DEPOSIT = 1, REC_WITHDRAW = 2, REC_TRANSFER = 3 };
+
+    // Fixed-size on-disk record; crc covers every byte before it. A WAL file
+    // starts with a WalHeader; files without one hold LegacyWalRecords.
+    struct WalRecord {
+        std::uint64_t lsn;
+        std::int64_t cents;
+        std::int64_t posted_at;  // unix seconds, stamped when its batch is written; 0 if unknown
+        std::int32_t account_id;
+        std::int32_t to_account_id;
+        std::uint8_t kind;
+        std::uint8_t keyed;  // its idempotency key is in the keys file
+        std::uint8_t reserved[2];
+        std::uint32_t crc;
+    };
+    static_assert(sizeof(WalRecord) == 40, "WAL record layout must not change");
+    struct LegacyWalRecord {
+        std::uint64_t lsn;
+        std::int64_t cents;
+        std::int32_t account_id;
+        std::int32_t to_account_id;
+        std::uint8_t kind;
+        std::uint8_t keyed;
+        std::uint8_t reserved[2];
+        std::uint32_t crc;
+    };
+    static_assert(sizeof(LegacyWalRecord) == 32, "WAL record layout must not change");
+    struct WalHeader {
+        std::uint64_t magic;
+        std::uint32_t record_size;
+        std::uint32_t crc;
+    };
+    static const std::uint64_t WAL_MAGIC = 0x324c41574b4e4142ULL;  // "BANKWAL2" in file order
+
+    // Keys file entry, followed by the key's bytes; crc covers the fields
+    // before it and the key.
+    struct KeyEntry {
+        std::uint64_t lsn;
+        std::uint32_t length;
+        std::uint32_t crc;
+    };
+    typedef std::unordered_map<std::uint64_t, std::string> KeysByLsn;
+
+    struct alignas(64) AccountSlot {
+        std::atomic<std::int64_t> cents{0};
+        std::atomic<bool> exists{false};
+        std::int32_t customer_id = 0;  // for snapshots; written before exists is set
+        std::uint8_t type_code = 0;    // AccountType
+        std::mutex transfer_mu;        // held by transfers only, lower account_id first
+    };
+    static_assert(sizeof(AccountSlot) == 64, "AccountSlot should fill exactly one cache line");
+
+    // Slots are allocated in chunks of 2^CHUNK_BITS and never move, so a
+    // lookup is two array indexes and no lock.
+    static const int CHUNK_BITS = 14;
+    static const std::size_t CHUNK_SIZE = std::size_t(1) << CHUNK_BITS;
+    static const std::size_t CHUNK_COUNT = (std::size_t(1) << 31) >> CHUNK_BITS;
+
+    AccountSlot* slot(int account_id, bool create);
+    static bool credit(AccountSlot &s, std::int64_t cents);
+    static bool debit(AccountSlot &s, std::int64_t cents);
+
+    OperationResult submit(const Operation &op, const std::string &key, std::uint64_t &lsn);
+    OperationResult applyAndLog(WalRecord &rec, const std::string &key);
+    std::uint64_t takeLsn();
+    void publish(WalRecord &rec, const std::string &key);
+    bool waitDurable(std::uint64_t lsn);
+    void undoInMemory(const WalRecord &rec);
+
+    static void readWal(int fd, std::vector<WalRecord> &out, std::uint64_t &prev);
+    static bool writeWalHeader(int fd);
+    static void readKeys(int fd, KeysByLsn &out);
+    bool writeKeys(const std::vector<std::pair<std::uint64_t, std::string>> &keys);
+    void recover(std::vector<WalRecord> &records);
+    void loadBalances(const std::vector<WalRecord> &records);
+    bool loadSnapshot(const std::vector<WalRecord> &records);
+    bool snapshotFromMemory(std::uint64_t lsn);
+    void resetWal();
+    void compact();
+    bool writeToMySQL(const std::vector<WalRecord> &records, const KeysByLsn &keys);
+    void truncateIfDrained();
+    void writerLoop();
+    void flusherLoop();
+    void snapshotLoop();
+
+    ConnectionPool &pool;
+    LedgerOptions options;
+    int fd;
+    int keys_fd;
+
+    std::unique_ptr<std::atomic<AccountSlot*>[]> chunks;
+
+    bool snapshots;  // options.snapshot_path is set and the last snapshot write worked
+    std::string old_wal_path;
+    std::string keys_path, old_keys_path;  // rotated and removed with the WAL files
+
+    // Records on their way to the writer, at index lsn % RING_SIZE. A caller
+    // whose LSN is a full ring ahead of the writer waits for it.
+    static const std::size_t RING_SIZE = std::size_t(1) << 16;
+    struct alignas(64) RingEntry {
+        std::atomic<std::uint64_t> lsn{0};  // stored last, once rec holds that LSN's record
+        WalRecord rec;
+        std::string key;                    // if rec.keyed
+    };
+    std::unique_ptr<RingEntry[]> ring;
+    std::atomic<std::uint64_t> next_lsn{1};
+    std::atomic<std::uint64_t> taken_lsn{0};    // every record up to here is out of the ring
+    std::atomic<std::uint64_t> durable_lsn{0};
+    std::int64_t last_posted_at = 0;  // writer thread only
+    std::atomic<int> in_submit{0};              // callers between their stop check and publish
+    std::atomic<bool> failed{false};            // a WAL write failed; no further operations are accepted
+    std::atomic<bool> stop_writer{false};
+    std::atomic<bool> writer_idle{false};
+    std::mutex wal_wake_mu;
+    std::condition_variable wal_wake;
+
+    // Callers waiting for their LSN to be durable, spread by LSN.
+    static const std::size_t WAITER_SHARDS = 64;
+    struct alignas(64) Waiters {
+        std::mutex mu;
+        std::condition_variable durable;
+    };
+    Waiters waiters[WAITER_SHARDS];
+
+    enum class KeyState : std::uint8_t { HELD, LOGGED };
+    static const std::size_t KEY_SHARDS = 16;
+    struct alignas(64) KeyShard {
+        std::mutex mu;
+        std::condition_variable released;
+        std::unordered_map<std::string, KeyState> keys;
+    };
+    KeyShard key_shards[KEY_SHARDS];
+    KeyShard& keyShard(const std::string &key) { return key_shards[std::hash<std::string>()(key) % KEY_SHARDS]; }
+
+    std::mutex mu;  // guards everything below; the writer, flusher and snapshotter share it
+    std::condition_variable flush_wake, snapshot_wake;
+    std::deque<WalRecord> unapplied;   // durable, not yet in MySQL
+    KeysByLsn unapplied_keys;          // keys of the keyed records in unapplied
+    std::uint64_t applied_lsn = 0;
+    bool stop_flusher = false;
+    bool stop_snapshotter = false;
+
+    std::mutex wal_mu;  // serializes file access (and fd) between the writer, truncation and rotation
+    std::thread writer;
+    std::thread flusher;
+    std::thread snapshotter;
+};
+
+#endif // LEDGER_ENGINE_H
+
+// -------------------- src/ledger_engine.cpp --------------------
+
+#include "ledger_engine.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "account_snapshot.h"
+#include "ledger_sql.h"
+
+static bool writeAll(int fd, const void *data, std::size_t n) {
+    const char *p = static_cast<const char*>(data);
+    while (n > 0) {
+        ssize_t w = ::write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= static_cast<std::size_t>(w);
+    }
+    return true;
+}
+
+LedgerEngine::LedgerEngine(ConnectionPool &pool, const LedgerOptions &options)
+    : pool(pool), options(options), fd(-1), keys_fd(-1), chunks(new std::atomic<AccountSlot*>[CHUNK_COUNT]),
+      snapshots(!options.snapshot_path.empty()), old_wal_path(options.wal_path + ".old"),
+      keys_path(options.wal_path + ".keys"), old_keys_path(options.wal_path + ".keys.old"), ring(new RingEntry[RING_SIZE]) {
+    for (std::size_t i = 0; i < CHUNK_COUNT; ++i) chunks[i].store(nullptr, std::memory_order_relaxed);
+    if (this->options.flush_batch == 0) this->options.flush_batch = 1;
+    if (this->options.snapshot_interval_s <= 0) this->options.snapshot_interval_s = 1;
+    fd = ::open(options.wal_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) throw std::runtime_error("cannot open WAL " + options.wal_path + ": " + std::strerror(errno));
+    keys_fd = ::open(keys_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (keys_fd < 0) {
+        ::close(fd);
+        throw std::runtime_error("cannot open WAL keys " + keys_path + ": " + std::strerror(errno));
+    }
+    try {
+        std::vector<WalRecord> records;
+        recover(records);
+        loadBalances(records);
+        resetWal();
+    } catch (...) {
+        ::close(fd);
+        ::close(keys_fd);
+        for (std::size_t i = 0; i < CHUNK_COUNT; ++i) delete[] chunks[i].load(std::memory_order_relaxed);
+        throw;
+    }
+    writer = std::thread([this] { writerLoop(); });
+    flusher = std::thread([this] { flusherLoop(); });
+    if (snapshots) snapshotter = std::thread([this] { snapshotLoop(); });
+}
+
+LedgerEngine::~LedgerEngine() {
+    if (snapshotter.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stop_snapshotter = true;
+        }
+        snapshot_wake.notify_all();
+        snapshotter.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(wal_wake_mu);
+        stop_writer = true;
+    }
+    wal_wake.notify_all();
+    writer.join();
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stop_flusher = true;
+    }
+    flush_wake.notify_all();
+    flusher.join();
+    // Nothing runs any more, so memory holds exactly the durable records. The
+    // WAL can only go if MySQL has all of them too.
+    if (snapshots && !failed && snapshotFromMemory(durable_lsn) && applied_lsn == durable_lsn) {
+        try { resetWal(); } catch (std::runtime_error &e) { std::cerr << "[ledger] " << e.what() << std::endl; }
+    }
+    ::close(fd);
+    ::close(keys_fd);
+    for (std::size_t i = 0; i < CHUNK_COUNT; ++i) delete[] chunks[i].load(std::memory_order_relaxed);
+}
+
+// A record that fails its checksum, or breaks LSN order, marks the end of
+// what was fully written before a crash. A file from before WalHeader holds
+// 32-byte records without posted_at; they are read as posted when flushed.
+void LedgerEngine::readWal(int fd, std::vector<WalRecord> &out, std::uint64_t &prev) {
+    WalHeader h;
+    if (::pread(fd, &h, sizeof(h), 0) == static_cast<ssize_t>(sizeof(h)) && h.magic == WAL_MAGIC) {
+        if (h.crc != crc32(&h, offsetof(WalHeader, crc)) || h.record_size != sizeof(WalRecord))
+            throw std::runtime_error("WAL header not understood; drain the WAL with the build that wrote it");
+        WalRecord rec;
+        off_t offset = sizeof(h);
+        while (::pread(fd, &rec, sizeof(rec), offset) == static_cast<ssize_t>(sizeof(rec))) {
+            if (rec.crc != crc32(&rec, offsetof(WalRecord, crc)) || rec.lsn <= prev) break;
+            out.push_back(rec);
+            prev = rec.lsn;
+            offset += sizeof(rec);
+        }
+        return;
+    }
+    LegacyWalRecord old;
+    off_t offset = 0;
+    while (::pread(fd, &old, sizeof(old), offset) == static_cast<ssize_t>(sizeof(old))) {
+        if (old.crc != crc32(&old, offsetof(LegacyWalRecord, crc)) || old.lsn <= prev) break;
+        WalRecord rec;
+        std::memset(&rec, 0, sizeof(rec));
+        rec.lsn = old.lsn;
+        rec.cents = old.cents;
+        rec.account_id = old.account_id;
+        rec.to_account_id = old.to_account_id;
+        rec.kind = old.kind;
+        rec.keyed = old.keyed;
+        out.push_back(rec);
+        prev = rec.lsn;
+        offset += sizeof(old);
+    }
+}
+
+// Called on an empty file, before any record.
+bool LedgerEngine::writeWalHeader(int fd) {
+    WalHeader h;
+    h.magic = WAL_MAGIC;
+    h.record_size = sizeof(WalRecord);
+    h.crc = crc32(&h, offsetof(WalHeader, crc));
+    return writeAll(fd, &h, sizeof(h));
+}
+
+// Keys are only looked up by LSN, so a torn tail just ends the file; its
+// records were not durable either.
+void LedgerEngine::readKeys(int fd, KeysByLsn &out) {
+    KeyEntry entry;
+    off_t offset = 0;
+    while (::pread(fd, &entry, sizeof(entry), offset) == static_cast<ssize_t>(sizeof(entry))) {
+        if (entry.length > 1024) break;
+        std::string key(entry.length, '\0');
+        if (::pread(fd, &key[0], entry.length, offset + sizeof(entry)) != static_cast<ssize_t>(entry.length)) break;
+        if (entry.crc != crc32(key.data(), key.size(), crc32(&entry, offsetof(KeyEntry, crc)))) break;
+        out[entry.lsn] = key;
+        offset += sizeof(entry) + entry.length;
+    }
+}
+
+// Reads the WAL (the rotated file first, if a compaction did not finish),
+// drops a torn tail, and pushes every record MySQL has not seen yet.
+// Afterwards MySQL holds the full state; records keeps every valid record.
+void LedgerEngine::recover(std::vector<WalRecord> &records) {
+    {
+        auto conn = pool.acquire();
+        std::unique_ptr<sql::Statement> st(conn->createStatement());
+        std::unique_ptr<sql::ResultSet> rs(st->executeQuery("SELECT applied_lsn FROM ledger_checkpoint WHERE id = 1"));
+        if (!rs->next()) throw std::runtime_error("ledger_checkpoint row missing; run db.sql");
+        applied_lsn = static_cast<std::uint64_t>(rs->getInt64(1));
+    }
+
+    std::uint64_t prev = 0;
+    int old_fd = ::open(old_wal_path.c_str(), O_RDONLY);
+    if (old_fd >= 0) {
+        readWal(old_fd, records, prev);
+        ::close(old_fd);
+    }
+    readWal(fd, records, prev);
+    KeysByLsn keys;
+    int old_keys_fd = ::open(old_keys_path.c_str(), O_RDONLY);
+    if (old_keys_fd >= 0) {
+        readKeys(old_keys_fd, keys);
+        ::close(old_keys_fd);
+    }
+    readKeys(keys_fd, keys);
+    std::vector<WalRecord> replay;
+    for (const WalRecord &rec : records) {
+        if (rec.lsn > applied_lsn) replay.push_back(rec);
+    }
+    const std::uint64_t last_lsn = std::max(prev, applied_lsn);
+    taken_lsn = last_lsn;
+    for (std::size_t i = 0; i < replay.size(); i += options.flush_batch) {
+        std::vector<WalRecord> chunk(replay.begin() + i,
+                                     replay.begin() + std::min(replay.size(), i + options.flush_batch));
+        if (!writeToMySQL(chunk, keys)) throw std::runtime_error("WAL replay into MySQL failed");
+        applied_lsn = chunk.back().lsn;
+    }
+    next_lsn = last_lsn + 1;
+    durable_lsn = last_lsn;
+    if (!replay.empty()) std::cerr << "[ledger] replayed " << replay.size() << " WAL records" << std::endl;
+}
+
+// The WAL is only emptied once balances are loaded: with snapshots on, the
+// records after the snapshot are part of the state being loaded.
+void LedgerEngine::resetWal() {
+    std::lock_guard<std::mutex> wal(wal_mu);
+    if (::ftruncate(fd, 0) != 0 || !writeWalHeader(fd) || ::fsync(fd) != 0 || ::ftruncate(keys_fd, 0) != 0 ||
+        ::fsync(keys_fd) != 0)
+        throw std::runtime_error(std::string("cannot reset WAL: ") + std::strerror(errno));
+    ::unlink(old_wal_path.c_str());
+    ::unlink(old_keys_path.c_str());
+}
+
+void LedgerEngine::loadBalances(const std::vector<WalRecord> &records) {
+    if (snapshots && loadSnapshot(records)) {
+        // accounts the snapshot already holds are not read again
+    } else {
+        auto conn = pool.acquire();
+        std::unique_ptr<sql::Statement> st(conn->createStatement());
+        std::unique_ptr<sql::ResultSet> rs(st->executeQuery(
+            "SELECT account_id, customer_id, account_type + 0, " SQL_BALANCE_CENTS " FROM accounts"));
+        while (rs->next()) {
+            AccountSlot *s = slot(rs->getInt(1), true);
+            if (!s) continue;
+            s->cents.store(rs->getInt64(4), std::memory_order_relaxed);
+            s->customer_id = rs->getInt(2);
+            s->type_code = static_cast<std::uint8_t>(rs->getInt(3));
+            s->exists.store(true, std::memory_order_release);
+        }
+    }
+    if (snapshots && !snapshotFromMemory(durable_lsn)) {
+        // an old snapshot must not outlive the WAL records it depends on
+        std::cerr << "[ledger] cannot write snapshot " << options.snapshot_path << "; snapshots off" << std::endl;
+        ::unlink(options.snapshot_path.c_str());
+        snapshots = false;
+    }
+}
+
+// Usable only if the WAL holds every record from the snapshot's LSN on.
+// Accounts are taken from the snapshot and brought forward by the WAL tail;
+// accounts created after it (ids above its last one) come from MySQL, whose
+// rows already include their WAL records.
+bool LedgerEngine::loadSnapshot(const std::vector<WalRecord> &records) {
+    std::unique_ptr<AccountSnapshot> snap;
+    try {
+        snap.reset(new AccountSnapshot(options.snapshot_path));
+    } catch (std::runtime_error &e) {
+        std::cerr << "[ledger] " << e.what() << "; loading balances from MySQL" << std::endl;
+        return false;
+    }
+    std::uint64_t expect = snap->lsn() + 1;
+    for (const WalRecord &rec : records) {
+        if (rec.lsn < expect) continue;
+        if (rec.lsn != expect) break;
+        ++expect;
+    }
+    if (expect != durable_lsn + 1) {
+        std::cerr << "[ledger] snapshot at LSN " << snap->lsn() << " is not covered by the WAL (last LSN "
+                  << durable_lsn << "); loading balances from MySQL" << std::endl;
+        return false;
+    }
+
+    // the file names its own codes; map them onto AccountType
+    std::vector<std::uint8_t> codes(snap->typeCount());
+    for (std::size_t t = 0; t < codes.size(); ++t) {
+        AccountType type;
+        parseAccountType(snap->typeName(static_cast<std::uint8_t>(t)), type);
+        codes[t] = static_cast<std::uint8_t>(type);
+    }
+    const std::size_t n = snap->size();
+    const std::int32_t *ids = snap->ids(), *customers = snap->customerIds();
+    const std::uint8_t *types = snap->typeCodes();
+    const std::int64_t *cents = snap->balanceCents();
+    for (std::size_t i = 0; i < n; ++i) {
+        AccountSlot *s = slot(ids[i], true);
+        if (!s) continue;
+        s->cents.store(cents[i], std::memory_order_relaxed);
+        s->customer_id = customers[i];
+        s->type_code = types[i] < codes.size() ? codes[types[i]] : 0;
+        s->exists.store(true, std::memory_order_release);
+    }
+    // durable records were checked when they were made; apply them as they are
+    std::size_t replayed = 0;
+    for (const WalRecord &rec : records) {
+        if (rec.lsn <= snap->lsn() || rec.kind == REC_VOID) continue;
+        AccountSlot *a = slot(rec.account_id, false);
+        AccountSlot *b = rec.kind == REC_TRANSFER ? slot(rec.to_account_id, false) : nullptr;
+        if (a) a->cents.fetch_add(rec.kind == REC_DEPOSIT ? rec.cents : -rec.cents, std::memory_order_relaxed);
+        if (b) b->cents.fetch_add(rec.cents, std::memory_order_relaxed);
+        ++replayed;
+    }
+
+    auto conn = pool.acquire();
+    sql::PreparedStatement *ps = conn.prepare(
+        "SELECT account_id, customer_id, account_type + 0, " SQL_BALANCE_CENTS " FROM accounts WHERE account_id > ?");
+    ps->setInt(1, n ? ids[n - 1] : 0);
+    std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+    std::size_t added = 0;
+    while (rs->next()) {
+        AccountSlot *s = slot(rs->getInt(1), true);
+        if (!s) continue;
+        s->cents.store(rs->getInt64(4), std::memory_order_relaxed);
+        s->customer_id = rs->getInt(2);
+        s->type_code = static_cast<std::uint8_t>(rs->getInt(3));
+        s->exists.store(true, std::memory_order_release);
+        ++added;
+    }
+    std::cerr << "[ledger] loaded " << n << " accounts from snapshot at LSN " << snap->lsn() << ", replayed "
+              << replayed << " WAL records, " << added << " newer accounts from MySQL" << std::endl;
+    return true;
+}
+
+std::uint64_t LedgerEngine::exportColumns(SnapshotColumns &cols) {
+    const std::uint64_t lsn = durable_lsn;
+    for (std::size_t t = 0; t < ACCOUNT_TYPE_COUNT; ++t) cols.type_names.push_back(toString(static_cast<AccountType>(t)));
+    for (std::size_t c = 0; c < CHUNK_COUNT; ++c) {
+        AccountSlot *chunk = chunks[c].load(std::memory_order_acquire);
+        if (!chunk) continue;
+        for (std::size_t i = 0; i < CHUNK_SIZE; ++i) {
+            const AccountSlot &s = chunk[i];
+            if (!s.exists.load(std::memory_order_acquire)) continue;
+            cols.ids.push_back(static_cast<std::int32_t>((c << CHUNK_BITS) | i));
+            cols.customer_ids.push_back(s.customer_id);
+            cols.type_codes.push_back(s.type_code);
+            cols.balance_cents.push_back(s.cents.load(std::memory_order_relaxed));
+        }
+    }
+    return lsn;
+}
+
+// Only called while nothing else changes balances: at startup and shutdown.
+bool LedgerEngine::snapshotFromMemory(std::uint64_t lsn) {
+    SnapshotColumns cols;
+    exportColumns(cols);
+    return AccountSnapshot::write(options.snapshot_path, lsn, cols);
+}
+
+// Rotates the WAL, then folds the rotated file into the current snapshot
+// without touching live balances: the snapshot's accounts plus every record
+// up to the rotation point give the state at that point. Leaves the rotated
+// file in place if anything fails; the next round retries it. The file is
+// also kept until the flusher has checkpointed its last record in MySQL:
+// recovery replays MySQL from the WAL, and the snapshot cannot stand in.
+void LedgerEngine::compact() {
+    if (::access(old_wal_path.c_str(), F_OK) != 0) {
+        std::lock_guard<std::mutex> wal(wal_mu);
+        if (::rename(options.wal_path.c_str(), old_wal_path.c_str()) != 0) {
+            std::cerr << "[ledger] WAL rotation failed: " << std::strerror(errno) << std::endl;
+            return;
+        }
+        int fresh = ::open(options.wal_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fresh < 0 || !writeWalHeader(fresh)) {
+            std::cerr << "[ledger] WAL rotation failed: " << std::strerror(errno) << std::endl;
+            if (fresh >= 0) ::close(fresh);
+            ::rename(old_wal_path.c_str(), options.wal_path.c_str());
+            return;
+        }
+        ::close(fd);
+        fd = fresh;
+        // Keys follow their records; if this fails they stay in the current
+        // file, which recovery reads as well.
+        int fresh_keys = -1;
+        if (::rename(keys_path.c_str(), old_keys_path.c_str()) == 0 &&
+            (fresh_keys = ::open(keys_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+            ::rename(old_keys_path.c_str(), keys_path.c_str());
+        if (fresh_keys >= 0) {
+            ::close(keys_fd);
+            keys_fd = fresh_keys;
+        }
+    }
+
+    std::vector<WalRecord> records;
+    std::uint64_t prev = 0;
+    int old_fd = ::open(old_wal_path.c_str(), O_RDONLY);
+    if (old_fd < 0) return;
+    readWal(old_fd, records, prev);
+    ::close(old_fd);
+    try {
+        AccountSnapshot base(options.snapshot_path);
+        if (!records.empty() && records.front().lsn > base.lsn() + 1) {
+            std::cerr << "[ledger] WAL does not continue snapshot at LSN " << base.lsn() << std::endl;
+            return;
+        }
+        SnapshotColumns cols;
+        const std::size_t n = base.size();
+        cols.ids.assign(base.ids(), base.ids() + n);
+        cols.customer_ids.assign(base.customerIds(), base.customerIds() + n);
+        cols.type_codes.assign(base.typeCodes(), base.typeCodes() + n);
+        cols.balance_cents.assign(base.balanceCents(), base.balanceCents() + n);
+        for (std::size_t t = 0; t < base.typeCount(); ++t) cols.type_names.push_back(base.typeName(static_cast<std::uint8_t>(t)));
+        std::uint64_t lsn = base.lsn();
+        for (const WalRecord &rec : records) {
+            lsn = std::max(lsn, rec.lsn);
+            if (rec.lsn <= base.lsn() || rec.kind == REC_VOID) continue;
+            std::ptrdiff_t a = base.find(rec.account_id);
+            std::ptrdiff_t b = rec.kind == REC_TRANSFER ? base.find(rec.to_account_id) : -1;
+            if (a >= 0) cols.balance_cents[a] += rec.kind == REC_DEPOSIT ? rec.cents : -rec.cents;
+            if (b >= 0) cols.balance_cents[b] += rec.cents;
+        }
+        // a file held back for MySQL was folded on an earlier round already
+        if (lsn != base.lsn() && !AccountSnapshot::write(options.snapshot_path, lsn, cols)) {
+            std::cerr << "[ledger] snapshot write failed" << std::endl;
+            return;
+        }
+    } catch (std::runtime_error &e) {
+        std::cerr << "[ledger] " << e.what() << std::endl;
+        return;
+    }
+    const std::uint64_t last = records.empty() ? 0 : records.back().lsn;
+    std::uint64_t applied;
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        applied = applied_lsn;
+    }
+    if (applied < last) {
+        std::cerr << "[ledger] keeping " << old_wal_path << " until MySQL has LSN " << last << " (applied "
+                  << applied << ")" << std::endl;
+        return;
+    }
+    ::unlink(old_wal_path.c_str());
+    ::unlink(old_keys_path.c_str());
+}
+
+void LedgerEngine::snapshotLoop() {
+    const auto interval = std::chrono::seconds(options.snapshot_interval_s);
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mu);
+            if (snapshot_wake.wait_for(lock, interval, [this] { return stop_snapshotter; })) return;
+        }
+        compact();
+    }
+}
+
+LedgerEngine::AccountSlot* LedgerEngine::slot(int account_id, bool create) {
+    if (account_id <= 0) return nullptr;
+    std::size_t id = static_cast<std::size_t>(account_id);
+    std::atomic<AccountSlot*> &entry = chunks[id >> CHUNK_BITS];
+    AccountSlot *chunk = entry.load(std::memory_order_acquire);
+    if (!chunk) {
+        if (!create) return nullptr;
+        AccountSlot *fresh = new AccountSlot[CHUNK_SIZE];
+        if (entry.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) chunk = fresh;
+        else delete[] fresh;  // another thread installed the chunk first; chunk now points at it
+    }
+    AccountSlot *s = &chunk[id & (CHUNK_SIZE - 1)];
+    if (!create && !s->exists.load(std::memory_order_acquire)) return nullptr;
+    return s;
+}
+
+bool LedgerEngine::credit(AccountSlot &s, std::int64_t cents) {
+    std::int64_t cur = s.cents.load(std::memory_order_relaxed), next;
+    do {
+        if (__builtin_add_overflow(cur, cents, &next)) return false;
+    } while (!s.cents.compare_exchange_weak(cur, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+    return true;
+}
+
+bool LedgerEngine::debit(AccountSlot &s, std::int64_t cents) {
+    std::int64_t cur = s.cents.load(std::memory_order_relaxed);
+    do {
+        if (cur < cents) return false;
+    } while (!s.cents.compare_exchange_weak(cur, cur - cents, std::memory_order_acq_rel, std::memory_order_relaxed));
+    return true;
+}
+
+bool LedgerEngine::balance(int account_id, Money &out) {
+    AccountSlot *s = slot(account_id, false);
+    if (!s) return false;
+    out = Money::fromCents(s->cents.load(std::memory_order_acquire));
+    return true;
+}
+
+void LedgerEngine::addAccount(int account_id, int customer_id, AccountType type) {
+    if (AccountSlot *s = slot(account_id, true)) {
+        s->customer_id = customer_id;
+        s->type_code = static_cast<std::uint8_t>(type);
+        s->exists.store(true, std::memory_order_release);
+    }
+}
+
+std::uint64_t LedgerEngine::takeLsn() {
+    return next_lsn.fetch_add(1, std::memory_order_seq_cst);
+}
+
+// Hands rec, whose LSN is taken, to the writer through the ring; the writer
+// stamps posted_at and the crc.
+void LedgerEngine::publish(WalRecord &rec, const std::string &key) {
+    if (rec.kind == REC_VOID) rec.keyed = 0;
+    while (rec.lsn > taken_lsn.load(std::memory_order_acquire) + RING_SIZE) std::this_thread::yield();
+    RingEntry &e = ring[rec.lsn & (RING_SIZE - 1)];
+    e.rec = rec;
+    if (rec.keyed) e.key = key;
+    e.lsn.store(rec.lsn, std::memory_order_seq_cst);
+}
+
+// Applies rec and gives it an LSN; see the class comment for which comes
+// first. A rejected operation publishes nothing unless it already had an LSN.
+OperationResult LedgerEngine::applyAndLog(WalRecord &rec, const std::string &key) {
+    AccountSlot *a = slot(rec.account_id, false);
+    if (!a) return OperationResult::REJECTED;
+    if (rec.kind == REC_WITHDRAW) {
+        if (!debit(*a, rec.cents)) return OperationResult::REJECTED;
+        rec.lsn = takeLsn();
+        publish(rec, key);
+        return OperationResult::APPLIED;
+    }
+    if (rec.kind == REC_DEPOSIT) {
+        rec.lsn = takeLsn();
+        bool ok = credit(*a, rec.cents);
+        if (!ok) rec.kind = REC_VOID;
+        publish(rec, key);
+        return ok ? OperationResult::APPLIED : OperationResult::REJECTED;
+    }
+
+    AccountSlot *b = slot(rec.to_account_id, false);
+    if (!b || b == a) return OperationResult::REJECTED;
+    AccountSlot *first = rec.account_id < rec.to_account_id ? a : b;
+    AccountSlot *second = first == a ? b : a;
+    std::lock_guard<std::mutex> l1(first->transfer_mu);
+    std::lock_guard<std::mutex> l2(second->transfer_mu);
+    if (!debit(*a, rec.cents)) return OperationResult::REJECTED;
+    rec.lsn = takeLsn();  // after the debit, before the credit
+    bool ok = credit(*b, rec.cents);
+    if (!ok) {
+        a->cents.fetch_add(rec.cents, std::memory_order_acq_rel);
+        rec.kind = REC_VOID;
+    }
+    publish(rec, key);
+    return ok ? OperationResult::APPLIED : OperationResult::REJECTED;
+}
+
+// Only used after a failed WAL write, to take back what submit() applied.
+void LedgerEngine::undoInMemory(const WalRecord &rec) {
+    if (rec.kind == REC_VOID) return;
+    AccountSlot *a = slot(rec.account_id, false);
+    if (!a) return;
+    if (rec.kind == REC_DEPOSIT) a->cents.fetch_sub(rec.cents, std::memory_order_acq_rel);
+    else a->cents.fetch_add(rec.cents, std::memory_order_acq_rel);
+    if (rec.kind == REC_TRANSFER) {
+        if (AccountSlot *b = slot(rec.to_account_id, false)) b->cents.fetch_sub(rec.cents, std::memory_order_acq_rel);
+    }
+}
+
+OperationResult LedgerEngine::submit(const Operation &op, const std::string &key, std::uint64_t &lsn) {
+    lsn = 0;
+    if (op.amount <= Money()) return OperationResult::REJECTED;
+    WalRecord rec;
+    std::memset(&rec, 0, sizeof(rec));
+    rec.cents = op.amount.cents();
+    rec.account_id = op.account_id;
+    rec.to_account_id = op.kind == Operation::TRANSFER ? op.to_account_id : 0;
+    rec.kind = op.kind == Operation::DEPOSIT ? REC_DEPOSIT : op.kind == Operation::WITHDRAW ? REC_WITHDRAW : REC_TRANSFER;
+    rec.keyed = key.empty() ? 0 : 1;
+
+    // in_submit keeps the writer from exiting while this call may still
+    // publish; it is raised before the stop check (see writerLoop()).
+    in_submit.fetch_add(1, std::memory_order_seq_cst);
+    OperationResult r = failed || stop_writer ? OperationResult::FAILED : applyAndLog(rec, key);
+    in_submit.fetch_sub(1, std::memory_order_seq_cst);
+    if (writer_idle.load(std::memory_order_seq_cst) && (rec.lsn != 0 || stop_writer)) {
+        std::lock_guard<std::mutex> lock(wal_wake_mu);
+        wal_wake.notify_one();
+    }
+    if (r == OperationResult::APPLIED) lsn = rec.lsn;
+    return r;
+}
+
+bool LedgerEngine::waitDurable(std::uint64_t lsn) {
+    Waiters &w = waiters[lsn % WAITER_SHARDS];
+    std::unique_lock<std::mutex> lock(w.mu);
+    w.durable.wait(lock, [&] { return durable_lsn >= lsn || failed; });
+    return durable_lsn >= lsn;
+}
+
+OperationResult LedgerEngine::apply(const Operation &op, const std::string &key) {
+    std::uint64_t lsn;
+    OperationResult r = submit(op, key, lsn);
+    if (r == OperationResult::APPLIED && !waitDurable(lsn)) r = OperationResult::FAILED;
+    if (r != OperationResult::APPLIED && !key.empty()) releaseKey(key);
+    return r;
+}
+
+bool LedgerEngine::holdKey(const std::string &key) {
+    KeyShard &s = keyShard(key);
+    std::unique_lock<std::mutex> lock(s.mu);
+    while (true) {
+        auto it = s.keys.find(key);
+        if (it == s.keys.end()) {
+            s.keys.emplace(key, KeyState::HELD);
+            return true;
+        }
+        if (it->second == KeyState::LOGGED) return false;
+        s.released.wait(lock);
+    }
+}
+
+void LedgerEngine::releaseKey(const std::string &key) {
+    KeyShard &s = keyShard(key);
+    {
+        std::lock_guard<std::mutex> lock(s.mu);
+        s.keys.erase(key);
+    }
+    s.released.notify_all();
+}
+
+std::vector<OperationResult> LedgerEngine::applyBatch(const std::vector<Operation> &ops) {
+    std::vector<OperationResult> results(ops.size());
+    std::vector<std::uint64_t> lsns(ops.size(), 0);
+    std::uint64_t last = 0;
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        results[i] = submit(ops[i], std::string(), lsns[i]);
+        last = std::max(last, lsns[i]);
+    }
+    if (last == 0 || waitDurable(last)) return results;
+    const std::uint64_t durable = durable_lsn;
+    for (std::size_t i = 0; i < ops.size(); ++i)
+        if (lsns[i] > durable) results[i] = OperationResult::FAILED;
+    return results;
+}
+
+// Takes the published records after taken_lsn, stopping at the first LSN
+// whose caller has not published yet. Once no caller is inside submit() after
+// stop_writer is set, every LSN taken has been published and written.
+void LedgerEngine::writerLoop() {
+    std::vector<WalRecord> batch;
+    std::vector<std::pair<std::uint64_t, std::string>> batch_keys;
+    while (true) {
+        std::uint64_t next = taken_lsn + 1;
+        for (RingEntry *e = &ring[next & (RING_SIZE - 1)]; e->lsn.load(std::memory_order_acquire) == next;
+             e = &ring[next & (RING_SIZE - 1)]) {
+            batch.push_back(e->rec);
+            if (e->rec.keyed) batch_keys.emplace_back(next, e->key);
+            ++next;
+        }
+        if (batch.empty()) {
+            std::unique_lock<std::mutex> lock(wal_wake_mu);
+            writer_idle = true;
+            auto ready = [&] {
+                return ring[next & (RING_SIZE - 1)].lsn.load(std::memory_order_seq_cst) == next ||
+                       (stop_writer && in_submit == 0);
+            };
+            wal_wake.wait(lock, ready);
+            writer_idle = false;
+            if (stop_writer && in_submit == 0 && next == next_lsn) return;
+            continue;
+        }
+        taken_lsn.store(batch.back().lsn, std::memory_order_release);
+        // one clock read per batch, never going back, so posting order is LSN order
+        last_posted_at = std::max(last_posted_at, static_cast<std::int64_t>(std::time(nullptr)));
+        for (WalRecord &rec : batch) {
+            rec.posted_at = last_posted_at;
+            rec.crc = crc32(&rec, offsetof(WalRecord, crc));
+        }
+
+        bool ok = false;
+        if (!failed) {
+            std::lock_guard<std::mutex> wal(wal_mu);
+            ok = writeKeys(batch_keys) && writeAll(fd, batch.data(), batch.size() * sizeof(WalRecord)) &&
+                 ::fdatasync(fd) == 0;
+            if (!ok) std::cerr << "[ledger] WAL write failed: " << std::strerror(errno) << std::endl;
+        }
+        if (!ok) {
+            for (auto &rec : batch) undoInMemory(rec);
+            failed = true;
+        } else {
+            // LOGGED before the flusher can see the records, which releases them
+            for (auto &k : batch_keys) {
+                KeyShard &ks = keyShard(k.second);
+                {
+                    std::lock_guard<std::mutex> lock(ks.mu);
+                    ks.keys[k.second] = KeyState::LOGGED;
+                }
+                ks.released.notify_all();
+            }
+            std::lock_guard<std::mutex> lock(mu);
+            durable_lsn = batch.back().lsn;
+            unapplied.insert(unapplied.end(), batch.begin(), batch.end());
+            for (auto &k : batch_keys) unapplied_keys.emplace(k.first, std::move(k.second));
+        }
+        for (Waiters &w : waiters) {
+            std::lock_guard<std::mutex> lock(w.mu);
+            w.durable.notify_all();
+        }
+        batch.clear();
+        batch_keys.clear();
+    }
+}
+
+// Called with wal_mu held, before the records are written.
+bool LedgerEngine::writeKeys(const std::vector<std::pair<std::uint64_t, std::string>> &keys) {
+    if (keys.empty()) return true;
+    std::string buf;
+    for (auto &k : keys) {
+        KeyEntry entry;
+        entry.lsn = k.first;
+        entry.length = static_cast<std::uint32_t>(k.second.size());
+        entry.crc = crc32(k.second.data(), k.second.size(), crc32(&entry, offsetof(KeyEntry, crc)));
+        buf.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        buf += k.second;
+    }
+    return writeAll(keys_fd, buf.data(), buf.size()) && ::fdatasync(keys_fd) == 0;
+}
+
+// One MySQL transaction: net balance change per account (in account_id order,
+// so concurrent flushes cannot deadlock), the ledger rows, the idempotency
+// keys, and the checkpoint.
+bool LedgerEngine::writeToMySQL(const std::vector<WalRecord> &records, const KeysByLsn &keys) {
+    ConnectionPool::Lease conn;
+    try {
+        std::map<int, Money> deltas;
+        std::vector<LedgerRow> rows;
+        std::vector<std::string> idem;
+        rows.reserve(records.size() * 2);
+        for (auto &rec : records) {
+            if (rec.keyed) {
+                auto k = keys.find(rec.lsn);
+                if (k != keys.end()) idem.push_back(k->second);
+                else std::cerr << "[ledger] key of LSN " << rec.lsn << " missing from " << keys_path << std::endl;
+            }
+            Money amount = Money::fromCents(rec.cents);
+            const std::size_t first = rows.size();
+            if (rec.kind == REC_VOID) {
+                continue;
+            } else if (rec.kind == REC_DEPOSIT) {
+                deltas[rec.account_id] += amount;
+                rows.push_back(LedgerRow{rec.account_id, TransactionType::DEPOSIT, amount, "Deposit via app"});
+            } else if (rec.kind == REC_WITHDRAW) {
+                deltas[rec.account_id] -= amount;
+                rows.push_back(LedgerRow{rec.account_id, TransactionType::WITHDRAW, amount, "Withdrawal via app"});
+            } else {
+                deltas[rec.account_id] -= amount;
+                deltas[rec.to_account_id] += amount;
+                rows.push_back(LedgerRow{rec.account_id, TransactionType::TRANSFER, amount, transferDetails("to", rec.to_account_id)});
+                rows.push_back(LedgerRow{rec.to_account_id, TransactionType::DEPOSIT, amount, transferDetails("from", rec.account_id)});
+            }
+            for (std::size_t i = first; i < rows.size(); ++i) rows[i].posted_at = rec.posted_at;
+        }
+
+        conn = pool.acquire();
+        conn->setAutoCommit(false);
+        for (auto &d : deltas) {
+            if (d.second == Money()) continue;
+            sql::PreparedStatement *ps = conn.prepare(SQL_CREDIT);
+            ps->setInt64(1, d.second.cents());
+            ps->setInt(2, d.first);
+            conn.execute(ps);
+        }
+        fillBalancesAfter(conn, rows);
+        insertLedgerRows(conn, rows, 100);
+        addDailyRollups(conn, rows);
+        insertIdempotencyKeys(conn, idem, 100);
+        sql::PreparedStatement *cp = conn.prepare("UPDATE ledger_checkpoint SET applied_lsn = ? WHERE id = 1");
+        cp->setInt64(1, static_cast<std::int64_t>(records.back().lsn));
+        conn.execute(cp);
+        conn.commit();
+        conn->setAutoCommit(true);
+        return true;
+    } catch (sql::SQLException &e) {
+        std::cerr << "[ledger flush error] " << e.what() << std::endl;
+        if (conn) {
+            try {
+                conn.rollback();
+                conn->setAutoCommit(true);
+            } catch (...) {
+            }
+        }
+        return false;
+    }
+}
+
+// The WAL only has to cover records MySQL does not have yet; once everything
+// issued so far is applied, the file can start over. With snapshots it also
+// has to cover the snapshot, and compact() rotates it instead.
+void LedgerEngine::truncateIfDrained() {
+    if (snapshots) return;
+    std::lock_guard<std::mutex> wal(wal_mu);
+    std::lock_guard<std::mutex> lock(mu);
+    if (applied_lsn + 1 != next_lsn) return;
+    if (::ftruncate(fd, sizeof(WalHeader)) != 0 || ::ftruncate(keys_fd, 0) != 0)
+        std::cerr << "[ledger] WAL truncate failed: " << std::strerror(errno) << std::endl;
+}
+
+void LedgerEngine::flusherLoop() {
+    const auto interval = std::chrono::milliseconds(options.flush_interval_ms);
+    std::vector<WalRecord> batch;
+    KeysByLsn keys;
+    bool backlog = false;  // last round left records behind; go again without waiting
+    while (true) {
+        bool draining;
+        {
+            std::unique_lock<std::mutex> lock(mu);
+            if (!backlog) flush_wake.wait_for(lock, interval, [this] { return stop_flusher; });
+            draining = stop_flusher;
+            std::size_t n = std::min(unapplied.size(), options.flush_batch);
+            batch.assign(unapplied.begin(), unapplied.begin() + n);
+            keys.clear();
+            for (auto &rec : batch) {
+                if (rec.keyed) keys.emplace(rec.lsn, unapplied_keys[rec.lsn]);
+            }
+            backlog = false;
+        }
+        if (batch.empty()) {
+            if (draining) return;
+            continue;
+        }
+        if (!writeToMySQL(batch, keys)) {
+            if (draining) return;  // records stay in the WAL; recovery replays them
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            unapplied.erase(unapplied.begin(), unapplied.begin() + batch.size());
+            for (auto &k : keys) unapplied_keys.erase(k.first);
+            applied_lsn = batch.back().lsn;
+            backlog = !unapplied.empty();
+        }
+        for (auto &k : keys) releaseKey(k.second);  // idempotency_keys answers from here on
+        truncateIfDrained();
+    }
+}
+
+// -------------------- src/string_arena.h --------------------
+
+#ifndef STRING_ARENA_H
+#define STRING_ARENA_H
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Bump allocator for the string fields of one batch of decoded rows. Views
+// handed out stay valid until reset(). reset() folds all blocks into one big
+// enough for the batch just seen, so a steady-state scan stops allocating
+// after its first batch.
+class StringArena {
+public:
+    explicit StringArena(std::size_t block_size = 64 * 1024) : block_size(block_size) {}
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+
+    std::string_view copy(const char *data, std::size_t n) {
+        if (n == 0) return std::string_view();
+        if (blocks.empty() || used + n > blocks.back().size) grow(n);
+        char *dst = blocks.back().data.get() + used;
+        std::memcpy(dst, data, n);
+        used += n;
+        return std::string_view(dst, n);
+    }
+
+    std::string_view copy(const std::string &s) { return copy(s.data(), s.size()); }
+
+    void reset() {
+        if (blocks.size() > 1) {
+            std::size_t total = 0;
+            for (const Block &b : blocks) total += b.size;
+            blocks.clear();
+            blocks.push_back(Block{std::unique_ptr<char[]>(new char[total]), total});
+        }
+        used = 0;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        std::size_t size;
+    };
+
+    void grow(std::size_t n) {
+        std::size_t size = n > block_size ? n : block_size;
+        blocks.push_back(Block{std::unique_ptr<char[]>(new char[size]), size});
+        used = 0;
+    }
+
+    std::size_t block_size;
+    std::vector<Block> blocks;
+    std::size_t used = 0;  // bytes taken from blocks.back()
+};
+
+#endif // STRING_ARENA_H
+
+// -------------------- src/bank.cpp --------------------
+
+#include "../include/bank.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+// Include MySQL Connector/C++ headers
+#include <mysql_driver.h>
+#include <mysql_connection.h>
+#include <cppconn/statement.h>
+#include <cppconn/prepared_statement.h>
+#include <cppconn/resultset.h>
+
+#include "../include/change_feed.h"
+#include "../include/eod_report.h"
+#include "account_cache.h"
+#include "account_snapshot.h"
+#include "connection_pool.h"
+#include "idempotency_cache.h"
+#include "ledger_engine.h"
+#include "ledger_sql.h"
+#include "limit_rules.h"
+#include "metrics.h"
+#include "partitions.h"
+#include "string_arena.h"
+
+// Rolls back the open transaction on a business-rule rejection (not an error).
+static bool abandon(ConnectionPool::Lease &conn) {
+    conn.rollback();
+    conn->setAutoCommit(true);
+    return false;
+}
+
+const char *toString(AccountType type) {
+    switch (type) {
+    case AccountType::SAVINGS: return "SAVINGS";
+    case AccountType::CURRENT: return "CURRENT";
+    default: return "";
+    }
+}
+
+const char *toString(TransactionType type) {
+    switch (type) {
+    case TransactionType::DEPOSIT: return "DEPOSIT";
+    case TransactionType::WITHDRAW: return "WITHDRAW";
+    case TransactionType::TRANSFER: return "TRANSFER";
+    default: return "";
+    }
+}
+
+bool parseAccountType(const std::string &text, AccountType &out) {
+    out = AccountType::UNKNOWN;
+    for (std::size_t t = 1; t < ACCOUNT_TYPE_COUNT; ++t) {
+        const char *name = toString(static_cast<AccountType>(t));
+        if (text.size() == std::strlen(name) &&
+            std::equal(text.begin(), text.end(), name, [](char a, char b) { return std::toupper(static_cast<unsigned char>(a)) == b; })) {
+            out = static_cast<AccountType>(t);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Row decoders. Columns are read by position, so each select list feeding a
+// decoder must name its columns in the order listed above the function.
+
+// customer_id, name, email, phone
+static Customer readCustomer(const sql::ResultSet &rs) {
+    Customer c;
+    c.id = rs.getInt(1);
+    c.name = rs.getString(2);
+    c.email = rs.getString(3);
+    c.phone = rs.getString(4);
+    return c;
+}
+
+static CustomerView readCustomerView(const sql::ResultSet &rs, StringArena &arena) {
+    CustomerView c;
+    c.id = rs.getInt(1);
+    c.name = arena.copy(rs.getString(2));
+    c.email = arena.copy(rs.getString(3));
+    c.phone = arena.copy(rs.getString(4));
+    return c;
+}
+
+// account_id, customer_id, account_type + 0, balance_cents
+static Account readAccount(const sql::ResultSet &rs) {
+    Account a;
+    a.id = rs.getInt(1);
+    a.customer_id = rs.getInt(2);
+    a.type = static_cast<AccountType>(rs.getInt(3));
+    a.balance = Money::fromCents(rs.getInt64(4));
+    return a;
+}
+
+// transaction_id, account_id, type + 0, amount_cents, details, created_at, balance_after_cents
+static TransactionRecord readTransaction(const sql::ResultSet &rs) {
+    TransactionRecord t;
+    t.id = rs.getInt64(1);
+    t.account_id = rs.getInt(2);
+    t.type = static_cast<TransactionType>(rs.getInt(3));
+    t.amount = Money::fromCents(rs.getInt64(4));
+    t.details = rs.getString(5);
+    t.created_at = rs.getString(6);
+    t.has_balance_after = !rs.isNull(7);
+    t.balance_after = t.has_balance_after ? Money::fromCents(rs.getInt64(7)) : Money();
+    return t;
+}
+
+static TransactionView readTransactionView(const sql::ResultSet &rs, StringArena &arena) {
+    TransactionView t;
+    t.id = rs.getInt64(1);
+    t.account_id = rs.getInt(2);
+    t.type = static_cast<TransactionType>(rs.getInt(3));
+    t.amount = Money::fromCents(rs.getInt64(4));
+    t.details = arena.copy(rs.getString(5));
+    t.created_at = arena.copy(rs.getString(6));
+    t.has_balance_after = !rs.isNull(7);
+    t.balance_after = t.has_balance_after ? Money::fromCents(rs.getInt64(7)) : Money();
+    return t;
+}
+
+// InnoDB errors after which the whole transaction can be run again as is.
+static bool retryable(const sql::SQLException &e) {
+    return e.getErrorCode() == 1213    // ER_LOCK_DEADLOCK: InnoDB already rolled the transaction back
+        || e.getErrorCode() == 1205;   // ER_LOCK_WAIT_TIMEOUT
+}
+
+static bool deadlocked(const sql::SQLException &e) {
+    return e.getErrorCode() == 1213;
+}
+
+// Full jitter: a uniform sleep in [0, min(max, base * 2^attempt)] so the
+// losers of one deadlock do not collide again in lockstep.
+static void backoff(const RetryOptions &retry, int attempt) {
+    static thread_local std::minstd_rand rng(static_cast<unsigned>(
+        std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+        static_cast<std::size_t>(std::chrono::steady_clock::now().time_since_epoch().count())));
+    long ceiling = static_cast<long>(retry.base_backoff_us) << std::min(attempt, 20);
+    ceiling = std::max(0L, std::min(ceiling, static_cast<long>(retry.max_backoff_us)));
+    std::this_thread::sleep_for(std::chrono::microseconds(std::uniform_int_distribution<long>(0, ceiling)(rng)));
+}
+
+static std::atomic<std::uint64_t> next_bank_id(1);
+
+static const std::size_t MAX_IDEMPOTENCY_KEY = 64;  // idempotency_keys.idem_key
+static const char *const SQL_CLAIM_KEY = "INSERT IGNORE INTO idempotency_keys(idem_key) VALUES(?)";
+static const char *const SQL_KEY_EXISTS = "SELECT 1 FROM idempotency_keys WHERE idem_key = ?";
+
+// key, account, cents, stripe + 1 (deposit) or striped (withdraw); from, to,
+// cents, from striped, to striped, to stripe + 1 (transfer). See db.sql.
+static const char *const SQL_DEPOSIT_FUNDS = "CALL deposit_funds(NULLIF(?,''),?,? / 100,?)";
+static const char *const SQL_WITHDRAW_FUNDS = "CALL withdraw_funds(NULLIF(?,''),?,? / 100,?)";
+static const char *const SQL_TRANSFER_FUNDS = "CALL transfer_funds(NULLIF(?,''),?,?,? / 100,?,?,?)";
+enum PostStatus { POST_APPLIED = 0, POST_DUPLICATE = 1, POST_REJECTED = 2, POST_FAILED = -1 };
+
+static bool validKey(const char *what, const std::string &key) {
+    if (key.size() <= MAX_IDEMPOTENCY_KEY) return true;
+    std::cerr << "[" << what << " error] idempotency key longer than " << MAX_IDEMPOTENCY_KEY << " characters" << std::endl;
+    return false;
+}
+
+// Records key inside the caller's transaction; false if a committed call
+// already holds it. A concurrent call with the same key waits here on the
+// row lock until the first one commits or rolls back.
+static bool claimKey(ConnectionPool::Lease &conn, const std::string &key) {
+    sql::PreparedStatement *ps = conn.prepare(SQL_CLAIM_KEY);
+    ps->setString(1, key);
+    return conn.executeUpdate(ps) == 1;
+}
+
+// The accounts of BankOptions::striping and the stripe each thread credits.
+class Stripes {
+public:
+    explicit Stripes(const StripingOptions &options)
+        : ids(options.accounts.begin(), options.accounts.end()), count(std::max(1, std::min(options.stripes, 255))) {}
+    bool contains(int account_id) const { return !ids.empty() && ids.count(account_id) != 0; }
+    // Threads are dealt stripes round-robin, so up to count of them never share one.
+    int pick() const {
+        static std::atomic<unsigned> next{0};
+        static thread_local unsigned mine = next.fetch_add(1, std::memory_order_relaxed);
+        return static_cast<int>(mine % static_cast<unsigned>(count));
+    }
+private:
+    std::unordered_set<int> ids;
+    int count;
+};
+
+// Adds amount to account_id inside the caller's transaction; false for an
+// unknown account. A striped account is credited on one of its stripes.
+static bool creditAccount(ConnectionPool::Lease &conn, const Stripes &stripes, int account_id, Money amount) {
+    if (stripes.contains(account_id)) {
+        sql::PreparedStatement *ps = conn.prepare(SQL_CREDIT_STRIPE);
+        ps->setInt(1, account_id);
+        ps->setInt(2, stripes.pick());
+        ps->setInt64(3, amount.cents());
+        return conn.executeUpdate(ps) > 0;  // 1 inserted, 2 updated
+    }
+    sql::PreparedStatement *ps = conn.prepare(SQL_CREDIT);
+    ps->setInt64(1, amount.cents());
+    ps->setInt(2, account_id);
+    return conn.executeUpdate(ps) == 1;
+}
+
+// Takes amount from account_id inside the caller's transaction; false for an
+// unknown account or insufficient funds. The balance check is part of the
+// UPDATE, so two concurrent debits cannot both pass it. A striped account's
+// stripes are locked, then folded into its row: the same stripe-then-row
+// order a striped deposit takes its locks in.
+static bool debitAccount(ConnectionPool::Lease &conn, const Stripes &stripes, int account_id, Money amount) {
+    if (stripes.contains(account_id)) {
+        sql::PreparedStatement *lock = conn.prepare(SQL_LOCK_STRIPES);
+        lock->setInt(1, account_id);
+        std::int64_t striped = 0;
+        {
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(lock));
+            if (rs->next()) striped = rs->getInt64(1);
+        }
+        if (striped != 0) {
+            sql::PreparedStatement *clear = conn.prepare(SQL_CLEAR_STRIPES);
+            clear->setInt(1, account_id);
+            conn.execute(clear);
+            sql::PreparedStatement *fold = conn.prepare(SQL_CREDIT);
+            fold->setInt64(1, striped);
+            fold->setInt(2, account_id);
+            conn.execute(fold);
+        }
+    }
+    sql::PreparedStatement *ps = conn.prepare(SQL_DEBIT_GUARDED);
+    ps->setInt64(1, amount.cents());
+    ps->setInt(2, account_id);
+    ps->setInt64(3, amount.cents());
+    return conn.executeUpdate(ps) == 1;
+}
+
+// Writes the ledger row of a posting the caller's transaction has already
+// applied to account_id, with the balance after it and its daily rollup. A
+// credit that went to a stripe has no exact balance after it: it is written
+// without one and rolled up on its own stripe, so it does not queue either.
+static void recordPosting(ConnectionPool::Lease &conn, const Stripes &stripes, int account_id, TransactionType type,
+                          Money amount, const std::string &details) {
+    const bool striped = stripes.contains(account_id);
+    sql::PreparedStatement *ps = conn.prepare(SQL_POST_TRANSACTION);
+    ps->setInt(1, account_id);
+    ps->setString(2, toString(type));
+    ps->setInt64(3, amount.cents());
+    ps->setString(4, details);
+    ps->setBoolean(5, striped);
+    ps->setInt(6, striped && type == TransactionType::DEPOSIT ? stripes.pick() + 1 : 0);  // stripe 0 is the account row's
+    conn.execute(ps);
+}
+
+// Runs a CALL to a procedure that ends by selecting one INT (LAST_INSERT_ID()
+// or a status) and returns it; -1 if it selected nothing.
+static int callForId(ConnectionPool::Lease &conn, sql::PreparedStatement *ps) {
+    int id = -1;
+    {
+        std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+        if (rs->next()) id = rs->getInt(1);
+    }
+    // drain the CALL's trailing status result so the session can run the next statement
+    while (ps->getMoreResults()) std::unique_ptr<sql::ResultSet> extra(ps->getResultSet());
+    return id;
+}
+
+struct Bank::Impl {
+    Metrics metrics;  // before the pools, which record into it
+    ConnectionPool pool;
+    std::vector<std::unique_ptr<ConnectionPool>> replicas;
+    std::atomic<unsigned> next_replica{0};
+    AccountCache cache;
+    IdempotencyCache keys;
+    RetryOptions retry;
+    Stripes stripes;
+    LimitRules limits;
+    std::chrono::milliseconds read_your_writes;
+    const std::uint64_t id;  // keys this Bank in the per-thread last-write map
+    std::unique_ptr<ChangeFeed> own_feed;
+    ChangeFeed *feed;                      // null unless options.feed turns change capture on
+    std::unique_ptr<LedgerEngine> ledger;  // null unless options.ledger.wal_path is set
+    Impl(const std::string &host, const std::string &user, const std::string &pass, const std::string &db,
+         const BankOptions &options)
+        : pool(host, user, pass, db, options.pool, &metrics), cache(options.cache), keys(options.idempotency), retry(options.retry),
+          stripes(options.striping), limits(options.rules), read_your_writes(options.replicas.read_your_writes_ms), id(next_bank_id.fetch_add(1)),
+          feed(options.feed.shared) {
+        if (!feed && options.feed.capacity > 0) {
+            own_feed.reset(new ChangeFeed(options.feed.capacity));
+            feed = own_feed.get();
+        }
+        for (const std::string &replica : options.replicas.hosts) {
+            try {
+                replicas.emplace_back(new ConnectionPool(replica, user, pass, db, options.replicas.pool, &metrics));
+            } catch (sql::SQLException &e) {
+                std::cerr << "[replica error] " << replica << " skipped: " << e.what() << std::endl;
+            }
+        }
+        if (!options.ledger.wal_path.empty()) ledger.reset(new LedgerEngine(pool, options.ledger));
+        if (limits.enabled() && options.rules.warm_start) warmLimits();
+    }
+
+    // Counts the postings of the longest rule window so limits hold across a
+    // restart. Ledger rows do not tell a transfer's credit from a deposit, so
+    // both count as deposits. On error the windows start empty.
+    void warmLimits() {
+        try {
+            auto conn = pool.acquire();
+            sql::PreparedStatement *ps = conn.prepare(
+                "SELECT account_id, type + 0, CAST(amount*100 AS SIGNED), UNIX_TIMESTAMP(created_at) FROM transactions "
+                "WHERE created_at >= FROM_UNIXTIME(?)");
+            ps->setInt64(1, LimitRules::now() - limits.longestWindow());
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+            while (rs->next()) {
+                int type = rs->getInt(2);
+                if (type < 1 || type > 3) continue;
+                limits.record(rs->getInt(1), static_cast<Operation::Kind>(type - 1), Money::fromCents(rs->getInt64(3)),
+                              rs->getInt64(4));
+            }
+        } catch (sql::SQLException &e) {
+            std::cerr << "[limit rules error] warm start skipped: " << e.what() << std::endl;
+        }
+    }
+
+    // False, counted as a rejection, when a limit rule turned the operation down.
+    bool admits(const LimitHold &hold) {
+        if (hold.passed()) return true;
+        metrics.count(C_RULE_REJECTIONS);
+        return false;
+    }
+
+    static std::unordered_map<std::uint64_t, std::chrono::steady_clock::time_point>& lastWrites() {
+        static thread_local std::unordered_map<std::uint64_t, std::chrono::steady_clock::time_point> last;
+        return last;
+    }
+
+    // Called once an operation has committed.
+    void publish(const Operation &op) {
+        if (feed) feed->publish(op.kind, op.account_id, op.kind == Operation::TRANSFER ? op.to_account_id : 0, op.amount);
+    }
+
+    // False, after logging, if idempotency_keys could not be read.
+    bool keyExists(const std::string &key, bool &exists) {
+        try {
+            ConnectionPool::Lease conn = pool.acquire();
+            sql::PreparedStatement *ps = conn.prepare(SQL_KEY_EXISTS);
+            ps->setString(1, key);
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+            exists = rs->next();
+            return true;
+        } catch (sql::SQLException &e) {
+            std::cerr << "[idempotency error] " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    // Result of a call the limits turned down before it reached MySQL: a
+    // retry of a keyed call that already went through still succeeds.
+    bool limitRejected(const Operation &op, const std::string &key) {
+        bool exists = false;
+        if (key.empty() || !keyExists(key, exists)) return false;
+        return finishKeyed(op, key, false, exists);
+    }
+
+    // Result of a direct MySQL call: duplicate means its key was already taken.
+    bool finishKeyed(const Operation &op, const std::string &key, bool applied, bool duplicate) {
+        if (duplicate) {
+            keys.insert(key);
+            return true;
+        }
+        if (applied) {
+            publish(op);
+            keys.insert(key);
+        }
+        return applied;
+    }
+
+    // The ledger engine logs the key with the operation's WAL record and
+    // inserts it into idempotency_keys when it flushes the record, so a keyed
+    // call costs one autocommit lookup and holds no connection across the
+    // engine call. Until the flush the engine remembers the key: holdKey makes
+    // a concurrent call wait for this one and then reports the key taken, or
+    // hands it over if this call was rejected.
+    bool applyLedger(const Operation &op, const std::string &key) {
+        if (!key.empty()) {
+            if (!ledger->holdKey(key)) {
+                keys.insert(key);
+                return true;
+            }
+            bool exists;
+            if (!keyExists(key, exists)) {
+                ledger->releaseKey(key);
+                return false;
+            }
+            if (exists) {
+                ledger->releaseKey(key);
+                keys.insert(key);
+                return true;
+            }
+        }
+        LimitHold limit(limits, op);
+        if (!admits(limit)) {
+            if (!key.empty()) ledger->releaseKey(key);
+            return false;
+        }
+        if (!limit.keep(ledger->apply(op, key) == OperationResult::APPLIED)) return false;
+        publish(op);
+        keys.insert(key);
+        return true;
+    }
+
+    // Called at the start of every write so the read-your-writes window is
+    // open before the write can commit.
+    void noteWrite() {
+        if (read_your_writes.count() > 0 && !replicas.empty()) lastWrites()[id] = std::chrono::steady_clock::now();
+    }
+
+    // Connection for a read-only call: the least busy replica (round robin on
+    // ties), or the primary when there are none, the calling thread wrote
+    // recently, or the chosen replica cannot hand out a connection.
+    ConnectionPool::Lease acquireRead() {
+        if (replicas.empty()) return pool.acquire();
+        if (read_your_writes.count() > 0) {
+            auto &last = lastWrites();
+            auto it = last.find(id);
+            if (it != last.end() && std::chrono::steady_clock::now() - it->second < read_your_writes) return pool.acquire();
+        }
+        const std::size_t n = replicas.size();
+        const std::size_t start = next_replica.fetch_add(1, std::memory_order_relaxed) % n;
+        std::size_t pick = start;
+        std::size_t least = replicas[start]->inUse();
+        for (std::size_t k = 1; k < n && least > 0; ++k) {
+            std::size_t i = (start + k) % n;
+            std::size_t busy = replicas[i]->inUse();
+            if (busy < least) {
+                least = busy;
+                pick = i;
+            }
+        }
+        try {
+            return replicas[pick]->acquire();
+        } catch (sql::SQLException &e) {
+            std::cerr << "[replica error] " << e.what() << "; reading from primary" << std::endl;
+            return pool.acquire();
+        }
+    }
+
+    // Rows read to fill the account cache must come from the primary: a lagging
+    // replica could put a balance older than the cache's own writes back in it.
+    // With the cache off, account reads go to the replicas like everything else.
+    ConnectionPool::Lease acquireAccountRead() {
+        return cache.enabled() ? pool.acquire() : acquireRead();
+    }
+
+    // Runs one of db.sql's money-movement procedures (sql, with bind setting
+    // its arguments) and returns its PostStatus. The procedure starts and
+    // commits its own transaction, so this is one round trip with no
+    // autocommit switching; deadlocks are retried as in runTransaction.
+    int runPosting(const char *what, const char *sql, const std::function<void(sql::PreparedStatement*)> &bind) {
+        for (int tries = 1;; ++tries) {
+            try {
+                ConnectionPool::Lease conn = pool.acquire();
+                sql::PreparedStatement *ps = conn.prepare(sql);
+                bind(ps);
+                return callForId(conn, ps);
+            } catch (sql::SQLException &e) {
+                if (retryable(e) && tries < retry.max_attempts) {
+                    metrics.countRetry(deadlocked(e));
+                    backoff(retry, tries - 1);
+                    continue;
+                }
+                std::cerr << "[" << what << " error] " << e.what() << std::endl;
+                return POST_FAILED;
+            }
+        }
+    }
+
+    // Runs attempt(conn) as one transaction on a fresh lease and returns its
+    // result. A deadlock or lock wait timeout rolls back and runs it again;
+    // any other error rolls back, is logged under what, and returns false.
+    // attempt must keep its side effects (cache writes) scoped to the call.
+    bool runTransaction(const char *what, const std::function<bool(ConnectionPool::Lease&)> &attempt) {
+        for (int tries = 1;; ++tries) {
+            ConnectionPool::Lease conn;
+            try {
+                conn = pool.acquire();
+                conn->setAutoCommit(false);
+                return attempt(conn);
+            } catch (sql::SQLException &e) {
+                if (conn) { try { conn.rollback(); conn->setAutoCommit(true); } catch(...){} }
+                if (retryable(e) && tries < retry.max_attempts) {
+                    metrics.countRetry(deadlocked(e));
+                    conn.release();  // let others use the connection while we back off
+                    backoff(retry, tries - 1);
+                    continue;
+                }
+                std::cerr << "[" << what << " error] " << e.what() << std::endl;
+                return false;
+            }
+        }
+    }
+
+    // Bank::transactionsPage without its timer, so recentTransactions can
+    // time itself and charge its own conflicts.
+    std::vector<TransactionRecord> transactionsPage(int account_id, std::int64_t before_txn_id, int limit);
+};
+
+Bank::Bank(const std::string &host, const std::string &user, const std::string &pass, const std::string &db,
+           const BankOptions &options) {
+    try {
+        impl = new Impl(host, user, pass, db, options);
+    } catch (sql::SQLException &e) {
+        std::cerr << "[DB Error] " << e.what() << std::endl;
+        throw;
+    } catch (std::runtime_error &e) {
+        std::cerr << "[Ledger Error] " << e.what() << std::endl;
+        throw;
+    }
+}
+
+Bank::~Bank() {
+    delete impl;
+}
+
+static std::string multiRowSql(const char *prefix, const char *tuple, std::size_t rows) {
+    std::string sql = prefix;
+    for (std::size_t i = 0; i < rows; ++i) {
+        if (i) sql += ',';
+        sql += tuple;
+    }
+    return sql;
+}
+
+// Shared body of createCustomers/createAccounts. bind(ps, col, row) sets one
+// row's parameters starting at col and advances it. InnoDB hands a multi-row
+// INSERT with a known row count consecutive auto-increment values in every
+// innodb_autoinc_lock_mode, so LAST_INSERT_ID() (the first of them) plus the
+// row count describes the statement's ids exactly.
+template <typename Row, typename Bind>
+static std::vector<IdRange> insertRows(ConnectionPool &pool, const std::vector<Row> &rows, const char *prefix,
+                                       const char *tuple, const BatchOptions &options, Bind bind, const char *what) {
+    std::vector<IdRange> done, pending;
+    const std::size_t per_insert = std::max<std::size_t>(options.rows_per_insert, 1);
+    const std::size_t commit_every = std::max(options.commit_every, per_insert);
+    const std::string full_sql = multiRowSql(prefix, tuple, per_insert);
+    ConnectionPool::Lease conn;
+    try {
+        conn = pool.acquire();
+        conn->setAutoCommit(false);
+        std::size_t since_commit = 0;
+        for (std::size_t i = 0; i < rows.size();) {
+            std::size_t n = std::min(per_insert, rows.size() - i);
+            // full groups share one cached statement; the shorter tail is prepared once and dropped
+            std::unique_ptr<sql::PreparedStatement> tail;
+            sql::PreparedStatement *ps;
+            if (n == per_insert) {
+                ps = conn.prepare(full_sql);
+            } else {
+                tail.reset(conn->prepareStatement(multiRowSql(prefix, tuple, n)));
+                ps = tail.get();
+            }
+            unsigned int col = 1;
+            for (std::size_t k = 0; k < n; ++k) bind(ps, col, rows[i + k]);
+            conn.execute(ps);
+
+            sql::PreparedStatement *ids = conn.prepare("SELECT LAST_INSERT_ID(), @@auto_increment_increment");
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ids));
+            rs->next();
+            pending.push_back(IdRange{rs->getInt(1), static_cast<int>(n), rs->getInt(2)});
+
+            i += n;
+            since_commit += n;
+            if (since_commit >= commit_every || i == rows.size()) {
+                conn.commit();
+                done.insert(done.end(), pending.begin(), pending.end());
+                pending.clear();
+                since_commit = 0;
+            }
+        }
+        conn->setAutoCommit(true);
+    } catch (sql::SQLException &e) {
+        std::cerr << "[" << what << " error] " << e.what() << std::endl;
+        if (conn) { try { conn.rollback(); conn->setAutoCommit(true); } catch(...){} }
+    }
+    return done;
+}
+
+int Bank::createCustomer(const std::string &name, const std::string &email, const std::string &phone) {
+    ScopedTimer timer(impl->metrics, T_CREATE_CUSTOMER);
+    impl->noteWrite();
+    try {
+        auto conn = impl->pool.acquire();
+        sql::PreparedStatement *ps = conn.prepare("CALL create_customer(?,?,?)");
+        ps->setString(1, name);
+        ps->setString(2, email);
+        ps->setString(3, phone);
+        return callForId(conn, ps);
+    } catch (sql::SQLException &e) {
+        std::cerr << "[createCustomer error] " << e.what() << std::endl;
+        return -1;
+    }
+}
+
+std::vector<IdRange> Bank::createCustomers(const std::vector<Customer> &customers, const BatchOptions &options) {
+    ScopedTimer timer(impl->metrics, T_CREATE_CUSTOMERS);
+    impl->noteWrite();
+    return insertRows(impl->pool, customers, "INSERT INTO customers(name,email,phone) VALUES", "(?,?,?)", options,
+                      [](sql::PreparedStatement *ps, unsigned int &col, const Customer &c) {
+                          ps->setString(col++, c.name);
+                          ps->setString(col++, c.email);
+                          ps->setString(col++, c.phone);
+                      }, "createCustomers");
+}
+
+std::vector<Customer> Bank::listCustomers() {
+    std::vector<Customer> out;
+    forEachCustomer([&out](const Customer &c) { out.push_back(c); });
+    return out;
+}
+
+std::int64_t Bank::forEachCustomer(const std::function<void(const Customer&)> &fn, const ScanOptions &options) {
+    return forEachCustomerView([&fn](const CustomerView &v) {
+        Customer c;
+        c.id = v.id;
+        c.name.assign(v.name);
+        c.email.assign(v.email);
+        c.phone.assign(v.phone);
+        fn(c);
+    }, options);
+}
+
+// Keyset scan on the primary key: each batch resumes after the last id seen,
+// so the server never materialises more than one batch and no cursor stays
+// open between round trips.
+std::int64_t Bank::forEachCustomerView(const std::function<void(const CustomerView&)> &fn, const ScanOptions &options) {
+    ScopedTimer timer(impl->metrics, T_SCAN_CUSTOMERS);
+    const std::size_t fetch = std::max<std::size_t>(options.fetch_rows, 1);
+    std::vector<CustomerView> chunk;
+    chunk.reserve(fetch);
+    StringArena arena;
+    int after_id = 0;
+    std::int64_t visited = 0;
+    try {
+        do {
+            chunk.clear();
+            arena.reset();
+            {
+                auto conn = impl->acquireRead();
+                sql::PreparedStatement *ps = conn.prepare("SELECT customer_id,name,email,phone FROM customers WHERE customer_id > ? ORDER BY customer_id LIMIT ?");
+                ps->setInt(1, after_id);
+                ps->setInt64(2, static_cast<std::int64_t>(fetch));
+                std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+                while (rs->next()) chunk.push_back(readCustomerView(*rs, arena));
+            }
+            for (const CustomerView &c : chunk) fn(c);
+            visited += static_cast<std::int64_t>(chunk.size());
+            if (!chunk.empty()) after_id = chunk.back().id;
+        } while (chunk.size() == fetch);
+    } catch (sql::SQLException &e) {
+        std::cerr << "[forEachCustomer error] " << e.what() << std::endl;
+        return -1;
+    }
+    return visited;
+}
+
+Customer Bank::getCustomer(int customer_id) {
+    ScopedTimer timer(impl->metrics, T_GET_CUSTOMER);
+    Customer c; c.id = -1;
+    try {
+        auto conn = impl->acquireRead();
+        sql::PreparedStatement *ps = conn.prepare("SELECT customer_id,name,email,phone FROM customers WHERE customer_id = ?");
+        ps->setInt(1, customer_id);
+        std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+        if (rs->next()) c = readCustomer(*rs);
+    } catch (sql::SQLException &e) {
+        std::cerr << "[getCustomer error] " << e.what() << std::endl;
+    }
+    return c;
+}
+
+int Bank::createAccount(int customer_id, AccountType type) {
+    ScopedTimer timer(impl->metrics, T_CREATE_ACCOUNT);
+    if (type == AccountType::UNKNOWN) {
+        std::cerr << "[createAccount error] unknown account type" << std::endl;
+        return -1;
+    }
+    impl->noteWrite();
+    try {
+        auto conn = impl->pool.acquire();
+        sql::PreparedStatement *ps = conn.prepare("CALL create_account(?,?)");
+        ps->setInt(1, customer_id);
+        ps->setString(2, toString(type));
+        int id = callForId(conn, ps);
+        if (id > 0 && impl->ledger) impl->ledger->addAccount(id, customer_id, type);
+        return id;
+    } catch (sql::SQLException &e) {
+        std::cerr << "[createAccount error] " << e.what() << std::endl;
+        return -1;
+    }
+}
+
+std::vector<IdRange> Bank::createAccounts(const std::vector<Account> &accounts, const BatchOptions &options) {
+    ScopedTimer timer(impl->metrics, T_CREATE_ACCOUNTS);
+    impl->noteWrite();
+    std::vector<IdRange> ranges =
+        insertRows(impl->pool, accounts, "INSERT INTO accounts(customer_id,account_type,balance) VALUES", "(?,?,0.0)",
+                   options, [](sql::PreparedStatement *ps, unsigned int &col, const Account &a) {
+                       ps->setInt(col++, a.customer_id);
+                       ps->setString(col++, toString(a.type));
+                   }, "createAccounts");
+    if (impl->ledger) {
+        std::size_t next = 0;  // ranges cover accounts in input order
+        for (const IdRange &r : ranges) {
+            for (int k = 0; k < r.count; ++k, ++next) {
+                impl->ledger->addAccount(r.first + k * r.step, accounts[next].customer_id, accounts[next].type);
+            }
+        }
+    }
+    return ranges;
+}
+
+Account Bank::getAccount(int account_id) {
+    ScopedTimer timer(impl->metrics, T_GET_ACCOUNT);
+    Account a; a.id = -1;
+    if (!impl->cache.get(account_id, a)) {
+        try {
+            std::uint64_t ticket = impl->cache.ticket();
+            auto conn = impl->acquireAccountRead();
+            sql::PreparedStatement *ps = conn.prepare("SELECT account_id,customer_id,account_type + 0," SQL_BALANCE_CENTS " AS balance_cents FROM accounts WHERE account_id = ?");
+            ps->setInt(1, account_id);
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+            if (rs->next()) {
+                a = readAccount(*rs);
+                impl->cache.fill(a, ticket);
+            }
+        } catch (sql::SQLException &e) {
+            std::cerr << "[getAccount error] " << e.what() << std::endl;
+        }
+    }
+    // MySQL trails the ledger engine; the engine holds the live balance
+    if (a.id >= 0 && impl->ledger) impl->ledger->balance(a.id, a.balance);
+    return a;
+}
+
+std::vector<Account> Bank::listAccountsByCustomer(int customer_id) {
+    ScopedTimer timer(impl->metrics, T_LIST_ACCOUNTS);
+    std::vector<Account> out;
+    try {
+        std::uint64_t ticket = impl->cache.ticket();
+        auto conn = impl->acquireAccountRead();
+        sql::PreparedStatement *ps = conn.prepare("SELECT account_id,customer_id,account_type + 0," SQL_BALANCE_CENTS " AS balance_cents FROM accounts WHERE customer_id = ?");
+        ps->setInt(1, customer_id);
+        std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+        while (rs->next()) {
+            Account a = readAccount(*rs);
+            impl->cache.fill(a, ticket);
+            if (impl->ledger) impl->ledger->balance(a.id, a.balance);
+            out.push_back(a);
+        }
+    } catch (sql::SQLException &e) {
+        std::cerr << "[listAccountsByCustomer error] " << e.what() << std::endl;
+    }
+    return out;
+}
+
+bool Bank::deposit(int account_id, Money amount, const std::string &idempotency_key) {
+    ScopedTimer timer(impl->metrics, T_DEPOSIT);
+    if (impl->keys.contains(idempotency_key)) return true;
+    if (!validKey("deposit", idempotency_key)) return false;
+    impl->noteWrite();
+    if (amount <= Money()) return false;
+    Operation op = {Operation::DEPOSIT, account_id, 0, amount};
+    if (impl->ledger) return impl->applyLedger(op, idempotency_key);
+    LimitHold limit(impl->limits, op);
+    if (!impl->admits(limit)) return impl->limitRejected(op, idempotency_key);
+    CacheWrite cached(impl->cache, account_id);
+    const int status = impl->runPosting("deposit", SQL_DEPOSIT_FUNDS, [&](sql::PreparedStatement *ps) {
+        ps->setString(1, idempotency_key);
+        ps->setInt(2, account_id);
+        ps->setInt64(3, amount.cents());
+        ps->setInt(4, impl->stripes.contains(account_id) ? impl->stripes.pick() + 1 : 0);
+    });
+    const bool applied = limit.keep(status == POST_APPLIED);
+    if (applied) cached.commit(amount);
+    return impl->finishKeyed(op, idempotency_key, applied, status == POST_DUPLICATE);
+}
+
+bool Bank::withdraw(int account_id, Money amount, const std::string &idempotency_key) {
+    ScopedTimer timer(impl->metrics, T_WITHDRAW);
+    if (impl->keys.contains(idempotency_key)) return true;
+    if (!validKey("withdraw", idempotency_key)) return false;
+    impl->noteWrite();
+    if (amount <= Money()) return false;
+    Operation op = {Operation::WITHDRAW, account_id, 0, amount};
+    if (impl->ledger) return impl->applyLedger(op, idempotency_key);
+    LimitHold limit(impl->limits, op);
+    if (!impl->admits(limit)) return impl->limitRejected(op, idempotency_key);
+    CacheWrite cached(impl->cache, account_id);
+    const int status = impl->runPosting("withdraw", SQL_WITHDRAW_FUNDS, [&](sql::PreparedStatement *ps) {
+        ps->setString(1, idempotency_key);
+        ps->setInt(2, account_id);
+        ps->setInt64(3, amount.cents());
+        ps->setBoolean(4, impl->stripes.contains(account_id));
+    });
+    const bool applied = limit.keep(status == POST_APPLIED);
+    if (applied) cached.commit(-amount);
+    return impl->finishKeyed(op, idempotency_key, applied, status == POST_DUPLICATE);
+}
+
+bool Bank::transfer(int from_account_id, int to_account_id, Money amount, const std::string &idempotency_key) {
+    ScopedTimer timer(impl->metrics, T_TRANSFER);
+    if (impl->keys.contains(idempotency_key)) return true;
+    if (!validKey("transfer", idempotency_key)) return false;
+    impl->noteWrite();
+    if (amount <= Money()) return false;
+    if (from_account_id == to_account_id) return false;
+    Operation op = {Operation::TRANSFER, from_account_id, to_account_id, amount};
+    if (impl->ledger) return impl->applyLedger(op, idempotency_key);
+    LimitHold limit(impl->limits, op);
+    if (!impl->admits(limit)) return impl->limitRejected(op, idempotency_key);
+    CacheWrite cached_from(impl->cache, from_account_id);
+    CacheWrite cached_to(impl->cache, to_account_id);
+    // transfer_funds takes the row locks lower account_id first
+    const int status = impl->runPosting("transfer", SQL_TRANSFER_FUNDS, [&](sql::PreparedStatement *ps) {
+        const bool to_striped = impl->stripes.contains(to_account_id);
+        ps->setString(1, idempotency_key);
+        ps->setInt(2, from_account_id);
+        ps->setInt(3, to_account_id);
+        ps->setInt64(4, amount.cents());
+        ps->setBoolean(5, impl->stripes.contains(from_account_id));
+        ps->setBoolean(6, to_striped);
+        ps->setInt(7, to_striped ? impl->stripes.pick() + 1 : 0);
+    });
+    const bool applied = limit.keep(status == POST_APPLIED);
+    if (applied) {
+        cached_from.commit(-amount);
+        cached_to.commit(amount);
+    }
+    return impl->finishKeyed(op, idempotency_key, applied, status == POST_DUPLICATE);
+}
+
+// Cross-shard transfer legs; ShardedBank runs them as a saga.
+
+std::int64_t Bank::transferOut(int from_account_id, int to_account_id, Money amount,
+                               const std::string &idempotency_key) {
+    ScopedTimer timer(impl->metrics, T_TRANSFER_OUT);
+    if (impl->keys.contains(idempotency_key)) return -2;
+    if (!validKey("transferOut", idempotency_key)) return 0;
+    impl->noteWrite();
+    if (amount <= Money()) return 0;
+    if (impl->ledger) {
+        std::cerr << "[transferOut error] cross-shard transfers need the ledger engine disabled" << std::endl;
+        return -1;
+    }
+    const Operation op = {Operation::TRANSFER, from_account_id, to_account_id, amount};
+    std::int64_t transfer_id = 0;
+    bool rejected = false, duplicate = false;
+    bool ok = impl->runTransaction("transferOut", [&](ConnectionPool::Lease &conn) {
+        transfer_id = 0;
+        duplicate = false;
+        if (!idempotency_key.empty() && !claimKey(conn, idempotency_key)) {
+            duplicate = true;
+            return abandon(conn);
+        }
+        LimitHold limit(impl->limits, op);
+        if (!impl->admits(limit)) {
+            rejected = true;
+            return abandon(conn);
+        }
+        CacheWrite cached(impl->cache, from_account_id);
+        if (!debitAccount(conn, impl->stripes, from_account_id, amount)) {
+            rejected = true;
+            return abandon(conn);
+        }
+
+        recordPosting(conn, impl->stripes, from_account_id, TransactionType::TRANSFER, amount, transferDetails("to", to_account_id));
+
+        sql::PreparedStatement *ps3 = conn.prepare("INSERT INTO shard_transfers(from_account_id,to_account_id,amount,idem_key) VALUES(?,?,? / 100,NULLIF(?,''))");
+        ps3->setInt(1, from_account_id);
+        ps3->setInt(2, to_account_id);
+        ps3->setInt64(3, amount.cents());
+        ps3->setString(4, idempotency_key);
+        conn.execute(ps3);
+        {
+            sql::PreparedStatement *ps4 = conn.prepare("SELECT LAST_INSERT_ID()");
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps4));
+            if (rs->next()) transfer_id = rs->getInt64(1);
+        }
+
+        conn.commit();
+        limit.keep(true);
+        cached.commit(-amount);
+        conn->setAutoCommit(true);
+        return true;
+    });
+    if (duplicate) return -2;
+    if (!ok) return rejected ? 0 : -1;
+    return transfer_id;
+}
+
+OperationResult Bank::transferIn(int source_shard, std::int64_t transfer_id, int from_account_id, int to_account_id,
+                                 Money amount) {
+    ScopedTimer timer(impl->metrics, T_TRANSFER_IN);
+    impl->noteWrite();
+    if (impl->ledger) {
+        std::cerr << "[transferIn error] cross-shard transfers need the ledger engine disabled" << std::endl;
+        return OperationResult::FAILED;
+    }
+    OperationResult result = OperationResult::FAILED;
+    impl->runTransaction("transferIn", [&](ConnectionPool::Lease &conn) {
+        result = OperationResult::FAILED;
+        CacheWrite cached(impl->cache, to_account_id);
+        // The credit marker commits with the credit, so a repeat finds it and does nothing.
+        sql::PreparedStatement *ps1 = conn.prepare("INSERT IGNORE INTO shard_transfer_credits(source_shard,transfer_id) VALUES(?,?)");
+        ps1->setInt(1, source_shard);
+        ps1->setInt64(2, transfer_id);
+        if (conn.executeUpdate(ps1) != 1) {
+            result = OperationResult::APPLIED;
+            return abandon(conn);
+        }
+
+        if (!creditAccount(conn, impl->stripes, to_account_id, amount)) {
+            // unknown account: no marker either, so the source refunds
+            result = OperationResult::REJECTED;
+            return abandon(conn);
+        }
+
+        recordPosting(conn, impl->stripes, to_account_id, TransactionType::DEPOSIT, amount, transferDetails("from", from_account_id));
+
+        conn.commit();
+        cached.commit(amount);
+        conn->setAutoCommit(true);
+        result = OperationResult::APPLIED;
+        return true;
+    });
+    return result;
+}
+
+bool Bank::settleTransferOut(std::int64_t transfer_id, bool credited) {
+    ScopedTimer timer(impl->metrics, T_SETTLE_TRANSFER_OUT);
+    impl->noteWrite();
+    if (impl->ledger) {
+        std::cerr << "[settleTransferOut error] cross-shard transfers need the ledger engine disabled" << std::endl;
+        return false;
+    }
+    std::string key;
+    bool ok = impl->runTransaction("settleTransferOut", [&](ConnectionPool::Lease &conn) {
+        int from_account_id = 0, to_account_id = 0;
+        Money amount;
+        {
+            sql::PreparedStatement *ps1 = conn.prepare("SELECT from_account_id,to_account_id,CAST(amount * 100 AS SIGNED),COALESCE(idem_key,'') FROM shard_transfers WHERE transfer_id = ? AND state = 'PENDING' FOR UPDATE");
+            ps1->setInt64(1, transfer_id);
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps1));
+            if (!rs->next()) return abandon(conn);  // settled already
+            from_account_id = rs->getInt(1);
+            to_account_id = rs->getInt(2);
+            amount = Money::fromCents(rs->getInt64(3));
+            key = rs->getString(4);
+        }
+        sql::PreparedStatement *ps2 = conn.prepare("UPDATE shard_transfers SET state = ? WHERE transfer_id = ?");
+        ps2->setString(1, credited ? "DONE" : "REFUNDED");
+        ps2->setInt64(2, transfer_id);
+        conn.execute(ps2);
+        if (credited) {
+            conn.commit();
+            conn->setAutoCommit(true);
+            return true;
+        }
+
+        CacheWrite cached(impl->cache, from_account_id);
+        creditAccount(conn, impl->stripes, from_account_id, amount);
+        recordPosting(conn, impl->stripes, from_account_id, TransactionType::DEPOSIT, amount,
+                      transferDetails("to", to_account_id) + " reversed");
+
+        if (!key.empty()) {
+            sql::PreparedStatement *ps5 = conn.prepare("DELETE FROM idempotency_keys WHERE idem_key = ?");
+            ps5->setString(1, key);
+            conn.execute(ps5);
+        }
+
+        conn.commit();
+        cached.commit(amount);
+        conn->setAutoCommit(true);
+        return true;
+    });
+    if (ok && credited) impl->keys.insert(key);
+    return ok;
+}
+
+std::vector<PendingTransfer> Bank::pendingTransfersOut(int older_than_s) {
+    ScopedTimer timer(impl->metrics, T_PENDING_TRANSFERS_OUT);
+    std::vector<PendingTransfer> out;
+    try {
+        auto conn = impl->pool.acquire();
+        sql::PreparedStatement *ps = conn.prepare("SELECT transfer_id,from_account_id,to_account_id,CAST(amount * 100 AS SIGNED) FROM shard_transfers WHERE state = 'PENDING' AND created_at <= NOW() - INTERVAL ? SECOND ORDER BY transfer_id LIMIT 1000");
+        ps->setInt(1, older_than_s);
+        std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+        while (rs->next()) {
+            PendingTransfer t;
+            t.transfer_id = rs->getInt64(1);
+            t.from_account_id = rs->getInt(2);
+            t.to_account_id = rs->getInt(3);
+            t.amount = Money::fromCents(rs->getInt64(4));
+            out.push_back(t);
+        }
+    } catch (sql::SQLException &e) {
+        std::cerr << "[pendingTransfersOut error] " << e.what() << std::endl;
+    }
+    return out;
+}
+
+std::vector<TransactionRecord> Bank::recentTransactions(int account_id, int limit) {
+    ScopedTimer timer(impl->metrics, T_RECENT_TRANSACTIONS);
+    return impl->transactionsPage(account_id, 0, limit);
+}
+
+std::vector<TransactionRecord> Bank::transactionsPage(int account_id, std::int64_t before_txn_id, int limit) {
+    ScopedTimer timer(impl->metrics, T_TRANSACTIONS_PAGE);
+    return impl->transactionsPage(account_id, before_txn_id, limit);
+}
+
+// Pages walk idx_transactions_account_created backwards from the cursor row,
+// with transaction_id breaking ties between rows written in the same second.
+// Newest first, one window of months per query: each names a created_at
+// range, so MySQL reads only those months' partitions. Windows double in
+// length going back (1, 2, 4... months) until the page is full or they pass
+// the month the account was opened. Archived months are not paged.
+std::vector<TransactionRecord> Bank::Impl::transactionsPage(int account_id, std::int64_t before_txn_id, int limit) {
+    std::vector<TransactionRecord> out;
+    if (limit <= 0) return out;
+    try {
+        auto conn = acquireRead();
+        std::string cursor_at;  // created_at of before_txn_id
+        int newest = currentMonth();
+        if (before_txn_id > 0) {
+            sql::PreparedStatement *ps = conn.prepare("SELECT created_at FROM transactions WHERE transaction_id = ? AND account_id = ?");
+            ps->setInt64(1, before_txn_id);
+            ps->setInt(2, account_id);
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+            if (!rs->next()) return out;
+            cursor_at = rs->getString(1);
+            if (monthOf(cursor_at) >= 0) newest = monthOf(cursor_at);
+        }
+        int opened = -1;  // month of the account's created_at, read once the first window falls short
+        int lower = newest, span = 1;
+        std::string upper;  // start of the previous window; none above the first
+        for (;;) {
+            std::string sql = "SELECT transaction_id,account_id,type + 0,CAST(amount * 100 AS SIGNED) AS amount_cents,details,created_at,"
+                              "CAST(balance_after * 100 AS SIGNED) FROM transactions WHERE account_id = ? AND created_at >= ?";
+            if (!upper.empty()) sql += " AND created_at < ?";
+            if (!cursor_at.empty()) sql += " AND (created_at < ? OR (created_at = ? AND transaction_id < ?))";
+            sql += " ORDER BY created_at DESC, transaction_id DESC LIMIT ?";
+            const std::string from = monthStart(lower);
+            sql::PreparedStatement *ps = conn.prepare(sql);
+            unsigned int col = 1;
+            ps->setInt(col++, account_id);
+            ps->setString(col++, from);
+            if (!upper.empty()) ps->setString(col++, upper);
+            if (!cursor_at.empty()) {
+                ps->setString(col++, cursor_at);
+                ps->setString(col++, cursor_at);
+                ps->setInt64(col++, before_txn_id);
+            }
+            ps->setInt(col++, limit - static_cast<int>(out.size()));
+            {
+                std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+                while (rs->next()) out.push_back(readTransaction(*rs));
+            }
+            if (static_cast<int>(out.size()) >= limit) break;
+            if (opened < 0) {
+                sql::PreparedStatement *acc = conn.prepare("SELECT created_at FROM accounts WHERE account_id = ?");
+                acc->setInt(1, account_id);
+                std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(acc));
+                if (!rs->next() || (opened = monthOf(rs->getString(1))) < 0) break;
+            }
+            if (lower <= opened) break;
+            upper = from;
+            span *= 2;
+            lower = std::max(opened, lower - span);
+        }
+    } catch (sql::SQLException &e) {
+        std::cerr << "[transactionsPage error] " << e.what() << std::endl;
+    }
+    return out;
+}
+
+std::int64_t Bank::forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                      const std::function<void(const TransactionRecord&)> &fn,
+                                      const ScanOptions &options) {
+    return forEachTransactionView(account_id, from, to, [&fn](const TransactionView &v) {
+        TransactionRecord t;
+        t.id = v.id;
+        t.account_id = v.account_id;
+        t.type = v.type;
+        t.amount = v.amount;
+        t.details.assign(v.details);
+        t.created_at.assign(v.created_at);
+        t.has_balance_after = v.has_balance_after;
+        t.balance_after = v.balance_after;
+        fn(t);
+    }, options);
+}
+
+// One page of forEachTransactionView from both transactions and transactions_archive.
+#define SCAN_TRANSACTIONS_FROM(table)                                                                     \
+    "(SELECT transaction_id,account_id,type + 0 AS type_code,CAST(amount * 100 AS SIGNED) AS amount_cents," \
+    "details,created_at,CAST(balance_after * 100 AS SIGNED) AS balance_after_cents FROM " table " "          \
+    "WHERE account_id = ? AND created_at >= ? AND created_at < ? AND (created_at > ? OR transaction_id > ?) " \
+    "ORDER BY created_at, transaction_id LIMIT ?)"
+static const char *const SQL_SCAN_TRANSACTIONS =
+    "SELECT transaction_id,account_id,type_code,amount_cents,details,created_at,balance_after_cents FROM ("
+    SCAN_TRANSACTIONS_FROM("transactions") " UNION " SCAN_TRANSACTIONS_FROM("transactions_archive")
+    ") page ORDER BY created_at, transaction_id LIMIT ?";
+#undef SCAN_TRANSACTIONS_FROM
+
+std::int64_t Bank::forEachTransactionView(int account_id, const std::string &from, const std::string &to,
+                                          const std::function<void(const TransactionView&)> &fn,
+                                          const ScanOptions &options) {
+    ScopedTimer timer(impl->metrics, T_SCAN_TRANSACTIONS);
+    const std::size_t fetch = std::max<std::size_t>(options.fetch_rows, 1);
+    std::vector<TransactionView> chunk;
+    chunk.reserve(fetch);
+    StringArena arena;
+    // (after_created, after_id) is the last row handed to fn; id 0 admits every row at from itself.
+    std::string after_created = from;
+    std::int64_t after_id = 0;
+    std::int64_t visited = 0;
+    try {
+        do {
+            chunk.clear();
+            arena.reset();
+            {
+                auto conn = impl->acquireRead();
+                // Both tables are bounded by created_at, so only the partitions of
+                // [from, to) are read; UNION drops rows a crashed archive run left
+                // in both.
+                sql::PreparedStatement *ps = conn.prepare(SQL_SCAN_TRANSACTIONS);
+                unsigned int col = 1;
+                for (int table = 0; table < 2; ++table) {
+                    ps->setInt(col++, account_id);
+                    ps->setString(col++, after_created);
+                    ps->setString(col++, to);
+                    ps->setString(col++, after_created);
+                    ps->setInt64(col++, after_id);
+                    ps->setInt64(col++, static_cast<std::int64_t>(fetch));
+                }
+                ps->setInt64(col++, static_cast<std::int64_t>(fetch));
+                std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+                while (rs->next()) chunk.push_back(readTransactionView(*rs, arena));
+            }  // lease released: a slow callback does not pin a pooled connection
+            for (const TransactionView &t : chunk) fn(t);
+            visited += static_cast<std::int64_t>(chunk.size());
+            if (!chunk.empty()) {
+                after_created.assign(chunk.back().created_at);  // before reset() recycles the arena
+                after_id = chunk.back().id;
+            }
+        } while (chunk.size() == fetch);
+    } catch (sql::SQLException &e) {
+        std::cerr << "[forEachTransaction error] " << e.what() << std::endl;
+        return -1;
+    }
+    return visited;
+}
+
+// The current balance less every rollup day after (cmp ">") or from (">=")
+// day: a balance on a date without an exact closing, as for a striped account.
+// False for an unknown account.
+static bool balanceLessLaterDays(ConnectionPool::Lease &conn, int account_id, const std::string &day, const char *cmp,
+                                 Money &out) {
+    sql::PreparedStatement *ps = conn.prepare(
+        std::string("SELECT CAST((balance + COALESCE((SELECT SUM(s.balance) FROM account_stripes s WHERE s.account_id = accounts.account_id), 0) "
+                    "- COALESCE((SELECT SUM(d.credits - d.debits) FROM account_daily d WHERE d.account_id = accounts.account_id AND d.day ") +
+        cmp + " ?), 0)) * 100 AS SIGNED) FROM accounts WHERE account_id = ?");
+    ps->setString(1, day);
+    ps->setInt(2, account_id);
+    std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+    if (!rs->next()) return false;
+    out = Money::fromCents(rs->getInt64(1));
+    return true;
+}
+
+bool Bank::balanceAsOf(int account_id, const std::string &day, Money &out) {
+    ScopedTimer timer(impl->metrics, T_BALANCE_AS_OF);
+    try {
+        auto conn = impl->acquireRead();
+        // The closing of the last day with postings; stripe rows on it mean there is none.
+        sql::PreparedStatement *ps = conn.prepare(
+            "SELECT CAST(MAX(CASE WHEN stripe = 0 THEN closing END) * 100 AS SIGNED), MAX(stripe) FROM account_daily "
+            "WHERE account_id = ? AND day = (SELECT MAX(day) FROM account_daily WHERE account_id = ? AND day <= ?)");
+        ps->setInt(1, account_id);
+        ps->setInt(2, account_id);
+        ps->setString(3, day);
+        {
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+            if (rs->next() && !rs->isNull(1) && rs->getInt(2) == 0) {
+                out = Money::fromCents(rs->getInt64(1));
+                return true;
+            }
+        }
+        return balanceLessLaterDays(conn, account_id, day, ">", out);
+    } catch (sql::SQLException &e) {
+        std::cerr << "[balanceAsOf error] " << e.what() << std::endl;
+        return false;
+    }
+}
+
+std::vector<DailyRollup> Bank::dailyRollups(int account_id, const std::string &from, const std::string &to) {
+    ScopedTimer timer(impl->metrics, T_DAILY_ROLLUPS);
+    std::vector<DailyRollup> out;
+    try {
+        auto conn = impl->acquireRead();
+        sql::PreparedStatement *ps = conn.prepare(
+            "SELECT day, stripe, CAST(opening * 100 AS SIGNED), CAST(closing * 100 AS SIGNED), "
+            "CAST(credits * 100 AS SIGNED), CAST(debits * 100 AS SIGNED) FROM account_daily "
+            "WHERE account_id = ? AND day >= ? AND day <= ? ORDER BY day, stripe");
+        ps->setInt(1, account_id);
+        ps->setString(2, from);
+        ps->setString(3, to);
+        bool exact = true;  // every day has its balances on stripe 0
+        {
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+            while (rs->next()) {
+                std::string day = rs->getString(1);
+                if (out.empty() || out.back().day != day) {
+                    out.push_back(DailyRollup());
+                    out.back().day = day;
+                    exact = exact && rs->getInt(2) == 0;
+                }
+                DailyRollup &d = out.back();
+                if (rs->getInt(2) == 0 && !rs->isNull(3) && !rs->isNull(4)) {
+                    d.opening = Money::fromCents(rs->getInt64(3));
+                    d.closing = Money::fromCents(rs->getInt64(4));
+                } else {
+                    exact = false;
+                }
+                d.credits += Money::fromCents(rs->getInt64(5));
+                d.debits += Money::fromCents(rs->getInt64(6));
+            }
+        }
+        if (!exact && !out.empty()) {
+            // chain the days from the balance they start with
+            Money balance;
+            if (!balanceLessLaterDays(conn, account_id, out.front().day, ">=", balance)) return std::vector<DailyRollup>();
+            for (DailyRollup &d : out) {
+                d.opening = balance;
+                balance += d.credits - d.debits;
+                d.closing = balance;
+            }
+        }
+    } catch (sql::SQLException &e) {
+        std::cerr << "[dailyRollups error] " << e.what() << std::endl;
+        out.clear();
+    }
+    return out;
+}
+
+namespace {
+
+// Rows of a striped account keep no running balance in a batch; a credit is
+// rolled up on this thread's stripe, a debit on the account row's.
+void markStriped(const Stripes &stripes, LedgerRow &row) {
+    if (!stripes.contains(row.account_id)) return;
+    row.stripe = row.type == TransactionType::DEPOSIT ? stripes.pick() + 1 : 0;
+}
+
+// Applies one operation's balance change inside the caller's transaction and
+// queues its ledger rows. A rejected operation leaves no change behind.
+OperationResult applyOne(ConnectionPool::Lease &conn, const Stripes &stripes, const Operation &op,
+                         std::vector<LedgerRow> &rows) {
+    if (op.amount <= Money()) return OperationResult::REJECTED;
+    if (op.kind == Operation::DEPOSIT) {
+        if (!creditAccount(conn, stripes, op.account_id, op.amount)) return OperationResult::REJECTED;
+        rows.push_back(LedgerRow{op.account_id, TransactionType::DEPOSIT, op.amount, "Deposit via app"});
+        markStriped(stripes, rows.back());
+        return OperationResult::APPLIED;
+    }
+    if (op.kind == Operation::TRANSFER && op.account_id == op.to_account_id) return OperationResult::REJECTED;
+
+    if (!debitAccount(conn, stripes, op.account_id, op.amount)) return OperationResult::REJECTED;
+    if (op.kind == Operation::WITHDRAW) {
+        rows.push_back(LedgerRow{op.account_id, TransactionType::WITHDRAW, op.amount, "Withdrawal via app"});
+        markStriped(stripes, rows.back());
+        return OperationResult::APPLIED;
+    }
+
+    if (!creditAccount(conn, stripes, op.to_account_id, op.amount)) {
+        // unknown destination: put the debit back instead of rolling back the whole chunk
+        sql::PreparedStatement *credit = conn.prepare(SQL_CREDIT);
+        credit->setInt64(1, op.amount.cents());
+        credit->setInt(2, op.account_id);
+        conn.execute(credit);
+        return OperationResult::REJECTED;
+    }
+    rows.push_back(LedgerRow{op.account_id, TransactionType::TRANSFER, op.amount, transferDetails("to", op.to_account_id)});
+    markStriped(stripes, rows.back());
+    rows.push_back(LedgerRow{op.to_account_id, TransactionType::DEPOSIT, op.amount, transferDetails("from", op.account_id)});
+    markStriped(stripes, rows.back());
+    return OperationResult::APPLIED;
+}
+
+} // namespace
+
+std::vector<OperationResult> Bank::applyBatch(const std::vector<Operation> &ops, const BatchOptions &options) {
+    ScopedTimer timer(impl->metrics, T_APPLY_BATCH);
+    impl->noteWrite();
+    if (impl->ledger && !impl->limits.enabled()) {
+        std::vector<OperationResult> results = impl->ledger->applyBatch(ops);
+        for (std::size_t i = 0; i < ops.size(); ++i) {
+            if (results[i] == OperationResult::APPLIED) impl->publish(ops[i]);
+        }
+        return results;
+    }
+    if (impl->ledger) {
+        // Only operations the limit rules let through reach the engine.
+        std::vector<OperationResult> results(ops.size(), OperationResult::REJECTED);
+        std::vector<LimitHold> holds;
+        std::vector<Operation> admitted;
+        std::vector<std::size_t> positions;
+        holds.reserve(ops.size());
+        for (std::size_t i = 0; i < ops.size(); ++i) {
+            holds.emplace_back(impl->limits, ops[i]);
+            if (!impl->admits(holds.back())) continue;
+            admitted.push_back(ops[i]);
+            positions.push_back(i);
+        }
+        std::vector<OperationResult> applied = impl->ledger->applyBatch(admitted);
+        for (std::size_t k = 0; k < admitted.size(); ++k) {
+            results[positions[k]] = applied[k];
+            if (holds[positions[k]].keep(applied[k] == OperationResult::APPLIED)) impl->publish(admitted[k]);
+        }
+        return results;
+    }
+    std::vector<OperationResult> results(ops.size(), OperationResult::FAILED);
+    const std::size_t chunk = options.commit_every ? options.commit_every : 1;
+    const std::size_t per_insert = options.rows_per_insert ? options.rows_per_insert : 1;
+    ConnectionPool::Lease conn;
+    try {
+        conn = impl->pool.acquire();
+    } catch (sql::SQLException &e) {
+        std::cerr << "[applyBatch error] " << e.what() << std::endl;
+        return results;
+    }
+
+    AccountCache &cache = impl->cache;
+    std::vector<LedgerRow> rows;
+    std::vector<std::pair<int, Money>> touched;  // cache writes of the open chunk: account, committed delta
+    std::vector<LimitHold> holds;                // limit windows taken by the open chunk, by operation
+    holds.reserve(std::min(ops.size(), chunk));
+    for (std::size_t start = 0; start < ops.size(); start += chunk) {
+        const std::size_t end = std::min(ops.size(), start + chunk);
+        for (int tries = 1;; ++tries) {
+            rows.clear();
+            touched.clear();
+            holds.clear();
+            try {
+                conn->setAutoCommit(false);
+                for (std::size_t i = start; i < end; ++i) {
+                    const Operation &op = ops[i];
+                    holds.emplace_back(impl->limits, op);
+                    if (!impl->admits(holds.back())) {
+                        results[i] = OperationResult::REJECTED;
+                        continue;
+                    }
+                    if (cache.enabled()) {
+                        cache.beginWrite(op.account_id);
+                        touched.push_back(std::make_pair(op.account_id, Money()));
+                        if (op.kind == Operation::TRANSFER) {
+                            cache.beginWrite(op.to_account_id);
+                            touched.push_back(std::make_pair(op.to_account_id, Money()));
+                        }
+                    }
+                    results[i] = applyOne(conn, impl->stripes, op, rows);
+                    if (cache.enabled() && results[i] == OperationResult::APPLIED) {
+                        if (op.kind == Operation::TRANSFER) {
+                            touched[touched.size() - 2].second = -op.amount;
+                            touched.back().second = op.amount;
+                        } else {
+                            touched.back().second = op.kind == Operation::DEPOSIT ? op.amount : -op.amount;
+                        }
+                    }
+                }
+                fillBalancesAfter(conn, rows);
+                insertLedgerRows(conn, rows, per_insert);
+                addDailyRollups(conn, rows);
+                conn.commit();
+                for (auto &t : touched) cache.endWrite(t.first, t.second);
+                touched.clear();
+                conn->setAutoCommit(true);
+                for (std::size_t i = start; i < end; ++i) {
+                    if (holds[i - start].keep(results[i] == OperationResult::APPLIED)) impl->publish(ops[i]);
+                }
+                break;
+            } catch (sql::SQLException &e) {
+                try { conn.rollback(); conn->setAutoCommit(true); } catch(...){}
+                for (auto &t : touched) cache.cancelWrite(t.first);
+                // operations are applied in caller order, so chunks can deadlock
+                // each other; the rolled-back chunk is simply run again
+                if (retryable(e) && tries < impl->retry.max_attempts) {
+                    impl->metrics.countRetry(deadlocked(e));
+                    backoff(impl->retry, tries - 1);
+                    continue;
+                }
+                std::cerr << "[applyBatch error] " << e.what() << std::endl;
+                for (std::size_t i = start; i < end; ++i) results[i] = OperationResult::FAILED;
+                break;
+            }
+        }
+    }
+    return results;
+}
+
+CacheStats Bank::cacheStats() {
+    return impl->cache.stats();
+}
+
+MetricsSnapshot Bank::metrics() {
+    MetricsSnapshot snap;
+    impl->metrics.snapshot(snap);
+    snap.pool_connections = impl->pool.size();
+    snap.pool_in_use = impl->pool.inUse();
+    return snap;
+}
+
+std::string Bank::metricsText() {
+    return prometheusText(metrics());
+}
+
+ChangeFeed *Bank::changeFeed() {
+    return impl->feed;
+}
+
+bool Bank::endOfDay(const EndOfDayOptions &options, EndOfDayReport &out) {
+    ScopedTimer timer(impl->metrics, T_END_OF_DAY);
+    if (!impl->ledger) return false;
+    SnapshotColumns cols;
+    std::uint64_t lsn = impl->ledger->exportColumns(cols);
+    try {
+        out = ::endOfDay(cols, lsn, options);
+    } catch (std::overflow_error &e) {
+        std::cerr << "[endOfDay error] " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// -------------------- include/async_bank.h --------------------
+
+#ifndef ASYNC_BANK_H
+#define ASYNC_BANK_H
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bank.h"
+
+// Non-blocking front for a Bank or ShardedBank. Calls are queued and run on a small set of
+// worker threads, so callers can keep thousands of requests in flight without
+// a thread each. Size the workers to PoolOptions::max_connections: more
+// workers than connections only wait on the pool.
+class AsyncBank {
+public:
+    explicit AsyncBank(BankInterface &bank, std::size_t threads = 4);
+    // Finishes everything already queued, then joins the workers.
+    ~AsyncBank();
+    AsyncBank(const AsyncBank&) = delete;
+    AsyncBank& operator=(const AsyncBank&) = delete;
+
+    std::future<int> createCustomer(const std::string &name, const std::string &email, const std::string &phone);
+    std::future<std::vector<IdRange>> createCustomers(std::vector<Customer> customers,
+                                                      const BatchOptions &options = BatchOptions());
+    std::future<std::vector<Customer>> listCustomers();
+    // fn runs on the worker thread executing the scan.
+    std::future<std::int64_t> forEachCustomer(std::function<void(const Customer&)> fn,
+                                              const ScanOptions &options = ScanOptions());
+    std::future<Customer> getCustomer(int customer_id);
+
+    std::future<int> createAccount(int customer_id, AccountType type);
+    std::future<std::vector<IdRange>> createAccounts(std::vector<Account> accounts,
+                                                     const BatchOptions &options = BatchOptions());
+    std::future<Account> getAccount(int account_id);
+    std::future<std::vector<Account>> listAccountsByCustomer(int customer_id);
+
+    std::future<bool> deposit(int account_id, Money amount, const std::string &idempotency_key = std::string());
+    std::future<bool> withdraw(int account_id, Money amount, const std::string &idempotency_key = std::string());
+    std::future<bool> transfer(int from_account_id, int to_account_id, Money amount,
+                               const std::string &idempotency_key = std::string());
+    std::future<std::vector<TransactionRecord>> recentTransactions(int account_id, int limit=10);
+    std::future<std::vector<TransactionRecord>> transactionsPage(int account_id, std::int64_t before_txn_id, int limit);
+    // fn runs on the worker thread executing the scan.
+    std::future<std::int64_t> forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                                 std::function<void(const TransactionRecord&)> fn,
+                                                 const ScanOptions &options = ScanOptions());
+    std::future<std::vector<OperationResult>> applyBatch(std::vector<Operation> ops,
+                                                         const BatchOptions &options = BatchOptions());
+
+    // Runs fn(bank) on a worker thread and returns its result through a future.
+    template <typename Fn>
+    auto submit(Fn fn) -> std::future<decltype(fn(std::declval<BankInterface&>()))> {
+        typedef decltype(fn(std::declval<BankInterface&>())) R;
+        auto task = std::make_shared<std::packaged_task<R()>>([this, fn]() mutable { return fn(bank); });
+        std::future<R> result = task->get_future();
+        post([task]() { (*task)(); });
+        return result;
+    }
+
+    // Callback form for event loops: done(result) runs on the worker thread
+    // that executed fn, so it should only hand the result off.
+    template <typename Fn, typename Done>
+    void submit(Fn fn, Done done) {
+        post([this, fn, done]() mutable { done(fn(bank)); });
+    }
+
+    std::size_t pending() const;
+
+private:
+    void post(std::function<void()> task);
+
+    BankInterface &bank;
+    struct Impl;
+    Impl* impl;
+};
+
+#endif // ASYNC_BANK_H
+
+// -------------------- src/async_bank.cpp --------------------
+
+#include "../include/async_bank.h"
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+struct AsyncBank::Impl {
+    std::mutex mu;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> queue;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                wake.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;  // stopping and drained
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            try {
+                task();
+            } catch (std::exception &e) {
+                // packaged_task stores exceptions itself; this only sees callback-form failures
+                std::cerr << "[AsyncBank error] " << e.what() << std::endl;
+            }
+        }
+    }
+};
+
+AsyncBank::AsyncBank(BankInterface &bank, std::size_t threads) : bank(bank), impl(new Impl()) {
+    if (threads == 0) threads = 1;
+    for (std::size_t i = 0; i < threads; ++i) impl->workers.emplace_back([this] { impl->run(); });
+}
+
+AsyncBank::~AsyncBank() {
+    {
+        std::lock_guard<std::mutex> lock(impl->mu);
+        impl->stopping = true;
+    }
+    impl->wake.notify_all();
+    for (auto &t : impl->workers) t.join();
+    delete impl;
+}
+
+void AsyncBank::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(impl->mu);
+        impl->queue.push_back(std::move(task));
+    }
+    impl->wake.notify_one();
+}
+
+std::size_t AsyncBank::pending() const {
+    std::lock_guard<std::mutex> lock(impl->mu);
+    return impl->queue.size();
+}
+
+std::future<int> AsyncBank::createCustomer(const std::string &name, const std::string &email, const std::string &phone) {
+    return submit([name, email, phone](BankInterface &b) { return b.createCustomer(name, email, phone); });
+}
+
+std::future<std::vector<IdRange>> AsyncBank::createCustomers(std::vector<Customer> customers, const BatchOptions &options) {
+    auto shared = std::make_shared<std::vector<Customer>>(std::move(customers));
+    return submit([shared, options](BankInterface &b) { return b.createCustomers(*shared, options); });
+}
+
+std::future<std::vector<Customer>> AsyncBank::listCustomers() {
+    return submit([](BankInterface &b) { return b.listCustomers(); });
+}
+
+std::future<std::int64_t> AsyncBank::forEachCustomer(std::function<void(const Customer&)> fn, const ScanOptions &options) {
+    return submit([fn, options](BankInterface &b) { return b.forEachCustomer(fn, options); });
+}
+
+std::future<Customer> AsyncBank::getCustomer(int customer_id) {
+    return submit([customer_id](BankInterface &b) { return b.getCustomer(customer_id); });
+}
+
+std::future<int> AsyncBank::createAccount(int customer_id, AccountType type) {
+    return submit([customer_id, type](BankInterface &b) { return b.createAccount(customer_id, type); });
+}
+
+std::future<std::vector<IdRange>> AsyncBank::createAccounts(std::vector<Account> accounts, const BatchOptions &options) {
+    auto shared = std::make_shared<std::vector<Account>>(std::move(accounts));
+    return submit([shared, options](BankInterface &b) { return b.createAccounts(*shared, options); });
+}
+
+std::future<Account> AsyncBank::getAccount(int account_id) {
+    return submit([account_id](BankInterface &b) { return b.getAccount(account_id); });
+}
+
+std::future<std::vector<Account>> AsyncBank::listAccountsByCustomer(int customer_id) {
+    return submit([customer_id](BankInterface &b) { return b.listAccountsByCustomer(customer_id); });
+}
+
+std::future<bool> AsyncBank::deposit(int account_id, Money amount, const std::string &idempotency_key) {
+    return submit([account_id, amount, idempotency_key](BankInterface &b) {
+        return b.deposit(account_id, amount, idempotency_key);
+    });
+}
+
+std::future<bool> AsyncBank::withdraw(int account_id, Money amount, const std::string &idempotency_key) {
+    return submit([account_id, amount, idempotency_key](BankInterface &b) {
+        return b.withdraw(account_id, amount, idempotency_key);
+    });
+}
+
+std::future<bool> AsyncBank::transfer(int from_account_id, int to_account_id, Money amount,
+                                      const std::string &idempotency_key) {
+    return submit([from_account_id, to_account_id, amount, idempotency_key](BankInterface &b) {
+        return b.transfer(from_account_id, to_account_id, amount, idempotency_key);
+    });
+}
+
+std::future<std::vector<TransactionRecord>> AsyncBank::recentTransactions(int account_id, int limit) {
+    return submit([account_id, limit](BankInterface &b) { return b.recentTransactions(account_id, limit); });
+}
+
+std::future<std::vector<TransactionRecord>> AsyncBank::transactionsPage(int account_id, std::int64_t before_txn_id, int limit) {
+    return submit([account_id, before_txn_id, limit](BankInterface &b) {
+        return b.transactionsPage(account_id, before_txn_id, limit);
+    });
+}
+
+std::future<std::int64_t> AsyncBank::forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                                        std::function<void(const TransactionRecord&)> fn,
+                                                        const ScanOptions &options) {
+    return submit([account_id, from, to, fn, options](BankInterface &b) {
+        return b.forEachTransaction(account_id, from, to, fn, options);
+    });
+}
+
+std::future<std::vector<OperationResult>> AsyncBank::applyBatch(std::vector<Operation> ops, const BatchOptions &options) {
+    auto shared = std::make_shared<std::vector<Operation>>(std::move(ops));
+    return submit([shared, options](BankInterface &b) { return b.applyBatch(*shared, options); });
+}
+
+// -------------------- include/metrics_server.h --------------------
+
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "bank.h"
+
+// Serves GET /metrics in Prometheus text format for one bank from a
+// background thread. Sized for a scraper polling every few seconds: one
+// request is handled at a time.
+class MetricsServer {
+public:
+    // Throws std::runtime_error if the address cannot be bound. Port 0 picks a free port.
+    MetricsServer(BankInterface &bank, int port, const std::string &bind_address = "0.0.0.0");
+    ~MetricsServer();
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    int port() const { return bound_port; }
+
+private:
+    void run();
+    void serve(int client);
+
+    BankInterface &bank;
+    int fd;
+    int bound_port;
+    std::atomic<bool> stopping;
+    std::thread worker;
+};
+
+#endif // METRICS_SERVER_H
+
+// -------------------- src/metrics_server.cpp --------------------
+
+#include "../include/metrics_server.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+MetricsServer::MetricsServer(BankInterface &bank, int port, const std::string &bind_address)
+    : bank(bank), fd(-1), bound_port(port), stopping(false) {
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) throw std::runtime_error(std::string("metrics socket: ") + std::strerror(errno));
+    int one = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<std::uint16_t>(port));
+    if (::inet_pton(AF_INET, bind_address.c_str(), &addr.sin_addr) != 1 ||
+        ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 16) != 0) {
+        std::string err = std::strerror(errno);
+        ::close(fd);
+        throw std::runtime_error("metrics listen on " + bind_address + ":" + std::to_string(port) + ": " + err);
+    }
+    socklen_t len = sizeof(addr);
+    if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) bound_port = ntohs(addr.sin_port);
+    worker = std::thread(&MetricsServer::run, this);
+}
+
+MetricsServer::~MetricsServer() {
+    stopping = true;
+    worker.join();
+    ::close(fd);
+}
+
+// Polls with a short timeout so the destructor never waits on a blocked accept().
+void MetricsServer::run() {
+    while (!stopping) {
+        pollfd p = {fd, POLLIN, 0};
+        if (::poll(&p, 1, 200) <= 0) continue;
+        int client = ::accept(fd, nullptr, nullptr);
+        if (client < 0) continue;
+        serve(client);
+        ::close(client);
+    }
+}
+
+void MetricsServer::serve(int client) {
+    timeval tv = {1, 0};
+    ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char buf[2048];
+    ssize_t n = ::recv(client, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return;
+    buf[n] = '\0';
+
+    std::string status = "200 OK", body;
+    if (std::strncmp(buf, "GET /metrics", 12) == 0) {
+        body = bank.metricsText();
+    } else {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+    std::string response = "HTTP/1.1 " + status + "\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "Connection: close\r\n\r\n" + body;
+    const char *p = response.data();
+    std::size_t left = response.size();
+    while (left > 0) {
+        ssize_t w = ::send(client, p, left, MSG_NOSIGNAL);
+        if (w <= 0) return;
+        p += w;
+        left -= static_cast<std::size_t>(w);
+    }
+}
+
+// -------------------- include/bank_protocol.h --------------------
+
+#ifndef BANK_PROTOCOL_H
+#define BANK_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Wire protocol of bank_server. Every message is a frame:
+//
+//   u32 length       bytes after this field
+//   u32 request_id   chosen by the client, echoed in the response
+//   u8  opcode       (request) or status (response)
+//   ...              payload
+//
+// Integers are little-endian; a string is a u16 byte count and the bytes;
+// Money is i64 cents. Requests may be pipelined: the client need not wait
+// for a response before sending the next request, and responses come back
+// in completion order, matched by request_id.
+//
+// Request payloads, and the response payload when the status is OK:
+//   PING                 -                                       -
+//   CREATE_CUSTOMER      str name, str email, str phone          i32 customer_id
+//   GET_CUSTOMER         i32 customer_id                         i32 id, str name, str email, str phone
+//   CREATE_ACCOUNT       i32 customer_id, u8 AccountType         i32 account_id
+//   GET_ACCOUNT          i32 account_id                          account
+//   LIST_ACCOUNTS        i32 customer_id                         u32 n, n x account
+//   DEPOSIT, WITHDRAW    i32 account_id, i64 cents, str key      -
+//   TRANSFER             i32 from, i32 to, i64 cents, str key    -
+//   RECENT_TRANSACTIONS  i32 account_id, i32 limit               u32 n, n x transaction
+//   APPLY_BATCH          u32 n, n x operation                    u32 n, n x u8 OperationResult
+//
+//   account      i32 id, i32 customer_id, u8 AccountType, i64 balance_cents
+//   transaction  i64 id, i32 account_id, u8 TransactionType, i64 cents, str details, str created_at
+//   operation    u8 Operation::Kind, i32 account_id, i32 to_account_id, i64 cents
+//
+// An empty key sends the call without an idempotency key. APPLY_BATCH is the
+// way to batch: its operations go to Bank::applyBatch as one call.
+namespace wire {
+
+enum Opcode : std::uint8_t {
+    PING = 0,
+    CREATE_CUSTOMER = 1,
+    GET_CUSTOMER = 2,
+    CREATE_ACCOUNT = 3,
+    GET_ACCOUNT = 4,
+    LIST_ACCOUNTS = 5,
+    DEPOSIT = 6,
+    WITHDRAW = 7,
+    TRANSFER = 8,
+    RECENT_TRANSACTIONS = 9,
+    APPLY_BATCH = 10,
+};
+
+enum Status : std::uint8_t {
+    OK = 0,
+    REJECTED = 1,     // the call returned false or -1: business rule or database error
+    NOT_FOUND = 2,
+    BAD_REQUEST = 3,  // unknown opcode or malformed payload
+    BUSY = 4,         // server is shutting down
+};
+
+static const std::size_t FRAME_HEADER = 9;  // length, request_id, opcode/status
+
+// Appends fields to a frame under construction.
+class Writer {
+public:
+    explicit Writer(std::string &out) : out(out) {}
+
+    // Starts a frame; end() fills in its length.
+    void begin(std::uint32_t request_id, std::uint8_t code) {
+        start = out.size();
+        u32(0);
+        u32(request_id);
+        u8(code);
+    }
+    void end() {
+        std::uint32_t n = static_cast<std::uint32_t>(out.size() - start - 4);
+        for (int i = 0; i < 4; ++i) out[start + i] = static_cast<char>(n >> (8 * i));
+    }
+
+    void u8(std::uint8_t v) { out += static_cast<char>(v); }
+    void u16(std::uint16_t v) { le(v, 2); }
+    void u32(std::uint32_t v) { le(v, 4); }
+    void i32(std::int32_t v) { le(static_cast<std::uint32_t>(v), 4); }
+    void i64(std::int64_t v) { le(static_cast<std::uint64_t>(v), 8); }
+    // Longer strings are cut to 65535 bytes.
+    void str(const std::string &s) {
+        std::size_t n = s.size() < 0xFFFF ? s.size() : 0xFFFF;
+        u16(static_cast<std::uint16_t>(n));
+        out.append(s.data(), n);
+    }
+
+private:
+    void le(std::uint64_t v, int bytes) {
+        for (int i = 0; i < bytes; ++i) out += static_cast<char>(v >> (8 * i));
+    }
+
+    std::string &out;
+    std::size_t start = 0;
+};
+
+// Reads fields from a frame body. Reading past the end sets ok() to false
+// and returns zeros, so a decoder checks ok() once at the end.
+class Reader {
+public:
+    Reader(const char *data, std::size_t n) : p(reinterpret_cast<const unsigned char*>(data)), left(n) {}
+
+    bool ok() const { return good; }
+    bool atEnd() const { return left == 0; }
+
+    std::uint8_t u8() { return static_cast<std::uint8_t>(le(1)); }
+    std::uint16_t u16() { return static_cast<std::uint16_t>(le(2)); }
+    std::uint32_t u32() { return static_cast<std::uint32_t>(le(4)); }
+    std::int32_t i32() { return static_cast<std::int32_t>(static_cast<std::uint32_t>(le(4))); }
+    std::int64_t i64() { return static_cast<std::int64_t>(le(8)); }
+    std::string str() {
+        std::size_t n = u16();
+        if (!take(n)) return std::string();
+        return std::string(reinterpret_cast<const char*>(p - n), n);
+    }
+
+private:
+    bool take(std::size_t n) {
+        if (!good || n > left) {
+            good = false;
+            return false;
+        }
+        p += n;
+        left -= n;
+        return true;
+    }
+    std::uint64_t le(int bytes) {
+        if (!take(static_cast<std::size_t>(bytes))) return 0;
+        std::uint64_t v = 0;
+        for (int i = 0; i < bytes; ++i) v |= static_cast<std::uint64_t>(p[i - bytes]) << (8 * i);
+        return v;
+    }
+
+    const unsigned char *p;
+    std::size_t left;
+    bool good = true;
+};
+
+} // namespace wire
+
+#endif // BANK_PROTOCOL_H
+
+// -------------------- include/bank_server.h --------------------
+
+#ifndef BANK_SERVER_H
+#define BANK_SERVER_H
+
+#include <cstddef>
+#include <string>
+
+#include "bank.h"
+
+struct BankServerOptions {
+    int port = 7400;                      // 0 picks a free port
+    std::string bind_address = "0.0.0.0";
+    std::size_t workers = 16;             // threads running Bank calls; match PoolOptions::max_connections
+    std::size_t max_inflight = 256;       // per connection; reading pauses at this many unanswered requests
+    std::size_t max_frame = 1 << 20;      // bytes; a larger frame closes the connection
+    std::size_t max_connections = 10000;
+};
+
+// Serves a bank over the binary protocol in bank_protocol.h. One thread runs
+// an epoll loop over every connection: it reads and splits frames, hands the
+// calls to an AsyncBank worker pool, and writes back whatever responses are
+// ready in as few send() calls as possible. A connection with max_inflight
+// unanswered requests, or a large unsent backlog, is not read from until it
+// drains, so a fast client cannot queue unbounded work.
+class BankServer {
+public:
+    // Throws std::runtime_error if the address cannot be bound.
+    BankServer(BankInterface &bank, const BankServerOptions &options = BankServerOptions());
+    // Stops reading new requests, sends the responses of those in flight
+    // (waiting up to five seconds), then closes every connection.
+    ~BankServer();
+    BankServer(const BankServer&) = delete;
+    BankServer& operator=(const BankServer&) = delete;
+
+    int port() const;
+
+private:
+    // opaque pointer to keep epoll and connection state out of this header
+    struct Impl;
+    Impl* impl;
+};
+
+#endif // BANK_SERVER_H
+
+// -------------------- src/bank_server.cpp --------------------
+
+#include "../include/bank_server.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../include/async_bank.h"
+#include "../include/bank_protocol.h"
+
+namespace {
+
+const std::size_t MAX_UNSENT = 4 << 20;   // bytes of responses before a connection stops being read
+const std::size_t READ_BUDGET = 256 << 10;  // bytes read per connection per wakeup, for fairness
+const int RECENT_LIMIT = 1000;
+
+struct Connection {
+    explicit Connection(int fd) : fd(fd) {}
+
+    int fd;
+    // loop thread only
+    std::string in;
+    std::string sending;      // responses taken from out, not yet written
+    std::size_t sent = 0;     // bytes of sending already written
+    bool reading = true;      // EPOLLIN enabled
+    bool writing = false;     // EPOLLOUT enabled
+    bool closed = false;
+    // shared with workers
+    std::mutex mu;
+    std::string out;          // finished responses, guarded by mu
+    bool queued = false;      // on the ready list; guarded by Impl::ready_mu
+    std::atomic<std::size_t> inflight{0};
+};
+
+void putAccount(wire::Writer &w, const Account &a) {
+    w.i32(a.id);
+    w.i32(a.customer_id);
+    w.u8(static_cast<std::uint8_t>(a.type));
+    w.i64(a.balance.cents());
+}
+
+// Runs one request against the bank and appends its response frame to out.
+void handle(BankInterface &bank, std::uint32_t id, std::uint8_t op, const std::string &payload, std::string &out) {
+    wire::Reader r(payload.data(), payload.size());
+    wire::Writer w(out);
+    std::string body;
+    wire::Writer b(body);
+    std::uint8_t status = wire::OK;
+    switch (op) {
+    case wire::CREATE_CUSTOMER: {
+        std::string name = r.str(), email = r.str(), phone = r.str();
+        if (!r.ok() || !r.atEnd()) { status = wire::BAD_REQUEST; break; }
+        int cid = bank.createCustomer(name, email, phone);
+        if (cid > 0) b.i32(cid); else status = wire::REJECTED;
+        break;
+    }
+    case wire::GET_CUSTOMER: {
+        int cid = r.i32();
+        if (!r.ok() || !r.atEnd()) { status = wire::BAD_REQUEST; break; }
+        Customer c = bank.getCustomer(cid);
+        if (c.id < 0) { status = wire::NOT_FOUND; break; }
+        b.i32(c.id);
+        b.str(c.name);
+        b.str(c.email);
+        b.str(c.phone);
+        break;
+    }
+    case wire::CREATE_ACCOUNT: {
+        int cid = r.i32();
+        std::uint8_t type = r.u8();
+        if (!r.ok() || !r.atEnd() || type >= ACCOUNT_TYPE_COUNT) { status = wire::BAD_REQUEST; break; }
+        int aid = bank.createAccount(cid, static_cast<AccountType>(type));
+        if (aid > 0) b.i32(aid); else status = wire::REJECTED;
+        break;
+    }
+    case wire::GET_ACCOUNT: {
+        int aid = r.i32();
+        if (!r.ok() || !r.atEnd()) { status = wire::BAD_REQUEST; break; }
+        Account a = bank.getAccount(aid);
+        if (a.id < 0) status = wire::NOT_FOUND; else putAccount(b, a);
+        break;
+    }
+    case wire::LIST_ACCOUNTS: {
+        int cid = r.i32();
+        if (!r.ok() || !r.atEnd()) { status = wire::BAD_REQUEST; break; }
+        std::vector<Account> accounts = bank.listAccountsByCustomer(cid);
+        b.u32(static_cast<std::uint32_t>(accounts.size()));
+        for (const Account &a : accounts) putAccount(b, a);
+        break;
+    }
+    case wire::DEPOSIT:
+    case wire::WITHDRAW: {
+        int aid = r.i32();
+        Money amount = Money::fromCents(r.i64());
+        std::string key = r.str();
+        if (!r.ok() || !r.atEnd()) { status = wire::BAD_REQUEST; break; }
+        bool ok = op == wire::DEPOSIT ? bank.deposit(aid, amount, key) : bank.withdraw(aid, amount, key);
+        if (!ok) status = wire::REJECTED;
+        break;
+    }
+    case wire::TRANSFER: {
+        int from = r.i32(), to = r.i32();
+        Money amount = Money::fromCents(r.i64());
+        std::string key = r.str();
+        if (!r.ok() || !r.atEnd()) { status = wire::BAD_REQUEST; break; }
+        if (!bank.transfer(from, to, amount, key)) status = wire::REJECTED;
+        break;
+    }
+    case wire::RECENT_TRANSACTIONS: {
+        int aid = r.i32(), limit = r.i32();
+        if (!r.ok() || !r.atEnd()) { status = wire::BAD_REQUEST; break; }
+        std::vector<TransactionRecord> rows = bank.recentTransactions(aid, limit < RECENT_LIMIT ? limit : RECENT_LIMIT);
+        b.u32(static_cast<std::uint32_t>(rows.size()));
+        for (const TransactionRecord &t : rows) {
+            b.i64(t.id);
+            b.i32(t.account_id);
+            b.u8(static_cast<std::uint8_t>(t.type));
+            b.i64(t.amount.cents());
+            b.str(t.details);
+            b.str(t.created_at);
+        }
+        break;
+    }
+    case wire::APPLY_BATCH: {
+        std::uint32_t n = r.u32();
+        if (!r.ok() || n > payload.size() / 17) { status = wire::BAD_REQUEST; break; }
+        std::vector<Operation> ops(n);
+        for (Operation &o : ops) {
+            std::uint8_t kind = r.u8();
+            o.kind = static_cast<Operation::Kind>(kind);
+            o.account_id = r.i32();
+            o.to_account_id = r.i32();
+            o.amount = Money::fromCents(r.i64());
+            if (kind > Operation::TRANSFER) status = wire::BAD_REQUEST;
+        }
+        if (status != wire::OK || !r.ok() || !r.atEnd()) { status = wire::BAD_REQUEST; break; }
+        std::vector<OperationResult> results = bank.applyBatch(ops);
+        b.u32(static_cast<std::uint32_t>(results.size()));
+        for (OperationResult res : results) b.u8(static_cast<std::uint8_t>(res));
+        break;
+    }
+    default:
+        status = wire::BAD_REQUEST;
+    }
+    if (status != wire::OK) body.clear();
+    w.begin(id, status);
+    out += body;
+    w.end();
+}
+
+void reply(std::string &out, std::uint32_t id, std::uint8_t status) {
+    wire::Writer w(out);
+    w.begin(id, status);
+    w.end();
+}
+
+} // namespace
+
+struct BankServer::Impl {
+    Impl(BankInterface &bank, const BankServerOptions &options) : bank(bank), options(options) {}
+
+    BankInterface &bank;
+    BankServerOptions options;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    int bound_port = 0;
+    std::unique_ptr<AsyncBank> async;
+    std::unordered_map<Connection*, std::shared_ptr<Connection>> connections;  // loop thread only
+
+    std::mutex ready_mu;
+    std::vector<std::shared_ptr<Connection>> ready;  // connections with new responses in out
+
+    std::atomic<bool> draining{false};
+    std::atomic<std::size_t> inflight{0};  // across all connections
+    std::thread loop_thread;
+
+    void loop();
+    void accept();
+    void onReadable(Connection &c);
+    void parse(const std::shared_ptr<Connection> &c);
+    void dispatch(const std::shared_ptr<Connection> &c, std::uint32_t id, std::uint8_t op, const char *p, std::size_t n);
+    void deliver(const std::shared_ptr<Connection> &c, std::string &&response);
+    void flush(const std::shared_ptr<Connection> &c);
+    void service(const std::shared_ptr<Connection> &c);
+    bool idle();
+    void watch(Connection &c);
+    void close(Connection &c);
+};
+
+BankServer::BankServer(BankInterface &bank, const BankServerOptions &options) : impl(new Impl(bank, options)) {
+    std::unique_ptr<Impl> guard(impl);
+    Impl &s = *impl;
+    s.listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s.listen_fd < 0) throw std::runtime_error(std::string("server socket: ") + std::strerror(errno));
+    int one = 1;
+    ::setsockopt(s.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<std::uint16_t>(options.port));
+    if (::inet_pton(AF_INET, options.bind_address.c_str(), &addr.sin_addr) != 1 ||
+        ::bind(s.listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(s.listen_fd, 1024) != 0) {
+        std::string err = std::strerror(errno);
+        ::close(s.listen_fd);
+        throw std::runtime_error("server listen on " + options.bind_address + ":" + std::to_string(options.port) + ": " + err);
+    }
+    socklen_t len = sizeof(addr);
+    s.bound_port = ::getsockname(s.listen_fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0 ? ntohs(addr.sin_port)
+                                                                                             : options.port;
+    s.epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    s.wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s.epoll_fd < 0 || s.wake_fd < 0) {
+        std::string err = std::strerror(errno);
+        ::close(s.listen_fd);
+        if (s.epoll_fd >= 0) ::close(s.epoll_fd);
+        if (s.wake_fd >= 0) ::close(s.wake_fd);
+        throw std::runtime_error("server epoll: " + err);
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;  // the listening socket
+    ::epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.listen_fd, &ev);
+    ev.data.ptr = &s.wake_fd;
+    ::epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.wake_fd, &ev);
+
+    s.async.reset(new AsyncBank(bank, options.workers));
+    s.loop_thread = std::thread(&Impl::loop, impl);
+    guard.release();
+}
+
+BankServer::~BankServer() {
+    impl->draining = true;
+    std::uint64_t one = 1;
+    if (::write(impl->wake_fd, &one, sizeof(one)) < 0) {}
+    impl->loop_thread.join();
+    impl->async.reset();  // runs anything still queued; those responses are dropped
+    for (auto &entry : impl->connections) ::close(entry.first->fd);
+    ::close(impl->listen_fd);
+    ::close(impl->epoll_fd);
+    ::close(impl->wake_fd);
+    delete impl;
+}
+
+int BankServer::port() const {
+    return impl->bound_port;
+}
+
+void BankServer::Impl::loop() {
+    std::vector<epoll_event> events(256);
+    bool drain_started = false;
+    std::chrono::steady_clock::time_point drain_deadline;
+    for (;;) {
+        if (draining) {
+            if (!drain_started) {
+                drain_started = true;
+                drain_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+                ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, nullptr);
+            }
+            if (idle() || std::chrono::steady_clock::now() > drain_deadline) return;
+        }
+        int n = ::epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), draining ? 50 : -1);
+        for (int i = 0; i < n; ++i) {
+            void *tag = events[i].data.ptr;
+            if (tag == nullptr) {
+                accept();
+            } else if (tag == &wake_fd) {
+                std::uint64_t count;
+                if (::read(wake_fd, &count, sizeof(count)) < 0) {}
+                std::vector<std::shared_ptr<Connection>> batch;
+                {
+                    std::lock_guard<std::mutex> lock(ready_mu);
+                    batch.swap(ready);
+                    for (auto &c : batch) c->queued = false;
+                }
+                for (auto &c : batch) service(c);
+            } else {
+                auto it = connections.find(static_cast<Connection*>(tag));
+                if (it == connections.end()) continue;
+                std::shared_ptr<Connection> c = it->second;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) { close(*c); continue; }
+                if (events[i].events & EPOLLOUT) service(c);
+                if (!c->closed && (events[i].events & EPOLLIN)) {
+                    onReadable(*c);
+                    if (!c->closed) parse(c);
+                    if (!c->closed && c->sent < c->sending.size()) flush(c);  // PING answers
+                }
+            }
+        }
+    }
+}
+
+void BankServer::Impl::accept() {
+    for (;;) {
+        int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;  // EAGAIN, or an error the next wakeup retries
+        if (connections.size() >= options.max_connections) {
+            ::close(fd);
+            continue;
+        }
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        auto c = std::make_shared<Connection>(fd);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c.get();
+        if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            ::close(fd);
+            continue;
+        }
+        connections[c.get()] = c;
+    }
+}
+
+void BankServer::Impl::onReadable(Connection &c) {
+    if (draining || !c.reading) return;
+    char buf[64 << 10];
+    std::size_t total = 0;
+    while (total < READ_BUDGET) {
+        ssize_t got = ::recv(c.fd, buf, sizeof(buf), 0);
+        if (got > 0) {
+            c.in.append(buf, static_cast<std::size_t>(got));
+            total += static_cast<std::size_t>(got);
+            continue;
+        }
+        if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close(c);  // peer closed or reset; unanswered requests are dropped
+            return;
+        }
+        if (errno != EINTR) return;
+    }
+}
+
+// Splits complete frames off the input and dispatches them, until the input
+// runs out or the connection reaches its in-flight limit.
+void BankServer::Impl::parse(const std::shared_ptr<Connection> &c) {
+    if (draining) return;
+    std::size_t pos = 0;
+    bool paused = false;
+    while (c->in.size() - pos >= 4) {
+        if (c->inflight >= options.max_inflight || c->sending.size() - c->sent > MAX_UNSENT) {
+            paused = true;
+            break;
+        }
+        const unsigned char *h = reinterpret_cast<const unsigned char*>(c->in.data() + pos);
+        std::uint32_t length = h[0] | (h[1] << 8) | (h[2] << 16) | (static_cast<std::uint32_t>(h[3]) << 24);
+        if (length < wire::FRAME_HEADER - 4 || length > options.max_frame) {
+            close(*c);
+            return;
+        }
+        if (c->in.size() - pos < 4 + std::size_t(length)) break;
+        std::uint32_t id = h[4] | (h[5] << 8) | (h[6] << 16) | (static_cast<std::uint32_t>(h[7]) << 24);
+        dispatch(c, id, h[8], c->in.data() + pos + wire::FRAME_HEADER, length - (wire::FRAME_HEADER - 4));
+        pos += 4 + length;
+    }
+    c->in.erase(0, pos);
+    if (paused == c->reading) {
+        c->reading = !paused;
+        watch(*c);
+    }
+}
+
+void BankServer::Impl::dispatch(const std::shared_ptr<Connection> &c, std::uint32_t id, std::uint8_t op,
+                                const char *p, std::size_t n) {
+    if (op == wire::PING) {
+        reply(c->sending, id, wire::OK);
+        return;
+    }
+    ++c->inflight;
+    ++inflight;
+    std::string payload(p, n);
+    std::shared_ptr<Connection> conn = c;
+    async->submit([id, op, payload](BankInterface &bank) {
+        std::string out;
+        try {
+            handle(bank, id, op, payload, out);
+        } catch (std::exception &e) {
+            std::cerr << "[BankServer error] " << e.what() << std::endl;
+            out.clear();
+            reply(out, id, wire::REJECTED);
+        }
+        return out;
+    }, [this, conn](std::string out) { deliver(conn, std::move(out)); });
+}
+
+// Worker side: queues a response and wakes the loop if it is not already
+// due to look at this connection.
+void BankServer::Impl::deliver(const std::shared_ptr<Connection> &c, std::string &&response) {
+    {
+        std::lock_guard<std::mutex> lock(c->mu);
+        c->out += response;
+    }
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> lock(ready_mu);
+        if (!c->queued) {
+            c->queued = true;
+            wake = ready.empty();
+            ready.push_back(c);
+        }
+    }
+    --c->inflight;
+    --inflight;  // after queueing, so idle() never sees a response in limbo
+    if (wake) {
+        std::uint64_t one = 1;
+        if (::write(wake_fd, &one, sizeof(one)) < 0) {}
+    }
+}
+
+void BankServer::Impl::flush(const std::shared_ptr<Connection> &c) {
+    if (c->closed) return;
+    {
+        std::lock_guard<std::mutex> lock(c->mu);
+        if (c->sent == c->sending.size()) {
+            c->sending.swap(c->out);
+            c->out.clear();
+            c->sent = 0;
+        } else {
+            c->sending += c->out;
+            c->out.clear();
+        }
+    }
+    while (c->sent < c->sending.size()) {
+        ssize_t w = ::send(c->fd, c->sending.data() + c->sent, c->sending.size() - c->sent, MSG_NOSIGNAL);
+        if (w > 0) {
+            c->sent += static_cast<std::size_t>(w);
+            continue;
+        }
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        close(*c);
+        return;
+    }
+    if (c->sent == c->sending.size()) {
+        c->sending.clear();
+        c->sent = 0;
+    }
+    bool want_write = c->sent < c->sending.size();
+    if (want_write != c->writing) {
+        c->writing = want_write;
+        watch(*c);
+    }
+}
+
+// Sends what is ready; a paused connection may then take more requests.
+void BankServer::Impl::service(const std::shared_ptr<Connection> &c) {
+    flush(c);
+    if (c->closed || c->reading) return;
+    parse(c);
+    if (!c->closed && c->sent < c->sending.size()) flush(c);
+}
+
+bool BankServer::Impl::idle() {
+    if (inflight != 0) return false;
+    {
+        std::lock_guard<std::mutex> lock(ready_mu);
+        if (!ready.empty()) return false;
+    }
+    for (auto &entry : connections) {
+        if (entry.first->sent < entry.first->sending.size()) return false;
+    }
+    return true;
+}
+
+void BankServer::Impl::watch(Connection &c) {
+    epoll_event ev;
+    ev.events = (c.reading ? EPOLLIN : 0u) | (c.writing ? EPOLLOUT : 0u);
+    ev.data.ptr = &c;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void BankServer::Impl::close(Connection &c) {
+    if (c.closed) return;
+    c.closed = true;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+    ::close(c.fd);
+    connections.erase(&c);  // workers may still hold it; their responses are dropped
+}
+
+// -------------------- include/change_feed.h --------------------
+
+#ifndef CHANGE_FEED_H
+#define CHANGE_FEED_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "bank.h"
+
+// One committed money movement. Fixed size and trivially copyable.
+struct LedgerEvent {
+    std::uint64_t seq;           // position in the feed: 0, 1, 2, ... in publish order
+    std::int64_t time_ns;        // wall clock at publish, ns since the Unix epoch
+    std::int64_t amount_cents;
+    std::int32_t account_id;     // source account for TRANSFER
+    std::int32_t to_account_id;  // TRANSFER only, else 0
+    std::uint8_t kind;           // Operation::Kind
+};
+
+// Little-endian wire form for message buses: seq, time_ns, amount_cents,
+// account_id, to_account_id, kind.
+static const std::size_t LEDGER_EVENT_WIRE_SIZE = 33;
+void encodeEvent(const LedgerEvent &e, unsigned char *out);
+LedgerEvent decodeEvent(const unsigned char *in);
+
+// Broadcast ring of the events published by one or more banks. Every
+// subscriber reads the same slots, so fan-out costs nothing at publish time
+// and nothing is allocated per event. Publishing never waits on subscribers:
+// one that falls a whole ring behind loses the overwritten events, and
+// Subscription::lost() says how many.
+//
+// Events are published right after their transaction commits (or, with the
+// ledger engine, once they are in the WAL), so concurrent calls on the same
+// account may appear in either order. Nothing is replayed after a restart.
+class ChangeFeed {
+public:
+    // capacity is rounded up to a power of two.
+    explicit ChangeFeed(std::size_t capacity);
+    ChangeFeed(const ChangeFeed&) = delete;
+    ChangeFeed& operator=(const ChangeFeed&) = delete;
+
+    // Safe from any number of threads. Fills in e.seq.
+    void publish(LedgerEvent e);
+    void publish(Operation::Kind kind, int account_id, int to_account_id, Money amount);
+
+    std::uint64_t published() const { return head.load(std::memory_order_acquire); }
+    std::size_t capacity() const { return mask + 1; }
+
+    // One reader's position. Not thread-safe; give each consumer its own.
+    class Subscription {
+    public:
+        // Copies up to max events, oldest first, and returns how many.
+        std::size_t poll(LedgerEvent *out, std::size_t max);
+        // Blocks until an event is ready or timeout passes; true if one is ready.
+        bool wait(std::chrono::milliseconds timeout);
+        std::uint64_t lost() const { return lost_events; }
+        std::uint64_t position() const { return next; }
+
+    private:
+        friend class ChangeFeed;
+        Subscription(ChangeFeed &feed, std::uint64_t next) : feed(&feed), next(next), lost_events(0) {}
+        bool ready() const;
+
+        ChangeFeed *feed;
+        std::uint64_t next;
+        std::uint64_t lost_events;
+    };
+
+    // Starts at the next event published from now on.
+    Subscription subscribe() { return Subscription(*this, published()); }
+
+private:
+    static constexpr std::size_t WORDS = sizeof(LedgerEvent) / sizeof(std::uint64_t);
+
+    // seq is 2 * position + 1 while the slot is written and 2 * position + 2
+    // once it holds that position's event (a per-slot seqlock).
+    struct Slot {
+        std::atomic<std::uint64_t> seq{0};
+        std::atomic<std::uint64_t> words[WORDS];
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask;
+    std::atomic<std::uint64_t> head{0};  // next position to claim
+    std::atomic<int> waiters{0};
+    std::mutex wait_mutex;
+    std::condition_variable wake;
+};
+
+// Pumps a feed into a message bus client from a background thread. sink gets
+// batches of events in order and returns false to have the same batch offered
+// again a little later (for example while the broker is unreachable).
+class FeedForwarder {
+public:
+    typedef std::function<bool(const LedgerEvent*, std::size_t)> Sink;
+
+    FeedForwarder(ChangeFeed &feed, Sink sink, std::size_t batch = 256);
+    // Stops after the batch in hand; events not yet forwarded are dropped.
+    ~FeedForwarder();
+    FeedForwarder(const FeedForwarder&) = delete;
+    FeedForwarder& operator=(const FeedForwarder&) = delete;
+
+    std::uint64_t forwarded() const { return forwarded_events.load(std::memory_order_relaxed); }
+    std::uint64_t lost() const { return lost_events.load(std::memory_order_relaxed); }
+
+private:
+    void run();
+
+    ChangeFeed::Subscription subscription;
+    Sink sink;
+    std::size_t batch;
+    std::atomic<bool> stopping;
+    std::atomic<std::uint64_t> forwarded_events;
+    std::atomic<std::uint64_t> lost_events;
+    std::thread worker;
+};
+
+#endif // CHANGE_FEED_H
+
+// -------------------- src/change_feed.cpp --------------------
+
+#include "../include/change_feed.h"
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+static_assert(std::is_trivially_copyable<LedgerEvent>::value, "LedgerEvent is copied word by word");
+static_assert(sizeof(LedgerEvent) % sizeof(std::uint64_t) == 0, "LedgerEvent must fill whole slot words");
+
+static void putLE(unsigned char *out, std::uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) out[i] = static_cast<unsigned char>(v >> (8 * i));
+}
+
+static std::uint64_t getLE(const unsigned char *in, int bytes) {
+    std::uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v |= static_cast<std::uint64_t>(in[i]) << (8 * i);
+    return v;
+}
+
+void encodeEvent(const LedgerEvent &e, unsigned char *out) {
+    putLE(out, e.seq, 8);
+    putLE(out + 8, static_cast<std::uint64_t>(e.time_ns), 8);
+    putLE(out + 16, static_cast<std::uint64_t>(e.amount_cents), 8);
+    putLE(out + 24, static_cast<std::uint32_t>(e.account_id), 4);
+    putLE(out + 28, static_cast<std::uint32_t>(e.to_account_id), 4);
+    out[32] = e.kind;
+}
+
+LedgerEvent decodeEvent(const unsigned char *in) {
+    LedgerEvent e;
+    std::memset(&e, 0, sizeof(e));
+    e.seq = getLE(in, 8);
+    e.time_ns = static_cast<std::int64_t>(getLE(in + 8, 8));
+    e.amount_cents = static_cast<std::int64_t>(getLE(in + 16, 8));
+    e.account_id = static_cast<std::int32_t>(static_cast<std::uint32_t>(getLE(in + 24, 4)));
+    e.to_account_id = static_cast<std::int32_t>(static_cast<std::uint32_t>(getLE(in + 28, 4)));
+    e.kind = in[32];
+    return e;
+}
+
+ChangeFeed::ChangeFeed(std::size_t capacity) {
+    std::size_t size = 2;
+    while (size < capacity) size <<= 1;
+    slots.reset(new Slot[size]);
+    mask = size - 1;
+}
+
+void ChangeFeed::publish(Operation::Kind kind, int account_id, int to_account_id, Money amount) {
+    LedgerEvent e;
+    std::memset(&e, 0, sizeof(e));
+    e.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    e.amount_cents = amount.cents();
+    e.account_id = account_id;
+    e.to_account_id = to_account_id;
+    e.kind = static_cast<std::uint8_t>(kind);
+    publish(e);
+}
+
+void ChangeFeed::publish(LedgerEvent e) {
+    const std::uint64_t pos = head.fetch_add(1, std::memory_order_acq_rel);
+    e.seq = pos;
+    Slot &slot = slots[pos & mask];
+    // Slots are written in lap order: wait for the writer one lap back, which
+    // only matters if publishers are a whole ring apart.
+    const std::uint64_t previous = pos > mask ? 2 * (pos - mask - 1) + 2 : 0;
+    while (slot.seq.load(std::memory_order_acquire) != previous) std::this_thread::yield();
+
+    std::uint64_t words[WORDS];
+    std::memcpy(words, &e, sizeof(e));
+    slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t i = 0; i < WORDS; ++i) slot.words[i].store(words[i], std::memory_order_relaxed);
+    slot.seq.store(2 * pos + 2, std::memory_order_release);
+
+    // pairs with the increment in Subscription::wait so a waiter either sees
+    // this event or is woken for it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        wake.notify_all();
+    }
+}
+
+bool ChangeFeed::Subscription::ready() const {
+    return feed->slots[next & feed->mask].seq.load(std::memory_order_acquire) >= 2 * next + 2;
+}
+
+std::size_t ChangeFeed::Subscription::poll(LedgerEvent *out, std::size_t max) {
+    std::size_t n = 0;
+    while (n < max) {
+        const Slot &slot = feed->slots[next & feed->mask];
+        const std::uint64_t want = 2 * next + 2;
+        std::uint64_t before = slot.seq.load(std::memory_order_acquire);
+        if (before < want) break;  // not published yet
+        std::uint64_t words[WORDS];
+        if (before == want) {
+            for (std::size_t i = 0; i < WORDS; ++i) words[i] = slot.words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == want) {
+                std::memcpy(&out[n++], words, sizeof(LedgerEvent));
+                ++next;
+                continue;
+            }
+        }
+        // Overwritten by a later lap: skip to the oldest event still in the ring.
+        const std::uint64_t head = feed->head.load(std::memory_order_acquire);
+        const std::uint64_t oldest = head > feed->mask + 1 ? head - feed->mask - 1 : 0;
+        const std::uint64_t resume = std::max(next + 1, oldest);
+        lost_events += resume - next;
+        next = resume;
+    }
+    return n;
+}
+
+bool ChangeFeed::Subscription::wait(std::chrono::milliseconds timeout) {
+    if (ready()) return true;
+    feed->waiters.fetch_add(1, std::memory_order_seq_cst);
+    bool got;
+    {
+        std::unique_lock<std::mutex> lock(feed->wait_mutex);
+        got = feed->wake.wait_for(lock, timeout, [this]() { return ready(); });
+    }
+    feed->waiters.fetch_sub(1, std::memory_order_relaxed);
+    return got;
+}
+
+FeedForwarder::FeedForwarder(ChangeFeed &feed, Sink sink, std::size_t batch)
+    : subscription(feed.subscribe()), sink(sink), batch(batch ? batch : 1), stopping(false), forwarded_events(0),
+      lost_events(0) {
+    worker = std::thread(&FeedForwarder::run, this);
+}
+
+FeedForwarder::~FeedForwarder() {
+    stopping = true;
+    worker.join();
+}
+
+// Wakes at least every 100ms to notice stopping.
+void FeedForwarder::run() {
+    std::unique_ptr<LedgerEvent[]> events(new LedgerEvent[batch]);
+    while (!stopping) {
+        if (!subscription.wait(std::chrono::milliseconds(100))) continue;
+        std::size_t n = subscription.poll(events.get(), batch);
+        lost_events.store(subscription.lost(), std::memory_order_relaxed);
+        if (n == 0) continue;
+        while (!sink(events.get(), n)) {
+            if (stopping) return;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        forwarded_events.fetch_add(n, std::memory_order_relaxed);
+    }
+}
+
+// -------------------- include/eod_report.h --------------------
+
+#ifndef EOD_REPORT_H
+#define EOD_REPORT_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include "money.h"
+
+class AccountSnapshot;
+struct SnapshotColumns;
+
+struct EndOfDayOptions {
+    std::string interest_type = "SAVINGS";
+    std::int64_t interest_rate_ppm = 0;  // interest for this run, parts per million of a positive balance
+    Money low_balance;                   // accounts with a balance below this are listed; zero lists overdrawn ones
+};
+
+struct EndOfDayReport {
+    std::uint64_t lsn = 0;  // WAL position of the data the report covers
+    std::size_t accounts = 0;
+    Money total;                                     // sum of all balances (total liabilities)
+    std::vector<std::pair<std::string, Money>> by_type;
+    Money interest_total;
+    std::vector<std::pair<int, Money>> interest;     // account_id and amount, non-zero entries only
+    std::vector<int> low_balance_accounts;
+    double seconds = 0;                              // time spent in the kernels
+};
+
+// End-of-day aggregates over a columnar copy of the accounts table, computed
+// in memory with vectorized scans instead of SQL on the primary. The snapshot
+// overload reads a mapped snapshot file in place; Bank::endOfDay() runs the
+// other on the live balances of its ledger engine.
+EndOfDayReport endOfDay(const AccountSnapshot &snapshot, const EndOfDayOptions &options);
+EndOfDayReport endOfDay(const SnapshotColumns &columns, std::uint64_t lsn, const EndOfDayOptions &options);
+
+#endif // EOD_REPORT_H
+
+// -------------------- src/eod_report.cpp --------------------
+
+#include "../include/eod_report.h"
+#include <chrono>
+#include "account_kernels.h"
+#include "account_snapshot.h"
+
+namespace {
+
+struct ColumnsView {
+    std::size_t n;
+    const std::int32_t *ids;
+    const std::uint8_t *type_codes;
+    const std::int64_t *balance_cents;
+    std::vector<std::string> type_names;
+};
+
+EndOfDayReport report(const ColumnsView &v, std::uint64_t lsn, const EndOfDayOptions &options) {
+    EndOfDayReport r;
+    r.lsn = lsn;
+    r.accounts = v.n;
+    auto start = std::chrono::steady_clock::now();
+
+    r.total = Money::fromCents(sumCents(v.balance_cents, v.n));
+
+    std::int64_t totals[SNAPSHOT_MAX_TYPES] = {};
+    std::size_t types = v.type_names.size() < SNAPSHOT_MAX_TYPES ? v.type_names.size() : SNAPSHOT_MAX_TYPES;
+    sumCentsByCode(v.type_codes, v.balance_cents, v.n, totals, types);
+    for (std::size_t t = 0; t < types; ++t) {
+        if (!v.type_names[t].empty()) r.by_type.emplace_back(v.type_names[t], Money::fromCents(totals[t]));
+    }
+
+    std::vector<std::uint32_t> rows(v.n);
+    rows.resize(rowsBelow(v.balance_cents, v.n, options.low_balance.cents(), rows.data()));
+    r.low_balance_accounts.reserve(rows.size());
+    for (std::uint32_t row : rows) r.low_balance_accounts.push_back(v.ids[row]);
+
+    for (std::size_t t = 0; t < types; ++t) {
+        if (v.type_names[t] != options.interest_type || options.interest_rate_ppm == 0) continue;
+        std::vector<std::int64_t> interest(v.n);
+        r.interest_total = Money::fromCents(accrueInterest(v.type_codes, v.balance_cents, v.n,
+                                                           static_cast<std::uint8_t>(t),
+                                                           options.interest_rate_ppm, interest.data()));
+        for (std::size_t i = 0; i < v.n; ++i) {
+            if (interest[i] != 0) r.interest.emplace_back(v.ids[i], Money::fromCents(interest[i]));
+        }
+    }
+
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return r;
+}
+
+} // namespace
+
+EndOfDayReport endOfDay(const AccountSnapshot &snapshot, const EndOfDayOptions &options) {
+    ColumnsView v{snapshot.size(), snapshot.ids(), snapshot.typeCodes(), snapshot.balanceCents(), {}};
+    for (std::size_t t = 0; t < snapshot.typeCount(); ++t) {
+        v.type_names.push_back(snapshot.typeName(static_cast<std::uint8_t>(t)));
+    }
+    return report(v, snapshot.lsn(), options);
+}
+
+EndOfDayReport endOfDay(const SnapshotColumns &columns, std::uint64_t lsn, const EndOfDayOptions &options) {
+    ColumnsView v{columns.ids.size(), columns.ids.data(), columns.type_codes.data(),
+                  columns.balance_cents.data(), columns.type_names};
+    return report(v, lsn, options);
+}
+
+// -------------------- include/sharded_bank.h --------------------
+
+#ifndef SHARDED_BANK_H
+#define SHARDED_BANK_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bank.h"
+#include "change_feed.h"
+
+// One MySQL instance of a ShardedBank. The shard owns every customer and
+// account id from first_id up to the next shard's first_id. Its customers
+// and accounts tables must hand out ids from first_id on, so run
+// "ALTER TABLE customers AUTO_INCREMENT = <first_id>" and the same for
+// accounts when the shard is created.
+struct ShardSpec {
+    std::string host;
+    int first_id;
+};
+
+// Spreads customers over several databases by id range. A customer's
+// accounts live on the customer's shard, so everything except a transfer
+// between two shards is a call on one Bank.
+//
+// Cross-shard transfers run as a saga of local transactions:
+//   1. source shard: debit, ledger row, shard_transfers leg (PENDING)
+//   2. target shard: credit and ledger row, once per leg (shard_transfer_credits)
+//   3. source shard: mark the leg DONE, or refund it if step 2 was rejected
+// A crash or unreachable shard between steps leaves the leg PENDING, and
+// resumePendingTransfers() finishes it later. Until then the money is
+// in flight: debited at the source, not yet credited at the target.
+//
+// New customers go to the shards in turn. applyBatch keeps the order of
+// operations within a shard but runs the shards in parallel; a cross-shard
+// transfer runs in its source shard's place, after the operations before it
+// there and before those after it. Its credit is not ordered against the
+// target shard's own operations.
+// The ledger engine is not supported per shard; options.ledger is ignored.
+class ShardedBank : public BankInterface {
+public:
+    ShardedBank(const std::vector<ShardSpec> &shards, const std::string &user, const std::string &pass,
+                const std::string &db, const BankOptions &options = BankOptions());
+    ShardedBank(const ShardedBank&) = delete;
+    ShardedBank& operator=(const ShardedBank&) = delete;
+
+    int createCustomer(const std::string &name, const std::string &email, const std::string &phone) override;
+    std::vector<IdRange> createCustomers(const std::vector<Customer> &customers,
+                                         const BatchOptions &options = BatchOptions()) override;
+    std::vector<Customer> listCustomers() override;
+    std::int64_t forEachCustomer(const std::function<void(const Customer&)> &fn,
+                                 const ScanOptions &options = ScanOptions()) override;
+    std::int64_t forEachCustomerView(const std::function<void(const CustomerView&)> &fn,
+                                     const ScanOptions &options = ScanOptions()) override;
+    Customer getCustomer(int customer_id) override;
+
+    int createAccount(int customer_id, AccountType type) override;
+    std::vector<IdRange> createAccounts(const std::vector<Account> &accounts,
+                                        const BatchOptions &options = BatchOptions()) override;
+    Account getAccount(int account_id) override;
+    std::vector<Account> listAccountsByCustomer(int customer_id) override;
+
+    bool deposit(int account_id, Money amount, const std::string &idempotency_key = std::string()) override;
+    bool withdraw(int account_id, Money amount, const std::string &idempotency_key = std::string()) override;
+    bool transfer(int from_account_id, int to_account_id, Money amount,
+                  const std::string &idempotency_key = std::string()) override;
+    std::vector<TransactionRecord> recentTransactions(int account_id, int limit=10) override;
+    std::vector<TransactionRecord> transactionsPage(int account_id, std::int64_t before_txn_id, int limit) override;
+    std::int64_t forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                    const std::function<void(const TransactionRecord&)> &fn,
+                                    const ScanOptions &options = ScanOptions()) override;
+    std::int64_t forEachTransactionView(int account_id, const std::string &from, const std::string &to,
+                                        const std::function<void(const TransactionView&)> &fn,
+                                        const ScanOptions &options = ScanOptions()) override;
+    bool balanceAsOf(int account_id, const std::string &day, Money &out) override;
+    std::vector<DailyRollup> dailyRollups(int account_id, const std::string &from, const std::string &to) override;
+
+    std::vector<OperationResult> applyBatch(const std::vector<Operation> &ops,
+                                            const BatchOptions &options = BatchOptions()) override;
+
+    // Summed over the shards; a quantile is the largest of the shards' values.
+    CacheStats cacheStats() override;
+    MetricsSnapshot metrics() override;
+    std::string metricsText() override;
+    // Shards publish their own operations to it; a cross-shard transfer is
+    // published once, as a TRANSFER, when its outbound leg is settled.
+    ChangeFeed *changeFeed() override { return feed; }
+
+    // Settles cross-shard legs left PENDING for at least older_than_s seconds.
+    // Runs once at construction; call it periodically as well. Safe to run
+    // from several processes at once. Returns the number of legs settled.
+    int resumePendingTransfers(int older_than_s = 60);
+
+    std::size_t shardCount() const { return shards.size(); }
+    // Index of the shard owning a customer or account id, or -1.
+    int shardOf(int id) const;
+
+private:
+    OperationResult crossShardTransfer(int source, int target, int from_account_id, int to_account_id, Money amount,
+                                       const std::string &idempotency_key = std::string());
+    void checkRange(int shard, const IdRange &range) const;
+
+    std::unique_ptr<ChangeFeed> own_feed;
+    ChangeFeed *feed = nullptr;
+    std::vector<int> first_ids;                 // ascending, parallel to shards
+    std::vector<std::unique_ptr<Bank>> shards;
+    std::atomic<unsigned> next_shard{0};        // round robin for new customers
+};
+
+#endif // SHARDED_BANK_H
+
+// -------------------- src/sharded_bank.cpp --------------------
+
+#include "../include/sharded_bank.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "metrics.h"
+
+ShardedBank::ShardedBank(const std::vector<ShardSpec> &specs, const std::string &user, const std::string &pass,
+                         const std::string &db, const BankOptions &options) {
+    if (specs.empty()) throw std::invalid_argument("ShardedBank needs at least one shard");
+    std::vector<ShardSpec> sorted(specs);
+    std::sort(sorted.begin(), sorted.end(), [](const ShardSpec &a, const ShardSpec &b) { return a.first_id < b.first_id; });
+    BankOptions shard_options(options);
+    if (!shard_options.ledger.wal_path.empty()) {
+        std::cerr << "[ShardedBank] the ledger engine is not supported on shards; ignoring ledger.wal_path" << std::endl;
+        shard_options.ledger.wal_path.clear();
+    }
+    feed = options.feed.shared;
+    if (!feed && options.feed.capacity > 0) {
+        own_feed.reset(new ChangeFeed(options.feed.capacity));
+        feed = own_feed.get();
+    }
+    shard_options.feed.shared = feed;
+    shard_options.feed.capacity = 0;
+    for (const ShardSpec &spec : sorted) {
+        if (!first_ids.empty() && spec.first_id == first_ids.back()) {
+            throw std::invalid_argument("two shards share first_id " + std::to_string(spec.first_id));
+        }
+        first_ids.push_back(spec.first_id);
+        shards.emplace_back(new Bank(spec.host, user, pass, db, shard_options));
+    }
+    resumePendingTransfers();
+}
+
+int ShardedBank::shardOf(int id) const {
+    auto it = std::upper_bound(first_ids.begin(), first_ids.end(), id);
+    if (it == first_ids.begin()) return -1;
+    return static_cast<int>(it - first_ids.begin()) - 1;
+}
+
+// A shard whose AUTO_INCREMENT was never raised to its first_id hands out ids
+// that route elsewhere; the rows exist, but say so loudly.
+void ShardedBank::checkRange(int shard, const IdRange &range) const {
+    if (range.count == 0) return;
+    int last = range.first + (range.count - 1) * range.step;
+    if (shardOf(range.first) != shard || shardOf(last) != shard) {
+        std::cerr << "[ShardedBank error] shard " << shard << " returned ids " << range.first << ".." << last
+                  << " outside its range; check its AUTO_INCREMENT" << std::endl;
+    }
+}
+
+int ShardedBank::createCustomer(const std::string &name, const std::string &email, const std::string &phone) {
+    int shard = static_cast<int>(next_shard.fetch_add(1, std::memory_order_relaxed) % shards.size());
+    int id = shards[shard]->createCustomer(name, email, phone);
+    if (id > 0) checkRange(shard, IdRange{id, 1, 1});
+    return id;
+}
+
+// Input is cut into one contiguous slice per shard so the returned ranges stay
+// in input order. A slice that comes back short ends the call: the ranges then
+// still describe a prefix of the input.
+std::vector<IdRange> ShardedBank::createCustomers(const std::vector<Customer> &customers, const BatchOptions &options) {
+    std::vector<IdRange> out;
+    const std::size_t n = shards.size();
+    const std::size_t start_shard = next_shard.fetch_add(1, std::memory_order_relaxed) % n;
+    const std::size_t per_shard = (customers.size() + n - 1) / n;
+    for (std::size_t k = 0, begin = 0; k < n && begin < customers.size(); ++k, begin += per_shard) {
+        const std::size_t end = std::min(customers.size(), begin + per_shard);
+        const int shard = static_cast<int>((start_shard + k) % n);
+        std::vector<Customer> slice(customers.begin() + begin, customers.begin() + end);
+        std::vector<IdRange> ranges = shards[shard]->createCustomers(slice, options);
+        std::size_t done = 0;
+        for (const IdRange &r : ranges) {
+            checkRange(shard, r);
+            done += static_cast<std::size_t>(r.count);
+        }
+        out.insert(out.end(), ranges.begin(), ranges.end());
+        if (done != slice.size()) break;
+    }
+    return out;
+}
+
+std::vector<Customer> ShardedBank::listCustomers() {
+    std::vector<Customer> out;
+    forEachCustomer([&out](const Customer &c) { out.push_back(c); });
+    return out;
+}
+
+// Shards are visited in first_id order, so customers still come out in id order.
+std::int64_t ShardedBank::forEachCustomer(const std::function<void(const Customer&)> &fn, const ScanOptions &options) {
+    std::int64_t visited = 0;
+    for (auto &shard : shards) {
+        std::int64_t n = shard->forEachCustomer(fn, options);
+        if (n < 0) return -1;
+        visited += n;
+    }
+    return visited;
+}
+
+std::int64_t ShardedBank::forEachCustomerView(const std::function<void(const CustomerView&)> &fn,
+                                              const ScanOptions &options) {
+    std::int64_t visited = 0;
+    for (auto &shard : shards) {
+        std::int64_t n = shard->forEachCustomerView(fn, options);
+        if (n < 0) return -1;
+        visited += n;
+    }
+    return visited;
+}
+
+Customer ShardedBank::getCustomer(int customer_id) {
+    int shard = shardOf(customer_id);
+    if (shard < 0) {
+        Customer c; c.id = -1;
+        return c;
+    }
+    return shards[shard]->getCustomer(customer_id);
+}
+
+int ShardedBank::createAccount(int customer_id, AccountType type) {
+    int shard = shardOf(customer_id);
+    if (shard < 0) return -1;
+    int id = shards[shard]->createAccount(customer_id, type);
+    if (id > 0) checkRange(shard, IdRange{id, 1, 1});
+    return id;
+}
+
+// Consecutive accounts of the same shard go in one call; like
+// createCustomers, a short run ends the call.
+std::vector<IdRange> ShardedBank::createAccounts(const std::vector<Account> &accounts, const BatchOptions &options) {
+    std::vector<IdRange> out;
+    std::size_t begin = 0;
+    while (begin < accounts.size()) {
+        const int shard = shardOf(accounts[begin].customer_id);
+        if (shard < 0) break;
+        std::size_t end = begin + 1;
+        while (end < accounts.size() && shardOf(accounts[end].customer_id) == shard) ++end;
+        std::vector<Account> run(accounts.begin() + begin, accounts.begin() + end);
+        std::vector<IdRange> ranges = shards[shard]->createAccounts(run, options);
+        std::size_t done = 0;
+        for (const IdRange &r : ranges) {
+            checkRange(shard, r);
+            done += static_cast<std::size_t>(r.count);
+        }
+        out.insert(out.end(), ranges.begin(), ranges.end());
+        if (done != run.size()) break;
+        begin = end;
+    }
+    return out;
+}
+
+Account ShardedBank::getAccount(int account_id) {
+    int shard = shardOf(account_id);
+    if (shard < 0) {
+        Account a; a.id = -1;
+        return a;
+    }
+    return shards[shard]->getAccount(account_id);
+}
+
+std::vector<Account> ShardedBank::listAccountsByCustomer(int customer_id) {
+    int shard = shardOf(customer_id);
+    if (shard < 0) return std::vector<Account>();
+    return shards[shard]->listAccountsByCustomer(customer_id);
+}
+
+bool ShardedBank::deposit(int account_id, Money amount, const std::string &idempotency_key) {
+    int shard = shardOf(account_id);
+    return shard >= 0 && shards[shard]->deposit(account_id, amount, idempotency_key);
+}
+
+bool ShardedBank::withdraw(int account_id, Money amount, const std::string &idempotency_key) {
+    int shard = shardOf(account_id);
+    return shard >= 0 && shards[shard]->withdraw(account_id, amount, idempotency_key);
+}
+
+// The key of a cross-shard transfer lives on the source shard.
+bool ShardedBank::transfer(int from_account_id, int to_account_id, Money amount, const std::string &idempotency_key) {
+    int source = shardOf(from_account_id), target = shardOf(to_account_id);
+    if (source < 0 || target < 0) return false;
+    if (source == target) return shards[source]->transfer(from_account_id, to_account_id, amount, idempotency_key);
+    if (amount <= Money()) return false;
+    return crossShardTransfer(source, target, from_account_id, to_account_id, amount, idempotency_key) ==
+           OperationResult::APPLIED;
+}
+
+// A repeated key reports APPLIED even while the first call's leg is still
+// pending; the leg settles like any other.
+OperationResult ShardedBank::crossShardTransfer(int source, int target, int from_account_id, int to_account_id,
+                                                Money amount, const std::string &idempotency_key) {
+    std::int64_t id = shards[source]->transferOut(from_account_id, to_account_id, amount, idempotency_key);
+    if (id == -2) return OperationResult::APPLIED;
+    if (id == 0) return OperationResult::REJECTED;
+    if (id < 0) return OperationResult::FAILED;
+    OperationResult credited = shards[target]->transferIn(first_ids[source], id, from_account_id, to_account_id, amount);
+    if (credited == OperationResult::FAILED) {
+        std::cerr << "[ShardedBank] transfer " << id << " from shard " << source
+                  << " is pending; resumePendingTransfers will settle it" << std::endl;
+        return OperationResult::FAILED;
+    }
+    // if this fails the leg stays PENDING and the next resume settles it
+    bool settled = shards[source]->settleTransferOut(id, credited == OperationResult::APPLIED);
+    if (settled && credited == OperationResult::APPLIED && feed) {
+        feed->publish(Operation::TRANSFER, from_account_id, to_account_id, amount);
+    }
+    return credited;
+}
+
+int ShardedBank::resumePendingTransfers(int older_than_s) {
+    int settled = 0;
+    for (std::size_t k = 0; k < shards.size(); ++k) {
+        for (const PendingTransfer &leg : shards[k]->pendingTransfersOut(older_than_s)) {
+            int target = shardOf(leg.to_account_id);
+            OperationResult credited = OperationResult::REJECTED;
+            if (target >= 0) {
+                credited = shards[target]->transferIn(first_ids[k], leg.transfer_id, leg.from_account_id,
+                                                      leg.to_account_id, leg.amount);
+            }
+            if (credited == OperationResult::FAILED) continue;
+            if (!shards[k]->settleTransferOut(leg.transfer_id, credited == OperationResult::APPLIED)) continue;
+            ++settled;
+            if (credited == OperationResult::APPLIED && feed) {
+                feed->publish(Operation::TRANSFER, leg.from_account_id, leg.to_account_id, leg.amount);
+            }
+        }
+    }
+    return settled;
+}
+
+std::vector<TransactionRecord> ShardedBank::recentTransactions(int account_id, int limit) {
+    int shard = shardOf(account_id);
+    if (shard < 0) return std::vector<TransactionRecord>();
+    return shards[shard]->recentTransactions(account_id, limit);
+}
+
+std::vector<TransactionRecord> ShardedBank::transactionsPage(int account_id, std::int64_t before_txn_id, int limit) {
+    int shard = shardOf(account_id);
+    if (shard < 0) return std::vector<TransactionRecord>();
+    return shards[shard]->transactionsPage(account_id, before_txn_id, limit);
+}
+
+std::int64_t ShardedBank::forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                             const std::function<void(const TransactionRecord&)> &fn,
+                                             const ScanOptions &options) {
+    int shard = shardOf(account_id);
+    if (shard < 0) return 0;
+    return shards[shard]->forEachTransaction(account_id, from, to, fn, options);
+}
+
+std::int64_t ShardedBank::forEachTransactionView(int account_id, const std::string &from, const std::string &to,
+                                                 const std::function<void(const TransactionView&)> &fn,
+                                                 const ScanOptions &options) {
+    int shard = shardOf(account_id);
+    if (shard < 0) return 0;
+    return shards[shard]->forEachTransactionView(account_id, from, to, fn, options);
+}
+
+bool ShardedBank::balanceAsOf(int account_id, const std::string &day, Money &out) {
+    int shard = shardOf(account_id);
+    return shard >= 0 && shards[shard]->balanceAsOf(account_id, day, out);
+}
+
+std::vector<DailyRollup> ShardedBank::dailyRollups(int account_id, const std::string &from, const std::string &to) {
+    int shard = shardOf(account_id);
+    if (shard < 0) return std::vector<DailyRollup>();
+    return shards[shard]->dailyRollups(account_id, from, to);
+}
+
+std::vector<OperationResult> ShardedBank::applyBatch(const std::vector<Operation> &ops, const BatchOptions &options) {
+    std::vector<OperationResult> results(ops.size(), OperationResult::REJECTED);
+    std::vector<std::vector<std::size_t>> queued(shards.size());
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        int shard = shardOf(ops[i].account_id);
+        if (shard >= 0) queued[shard].push_back(i);
+    }
+
+    // Each shard's operations go to it in runs, cut at its cross-shard
+    // transfers, which run as sagas between them.
+    std::vector<std::thread> workers;
+    for (std::size_t k = 0; k < shards.size(); ++k) {
+        if (queued[k].empty()) continue;
+        workers.emplace_back([this, k, &ops, &queued, &results, &options]() {
+            std::vector<Operation> run;
+            std::vector<std::size_t> positions;
+            auto flush = [&]() {
+                if (run.empty()) return;
+                std::vector<OperationResult> r = shards[k]->applyBatch(run, options);
+                for (std::size_t j = 0; j < r.size(); ++j) results[positions[j]] = r[j];
+                run.clear();
+                positions.clear();
+            };
+            for (std::size_t i : queued[k]) {
+                const Operation &op = ops[i];
+                const int target = op.kind == Operation::TRANSFER ? shardOf(op.to_account_id) : static_cast<int>(k);
+                if (target == static_cast<int>(k)) {
+                    run.push_back(op);
+                    positions.push_back(i);
+                    continue;
+                }
+                flush();
+                if (target < 0 || op.amount <= Money()) continue;
+                results[i] = crossShardTransfer(static_cast<int>(k), target, op.account_id, op.to_account_id, op.amount);
+            }
+            flush();
+        });
+    }
+    for (auto &w : workers) w.join();
+    return results;
+}
+
+CacheStats ShardedBank::cacheStats() {
+    CacheStats total;
+    for (auto &shard : shards) {
+        CacheStats s = shard->cacheStats();
+        total.hits += s.hits;
+        total.misses += s.misses;
+        total.evictions += s.evictions;
+        total.entries += s.entries;
+    }
+    return total;
+}
+
+static void mergeSummaries(std::vector<LatencySummary> &into, const std::vector<LatencySummary> &from) {
+    if (into.empty()) {
+        into = from;
+        return;
+    }
+    for (std::size_t i = 0; i < into.size() && i < from.size(); ++i) {
+        into[i].count += from[i].count;
+        into[i].sum_ns += from[i].sum_ns;
+        into[i].p50_ns = std::max(into[i].p50_ns, from[i].p50_ns);
+        into[i].p99_ns = std::max(into[i].p99_ns, from[i].p99_ns);
+        into[i].p999_ns = std::max(into[i].p999_ns, from[i].p999_ns);
+        into[i].max_ns = std::max(into[i].max_ns, from[i].max_ns);
+        into[i].deadlocks += from[i].deadlocks;
+        into[i].lock_wait_timeouts += from[i].lock_wait_timeouts;
+    }
+}
+
+MetricsSnapshot ShardedBank::metrics() {
+    MetricsSnapshot total;
+    for (auto &shard : shards) {
+        MetricsSnapshot s = shard->metrics();
+        mergeSummaries(total.methods, s.methods);
+        mergeSummaries(total.phases, s.phases);
+        total.rollbacks += s.rollbacks;
+        total.lock_wait_retries += s.lock_wait_retries;
+        total.pool_waits += s.pool_waits;
+        total.pool_timeouts += s.pool_timeouts;
+        total.rule_rejections += s.rule_rejections;
+        total.pool_connections += s.pool_connections;
+        total.pool_in_use += s.pool_in_use;
+    }
+    return total;
+}
+
+std::string ShardedBank::metricsText() {
+    return prometheusText(metrics());
+}
+
+// -------------------- include/call_trace.h --------------------
+
+#ifndef CALL_TRACE_H
+#define CALL_TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bank.h"
+
+// Compact binary traces of real Bank traffic, written by TracingBank and
+// played back by bank_replay.
+//
+// A trace file is the 8-byte magic "BKTRACE1" and the wall-clock start in
+// nanoseconds since the epoch (u64), followed by 32-byte records, all
+// little-endian:
+//
+//   u64 offset_ns       call start, relative to the trace start
+//   u8  call            TraceCall
+//   u8  kind            Operation::Kind of a BATCH_OP
+//   u8  flags           TRACE_KEYED, TRACE_REJECTED
+//   u8  reserved
+//   u32 count           limit of a page call; operations that follow an APPLY_BATCH
+//   i32 account_id      customer id for LIST_ACCOUNTS; commit_every for APPLY_BATCH
+//   i32 to_account_id   rows_per_insert for APPLY_BATCH
+//   i64 value           amount in cents; before_txn_id for TRANSACTIONS_PAGE
+//
+// Records are appended when calls return, so offsets are not quite in order;
+// readers sort them. Only ids, amounts and timing are kept: no names, emails,
+// details or idempotency keys.
+enum class TraceCall : std::uint8_t {
+    GET_ACCOUNT = 1, LIST_ACCOUNTS, DEPOSIT, WITHDRAW, TRANSFER, RECENT_TRANSACTIONS, TRANSACTIONS_PAGE,
+    APPLY_BATCH, BATCH_OP
+};
+static const int TRACE_CALL_COUNT = 9;
+
+enum : std::uint8_t {
+    TRACE_KEYED = 1,     // made with an idempotency key
+    TRACE_REJECTED = 2,  // returned false, an empty account or a non-APPLIED result
+};
+
+// Name of a call in reports ("deposit", "get_account", ...). These match the
+// Bank metrics method names.
+const char *traceCallName(TraceCall call);
+
+struct TraceRecord {
+    std::uint64_t offset_ns = 0;
+    TraceCall call = TraceCall::GET_ACCOUNT;
+    std::uint8_t kind = 0;
+    std::uint8_t flags = 0;
+    std::uint32_t count = 0;
+    int account_id = 0;
+    int to_account_id = 0;
+    std::int64_t value = 0;
+};
+
+// One call read back from a trace; ops holds an APPLY_BATCH's operations.
+struct TracedCall {
+    TraceRecord record;
+    std::vector<Operation> ops;
+};
+
+// Appends records to a trace file. Safe to share between threads: each call
+// takes a mutex just long enough to copy its record into a buffer, which is
+// written out every 64 KiB and on destruction.
+class TraceWriter {
+public:
+    // Throws std::runtime_error if path cannot be created.
+    explicit TraceWriter(const std::string &path);
+    ~TraceWriter();
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    // Nanoseconds since the trace started, for TraceRecord::offset_ns.
+    std::uint64_t offsetNow() const;
+    void write(const TraceRecord &r, const std::vector<Operation> *ops = nullptr);
+    void flush();
+
+private:
+    void encode(const TraceRecord &r);
+
+    std::FILE *file;
+    std::uint64_t start_steady_ns;
+    std::mutex mu;
+    std::vector<unsigned char> buffer;
+};
+
+// Reads a whole trace into calls, sorted by offset. Returns false with error
+// set for a missing, foreign or truncated file.
+bool readTrace(const std::string &path, std::vector<TracedCall> &calls, std::string &error);
+
+// Forwards every call to bank and records the traced ones (see TraceCall) in
+// writer; everything else passes through unrecorded. Put it in front of the
+// Bank a server serves to capture production traffic.
+class TracingBank : public BankInterface {
+public:
+    TracingBank(BankInterface &bank, TraceWriter &writer) : bank(bank), writer(writer) {}
+
+    int createCustomer(const std::string &name, const std::string &email, const std::string &phone) override;
+    std::vector<IdRange> createCustomers(const std::vector<Customer> &customers,
+                                         const BatchOptions &options = BatchOptions()) override;
+    std::vector<Customer> listCustomers() override;
+    std::int64_t forEachCustomer(const std::function<void(const Customer&)> &fn,
+                                 const ScanOptions &options = ScanOptions()) override;
+    std::int64_t forEachCustomerView(const std::function<void(const CustomerView&)> &fn,
+                                     const ScanOptions &options = ScanOptions()) override;
+    Customer getCustomer(int customer_id) override;
+
+    int createAccount(int customer_id, AccountType type) override;
+    std::vector<IdRange> createAccounts(const std::vector<Account> &accounts,
+                                        const BatchOptions &options = BatchOptions()) override;
+    Account getAccount(int account_id) override;
+    std::vector<Account> listAccountsByCustomer(int customer_id) override;
+
+    bool deposit(int account_id, Money amount, const std::string &idempotency_key = std::string()) override;
+    bool withdraw(int account_id, Money amount, const std::string &idempotency_key = std::string()) override;
+    bool transfer(int from_account_id, int to_account_id, Money amount,
+                  const std::string &idempotency_key = std::string()) override;
+    std::vector<TransactionRecord> recentTransactions(int account_id, int limit=10) override;
+    std::vector<TransactionRecord> transactionsPage(int account_id, std::int64_t before_txn_id, int limit) override;
+    std::int64_t forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                    const std::function<void(const TransactionRecord&)> &fn,
+                                    const ScanOptions &options = ScanOptions()) override;
+    std::int64_t forEachTransactionView(int account_id, const std::string &from, const std::string &to,
+                                        const std::function<void(const TransactionView&)> &fn,
+                                        const ScanOptions &options = ScanOptions()) override;
+    bool balanceAsOf(int account_id, const std::string &day, Money &out) override;
+    std::vector<DailyRollup> dailyRollups(int account_id, const std::string &from, const std::string &to) override;
+
+    std::vector<OperationResult> applyBatch(const std::vector<Operation> &ops,
+                                            const BatchOptions &options = BatchOptions()) override;
+
+    CacheStats cacheStats() override { return bank.cacheStats(); }
+    MetricsSnapshot metrics() override { return bank.metrics(); }
+    std::string metricsText() override { return bank.metricsText(); }
+    ChangeFeed *changeFeed() override { return bank.changeFeed(); }
+
+private:
+    void record(TraceCall call, std::uint64_t start, bool ok, int account_id, int to_account_id = 0,
+                std::int64_t value = 0, std::uint32_t count = 0, bool keyed = false);
+
+    BankInterface &bank;
+    TraceWriter &writer;
+};
+
+#endif // CALL_TRACE_H
+
+// -------------------- src/call_trace.cpp --------------------
+
+#include "../include/call_trace.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+static const char TRACE_MAGIC[8] = {'B', 'K', 'T', 'R', 'A', 'C', 'E', '1'};
+static const std::size_t RECORD_SIZE = 32;
+static const std::size_t FLUSH_AT = 64 * 1024;
+
+static const char *const CALL_NAMES[TRACE_CALL_COUNT] = {
+    "get_account", "list_accounts", "deposit", "withdraw", "transfer", "recent_transactions", "transactions_page",
+    "apply_batch", "batch_op",
+};
+
+const char *traceCallName(TraceCall call) {
+    int i = static_cast<int>(call) - 1;
+    return i >= 0 && i < TRACE_CALL_COUNT ? CALL_NAMES[i] : "";
+}
+
+static std::uint64_t steadyNs() {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static void putLE(std::vector<unsigned char> &out, std::uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) out.push_back(static_cast<unsigned char>(v >> (8 * i)));
+}
+
+static std::uint64_t getLE(const unsigned char *p, int bytes) {
+    std::uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v |= std::uint64_t(p[i]) << (8 * i);
+    return v;
+}
+
+TraceWriter::TraceWriter(const std::string &path) : file(std::fopen(path.c_str(), "wb")), start_steady_ns(steadyNs()) {
+    if (!file) throw std::runtime_error("cannot create trace file " + path);
+    buffer.reserve(FLUSH_AT + RECORD_SIZE);
+    buffer.insert(buffer.end(), TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC));
+    putLE(buffer, static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count()), 8);
+}
+
+TraceWriter::~TraceWriter() {
+    flush();
+    std::fclose(file);
+}
+
+std::uint64_t TraceWriter::offsetNow() const {
+    return steadyNs() - start_steady_ns;
+}
+
+void TraceWriter::encode(const TraceRecord &r) {
+    putLE(buffer, r.offset_ns, 8);
+    buffer.push_back(static_cast<unsigned char>(r.call));
+    buffer.push_back(r.kind);
+    buffer.push_back(r.flags);
+    buffer.push_back(0);
+    putLE(buffer, r.count, 4);
+    putLE(buffer, static_cast<std::uint32_t>(r.account_id), 4);
+    putLE(buffer, static_cast<std::uint32_t>(r.to_account_id), 4);
+    putLE(buffer, static_cast<std::uint64_t>(r.value), 8);
+}
+
+void TraceWriter::write(const TraceRecord &r, const std::vector<Operation> *ops) {
+    std::lock_guard<std::mutex> lock(mu);
+    encode(r);
+    if (ops) {
+        for (const Operation &op : *ops) {
+            TraceRecord item;
+            item.offset_ns = r.offset_ns;
+            item.call = TraceCall::BATCH_OP;
+            item.kind = static_cast<std::uint8_t>(op.kind);
+            item.account_id = op.account_id;
+            item.to_account_id = op.to_account_id;
+            item.value = op.amount.cents();
+            encode(item);
+        }
+    }
+    // flushed with the lock held so records from different threads never interleave mid-record
+    if (buffer.size() >= FLUSH_AT) {
+        std::fwrite(buffer.data(), 1, buffer.size(), file);
+        buffer.clear();
+    }
+}
+
+void TraceWriter::flush() {
+    std::lock_guard<std::mutex> lock(mu);
+    if (!buffer.empty()) std::fwrite(buffer.data(), 1, buffer.size(), file);
+    buffer.clear();
+    std::fflush(file);
+}
+
+bool readTrace(const std::string &path, std::vector<TracedCall> &calls, std::string &error) {
+    calls.clear();
+    std::FILE *f = std::fopen(path.c_str(), "rb");
+    if (!f) {
+        error = "cannot open " + path;
+        return false;
+    }
+    unsigned char header[16];
+    if (std::fread(header, 1, sizeof(header), f) != sizeof(header) || !std::equal(TRACE_MAGIC, TRACE_MAGIC + 8, header)) {
+        std::fclose(f);
+        error = path + " is not a bank trace";
+        return false;
+    }
+    unsigned char p[RECORD_SIZE];
+    std::size_t pending = 0;  // BATCH_OP records still owed to the last APPLY_BATCH
+    std::size_t got;
+    while ((got = std::fread(p, 1, RECORD_SIZE, f)) == RECORD_SIZE) {
+        TraceRecord r;
+        r.offset_ns = getLE(p, 8);
+        r.call = static_cast<TraceCall>(p[8]);
+        r.kind = p[9];
+        r.flags = p[10];
+        r.count = static_cast<std::uint32_t>(getLE(p + 12, 4));
+        r.account_id = static_cast<int>(static_cast<std::uint32_t>(getLE(p + 16, 4)));
+        r.to_account_id = static_cast<int>(static_cast<std::uint32_t>(getLE(p + 20, 4)));
+        r.value = static_cast<std::int64_t>(getLE(p + 24, 8));
+        if (r.call == TraceCall::BATCH_OP) {
+            if (pending == 0 || r.kind > Operation::TRANSFER) break;
+            calls.back().ops.push_back(Operation{static_cast<Operation::Kind>(r.kind), r.account_id, r.to_account_id,
+                                                 Money::fromCents(r.value)});
+            --pending;
+            continue;
+        }
+        if (pending != 0 || traceCallName(r.call)[0] == '\0') break;
+        calls.push_back(TracedCall{r, std::vector<Operation>()});
+        if (r.call == TraceCall::APPLY_BATCH) {
+            pending = r.count;
+            calls.back().ops.reserve(pending);
+        }
+    }
+    bool eof = std::feof(f) && got == 0 && pending == 0;
+    std::fclose(f);
+    if (!eof) {
+        error = path + " is truncated or corrupt after " + std::to_string(calls.size()) + " calls";
+        return false;
+    }
+    std::stable_sort(calls.begin(), calls.end(), [](const TracedCall &a, const TracedCall &b) {
+        return a.record.offset_ns < b.record.offset_ns;
+    });
+    return true;
+}
+
+// TracingBank
+
+void TracingBank::record(TraceCall call, std::uint64_t start, bool ok, int account_id, int to_account_id,
+                         std::int64_t value, std::uint32_t count, bool keyed) {
+    TraceRecord r;
+    r.offset_ns = start;
+    r.call = call;
+    r.flags = static_cast<std::uint8_t>((keyed ? TRACE_KEYED : 0) | (ok ? 0 : TRACE_REJECTED));
+    r.count = count;
+    r.account_id = account_id;
+    r.to_account_id = to_account_id;
+    r.value = value;
+    writer.write(r);
+}
+
+int TracingBank::createCustomer(const std::string &name, const std::string &email, const std::string &phone) {
+    return bank.createCustomer(name, email, phone);
+}
+
+std::vector<IdRange> TracingBank::createCustomers(const std::vector<Customer> &customers, const BatchOptions &options) {
+    return bank.createCustomers(customers, options);
+}
+
+std::vector<Customer> TracingBank::listCustomers() {
+    return bank.listCustomers();
+}
+
+std::int64_t TracingBank::forEachCustomer(const std::function<void(const Customer&)> &fn, const ScanOptions &options) {
+    return bank.forEachCustomer(fn, options);
+}
+
+std::int64_t TracingBank::forEachCustomerView(const std::function<void(const CustomerView&)> &fn,
+                                              const ScanOptions &options) {
+    return bank.forEachCustomerView(fn, options);
+}
+
+Customer TracingBank::getCustomer(int customer_id) {
+    return bank.getCustomer(customer_id);
+}
+
+int TracingBank::createAccount(int customer_id, AccountType type) {
+    return bank.createAccount(customer_id, type);
+}
+
+std::vector<IdRange> TracingBank::createAccounts(const std::vector<Account> &accounts, const BatchOptions &options) {
+    return bank.createAccounts(accounts, options);
+}
+
+Account TracingBank::getAccount(int account_id) {
+    std::uint64_t start = writer.offsetNow();
+    Account a = bank.getAccount(account_id);
+    record(TraceCall::GET_ACCOUNT, start, a.id >= 0, account_id);
+    return a;
+}
+
+std::vector<Account> TracingBank::listAccountsByCustomer(int customer_id) {
+    std::uint64_t start = writer.offsetNow();
+    std::vector<Account> accounts = bank.listAccountsByCustomer(customer_id);
+    record(TraceCall::LIST_ACCOUNTS, start, true, customer_id);
+    return accounts;
+}
+
+bool TracingBank::deposit(int account_id, Money amount, const std::string &idempotency_key) {
+    std::uint64_t start = writer.offsetNow();
+    bool ok = bank.deposit(account_id, amount, idempotency_key);
+    record(TraceCall::DEPOSIT, start, ok, account_id, 0, amount.cents(), 0, !idempotency_key.empty());
+    return ok;
+}
+
+bool TracingBank::withdraw(int account_id, Money amount, const std::string &idempotency_key) {
+    std::uint64_t start = writer.offsetNow();
+    bool ok = bank.withdraw(account_id, amount, idempotency_key);
+    record(TraceCall::WITHDRAW, start, ok, account_id, 0, amount.cents(), 0, !idempotency_key.empty());
+    return ok;
+}
+
+bool TracingBank::transfer(int from_account_id, int to_account_id, Money amount, const std::string &idempotency_key) {
+    std::uint64_t start = writer.offsetNow();
+    bool ok = bank.transfer(from_account_id, to_account_id, amount, idempotency_key);
+    record(TraceCall::TRANSFER, start, ok, from_account_id, to_account_id, amount.cents(), 0, !idempotency_key.empty());
+    return ok;
+}
+
+std::vector<TransactionRecord> TracingBank::recentTransactions(int account_id, int limit) {
+    std::uint64_t start = writer.offsetNow();
+    std::vector<TransactionRecord> rows = bank.recentTransactions(account_id, limit);
+    record(TraceCall::RECENT_TRANSACTIONS, start, true, account_id, 0, 0, static_cast<std::uint32_t>(std::max(limit, 0)));
+    return rows;
+}
+
+std::vector<TransactionRecord> TracingBank::transactionsPage(int account_id, std::int64_t before_txn_id, int limit) {
+    std::uint64_t start = writer.offsetNow();
+    std::vector<TransactionRecord> rows = bank.transactionsPage(account_id, before_txn_id, limit);
+    record(TraceCall::TRANSACTIONS_PAGE, start, true, account_id, 0, before_txn_id,
+           static_cast<std::uint32_t>(std::max(limit, 0)));
+    return rows;
+}
+
+std::int64_t TracingBank::forEachTransaction(int account_id, const std::string &from, const std::string &to,
+                                             const std::function<void(const TransactionRecord&)> &fn,
+                                             const ScanOptions &options) {
+    return bank.forEachTransaction(account_id, from, to, fn, options);
+}
+
+std::int64_t TracingBank::forEachTransactionView(int account_id, const std::string &from, const std::string &to,
+                                                 const std::function<void(const TransactionView&)> &fn,
+                                                 const ScanOptions &options) {
+    return bank.forEachTransactionView(account_id, from, to, fn, options);
+}
+
+bool TracingBank::balanceAsOf(int account_id, const std::string &day, Money &out) {
+    return bank.balanceAsOf(account_id, day, out);
+}
+
+std::vector<DailyRollup> TracingBank::dailyRollups(int account_id, const std::string &from, const std::string &to) {
+    return bank.dailyRollups(account_id, from, to);
+}
+
+std::vector<OperationResult> TracingBank::applyBatch(const std::vector<Operation> &ops, const BatchOptions &options) {
+    std::uint64_t start = writer.offsetNow();
+    std::vector<OperationResult> results = bank.applyBatch(ops, options);
+    bool ok = std::all_of(results.begin(), results.end(), [](OperationResult r) { return r == OperationResult::APPLIED; });
+    TraceRecord r;
+    r.offset_ns = start;
+    r.call = TraceCall::APPLY_BATCH;
+    r.flags = ok ? 0 : TRACE_REJECTED;
+    r.count = static_cast<std::uint32_t>(ops.size());
+    r.account_id = static_cast<int>(options.commit_every);
+    r.to_account_id = static_cast<int>(options.rows_per_insert);
+    writer.write(r, &ops);
+    return results;
+}
+
+// -------------------- src/eod.cpp --------------------
+
+// bank_eod: end-of-day totals from a ledger snapshot file, without touching
+// MySQL. Prints total liabilities, balances per account type, the interest a
+// rate would accrue and the accounts below a balance floor.
+//
+//   ./bank_eod --snapshot /var/lib/bank/accounts.snap --rate-ppm 110 --interest-out interest.csv
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "../include/eod_report.h"
+#include "account_kernels.h"
+#include "account_snapshot.h"
+
+static void usage() {
+    std::cerr << "usage: bank_eod --snapshot PATH [--interest-type SAVINGS] [--rate-ppm N]\n"
+                 "                [--low-balance AMOUNT] [--interest-out FILE] [--kernels scalar|avx2|avx512]"
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::string path, interest_out;
+    EndOfDayOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) { usage(); return 1; }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--snapshot") path = value;
+            else if (arg == "--interest-type") options.interest_type = value;
+            else if (arg == "--rate-ppm") options.interest_rate_ppm = std::stoll(value);
+            else if (arg == "--low-balance") options.low_balance = Money::parse(value);
+            else if (arg == "--interest-out") interest_out = value;
+            else if (arg == "--kernels" && value == "scalar") limitKernelLevel(KernelLevel::SCALAR);
+            else if (arg == "--kernels" && value == "avx2") limitKernelLevel(KernelLevel::AVX2);
+            else if (arg == "--kernels" && value == "avx512") limitKernelLevel(KernelLevel::AVX512);
+            else { usage(); return 1; }
+        } catch (const std::exception &) {
+            std::cerr << "bad value for " << arg << ": " << value << std::endl;
+            return 1;
+        }
+    }
+    if (path.empty()) { usage(); return 1; }
+
+    try {
+        AccountSnapshot snapshot(path);
+        EndOfDayReport r = endOfDay(snapshot, options);
+        std::cout << "snapshot LSN " << r.lsn << ", " << r.accounts << " accounts, "
+                  << kernelLevelName(kernelLevel()) << " kernels, " << r.seconds * 1000 << " ms\n";
+        std::cout << "total liabilities " << r.total << "\n";
+        for (const auto &t : r.by_type) std::cout << "  " << t.first << " " << t.second << "\n";
+        std::cout << "interest on " << options.interest_type << " " << r.interest_total
+                  << " across " << r.interest.size() << " accounts\n";
+        std::cout << r.low_balance_accounts.size() << " accounts below " << options.low_balance << std::endl;
+
+        if (!interest_out.empty()) {
+            std::ofstream out(interest_out);
+            out << "account_id,amount\n";
+            for (const auto &row : r.interest) out << row.first << "," << row.second << "\n";
+            if (!out) {
+                std::cerr << "failed to write " << interest_out << std::endl;
+                return 1;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "bank_eod: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// -------------------- src/bulk.cpp --------------------
+
+// bank_bulk: moves whole customers, accounts, transactions or account_daily
+// tables in or out as CSV, in parallel over a connection pool. Ids are kept,
+// so a portfolio exported from one database imports into another unchanged.
+//
+//   ./bank_bulk export --table transactions --out /data/dump --threads 16
+//   ./bank_bulk import --table transactions --threads 16 --checkpoint tx.ckpt /data/dump/transactions-*.csv
+//
+// Export splits the primary key range into partitions, each read by keyset
+// pages into its own file (<table>-NNNN.csv); a finished file is not read
+// again, so an interrupted export resumes where it stopped. The split is
+// fixed by the first run in <table>.manifest and reused on resume, whatever
+// the table or --threads look like by then. Import parses
+// files in order and hands fixed-size chunks to worker threads, one
+// transaction per chunk with foreign key and unique checks off for the
+// session; committed chunks are appended to the checkpoint file and skipped
+// when the same command is run again. Stop the application (or at least its
+// ledger engine) while importing: rows go straight to the tables.
+//
+// Move account_daily along with transactions: balanceAsOf and dailyRollups
+// read only the rollups, so history imported without them reports today's
+// balance for every past date and no daily totals.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cppconn/datatype.h>
+#include <cppconn/statement.h>
+#include "connection_pool.h"
+
+// One movable table; columns are listed in CSV order.
+struct TableSpec {
+    const char *name;
+    const char *key;           // integer primary key, used for export ranges
+    const char *columns;       // CSV header and INSERT column list
+    const char *select;        // export select list, same order
+    const char *placeholders;  // one VALUES tuple
+    int width;
+    int money_column;          // exported as cents, written as an amount; -1 if none
+    int key_width;             // leading columns forming the primary key; the first is `key`
+};
+
+static const TableSpec TABLES[] = {
+    {"customers", "customer_id", "customer_id,name,email,phone,created_at",
+     "customer_id,name,email,phone,created_at", "(?,?,?,?,?)", 5, -1, 1},
+    {"accounts", "account_id", "account_id,customer_id,account_type,balance,created_at",
+     // stripes (account_stripes) are folded into the exported balance
+     "account_id,customer_id,account_type,CAST((balance + COALESCE((SELECT SUM(s.balance) FROM account_stripes s "
+     "WHERE s.account_id = accounts.account_id), 0)) * 100 AS SIGNED),created_at", "(?,?,?,? / 100,?)", 5, 3, 1},
+    {"transactions", "transaction_id", "transaction_id,account_id,type,amount,details,balance_after,created_at",
+     "transaction_id,account_id,type,CAST(amount * 100 AS SIGNED),details,balance_after,created_at", "(?,?,?,? / 100,?,?,?)", 7, 3, 1},
+    {"transactions_archive", "transaction_id", "transaction_id,account_id,type,amount,details,balance_after,created_at",
+     "transaction_id,account_id,type,CAST(amount * 100 AS SIGNED),details,balance_after,created_at", "(?,?,?,? / 100,?,?,?)", 7, 3, 1},
+    // several rows per account: ranges split on account_id, pages on the whole key
+    {"account_daily", "account_id", "account_id,day,stripe,opening,closing,credits,debits",
+     "account_id,day,stripe,opening,closing,credits,debits", "(?,?,?,?,?,?,?)", 7, -1, 3},
+};
+
+struct Config {
+    std::string mode;
+    std::string host = "tcp://127.0.0.1:3306", user = "root", pass, db = "banking_system";
+    const TableSpec *table = nullptr;
+    int threads = 8;
+    int partitions = 0;             // export; 0 = 4 per thread
+    std::size_t fetch_rows = 10000;  // export rows per keyset page
+    std::size_t chunk_rows = 5000;   // import rows per transaction
+    std::size_t rows_per_insert = 500;
+    std::string out = ".";
+    std::string checkpoint;
+    std::vector<std::string> files;
+};
+
+// A CSV field; \N unquoted is SQL NULL, as in MySQL's own dumps.
+struct Field {
+    std::string text;
+    bool null = false;
+};
+typedef std::vector<Field> Row;
+
+static void writeField(std::string &out, const std::string &text) {
+    if (text.find_first_of(",\"\r\n") == std::string::npos && text != "\\N") {
+        out += text;
+        return;
+    }
+    out += '"';
+    for (char c : text) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+// RFC 4180 reader: quoted fields may hold commas, quotes ("") and newlines.
+class CsvReader {
+public:
+    explicit CsvReader(std::istream &in) : in(*in.rdbuf()) {}
+
+    // Returns false at end of input.
+    bool next(Row &row) {
+        row.clear();
+        int c = in.sbumpc();
+        if (c == EOF) return false;
+        Field f;
+        bool quoted = false, was_quoted = false;
+        for (;; c = in.sbumpc()) {
+            if (c == EOF) break;
+            char ch = static_cast<char>(c);
+            if (quoted) {
+                if (ch != '"') f.text += ch;
+                else if (in.sgetc() == '"') { f.text += '"'; in.sbumpc(); }
+                else quoted = false;
+            } else if (ch == '"') {
+                quoted = was_quoted = true;
+            } else if (ch == ',') {
+                finish(row, f, was_quoted);
+            } else if (ch == '\n') {
+                break;
+            } else if (ch != '\r') {
+                f.text += ch;
+            }
+        }
+        finish(row, f, was_quoted);
+        return true;
+    }
+
+private:
+    static void finish(Row &row, Field &f, bool &was_quoted) {
+        f.null = !was_quoted && f.text == "\\N";
+        row.push_back(std::move(f));
+        f = Field();
+        was_quoted = false;
+    }
+
+    std::streambuf &in;
+};
+
+// Rows moved so far, printed to stderr once a second.
+class Progress {
+public:
+    explicit Progress(const char *what) : what(what), start(std::chrono::steady_clock::now()),
+                                          reporter([this] { loop(); }) {}
+    ~Progress() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stop = true;
+        }
+        wake.notify_all();
+        reporter.join();
+        print();
+    }
+    void add(std::size_t n) { rows.fetch_add(n, std::memory_order_relaxed); }
+
+private:
+    void loop() {
+        std::unique_lock<std::mutex> lock(mu);
+        while (!wake.wait_for(lock, std::chrono::seconds(1), [this] { return stop; })) print();
+    }
+    void print() {
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::uint64_t n = rows.load(std::memory_order_relaxed);
+        std::cerr << what << " " << n << " rows in " << static_cast<int>(s) << "s ("
+                  << static_cast<std::uint64_t>(s > 0 ? double(n) / s : 0) << " rows/s)" << std::endl;
+    }
+
+    const char *what;
+    std::chrono::steady_clock::time_point start;
+    std::atomic<std::uint64_t> rows{0};
+    std::mutex mu;
+    std::condition_variable wake;
+    bool stop = false;
+    std::thread reporter;  // last: starts once the members above exist
+};
+
+// ---- export ----
+
+static bool exportPartition(ConnectionPool &pool, const Config &cfg, std::int64_t lo, std::int64_t hi,
+                            const std::string &path, Progress &progress) {
+    const TableSpec &t = *cfg.table;
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    std::string buf = std::string(t.columns) + "\n";
+    // Pages resume after the last row's primary key, (k1, k2, ...) > cursor,
+    // spelled out so MySQL can range-scan the key.
+    std::vector<std::string> keys;
+    for (std::size_t at = 0; keys.size() < static_cast<std::size_t>(t.key_width);) {
+        std::size_t comma = std::string(t.columns).find(',', at);
+        keys.push_back(std::string(t.columns).substr(at, comma - at));
+        at = comma + 1;
+    }
+    std::string after = keys.back() + " > ?", order = keys.front();
+    for (std::size_t k = keys.size() - 1; k-- > 0;) after = "(" + keys[k] + " > ? OR (" + keys[k] + " = ? AND " + after + "))";
+    for (std::size_t k = 1; k < keys.size(); ++k) order += "," + keys[k];
+    const std::string head = std::string("SELECT ") + t.select + " FROM " + t.name + " WHERE " + t.key + " >= ? AND " +
+                             t.key + " < ? ";
+    const std::string first_sql = head + "ORDER BY " + order + " LIMIT ?";
+    const std::string next_sql = head + "AND " + after + " ORDER BY " + order + " LIMIT ?";
+    std::vector<std::string> cursor(keys.size());  // key of the last row written; cursor[0] is unused
+    std::int64_t cursor_key = 0;
+    bool started = false;
+    for (;;) {
+        std::size_t got = 0;
+        {
+            auto conn = pool.acquire();
+            sql::PreparedStatement *ps = conn.prepare(started ? next_sql : first_sql);
+            unsigned int p = 1;
+            ps->setInt64(p++, lo);
+            ps->setInt64(p++, hi);
+            if (started) {
+                for (std::size_t k = 0; k < keys.size(); ++k) {
+                    const int uses = k + 1 < keys.size() ? 2 : 1;
+                    for (int u = 0; u < uses; ++u) {
+                        if (k == 0) ps->setInt64(p++, cursor_key);
+                        else ps->setString(p++, cursor[k]);
+                    }
+                }
+            }
+            ps->setInt64(p, static_cast<std::int64_t>(cfg.fetch_rows));
+            std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+            while (rs->next()) {
+                for (int c = 0; c < t.width; ++c) {
+                    unsigned int col = static_cast<unsigned int>(c + 1);
+                    if (c) buf += ',';
+                    if (rs->isNull(col)) buf += "\\N";
+                    else if (c == t.money_column) buf += Money::fromCents(rs->getInt64(col)).toString();
+                    else writeField(buf, rs->getString(col));
+                }
+                buf += '\n';
+                cursor_key = rs->getInt64(1);
+                for (std::size_t k = 1; k < keys.size(); ++k) cursor[k] = rs->getString(static_cast<unsigned int>(k + 1));
+                started = true;
+                ++got;
+            }
+        }
+        out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+        buf.clear();
+        progress.add(got);
+        if (got < cfg.fetch_rows) break;
+    }
+    out.close();
+    if (!out || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cerr << "cannot write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The key ranges of an export: partition p covers [lo + p*span, lo + (p+1)*span).
+struct ExportPlan {
+    std::int64_t lo = 0, hi = -1, span = 1;
+    int parts = 0;
+};
+
+static std::string manifestPath(const Config &cfg) {
+    return cfg.out + "/" + cfg.table->name + ".manifest";
+}
+
+static bool readManifest(const std::string &path, ExportPlan &plan) {
+    std::ifstream in(path);
+    return in && (in >> plan.lo >> plan.hi >> plan.span >> plan.parts) && plan.span > 0 && plan.parts > 0;
+}
+
+static bool writeManifest(const std::string &path, const ExportPlan &plan) {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << plan.lo << " " << plan.hi << " " << plan.span << " " << plan.parts << "\n";
+        if (!out) return false;
+    }
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// Splits the current key range, or takes the split of the run being resumed:
+// partition files are matched by index, so they must keep their ranges.
+static bool planExport(ConnectionPool &pool, const Config &cfg, ExportPlan &plan) {
+    const TableSpec &t = *cfg.table;
+    const std::string manifest = manifestPath(cfg);
+    if (std::ifstream(manifest)) {
+        if (!readManifest(manifest, plan)) {
+            std::cerr << "cannot read " << manifest << std::endl;
+            return false;
+        }
+        std::cerr << "resuming the export planned in " << manifest << " (" << t.key << " " << plan.lo << ".." << plan.hi
+                  << ", " << plan.parts << " partitions); rows added since are not included" << std::endl;
+        return true;
+    }
+    char first[32];
+    std::snprintf(first, sizeof(first), "-%04d.csv", 0);
+    if (std::ifstream(cfg.out + "/" + t.name + first)) {
+        std::cerr << cfg.out << " holds " << t.name << " partitions but no " << t.name
+                  << ".manifest; remove them or export to another --out" << std::endl;
+        return false;
+    }
+    {
+        auto conn = pool.acquire();
+        sql::PreparedStatement *ps = conn.prepare(std::string("SELECT COALESCE(MIN(") + t.key + "),0), COALESCE(MAX(" +
+                                                  t.key + "),-1) FROM " + t.name);
+        std::unique_ptr<sql::ResultSet> rs(conn.executeQuery(ps));
+        if (rs->next()) { plan.lo = rs->getInt64(1); plan.hi = rs->getInt64(2); }
+    }
+    plan.parts = cfg.partitions > 0 ? cfg.partitions : cfg.threads * 4;
+    plan.span = (plan.hi - plan.lo + 1 + plan.parts - 1) / plan.parts;
+    if (plan.span < 1) plan.span = 1;
+    if (!writeManifest(manifest, plan)) {
+        std::cerr << "cannot write " << manifest << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static int runExport(ConnectionPool &pool, const Config &cfg) {
+    const TableSpec &t = *cfg.table;
+    ExportPlan plan;
+    if (!planExport(pool, cfg, plan)) return 1;
+    const std::int64_t lo = plan.lo, span = plan.span;
+    const int parts = plan.parts;
+
+    std::atomic<int> next(0);
+    std::atomic<bool> failed(false);
+    int skipped = 0;
+    std::vector<bool> done(static_cast<std::size_t>(parts));
+    for (int p = 0; p < parts; ++p) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "-%04d.csv", p);
+        std::ifstream existing(cfg.out + "/" + t.name + name);
+        if (existing) { done[static_cast<std::size_t>(p)] = true; ++skipped; }
+    }
+    if (skipped) std::cerr << "resuming: " << skipped << " of " << parts << " partitions already exported" << std::endl;
+
+    {
+        Progress progress("exported");
+        std::vector<std::thread> workers;
+        for (int w = 0; w < cfg.threads; ++w) {
+            workers.emplace_back([&] {
+                for (int p = next++; p < parts && !failed; p = next++) {
+                    if (done[static_cast<std::size_t>(p)]) continue;
+                    char name[32];
+                    std::snprintf(name, sizeof(name), "-%04d.csv", p);
+                    std::int64_t from = lo + p * span;
+                    try {
+                        if (!exportPartition(pool, cfg, from, from + span, cfg.out + "/" + t.name + name, progress))
+                            failed = true;
+                    } catch (sql::SQLException &e) {
+                        std::cerr << "[export error] partition " << p << ": " << e.what() << std::endl;
+                        failed = true;
+                    }
+                }
+            });
+        }
+        for (auto &w : workers) w.join();
+    }
+    return failed ? 1 : 0;
+}
+
+// ---- import ----
+
+struct Chunk {
+    std::string key;  // "<file>:<chunk number>", as recorded in the checkpoint
+    std::vector<Row> rows;
+};
+
+// Committed chunks of earlier runs, and the file new ones are appended to.
+class Checkpoint {
+public:
+    explicit Checkpoint(const Config &cfg) {
+        if (cfg.checkpoint.empty()) return;
+        std::string header = std::string("bank_bulk import ") + cfg.table->name + " " + std::to_string(cfg.chunk_rows);
+        std::ifstream in(cfg.checkpoint);
+        std::string line;
+        bool fresh = !std::getline(in, line);
+        if (!fresh && line != header)
+            throw std::runtime_error(cfg.checkpoint + " was written by '" + line + "', not '" + header + "'");
+        while (std::getline(in, line)) done.insert(line);
+        in.close();
+        out.open(cfg.checkpoint, std::ios::app);
+        if (fresh) out << header << "\n" << std::flush;
+        if (!out) throw std::runtime_error("cannot write " + cfg.checkpoint);
+    }
+
+    bool contains(const std::string &key) const { return done.count(key) != 0; }
+    std::size_t size() const { return done.size(); }
+
+    void record(const std::string &key) {
+        if (!out.is_open()) return;
+        std::lock_guard<std::mutex> lock(mu);
+        out << key << "\n" << std::flush;
+    }
+
+private:
+    std::set<std::string> done;
+    std::mutex mu;
+    std::ofstream out;
+};
+
+static void bindRow(sql::PreparedStatement *ps, unsigned int &col, const TableSpec &t, const Row &row) {
+    for (int c = 0; c < t.width; ++c, ++col) {
+        const Field &f = row[static_cast<std::size_t>(c)];
+        if (f.null) ps->setNull(col, sql::DataType::VARCHAR);
+        else if (c == t.money_column) ps->setInt64(col, Money::parse(f.text).cents());
+        else ps->setString(col, f.text);
+    }
+}
+
+static std::string insertSql(const TableSpec &t, std::size_t rows) {
+    std::string sql = std::string("INSERT INTO ") + t.name + "(" + t.columns + ") VALUES";
+    for (std::size_t i = 0; i < rows; ++i) {
+        if (i) sql += ',';
+        sql += t.placeholders;
+    }
+    return sql;
+}
+
+static void importChunk(ConnectionPool::Lease &conn, const Config &cfg, const std::vector<Row> &rows) {
+    conn->setAutoCommit(false);
+    try {
+        for (std::size_t i = 0; i < rows.size(); i += cfg.rows_per_insert) {
+            std::size_t n = std::min(cfg.rows_per_insert, rows.size() - i);
+            sql::PreparedStatement *ps = conn.prepare(insertSql(*cfg.table, n));
+            unsigned int col = 1;
+            for (std::size_t k = 0; k < n; ++k) bindRow(ps, col, *cfg.table, rows[i + k]);
+            conn.executeUpdate(ps);
+        }
+        conn.commit();
+    } catch (...) {
+        try { conn.rollback(); } catch (...) {}
+        conn->setAutoCommit(true);
+        throw;
+    }
+    conn->setAutoCommit(true);
+}
+
+static int runImport(ConnectionPool &pool, const Config &cfg) {
+    const TableSpec &t = *cfg.table;
+    Checkpoint checkpoint(cfg);
+    if (checkpoint.size()) std::cerr << "resuming: " << checkpoint.size() << " chunks already imported" << std::endl;
+
+    std::mutex mu;
+    std::condition_variable changed;
+    std::deque<Chunk> queue;  // bounded, so parsing stays just ahead of the workers
+    bool finished = false;
+    std::atomic<bool> failed(false);
+    const std::size_t max_queued = static_cast<std::size_t>(cfg.threads) * 2;
+
+    Progress progress("imported");
+    std::vector<std::thread> workers;
+    for (int w = 0; w < cfg.threads; ++w) {
+        workers.emplace_back([&] {
+            try {
+                auto conn = pool.acquire();
+                std::unique_ptr<sql::Statement> st(conn->createStatement());
+                st->execute("SET foreign_key_checks = 0, unique_checks = 0");
+                for (;;) {
+                    Chunk chunk;
+                    {
+                        std::unique_lock<std::mutex> lock(mu);
+                        changed.wait(lock, [&] { return !queue.empty() || finished || failed; });
+                        if (queue.empty() || failed) return;
+                        chunk = std::move(queue.front());
+                        queue.pop_front();
+                    }
+                    changed.notify_all();
+                    importChunk(conn, cfg, chunk.rows);
+                    checkpoint.record(chunk.key);
+                    progress.add(chunk.rows.size());
+                }
+            } catch (std::exception &e) {
+                std::cerr << "[import error] " << e.what() << std::endl;
+                failed = true;
+                changed.notify_all();
+            }
+        });
+    }
+
+    for (const std::string &path : cfg.files) {
+        if (failed) break;
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            std::cerr << "cannot open " << path << std::endl;
+            failed = true;
+            break;
+        }
+        CsvReader reader(in);
+        Row row;
+        std::string header;
+        if (reader.next(row)) {
+            for (std::size_t c = 0; c < row.size(); ++c) header += (c ? "," : "") + row[c].text;
+        }
+        if (header != t.columns) {
+            std::cerr << path << ": header must be " << t.columns << std::endl;
+            failed = true;
+            break;
+        }
+        std::size_t number = 0, line = 1;
+        Chunk chunk;
+        for (bool more = true; more && !failed;) {
+            more = reader.next(row);
+            if (more) {
+                ++line;
+                if (row.size() == 1 && row[0].text.empty() && !row[0].null) continue;  // blank line
+                if (row.size() != static_cast<std::size_t>(t.width)) {
+                    std::cerr << path << ":" << line << ": expected " << t.width << " fields" << std::endl;
+                    failed = true;
+                    break;
+                }
+                chunk.rows.push_back(row);
+            }
+            if (chunk.rows.size() == cfg.chunk_rows || (!more && !chunk.rows.empty())) {
+                chunk.key = path + ":" + std::to_string(number++);
+                if (checkpoint.contains(chunk.key)) {
+                    chunk.rows.clear();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(mu);
+                changed.wait(lock, [&] { return queue.size() < max_queued || failed; });
+                queue.push_back(std::move(chunk));
+                chunk = Chunk();
+                lock.unlock();
+                changed.notify_all();
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        finished = true;
     }
+    changed.notify_all();
+    for (auto &w : workers) w.join();
+    if (failed) std::cerr << "import stopped; rerun the same command to resume" << std::endl;
+    return failed ? 1 : 0;
 }
 
-std::vector<Customer> Bank::listCustomers() {
-    std::vector<Customer> out;
-    try {
-        std::unique_ptr<sql::Statement> st(impl->conn->createStatement());
-        std::unique_ptr<sql::ResultSet> rs(st->executeQuery("SELECT customer_id,name,email,phone FROM customers"));
-        while (rs->next()) {
-            Customer c;
-            c.id = rs->getInt("customer_id");
-            c.name = rs->getString("name");
-            c.email = rs->getString("email");
-            c.phone = rs->getString("phone");
-            out.push_back(c);
-        }
-    } catch (sql::SQLException &e) {
-        std::cerr << "[listCustomers error] " << e.what() << std::endl;
-    }
-    return out;
+static void usage() {
+    std::cerr << "usage: bank_bulk export --table T [--out DIR] [--partitions N] [--fetch-rows N]\n"
+                 "       bank_bulk import --table T [--checkpoint FILE] [--chunk-rows N] [--rows-per-insert N] FILE...\n"
+                 "  tables: customers, accounts, transactions, transactions_archive, account_daily\n"
+                 "  common: --host --user --pass --db --threads N" << std::endl;
 }
 
-Customer Bank::getCustomer(int customer_id) {
-    Customer c; c.id = -1;
-    try {
-        std::unique_ptr<sql::PreparedStatement> ps(
-            impl->conn->prepareStatement("SELECT customer_id,name,email,phone FROM customers WHERE customer_id = ?"));
-        ps->setInt(1, customer_id);
-        std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
-        if (rs->next()) {
-            c.id = rs->getInt("customer_id");
-            c.name = rs->getString("name");
-            c.email = rs->getString("email");
-            c.phone = rs->getString("phone");
-        }
-    } catch (sql::SQLException &e) {
-        std::cerr << "[getCustomer error] " << e.what() << std::endl;
+static bool parseArgs(int argc, char **argv, Config &cfg) {
+    if (argc < 2) return false;
+    cfg.mode = argv[1];
+    for (int i = 2; i < argc; ++i) {
+        std::string k = argv[i];
+        if (k.compare(0, 2, "--") != 0) { cfg.files.push_back(k); continue; }
+        if (i + 1 >= argc) return false;
+        std::string v = argv[++i];
+        if (k == "--host") cfg.host = v;
+        else if (k == "--user") cfg.user = v;
+        else if (k == "--pass") cfg.pass = v;
+        else if (k == "--db") cfg.db = v;
+        else if (k == "--threads") cfg.threads = std::atoi(v.c_str());
+        else if (k == "--partitions") cfg.partitions = std::atoi(v.c_str());
+        else if (k == "--fetch-rows") cfg.fetch_rows = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--chunk-rows") cfg.chunk_rows = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--rows-per-insert") cfg.rows_per_insert = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--out") cfg.out = v;
+        else if (k == "--checkpoint") cfg.checkpoint = v;
+        else if (k == "--table") {
+            for (const TableSpec &t : TABLES) if (v == t.name) cfg.table = &t;
+            if (!cfg.table) return false;
+        } else return false;
     }
-    return c;
+    if (!cfg.table || cfg.threads <= 0 || cfg.fetch_rows == 0 || cfg.chunk_rows == 0 || cfg.rows_per_insert == 0)
+        return false;
+    if (cfg.mode == "export") return cfg.files.empty();
+    return cfg.mode == "import" && !cfg.files.empty();
 }
 
-int Bank::createAccount(int customer_id, const std::string &type) {
+int main(int argc, char **argv) {
+    Config cfg;
+    if (!parseArgs(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
     try {
-        std::unique_ptr<sql::PreparedStatement> ps(
-            impl->conn->prepareStatement("INSERT INTO accounts(customer_id,account_type,balance) VALUES(?,?,0.0)"));
-        ps->setInt(1, customer_id);
-        ps->setString(2, type);
-        ps->execute();
-        std::unique_ptr<sql::Statement> st(impl->conn->createStatement());
-        std::unique_ptr<sql::ResultSet> rs(st->executeQuery("SELECT LAST_INSERT_ID() as id"));
-        rs->next();
-        return rs->getInt("id");
-    } catch (sql::SQLException &e) {
-        std::cerr << "[createAccount error] " << e.what() << std::endl;
-        return -1;
+        PoolOptions options;
+        options.min_connections = static_cast<std::size_t>(cfg.threads);
+        options.max_connections = static_cast<std::size_t>(cfg.threads) + 1;  // + the export range query
+        options.acquire_timeout_ms = 60000;
+        ConnectionPool pool(cfg.host, cfg.user, cfg.pass, cfg.db, options);
+        return cfg.mode == "export" ? runExport(pool, cfg) : runImport(pool, cfg);
+    } catch (std::exception &e) {
+        std::cerr << "Fatal: " << e.what() << std::endl;
+        return 1;
     }
 }
 
-Account Bank::getAccount(int account_id) {
-    Account a; a.id = -1;
-    try {
-        std::unique_ptr<sql::PreparedStatement> ps(
-            impl->conn->prepareStatement("SELECT account_id,customer_id,account_type,balance FROM accounts WHERE account_id = ?"));
-        ps->setInt(1, account_id);
-        std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
-        if (rs->next()) {
-            a.id = rs->getInt("account_id");
-            a.customer_id = rs->getInt("customer_id");
-            a.type = rs->getString("account_type");
-            a.balance = rs->getDouble("balance");
-        }
-    } catch (sql::SQLException &e) {
-        std::cerr << "[getAccount error] " << e.what() << std::endl;
-    }
-    return a;
+// -------------------- src/archive.cpp --------------------
+
+// bank_archive: monthly upkeep of the partitioned transactions table. Creates
+// the partitions of the coming months, then moves every month older than
+// --keep-months into the compressed transactions_archive table, where
+// forEachTransaction still finds it. Run it daily, e.g. from cron:
+//
+//   ./bank_archive --keep-months 12 --ahead 3
+//
+// Both steps are safe to repeat. Adding and dropping a partition each take a
+// brief metadata lock on transactions, so writers pause for a moment.
+
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include "connection_pool.h"
+#include "partitions.h"
+
+struct Config {
+    std::string host = "tcp://127.0.0.1:3306", user = "root", pass, db = "banking_system";
+    PartitionOptions partitions;
+};
+
+static void usage() {
+    std::cerr << "usage: bank_archive [--keep-months N] [--ahead N] [--copy-rows N]\n"
+                 "  common: --host --user --pass --db" << std::endl;
 }
 
-std::vector<Account> Bank::listAccountsByCustomer(int customer_id) {
-    std::vector<Account> out;
-    try {
-        std::unique_ptr<sql::PreparedStatement> ps(
-            impl->conn->prepareStatement("SELECT account_id,customer_id,account_type,balance FROM accounts WHERE customer_id = ?"));
-        ps->setInt(1, customer_id);
-        std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
-        while (rs->next()) {
-            Account a;
-            a.id = rs->getInt("account_id");
-            a.customer_id = rs->getInt("customer_id");
-            a.type = rs->getString("account_type");
-            a.balance = rs->getDouble("balance");
-            out.push_back(a);
-        }
-    } catch (sql::SQLException &e) {
-        std::cerr << "[listAccountsByCustomer error] " << e.what() << std::endl;
+static bool parseArgs(int argc, char **argv, Config &cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string k = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string v = argv[++i];
+        if (k == "--host") cfg.host = v;
+        else if (k == "--user") cfg.user = v;
+        else if (k == "--pass") cfg.pass = v;
+        else if (k == "--db") cfg.db = v;
+        else if (k == "--keep-months") cfg.partitions.keep_months = std::atoi(v.c_str());
+        else if (k == "--ahead") cfg.partitions.months_ahead = std::atoi(v.c_str());
+        else if (k == "--copy-rows") cfg.partitions.copy_rows = std::strtoul(v.c_str(), nullptr, 10);
+        else return false;
     }
-    return out;
+    return cfg.partitions.keep_months >= 0 && cfg.partitions.months_ahead >= 0 && cfg.partitions.copy_rows > 0;
 }
 
-bool Bank::deposit(int account_id, double amount) {
-    if (amount <= 0) return false;
+int main(int argc, char **argv) {
+    Config cfg;
+    if (!parseArgs(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
     try {
-        impl->conn->setAutoCommit(false);
-        std::unique_ptr<sql::PreparedStatement> ps1(impl->conn->prepareStatement("UPDATE accounts SET balance = balance + ? WHERE account_id = ?"));
-        ps1->setDouble(1, amount);
-        ps1->setInt(2, account_id);
-        ps1->execute();
-
-        std::unique_ptr<sql::PreparedStatement> ps2(impl->conn->prepareStatement(
-            "INSERT INTO transactions(account_id,type,amount,details) VALUES(?,?,?,?)"));
-        ps2->setInt(1, account_id);
-        ps2->setString(2, "DEPOSIT");
-        ps2->setDouble(3, amount);
-        ps2->setString(4, "Deposit via app");
-        ps2->execute();
-
-        impl->conn->commit();
-        impl->conn->setAutoCommit(true);
-        return true;
-    } catch (sql::SQLException &e) {
-        std::cerr << "[deposit error] " << e.what() << std::endl;
-        try { impl->conn->rollback(); impl->conn->setAutoCommit(true); } catch(...){}
-        return false;
+        PoolOptions options;
+        options.max_connections = 1;
+        ConnectionPool pool(cfg.host, cfg.user, cfg.pass, cfg.db, options);
+        auto conn = pool.acquire();
+        int added = addMonthPartitions(conn, cfg.partitions);
+        if (added < 0) return 1;
+        int archived = archiveOldPartitions(conn, cfg.partitions);
+        if (archived < 0) return 1;
+        std::cout << added << " partitions added, " << archived << " archived" << std::endl;
+        return 0;
+    } catch (std::exception &e) {
+        std::cerr << "Fatal: " << e.what() << std::endl;
+        return 1;
     }
 }
 
-bool Bank::withdraw(int account_id, double amount) {
-    if (amount <= 0) return false;
-    try {
-        // check balance
-        Account a = getAccount(account_id);
-        if (a.id < 0) return false;
-        if (a.balance < amount) return false;
-
-        impl->conn->setAutoCommit(false);
-        std::unique_ptr<sql::PreparedStatement> ps1(impl->conn->prepareStatement("UPDATE accounts SET balance = balance - ? WHERE account_id = ?"));
-        ps1->setDouble(1, amount);
-        ps1->setInt(2, account_id);
-        ps1->execute();
-
-        std::unique_ptr<sql::PreparedStatement> ps2(impl->conn->prepareStatement(
-            "INSERT INTO transactions(account_id,type,amount,details) VALUES(?,?,?,?)"));
-        ps2->setInt(1, account_id);
-        ps2->setString(2, "WITHDRAW");
-        ps2->setDouble(3, amount);
-        ps2->setString(4, "Withdrawal via app");
-        ps2->execute();
-
-        impl->conn->commit();
-        impl->conn->setAutoCommit(true);
-        return true;
-    } catch (sql::SQLException &e) {
-        std::cerr << "[withdraw error] " << e.what() << std::endl;
-        try { impl->conn->rollback(); impl->conn->setAutoCommit(true); } catch(...){}
-        return false;
-    }
+// -------------------- src/server_main.cpp --------------------
+
+// bank_server: serves one Bank over the binary protocol in bank_protocol.h
+// until SIGINT or SIGTERM.
+//
+//   ./bank_server --port 7400 --workers 32 --metrics-port 9100
+//   ./bank_server --trace prod.trace   # also records the calls for bank_replay
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "../include/bank.h"
+#include "../include/bank_server.h"
+#include "../include/call_trace.h"
+#include "../include/metrics_server.h"
+
+struct Config {
+    std::string host = "tcp://127.0.0.1:3306", user = "root", pass, db = "banking_system";
+    BankServerOptions server;
+    std::size_t cache = 0;
+    std::string wal;
+    int metrics_port = -1;  // -1 = no /metrics endpoint
+    std::string trace;      // empty = no call trace
+};
+
+static void usage() {
+    std::cerr << "usage: bank_server [--host URL] [--user U] [--pass P] [--db NAME] [--port N] [--bind ADDR]\n"
+                 "                   [--workers N] [--max-inflight N] [--cache N] [--wal PATH] [--metrics-port N]\n"
+                 "                   [--trace FILE]"
+              << std::endl;
 }
 
-bool Bank::transfer(int from_account_id, int to_account_id, double amount) {
-    if (amount <= 0) return false;
-    try {
-        Account a_from = getAccount(from_account_id);
-        Account a_to = getAccount(to_account_id);
-        if (a_from.id < 0 || a_to.id < 0) return false;
-        if (a_from.balance < amount) return false;
-
-        impl->conn->setAutoCommit(false);
-        std::unique_ptr<sql::PreparedStatement> ps1(impl->conn->prepareStatement("UPDATE accounts SET balance = balance - ? WHERE account_id = ?"));
-        ps1->setDouble(1, amount);
-        ps1->setInt(2, from_account_id);
-        ps1->execute();
-
-        std::unique_ptr<sql::PreparedStatement> ps2(impl->conn->prepareStatement("UPDATE accounts SET balance = balance + ? WHERE account_id = ?"));
-        ps2->setDouble(1, amount);
-        ps2->setInt(2, to_account_id);
-        ps2->execute();
-
-        std::unique_ptr<sql::PreparedStatement> ps3(impl->conn->prepareStatement(
-            "INSERT INTO transactions(account_id,type,amount,details) VALUES(?,?,?,?)"));
-        ps3->setInt(1, from_account_id);
-        ps3->setString(2, "TRANSFER");
-        ps3->setDouble(3, amount);
-        std::ostringstream det;
-        det << "Transfer to account " << to_account_id;
-        ps3->setString(4, det.str());
-        ps3->execute();
-
-        std::unique_ptr<sql::PreparedStatement> ps4(impl->conn->prepareStatement(
-            "INSERT INTO transactions(account_id,type,amount,details) VALUES(?,?,?,?)"));
-        ps4->setInt(1, to_account_id);
-        ps4->setString(2, "DEPOSIT");
-        ps4->setDouble(3, amount);
-        std::ostringstream det2;
-        det2 << "Transfer from account " << from_account_id;
-        ps4->setString(4, det2.str());
-        ps4->execute();
-
-        impl->conn->commit();
-        impl->conn->setAutoCommit(true);
-        return true;
-    } catch (sql::SQLException &e) {
-        std::cerr << "[transfer error] " << e.what() << std::endl;
-        try { impl->conn->rollback(); impl->conn->setAutoCommit(true); } catch(...){}
-        return false;
+static bool parseArgs(int argc, char **argv, Config &cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string k = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string v = argv[++i];
+        if (k == "--host") cfg.host = v;
+        else if (k == "--user") cfg.user = v;
+        else if (k == "--pass") cfg.pass = v;
+        else if (k == "--db") cfg.db = v;
+        else if (k == "--port") cfg.server.port = std::atoi(v.c_str());
+        else if (k == "--bind") cfg.server.bind_address = v;
+        else if (k == "--workers") cfg.server.workers = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--max-inflight") cfg.server.max_inflight = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--cache") cfg.cache = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--wal") cfg.wal = v;
+        else if (k == "--metrics-port") cfg.metrics_port = std::atoi(v.c_str());
+        else if (k == "--trace") cfg.trace = v;
+        else return false;
     }
+    return cfg.server.workers > 0 && cfg.server.max_inflight > 0;
 }
 
-std::vector<TransactionRecord> Bank::recentTransactions(int account_id, int limit) {
-    std::vector<TransactionRecord> out;
+int main(int argc, char **argv) {
+    Config cfg;
+    if (!parseArgs(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
+    // blocked before any thread starts, so only sigwait below sees them
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, nullptr);
     try {
-        std::unique_ptr<sql::PreparedStatement> ps(
-            impl->conn->prepareStatement("SELECT transaction_id,account_id,type,amount,details,created_at FROM transactions WHERE account_id = ? ORDER BY created_at DESC LIMIT ?"));
-        ps->setInt(1, account_id);
-        ps->setInt(2, limit);
-        std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
-        while (rs->next()) {
-            TransactionRecord t;
-            t.id = rs->getInt("transaction_id");
-            t.account_id = rs->getInt("account_id");
-            t.type = rs->getString("type");
-            t.amount = rs->getDouble("amount");
-            t.details = rs->getString("details");
-            t.created_at = rs->getString("created_at");
-            out.push_back(t);
+        BankOptions options;
+        options.pool.min_connections = cfg.server.workers;
+        options.pool.max_connections = cfg.server.workers;
+        options.cache.capacity = cfg.cache;
+        options.ledger.wal_path = cfg.wal;
+        Bank bank(cfg.host, cfg.user, cfg.pass, cfg.db, options);
+
+        std::unique_ptr<MetricsServer> metrics_server;
+        if (cfg.metrics_port >= 0) {
+            metrics_server.reset(new MetricsServer(bank, cfg.metrics_port));
+            std::cerr << "metrics on :" << metrics_server->port() << "/metrics" << std::endl;
         }
-    } catch (sql::SQLException &e) {
-        std::cerr << "[recentTransactions error] " << e.what() << std::endl;
+        std::unique_ptr<TraceWriter> trace;
+        std::unique_ptr<TracingBank> traced;
+        if (!cfg.trace.empty()) {
+            trace.reset(new TraceWriter(cfg.trace));
+            traced.reset(new TracingBank(bank, *trace));
+            std::cerr << "tracing calls to " << cfg.trace << std::endl;
+        }
+        BankServer server(traced ? static_cast<BankInterface&>(*traced) : bank, cfg.server);
+        std::cerr << "serving on :" << server.port() << " with " << cfg.server.workers << " workers" << std::endl;
+
+        int sig = 0;
+        sigwait(&stop, &sig);
+        std::cerr << "signal " << sig << ", shutting down" << std::endl;
+    } catch (std::exception &e) {
+        std::cerr << "Fatal: " << e.what() << std::endl;
+        return 1;
     }
-    return out;
+    return 0;
 }
 
 // -------------------- src/main.cpp --------------------
@@ -453,6 +8983,18 @@ void pause() {
     std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 }
 
+// Reads an amount such as 12.50; bad input becomes zero, which Bank rejects.
+Money readAmount() {
+    std::string text;
+    std::cin >> text;
+    try {
+        return Money::parse(text);
+    } catch (std::exception &) {
+        std::cout << "Invalid amount\n";
+        return Money();
+    }
+}
+
 int main() {
     // Update these DB credentials before running
     const std::string DB_HOST = "tcp://127.0.0.1:3306"; // or "tcp://localhost:3306"
@@ -478,53 +9020,64 @@ int main() {
                 else std::cout << "Failed to create customer\n";
                 pause();
             } else if (choice == 2) {
-                auto customers = bank.listCustomers();
-                for (auto &c: customers) {
+                bank.forEachCustomer([](const Customer &c) {
                     std::cout << c.id << ": " << c.name << " (" << c.email << ") " << c.phone << "\n";
-                }
+                });
                 pause();
             } else if (choice == 3) {
-                int cid; std::string type;
+                int cid; std::string text; AccountType type;
                 std::cout << "Customer ID: "; std::cin >> cid; std::cin.ignore();
-                std::cout << "Account type (SAVINGS/CURRENT): "; std::getline(std::cin, type);
-                int aid = bank.createAccount(cid, type);
-                if (aid > 0) std::cout << "Account created with ID: " << aid << "\n";
-                else std::cout << "Failed to create account\n";
+                std::cout << "Account type (SAVINGS/CURRENT): "; std::getline(std::cin, text);
+                if (!parseAccountType(text, type)) std::cout << "Unknown account type\n";
+                else {
+                    int aid = bank.createAccount(cid, type);
+                    if (aid > 0) std::cout << "Account created with ID: " << aid << "\n";
+                    else std::cout << "Failed to create account\n";
+                }
                 pause();
             } else if (choice == 4) {
                 int cid; std::cout << "Customer ID: "; std::cin >> cid; std::cin.ignore();
                 auto accs = bank.listAccountsByCustomer(cid);
                 for (auto &a: accs) {
-                    std::cout << a.id << ": " << a.type << " Balance: " << a.balance << "\n";
+                    std::cout << a.id << ": " << toString(a.type) << " Balance: " << a.balance << "\n";
                 }
                 pause();
             } else if (choice == 5) {
-                int aid; double amt;
+                int aid; Money amt;
                 std::cout << "Account ID: "; std::cin >> aid;
-                std::cout << "Amount: "; std::cin >> amt;
+                std::cout << "Amount: "; amt = readAmount();
                 if (bank.deposit(aid, amt)) std::cout << "Deposit successful\n"; else std::cout << "Deposit failed\n";
                 pause();
             } else if (choice == 6) {
-                int aid; double amt;
+                int aid; Money amt;
                 std::cout << "Account ID: "; std::cin >> aid;
-                std::cout << "Amount: "; std::cin >> amt;
+                std::cout << "Amount: "; amt = readAmount();
                 if (bank.withdraw(aid, amt)) std::cout << "Withdrawal successful\n"; else std::cout << "Withdrawal failed (insufficient funds?)\n";
                 pause();
             } else if (choice == 7) {
-                int from,to; double amt;
+                int from,to; Money amt;
                 std::cout << "From Account ID: "; std::cin >> from;
                 std::cout << "To Account ID: "; std::cin >> to;
-                std::cout << "Amount: "; std::cin >> amt;
+                std::cout << "Amount: "; amt = readAmount();
                 if (bank.transfer(from, to, amt)) std::cout << "Transfer successful\n"; else std::cout << "Transfer failed\n";
                 pause();
             } else if (choice == 8) {
                 int aid; std::cout << "Account ID: "; std::cin >> aid; std::cin.ignore();
                 Account a = bank.getAccount(aid);
                 if (a.id > 0) {
-                    std::cout << "Account " << a.id << " (" << a.type << ") Balance: " << a.balance << "\n";
+                    std::cout << "Account " << a.id << " (" << toString(a.type) << ") Balance: " << a.balance << "\n";
                     auto tx = bank.recentTransactions(aid, 10);
-                    for (auto &t : tx) {
-                        std::cout << t.created_at << " | " << t.type << " | " << t.amount << " | " << t.details << "\n";
+                    while (true) {
+                        for (auto &t : tx) {
+                            std::cout << t.created_at << " | " << toString(t.type) << " | " << t.amount << " | " << t.details;
+                            if (t.has_balance_after) std::cout << " | balance " << t.balance_after;
+                            std::cout << "\n";
+                        }
+                        if (tx.size() < 10) break;
+                        std::string more;
+                        std::cout << "Show older? (y/n): "; std::getline(std::cin, more);
+                        if (more != "y" && more != "Y") break;
+                        tx = bank.transactionsPage(aid, tx.back().id, 10);
                     }
                 } else {
                     std::cout << "Account not found\n";
@@ -537,3 +9090,713 @@ int main() {
     }
     return 0;
 }
+
+// -------------------- src/latency_stats.h --------------------
+
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <cstdint>
+#include <vector>
+
+// Log-linear latency histogram (HDR-style): every power of two is split into
+// 32 linear sub-buckets, so any recorded value is reported within ~3%.
+// Not thread-safe; give each thread its own and merge() at the end.
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 5;
+    static const int MAX_BITS = 42;  // ~73 minutes in nanoseconds
+    static const std::size_t BUCKETS = std::size_t(MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+    LatencyHistogram() : counts(BUCKETS, 0) {}
+
+    void record(std::uint64_t ns) {
+        ++counts[indexOf(ns)];
+        ++total;
+        if (ns > max_ns) max_ns = ns;
+        sum_ns += ns;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (std::size_t i = 0; i < counts.size(); ++i) counts[i] += other.counts[i];
+        total += other.total;
+        sum_ns += other.sum_ns;
+        if (other.max_ns > max_ns) max_ns = other.max_ns;
+    }
+
+    // Bulk forms of record() for folding in counts kept elsewhere (see metrics.h):
+    // n values that fell into bucket i, then their sum and maximum.
+    void addBucket(std::size_t i, std::uint64_t n) {
+        counts[i] += n;
+        total += n;
+    }
+
+    void addTotals(std::uint64_t sum, std::uint64_t max) {
+        sum_ns += sum;
+        if (max > max_ns) max_ns = max;
+    }
+
+    std::uint64_t count() const { return total; }
+    std::uint64_t sum() const { return sum_ns; }
+    std::uint64_t max() const { return max_ns; }
+    double mean() const { return total ? double(sum_ns) / double(total) : 0.0; }
+
+    // Upper edge of the bucket holding the q-th quantile (0 < q <= 1).
+    std::uint64_t percentile(double q) const {
+        if (total == 0) return 0;
+        std::uint64_t rank = static_cast<std::uint64_t>(q * double(total) + 0.5);
+        if (rank == 0) rank = 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                std::uint64_t edge = upperEdge(i);
+                return edge < max_ns ? edge : max_ns;
+            }
+        }
+        return max_ns;
+    }
+
+    // Values below 32 get exact buckets (group 0). Above that, group g holds
+    // [2^(g+4), 2^(g+5)) split into 32 equal sub-buckets.
+    static std::size_t indexOf(std::uint64_t v) {
+        if (v < (std::uint64_t(1) << SUB_BITS)) return static_cast<std::size_t>(v);
+        int msb = 63 - __builtin_clzll(v);
+        if (msb >= MAX_BITS) return BUCKETS - 1;
+        std::size_t group = static_cast<std::size_t>(msb - SUB_BITS + 1);
+        std::size_t sub = static_cast<std::size_t>(v >> (msb - SUB_BITS)) - (std::size_t(1) << SUB_BITS);
+        return (group << SUB_BITS) + sub;
+    }
+
+    static std::uint64_t upperEdge(std::size_t i) {
+        std::size_t group = i >> SUB_BITS;
+        std::uint64_t sub = i & ((std::size_t(1) << SUB_BITS) - 1);
+        if (group == 0) return sub;
+        return (((std::uint64_t(1) << SUB_BITS) + sub + 1) << (group - 1)) - 1;
+    }
+
+private:
+    std::vector<std::uint64_t> counts;
+    std::uint64_t total = 0;
+    std::uint64_t sum_ns = 0;
+    std::uint64_t max_ns = 0;
+};
+
+#endif // LATENCY_STATS_H
+
+// -------------------- src/bench.cpp --------------------
+
+// bank_bench: drives the Bank API from N threads with a chosen workload mix
+// and reports throughput and latency percentiles per operation type.
+//
+//   ./bank_bench --setup --accounts 10000 --threads 16 --duration 30 --mix transfer
+//   ./bank_bench --first-account 1 --accounts 10000 --mix hot --format json > run.json
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/bank.h"
+#include "../include/metrics_server.h"
+#include "latency_stats.h"
+
+enum BenchOp { OP_BALANCE, OP_DEPOSIT, OP_WITHDRAW, OP_TRANSFER, OP_BATCH, OP_COUNT };
+static const char *const OP_NAMES[OP_COUNT] = {"balance", "deposit", "withdraw", "transfer", "batch"};
+
+// Percent of calls per operation, in BenchOp order.
+struct Mix {
+    const char *name;
+    int weights[OP_COUNT];
+    double default_zipf;  // 0 = uniform account choice
+};
+
+static const Mix MIXES[] = {
+    {"read",     {90, 5, 5, 0, 0},   0.0},
+    {"transfer", {10, 10, 0, 80, 0}, 0.0},
+    {"hot",      {10, 10, 0, 80, 0}, 0.99},
+    {"bulk",     {0, 0, 0, 0, 100},  0.0},
+};
+
+struct Config {
+    std::string host = "tcp://127.0.0.1:3306", user = "root", pass, db = "banking_system";
+    const Mix *mix = &MIXES[1];
+    int threads = 8;
+    int duration_s = 10;
+    int accounts = 1000;
+    int first_account = 1;
+    bool setup = false;
+    double zipf = -1;  // -1 = use the mix default
+    std::size_t batch = 1000;
+    std::size_t cache = 0;
+    std::string wal;
+    std::string format = "text";
+    unsigned seed = 42;
+    int metrics_port = -1;  // -1 = no /metrics endpoint during the run
+};
+
+// YCSB-style Zipfian generator over [0, n); rank 0 is the hottest.
+class Zipfian {
+public:
+    Zipfian(std::uint64_t n, double theta) : n(n), theta(theta) {
+        zetan = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - std::pow(2.0 / double(n), 1.0 - theta)) / (1.0 - zeta(2, theta) / zetan);
+    }
+
+    template <typename Rng>
+    std::uint64_t next(Rng &rng) {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + std::pow(0.5, theta)) return 1;
+        std::uint64_t r = static_cast<std::uint64_t>(double(n) * std::pow(eta * u - eta + 1.0, alpha));
+        return r < n ? r : n - 1;
+    }
+
+private:
+    static double zeta(std::uint64_t n, double theta) {
+        double sum = 0;
+        for (std::uint64_t i = 1; i <= n; ++i) sum += 1.0 / std::pow(double(i), theta);
+        return sum;
+    }
+
+    std::uint64_t n;
+    double theta, zetan, alpha, eta;
+};
+
+struct ThreadResult {
+    LatencyHistogram hist[OP_COUNT];
+    std::uint64_t rejected[OP_COUNT] = {};
+};
+
+static void usage() {
+    std::cerr << "usage: bank_bench [--host H] [--user U] [--pass P] [--db D]\n"
+                 "                  [--mix read|transfer|hot|bulk] [--threads N] [--duration SEC]\n"
+                 "                  [--accounts N] [--first-account ID | --setup] [--zipf THETA]\n"
+                 "                  [--batch N] [--cache CAPACITY] [--wal PATH] [--format text|json] [--seed S]\n"
+                 "                  [--metrics-port PORT]\n";
+}
+
+static bool parseArgs(int argc, char **argv, Config &cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string k = argv[i];
+        if (k == "--setup") { cfg.setup = true; continue; }
+        if (i + 1 >= argc) return false;
+        std::string v = argv[++i];
+        if (k == "--host") cfg.host = v;
+        else if (k == "--user") cfg.user = v;
+        else if (k == "--pass") cfg.pass = v;
+        else if (k == "--db") cfg.db = v;
+        else if (k == "--threads") cfg.threads = std::atoi(v.c_str());
+        else if (k == "--duration") cfg.duration_s = std::atoi(v.c_str());
+        else if (k == "--accounts") cfg.accounts = std::atoi(v.c_str());
+        else if (k == "--first-account") cfg.first_account = std::atoi(v.c_str());
+        else if (k == "--zipf") cfg.zipf = std::atof(v.c_str());
+        else if (k == "--batch") cfg.batch = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--cache") cfg.cache = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--wal") cfg.wal = v;
+        else if (k == "--format") cfg.format = v;
+        else if (k == "--metrics-port") cfg.metrics_port = std::atoi(v.c_str());
+        else if (k == "--seed") cfg.seed = static_cast<unsigned>(std::strtoul(v.c_str(), nullptr, 10));
+        else if (k == "--mix") {
+            cfg.mix = nullptr;
+            for (auto &m : MIXES) if (v == m.name) cfg.mix = &m;
+            if (!cfg.mix) return false;
+        } else return false;
+    }
+    if (cfg.zipf < 0) cfg.zipf = cfg.mix->default_zipf;
+    return cfg.threads > 0 && cfg.accounts > 1 && cfg.duration_s > 0 && cfg.zipf < 1.0 && cfg.batch > 0;
+}
+
+// Creates one customer and cfg.accounts funded accounts; returns the first account id.
+static int setupAccounts(BankInterface &bank, const Config &cfg) {
+    int cid = bank.createCustomer("bench", "bench@example.com", "");
+    if (cid < 0) return -1;
+    Account proto = {0, cid, AccountType::CURRENT, Money()};
+    BatchOptions bulk;
+    bulk.rows_per_insert = 1000;
+    bulk.commit_every = 10000;
+    std::vector<IdRange> ranges = bank.createAccounts(std::vector<Account>(static_cast<std::size_t>(cfg.accounts), proto), bulk);
+    if (ranges.empty()) return -1;
+    int first = ranges.front().first, next = first;
+    for (const IdRange &r : ranges) {
+        if (r.step != 1 || r.first != next) {
+            std::cerr << "account ids are not contiguous; use --first-account on an existing range" << std::endl;
+            return -1;
+        }
+        next += r.count;
+    }
+    if (next - first != cfg.accounts) return -1;
+    std::vector<Operation> seed;
+    for (int id = first; id < next; ++id) seed.push_back(Operation{Operation::DEPOSIT, id, 0, Money::fromCents(100000000)});
+    bank.applyBatch(seed);
+    return first;
+}
+
+static void worker(BankInterface &bank, const Config &cfg, unsigned seed, std::chrono::steady_clock::time_point deadline,
+                   ThreadResult &out) {
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<int> pct(0, 99);
+    std::uniform_int_distribution<int> uniform(0, cfg.accounts - 1);
+    std::uniform_int_distribution<std::int64_t> cents(1, 10000);
+    Zipfian zipf(static_cast<std::uint64_t>(cfg.accounts), cfg.zipf > 0 ? cfg.zipf : 0.5);
+    auto pick = [&]() {
+        int r = cfg.zipf > 0 ? static_cast<int>(zipf.next(rng)) : uniform(rng);
+        return cfg.first_account + r;
+    };
+    std::vector<Operation> batch(cfg.batch);
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        int roll = pct(rng), op = 0;
+        for (int acc = cfg.mix->weights[0]; roll >= acc && op + 1 < OP_COUNT; acc += cfg.mix->weights[++op]) {}
+        int a = pick(), b = pick();
+        if (op == OP_TRANSFER && a == b) b = cfg.first_account + (b - cfg.first_account + 1) % cfg.accounts;
+        Money amount = Money::fromCents(cents(rng));
+        if (op == OP_BATCH) {
+            for (auto &o : batch) o = Operation{Operation::DEPOSIT, pick(), 0, amount};
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = true;
+        switch (op) {
+        case OP_BALANCE: ok = bank.getAccount(a).id >= 0; break;
+        case OP_DEPOSIT: ok = bank.deposit(a, amount); break;
+        case OP_WITHDRAW: ok = bank.withdraw(a, amount); break;
+        case OP_TRANSFER: ok = bank.transfer(a, b, amount); break;
+        case OP_BATCH: {
+            auto results = bank.applyBatch(batch);
+            for (auto r : results) ok = ok && r == OperationResult::APPLIED;
+            break;
+        }
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        out.hist[op].record(static_cast<std::uint64_t>(ns));
+        if (!ok) ++out.rejected[op];
+    }
+}
+
+static double us(std::uint64_t ns) { return double(ns) / 1000.0; }
+
+static void report(const Config &cfg, const ThreadResult &total, double seconds) {
+    if (cfg.format == "json") {
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << "{\"mix\":\"" << cfg.mix->name << "\",\"threads\":" << cfg.threads
+                  << ",\"accounts\":" << cfg.accounts << ",\"zipf\":" << cfg.zipf
+                  << ",\"duration_s\":" << seconds << ",\"ops\":[";
+        bool first = true;
+        for (int op = 0; op < OP_COUNT; ++op) {
+            const LatencyHistogram &h = total.hist[op];
+            if (h.count() == 0) continue;
+            std::cout << (first ? "" : ",") << "{\"op\":\"" << OP_NAMES[op] << "\",\"count\":" << h.count()
+                      << ",\"rejected\":" << total.rejected[op] << ",\"ops_per_sec\":" << double(h.count()) / seconds
+                      << ",\"mean_us\":" << h.mean() / 1000.0 << ",\"p50_us\":" << us(h.percentile(0.50))
+                      << ",\"p99_us\":" << us(h.percentile(0.99)) << ",\"p999_us\":" << us(h.percentile(0.999))
+                      << ",\"max_us\":" << us(h.max()) << "}";
+            first = false;
+        }
+        std::cout << "]}" << std::endl;
+        return;
+    }
+    std::cout << "mix=" << cfg.mix->name << " threads=" << cfg.threads << " accounts=" << cfg.accounts
+              << " zipf=" << cfg.zipf << " duration=" << std::fixed << std::setprecision(1) << seconds << "s\n";
+    std::cout << std::left << std::setw(10) << "op" << std::right << std::setw(10) << "count" << std::setw(10)
+              << "rejected" << std::setw(12) << "ops/s" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+              << std::setw(10) << "p999 us" << std::setw(10) << "max us" << "\n";
+    for (int op = 0; op < OP_COUNT; ++op) {
+        const LatencyHistogram &h = total.hist[op];
+        if (h.count() == 0) continue;
+        std::cout << std::left << std::setw(10) << OP_NAMES[op] << std::right << std::setw(10) << h.count()
+                  << std::setw(10) << total.rejected[op] << std::setw(12) << double(h.count()) / seconds
+                  << std::setw(10) << us(h.percentile(0.50)) << std::setw(10) << us(h.percentile(0.99))
+                  << std::setw(10) << us(h.percentile(0.999)) << std::setw(10) << us(h.max()) << "\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    Config cfg;
+    if (!parseArgs(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
+    try {
+        BankOptions options;
+        options.pool.min_connections = static_cast<std::size_t>(cfg.threads);
+        options.pool.max_connections = static_cast<std::size_t>(cfg.threads);
+        options.cache.capacity = cfg.cache;
+        options.ledger.wal_path = cfg.wal;
+        Bank bank(cfg.host, cfg.user, cfg.pass, cfg.db, options);
+        if (cfg.setup) {
+            cfg.first_account = setupAccounts(bank, cfg);
+            if (cfg.first_account < 0) {
+                std::cerr << "setup failed" << std::endl;
+                return 1;
+            }
+            std::cerr << "created accounts " << cfg.first_account << ".." << cfg.first_account + cfg.accounts - 1 << std::endl;
+        }
+
+        std::unique_ptr<MetricsServer> metrics_server;
+        if (cfg.metrics_port >= 0) {
+            metrics_server.reset(new MetricsServer(bank, cfg.metrics_port));
+            std::cerr << "metrics on :" << metrics_server->port() << "/metrics" << std::endl;
+        }
+
+        std::vector<ThreadResult> results(static_cast<std::size_t>(cfg.threads));
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::seconds(cfg.duration_s);
+        for (int t = 0; t < cfg.threads; ++t) {
+            threads.emplace_back(worker, std::ref(bank), std::cref(cfg), cfg.seed + static_cast<unsigned>(t), deadline,
+                                 std::ref(results[static_cast<std::size_t>(t)]));
+        }
+        for (auto &t : threads) t.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        ThreadResult total;
+        for (auto &r : results) {
+            for (int op = 0; op < OP_COUNT; ++op) {
+                total.hist[op].merge(r.hist[op]);
+                total.rejected[op] += r.rejected[op];
+            }
+        }
+        report(cfg, total, seconds);
+    } catch (std::exception &e) {
+        std::cerr << "Fatal: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// -------------------- src/replay.cpp --------------------
+
+// bank_replay: plays a trace captured by TracingBank (e.g. bank_server --trace)
+// back against a staging database, keeping the recorded arrival times scaled
+// by --speed, and reports latency and lock conflicts per call type. With
+// --baseline it compares the run against a saved report and exits 3 on a
+// regression, so it can gate a change on real traffic.
+//
+//   ./bank_replay --trace prod.trace --speed 4 --threads 32 --save before.json
+//   ./bank_replay --trace prod.trace --speed 4 --threads 32 --baseline before.json --tolerance 10
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/bank.h"
+#include "../include/call_trace.h"
+#include "latency_stats.h"
+
+struct Config {
+    std::string host = "tcp://127.0.0.1:3306", user = "root", pass, db = "banking_system";
+    std::string trace;
+    double speed = 1.0;  // 0 = as fast as the threads go, ignoring the recorded timing
+    int threads = 16;
+    std::size_t cache = 0;
+    std::string wal;
+    std::string format = "text";
+    std::string save;      // write the JSON report here
+    std::string baseline;  // compare against this saved report
+    double tolerance_pct = 10;
+};
+
+struct ThreadResult {
+    LatencyHistogram hist[TRACE_CALL_COUNT];
+    std::uint64_t rejected[TRACE_CALL_COUNT] = {};
+    LatencyHistogram behind;  // how late calls started against the scaled schedule
+};
+
+// One call type in a report; also what a baseline file is read back into.
+struct OpReport {
+    std::string op;
+    std::uint64_t count = 0;
+    std::uint64_t rejected = 0;
+    double ops_per_sec = 0, mean_us = 0, p50_us = 0, p99_us = 0, p999_us = 0, max_us = 0;
+    std::uint64_t deadlocks = 0;
+    std::uint64_t lock_wait_timeouts = 0;
+};
+
+static void usage() {
+    std::cerr << "usage: bank_replay --trace FILE [--host H] [--user U] [--pass P] [--db D]\n"
+                 "                   [--speed X] [--threads N] [--cache CAPACITY] [--wal PATH]\n"
+                 "                   [--format text|json] [--save FILE] [--baseline FILE] [--tolerance PCT]\n";
+}
+
+static bool parseArgs(int argc, char **argv, Config &cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string k = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string v = argv[++i];
+        if (k == "--host") cfg.host = v;
+        else if (k == "--user") cfg.user = v;
+        else if (k == "--pass") cfg.pass = v;
+        else if (k == "--db") cfg.db = v;
+        else if (k == "--trace") cfg.trace = v;
+        else if (k == "--speed") cfg.speed = std::atof(v.c_str());
+        else if (k == "--threads") cfg.threads = std::atoi(v.c_str());
+        else if (k == "--cache") cfg.cache = std::strtoul(v.c_str(), nullptr, 10);
+        else if (k == "--wal") cfg.wal = v;
+        else if (k == "--format") cfg.format = v;
+        else if (k == "--save") cfg.save = v;
+        else if (k == "--baseline") cfg.baseline = v;
+        else if (k == "--tolerance") cfg.tolerance_pct = std::atof(v.c_str());
+        else return false;
+    }
+    return !cfg.trace.empty() && cfg.threads > 0 && cfg.speed >= 0 && cfg.tolerance_pct >= 0;
+}
+
+// Makes one traced call. Keyed calls get a fresh key per run, so they pay for
+// the key like the original did without colliding with it.
+static bool replayOne(BankInterface &bank, const TracedCall &c, const std::string &key_prefix, std::size_t index) {
+    const TraceRecord &r = c.record;
+    const std::string key = r.flags & TRACE_KEYED ? key_prefix + std::to_string(index) : std::string();
+    const Money amount = Money::fromCents(r.value);
+    switch (r.call) {
+    case TraceCall::GET_ACCOUNT: return bank.getAccount(r.account_id).id >= 0;
+    case TraceCall::LIST_ACCOUNTS: bank.listAccountsByCustomer(r.account_id); return true;
+    case TraceCall::DEPOSIT: return bank.deposit(r.account_id, amount, key);
+    case TraceCall::WITHDRAW: return bank.withdraw(r.account_id, amount, key);
+    case TraceCall::TRANSFER: return bank.transfer(r.account_id, r.to_account_id, amount, key);
+    case TraceCall::RECENT_TRANSACTIONS: bank.recentTransactions(r.account_id, static_cast<int>(r.count)); return true;
+    case TraceCall::TRANSACTIONS_PAGE: bank.transactionsPage(r.account_id, r.value, static_cast<int>(r.count)); return true;
+    case TraceCall::APPLY_BATCH: {
+        BatchOptions options;
+        if (r.account_id > 0) options.commit_every = static_cast<std::size_t>(r.account_id);
+        if (r.to_account_id > 0) options.rows_per_insert = static_cast<std::size_t>(r.to_account_id);
+        bool ok = true;
+        for (OperationResult result : bank.applyBatch(c.ops, options)) ok = ok && result == OperationResult::APPLIED;
+        return ok;
+    }
+    default: return false;
+    }
+}
+
+static void worker(BankInterface &bank, const Config &cfg, const std::vector<TracedCall> &calls,
+                   std::atomic<std::size_t> &next, std::chrono::steady_clock::time_point t0,
+                   const std::string &key_prefix, ThreadResult &out) {
+    for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < calls.size();) {
+        const TracedCall &c = calls[i];
+        if (cfg.speed > 0) {
+            auto due = t0 + std::chrono::nanoseconds(static_cast<std::int64_t>(double(c.record.offset_ns) / cfg.speed));
+            std::this_thread::sleep_until(due);
+            auto late = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - due).count();
+            out.behind.record(static_cast<std::uint64_t>(late > 0 ? late : 0));
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool ok = replayOne(bank, c, key_prefix, i);
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        const int op = static_cast<int>(c.record.call) - 1;
+        out.hist[op].record(static_cast<std::uint64_t>(ns));
+        if (!ok) ++out.rejected[op];
+    }
+}
+
+static double us(std::uint64_t ns) { return double(ns) / 1000.0; }
+
+// Conflicts retried inside the named Bank method between two snapshots.
+static void conflictsOf(const MetricsSnapshot &before, const MetricsSnapshot &after, const std::string &method,
+                        OpReport &out) {
+    for (std::size_t i = 0; i < after.methods.size(); ++i) {
+        if (after.methods[i].name != method) continue;
+        const LatencySummary *b = i < before.methods.size() ? &before.methods[i] : nullptr;
+        out.deadlocks = after.methods[i].deadlocks - (b ? b->deadlocks : 0);
+        out.lock_wait_timeouts = after.methods[i].lock_wait_timeouts - (b ? b->lock_wait_timeouts : 0);
+    }
+}
+
+static std::string toJson(const Config &cfg, std::size_t calls, double seconds, const LatencyHistogram &behind,
+                          const std::vector<OpReport> &ops) {
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(1);
+    os << "{\"trace\":\"" << cfg.trace << "\",\"calls\":" << calls << ",\"speed\":" << cfg.speed
+       << ",\"threads\":" << cfg.threads << ",\"duration_s\":" << seconds
+       << ",\"behind_p99_us\":" << us(behind.percentile(0.99)) << ",\"ops\":[";
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        const OpReport &o = ops[i];
+        os << (i ? "," : "") << "{\"op\":\"" << o.op << "\",\"count\":" << o.count << ",\"rejected\":" << o.rejected
+           << ",\"ops_per_sec\":" << o.ops_per_sec << ",\"mean_us\":" << o.mean_us << ",\"p50_us\":" << o.p50_us
+           << ",\"p99_us\":" << o.p99_us << ",\"p999_us\":" << o.p999_us << ",\"max_us\":" << o.max_us
+           << ",\"deadlocks\":" << o.deadlocks << ",\"lock_wait_timeouts\":" << o.lock_wait_timeouts << "}";
+    }
+    os << "]}";
+    return os.str();
+}
+
+static void printText(const Config &cfg, std::size_t calls, double seconds, const LatencyHistogram &behind,
+                      const std::vector<OpReport> &ops) {
+    std::cout << "trace=" << cfg.trace << " calls=" << calls << " speed=" << cfg.speed << " threads=" << cfg.threads
+              << " duration=" << std::fixed << std::setprecision(1) << seconds << "s";
+    if (cfg.speed > 0) std::cout << " behind p99=" << us(behind.percentile(0.99)) << "us";
+    std::cout << "\n" << std::left << std::setw(20) << "op" << std::right << std::setw(10) << "count" << std::setw(10)
+              << "rejected" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "p999 us"
+              << std::setw(10) << "max us" << std::setw(11) << "deadlocks" << std::setw(11) << "lock waits" << "\n";
+    for (const OpReport &o : ops) {
+        std::cout << std::left << std::setw(20) << o.op << std::right << std::setw(10) << o.count << std::setw(10)
+                  << o.rejected << std::setw(10) << o.p50_us << std::setw(10) << o.p99_us << std::setw(10) << o.p999_us
+                  << std::setw(10) << o.max_us << std::setw(11) << o.deadlocks << std::setw(11) << o.lock_wait_timeouts
+                  << "\n";
+    }
+}
+
+// Reads the number after "key": in one op object of a saved report.
+static double field(const std::string &obj, const char *key) {
+    std::string needle = std::string("\"") + key + "\":";
+    std::size_t at = obj.find(needle);
+    return at == std::string::npos ? 0 : std::atof(obj.c_str() + at + needle.size());
+}
+
+// Parses the "ops" of a report written by --save (or --format json).
+static bool readBaseline(const std::string &path, std::vector<OpReport> &out) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::stringstream ss;
+    ss << in.rdbuf();
+    const std::string text = ss.str();
+    const std::string start = "{\"op\":\"";
+    for (std::size_t at = text.find(start); at != std::string::npos; at = text.find(start, at + 1)) {
+        std::size_t name_end = text.find('"', at + start.size());
+        std::size_t obj_end = text.find('}', at);
+        if (name_end == std::string::npos || obj_end == std::string::npos) return false;
+        const std::string obj = text.substr(at, obj_end - at);
+        OpReport o;
+        o.op = text.substr(at + start.size(), name_end - at - start.size());
+        o.count = static_cast<std::uint64_t>(field(obj, "count"));
+        o.p99_us = field(obj, "p99_us");
+        o.p999_us = field(obj, "p999_us");
+        o.deadlocks = static_cast<std::uint64_t>(field(obj, "deadlocks"));
+        o.lock_wait_timeouts = static_cast<std::uint64_t>(field(obj, "lock_wait_timeouts"));
+        out.push_back(o);
+    }
+    return !out.empty();
+}
+
+static double conflictsPer1k(const OpReport &o) {
+    return o.count ? 1000.0 * double(o.deadlocks + o.lock_wait_timeouts) / double(o.count) : 0;
+}
+
+// Prints current against baseline per call type and returns the number of
+// regressions: p99 or lock conflicts per 1000 calls up by more than the
+// tolerance (conflicts also by at least one per 1000, so near-zero rates do not trip it).
+static int compare(const std::vector<OpReport> &base, const std::vector<OpReport> &current, double tolerance_pct) {
+    const double allow = 1.0 + tolerance_pct / 100.0;
+    int regressions = 0;
+    std::ostream &os = std::cerr;
+    os << std::left << std::setw(20) << "op" << std::right << std::setw(12) << "base p99" << std::setw(12) << "p99"
+       << std::setw(9) << "change" << std::setw(14) << "base conf/1k" << std::setw(10) << "conf/1k" << "\n";
+    for (const OpReport &o : current) {
+        const OpReport *b = nullptr;
+        for (const OpReport &candidate : base) if (candidate.op == o.op) b = &candidate;
+        if (!b) {
+            os << std::left << std::setw(20) << o.op << "  not in baseline\n";
+            continue;
+        }
+        const double change = b->p99_us > 0 ? 100.0 * (o.p99_us - b->p99_us) / b->p99_us : 0;
+        const double base_conf = conflictsPer1k(*b), conf = conflictsPer1k(o);
+        const bool slower = b->p99_us > 0 && o.p99_us > b->p99_us * allow;
+        const bool conflicted = conf > base_conf * allow && conf - base_conf >= 1.0;
+        os << std::left << std::setw(20) << o.op << std::right << std::fixed << std::setprecision(1) << std::setw(12)
+           << b->p99_us << std::setw(12) << o.p99_us << std::setw(8) << change << "%" << std::setw(14) << base_conf
+           << std::setw(10) << conf << (slower || conflicted ? "  REGRESSION" : "") << "\n";
+        if (slower || conflicted) ++regressions;
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    Config cfg;
+    if (!parseArgs(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
+    std::vector<TracedCall> calls;
+    std::string error;
+    if (!readTrace(cfg.trace, calls, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    std::vector<OpReport> base;
+    if (!cfg.baseline.empty() && !readBaseline(cfg.baseline, base)) {
+        std::cerr << "cannot read baseline " << cfg.baseline << std::endl;
+        return 1;
+    }
+    try {
+        BankOptions options;
+        options.pool.min_connections = static_cast<std::size_t>(cfg.threads);
+        options.pool.max_connections = static_cast<std::size_t>(cfg.threads);
+        options.cache.capacity = cfg.cache;
+        options.ledger.wal_path = cfg.wal;
+        Bank bank(cfg.host, cfg.user, cfg.pass, cfg.db, options);
+        std::cerr << "replaying " << calls.size() << " calls at " << (cfg.speed > 0 ? std::to_string(cfg.speed) + "x" : "full speed")
+                  << std::endl;
+
+        const std::string key_prefix = "replay-" + std::to_string(static_cast<long long>(std::time(nullptr))) + "-";
+        MetricsSnapshot before = bank.metrics();
+        std::vector<ThreadResult> results(static_cast<std::size_t>(cfg.threads));
+        std::vector<std::thread> threads;
+        std::atomic<std::size_t> next{0};
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < cfg.threads; ++t) {
+            threads.emplace_back(worker, std::ref(bank), std::cref(cfg), std::cref(calls), std::ref(next), start,
+                                 std::cref(key_prefix), std::ref(results[static_cast<std::size_t>(t)]));
+        }
+        for (auto &t : threads) t.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        MetricsSnapshot after = bank.metrics();
+
+        ThreadResult total;
+        for (auto &r : results) {
+            for (int op = 0; op < TRACE_CALL_COUNT; ++op) {
+                total.hist[op].merge(r.hist[op]);
+                total.rejected[op] += r.rejected[op];
+            }
+            total.behind.merge(r.behind);
+        }
+        std::vector<OpReport> ops;
+        for (int op = 0; op < TRACE_CALL_COUNT; ++op) {
+            const LatencyHistogram &h = total.hist[op];
+            if (h.count() == 0) continue;
+            OpReport o;
+            o.op = traceCallName(static_cast<TraceCall>(op + 1));
+            o.count = h.count();
+            o.rejected = total.rejected[op];
+            o.ops_per_sec = double(h.count()) / seconds;
+            o.mean_us = h.mean() / 1000.0;
+            o.p50_us = us(h.percentile(0.50));
+            o.p99_us = us(h.percentile(0.99));
+            o.p999_us = us(h.percentile(0.999));
+            o.max_us = us(h.max());
+            conflictsOf(before, after, o.op, o);
+            ops.push_back(o);
+        }
+
+        const std::string json = toJson(cfg, calls.size(), seconds, total.behind, ops);
+        if (cfg.format == "json") std::cout << json << std::endl;
+        else printText(cfg, calls.size(), seconds, total.behind, ops);
+        if (!cfg.save.empty()) {
+            std::ofstream out(cfg.save);
+            out << json << "\n";
+            if (!out) {
+                std::cerr << "cannot write " << cfg.save << std::endl;
+                return 1;
+            }
+        }
+        if (!base.empty() && compare(base, ops, cfg.tolerance_pct) > 0) return 3;
+    } catch (std::exception &e) {
+        std::cerr << "Fatal: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}